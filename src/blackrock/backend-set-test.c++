@@ -0,0 +1,343 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "backend-set.h"
+#include <blackrock/frontend.capnp.h>
+#include <kj/test.h>
+#include <kj/vector.h>
+
+namespace blackrock {
+namespace {
+
+class TestBackend final: public Mongo::Server {
+  // A backend which answers with its own ID as the port number, after `delay`, unless told to
+  // fail or hang.
+
+public:
+  TestBackend(kj::Timer& timer, uint id): timer(timer), id(id) {}
+
+  uint calls = 0;
+  kj::Duration delay = 0 * kj::SECONDS;
+  bool fail = false;
+  bool hang = false;
+
+protected:
+  kj::Promise<void> getConnectionInfo(GetConnectionInfoContext context) override {
+    ++calls;
+    if (hang) return kj::NEVER_DONE;
+
+    return timer.afterDelay(delay).then([this,context]() mutable {
+      if (fail) {
+        kj::throwFatalException(KJ_EXCEPTION(DISCONNECTED, "test backend failed", id));
+      }
+      context.getResults().initAddress().setPort(id);
+    });
+  }
+
+private:
+  kj::Timer& timer;
+  uint id;
+};
+
+typedef kj::Promise<capnp::Response<Mongo::GetConnectionInfoResults>> InfoPromise;
+
+struct TestEnv {
+  kj::AsyncIoContext ioContext;
+  kj::Timer& timer;
+  kj::WaitScope& waitScope;
+  kj::Own<BackendSetImpl<Mongo>> set;
+  kj::Vector<TestBackend*> backends;
+
+  TestEnv(BackendSetBase::Policy policy, uint count)
+      : ioContext(kj::setupAsyncIo()),
+        timer(ioContext.provider->getTimer()),
+        waitScope(ioContext.waitScope),
+        set(kj::refcounted<BackendSetImpl<Mongo>>(timer, policy)) {
+    for (uint i = 0; i < count; i++) {
+      add(i);
+    }
+  }
+
+  void add(uint id) {
+    BackendSet<Mongo>::Client client = kj::addRef(*set);
+    auto backend = kj::heap<TestBackend>(timer, id);
+    backends.add(backend.get());
+    auto req = client.addRequest();
+    req.setId(id);
+    req.setBackend(kj::mv(backend));
+    req.send().wait(waitScope);
+  }
+
+  void setWarm(uint id, kj::StringPtr resource) {
+    BackendSet<Mongo>::Client client = kj::addRef(*set);
+    auto req = client.setLoadRequest();
+    req.setId(id);
+    req.initLoad().initWarm(1).set(0, resource.asBytes());
+    req.send().wait(waitScope);
+  }
+
+  void remove(uint id) {
+    BackendSet<Mongo>::Client client = kj::addRef(*set);
+    auto req = client.removeRequest();
+    req.setId(id);
+    req.send().wait(waitScope);
+  }
+
+  uint64_t choose(kj::StringPtr affinity) {
+    return set->choose(affinity.asBytes()).wait(waitScope).id;
+  }
+
+  kj::Promise<uint> call(BackendCallOptions options = BackendCallOptions()) {
+    return set->call([](BackendSetImpl<Mongo>::Choice&& choice) -> InfoPromise {
+      return choice.client.getConnectionInfoRequest().send();
+    }, options).then([](capnp::Response<Mongo::GetConnectionInfoResults>&& response) {
+      return uint(response.getAddress().getPort());
+    });
+  }
+
+  void settle() {
+    timer.afterDelay(10 * kj::MILLISECONDS).wait(waitScope);
+  }
+};
+
+KJ_TEST("least-outstanding policy avoids backends with calls in flight") {
+  TestEnv env(BackendSetBase::Policy::LEAST_OUTSTANDING, 3);
+  env.backends[0]->hang = true;
+
+  kj::Vector<InfoPromise> inFlight;
+  for (uint i = 0; i < 9; i++) {
+    inFlight.add(env.set->chooseOne().getConnectionInfoRequest().send());
+    env.settle();
+  }
+
+  // Round-robin would have sent backend 0 three calls. Once it has one stuck, it always has more
+  // in flight than the others.
+  KJ_EXPECT(env.backends[0]->calls <= 1);
+  KJ_EXPECT(env.backends[0]->calls + env.backends[1]->calls + env.backends[2]->calls == 9);
+}
+
+KJ_TEST("weighted policy follows reported load") {
+  TestEnv env(BackendSetBase::Policy::WEIGHTED, 2);
+
+  BackendSet<Mongo>::Client client = kj::addRef(*env.set);
+  auto req = client.setLoadRequest();
+  req.setId(0);
+  req.initLoad().setWeight(3);
+  req.send().wait(env.waitScope);
+
+  for (uint i = 0; i < 8; i++) {
+    env.set->chooseOne().getConnectionInfoRequest().send().wait(env.waitScope);
+  }
+
+  KJ_EXPECT(env.backends[0]->calls == 6);
+  KJ_EXPECT(env.backends[1]->calls == 2);
+}
+
+KJ_TEST("call() retries on another backend and quarantines the failed one") {
+  TestEnv env(BackendSetBase::Policy::ROUND_ROBIN, 2);
+  env.backends[0]->fail = true;
+
+  for (uint i = 0; i < 4; i++) {
+    KJ_EXPECT(env.call().wait(env.waitScope) == 1);
+  }
+  KJ_EXPECT(env.backends[0]->calls == 1);
+}
+
+KJ_TEST("available() doesn't count quarantined backends") {
+  TestEnv env(BackendSetBase::Policy::ROUND_ROBIN, 2);
+  KJ_EXPECT(env.set->available() == 2);
+
+  env.backends[0]->fail = true;
+  env.backends[1]->fail = true;
+  BackendCallOptions options;
+  options.maxAttempts = 2;
+  KJ_EXPECT_THROW(DISCONNECTED, env.call(options).wait(env.waitScope));
+
+  KJ_EXPECT(env.set->available() == 0);
+  KJ_EXPECT(env.set->size() == 2);
+}
+
+KJ_TEST("getAll() includes quarantined backends") {
+  TestEnv env(BackendSetBase::Policy::ROUND_ROBIN, 3);
+  env.backends[1]->fail = true;
+  BackendCallOptions options;
+  options.maxAttempts = 1;
+  while (env.set->available() == 3) {
+    env.call(options).then([](uint) {}, [](kj::Exception&&) {}).wait(env.waitScope);
+  }
+
+  auto all = env.set->getAll();
+  KJ_ASSERT(all.size() == 3);
+  env.backends[1]->fail = false;
+  for (auto i: kj::indices(all)) {
+    KJ_EXPECT(all[i].id == i);
+    auto response = all[i].client.getConnectionInfoRequest().send().wait(env.waitScope);
+    KJ_EXPECT(response.getAddress().getPort() == i);
+  }
+}
+
+KJ_TEST("hedged call() uses a second backend when the first is slow") {
+  TestEnv env(BackendSetBase::Policy::ROUND_ROBIN, 2);
+  env.backends[0]->hang = true;
+
+  BackendCallOptions options;
+  options.hedgeAfter = 10 * kj::MILLISECONDS;
+  KJ_EXPECT(env.call(options).wait(env.waitScope) == 1);
+  KJ_EXPECT(env.backends[0]->calls == 1);
+  KJ_EXPECT(env.backends[1]->calls == 1);
+}
+
+KJ_TEST("hedged call() waits for the hedge when the first attempt fails") {
+  TestEnv env(BackendSetBase::Policy::ROUND_ROBIN, 2);
+  env.backends[0]->delay = 50 * kj::MILLISECONDS;
+  env.backends[0]->fail = true;
+  env.backends[1]->delay = 100 * kj::MILLISECONDS;
+
+  BackendCallOptions options;
+  options.maxAttempts = 1;
+  options.hedgeAfter = 10 * kj::MILLISECONDS;
+  KJ_EXPECT(env.call(options).wait(env.waitScope) == 1);
+}
+
+KJ_TEST("hedged call() fails once both attempts have failed") {
+  TestEnv env(BackendSetBase::Policy::ROUND_ROBIN, 2);
+  env.backends[0]->delay = 50 * kj::MILLISECONDS;
+  env.backends[0]->fail = true;
+  env.backends[1]->delay = 20 * kj::MILLISECONDS;
+  env.backends[1]->fail = true;
+
+  BackendCallOptions options;
+  options.maxAttempts = 1;
+  options.hedgeAfter = 10 * kj::MILLISECONDS;
+  KJ_EXPECT_THROW(DISCONNECTED, env.call(options).wait(env.waitScope));
+}
+
+KJ_TEST("shardFor() moves only keys that land on a new shard") {
+  uint moved = 0;
+  for (uint i = 0; i < 1000; i++) {
+    auto key = kj::str("user-", i);
+    KJ_EXPECT(BackendSetBase::shardFor(key.asBytes(), 1) == 0);
+
+    uint64_t before = BackendSetBase::shardFor(key.asBytes(), 4);
+    uint64_t after = BackendSetBase::shardFor(key.asBytes(), 5);
+    KJ_EXPECT(before < 4);
+    KJ_EXPECT(BackendSetBase::shardFor(key.asBytes(), 4) == before);
+    if (after != before) {
+      KJ_EXPECT(after == 4, key, before, after);
+      ++moved;
+    }
+  }
+
+  // About a fifth of the keys should move to the fifth shard.
+  KJ_EXPECT(moved > 100 && moved < 300, moved);
+}
+
+KJ_TEST("chooseShard() ignores quarantine and waits a while for a missing shard") {
+  TestEnv env(BackendSetBase::Policy::ROUND_ROBIN, 3);
+
+  auto keyFor = [](uint64_t shard, uint shardCount) {
+    for (uint i = 0;; i++) {
+      auto key = kj::str("user-", i);
+      if (BackendSetBase::shardFor(key.asBytes(), shardCount) == shard) return key;
+    }
+  };
+
+  // Quarantine backend 1; its shard still goes to it, since no other backend has the data.
+  env.backends[1]->fail = true;
+  BackendCallOptions options;
+  options.maxAttempts = 1;
+  while (env.backends[1]->calls == 0) {
+    env.call(options).then([](uint) {}, [](kj::Exception&&) {}).wait(env.waitScope);
+  }
+  env.backends[1]->fail = false;
+  auto key1 = keyFor(1, 3);
+  KJ_EXPECT(env.set->chooseShard(key1.asBytes(), 3).getConnectionInfoRequest().send()
+      .wait(env.waitScope).getAddress().getPort() == 1);
+
+  // Shard 3 of 4 isn't in the set yet.
+  auto key3 = keyFor(3, 4);
+  auto promise = env.set->chooseShard(key3.asBytes(), 4).getConnectionInfoRequest().send()
+      .then([](auto&& response) { return uint(response.getAddress().getPort()); }).fork();
+  KJ_EXPECT(!promise.addBranch().then([](uint) { return true; })
+      .exclusiveJoin(env.timer.afterDelay(10 * kj::MILLISECONDS).then([]() { return false; }))
+      .wait(env.waitScope));
+
+  env.add(3);
+  KJ_EXPECT(promise.addBranch().wait(env.waitScope) == 3);
+
+  // Shard 4 of 5 never shows up. Adding other shards doesn't extend the wait.
+  auto key4 = keyFor(4, 5);
+  auto missing = env.set->chooseShard(key4.asBytes(), 5, 50 * kj::MILLISECONDS)
+      .getConnectionInfoRequest().send();
+  env.timer.afterDelay(10 * kj::MILLISECONDS).wait(env.waitScope);
+  env.add(5);
+  KJ_EXPECT_THROW(DISCONNECTED, missing.wait(env.waitScope));
+}
+
+KJ_TEST("affinity prefers a backend where the resource is warm") {
+  TestEnv env(BackendSetBase::Policy::ROUND_ROBIN, 3);
+
+  // Find a resource which rendezvous hashing doesn't put on backend 2, then warm it there.
+  kj::String resource;
+  for (uint i = 0;; i++) {
+    resource = kj::str("package-", i);
+    if (env.choose(resource) != 2) break;
+  }
+  env.setWarm(2, resource);
+
+  KJ_EXPECT(env.choose(resource) == 2);
+  KJ_EXPECT(env.choose(resource) == 2);
+}
+
+KJ_TEST("affinity falls back when the warm backend is quarantined or gone") {
+  TestEnv env(BackendSetBase::Policy::ROUND_ROBIN, 3);
+  env.setWarm(2, "package-a");
+
+  // Fail a call on backend 2 to quarantine it.
+  env.backends[2]->fail = true;
+  BackendCallOptions options;
+  options.maxAttempts = 1;
+  KJ_EXPECT_THROW(DISCONNECTED, env.set->call(kj::StringPtr("package-a").asBytes(),
+      [](BackendSetImpl<Mongo>::Choice&& choice) -> InfoPromise {
+    return choice.client.getConnectionInfoRequest().send();
+  }, options).wait(env.waitScope));
+  KJ_EXPECT(env.backends[2]->calls == 1);
+  KJ_EXPECT(env.choose("package-a") != 2);
+
+  // Once it's gone altogether, the resource still goes to a consistent backend.
+  env.remove(2);
+  auto chosen = env.choose("package-a");
+  KJ_EXPECT(chosen != 2);
+  KJ_EXPECT(env.choose("package-a") == chosen);
+}
+
+KJ_TEST("affinity spreads a hot resource across backends") {
+  TestEnv env(BackendSetBase::Policy::ROUND_ROBIN, 3);
+  env.setWarm(0, "package-a");
+
+  uint counts[3] = { 0, 0, 0 };
+  for (uint i = 0; i < 30; i++) {
+    ++counts[env.choose("package-a")];
+  }
+
+  // Backend 0 gets the most, but once it's well above average the rest go elsewhere.
+  KJ_EXPECT(counts[0] > counts[1] && counts[0] > counts[2], counts[0], counts[1], counts[2]);
+  KJ_EXPECT(counts[1] > 0 && counts[2] > 0, counts[1], counts[2]);
+  KJ_EXPECT(counts[0] <= 15, counts[0]);
+}
+
+}  // namespace
+}  // namespace blackrock
@@ -16,13 +16,52 @@
 
 #include "backend-set.h"
 #include <kj/debug.h>
+#include <capnp/message.h>
 
 namespace blackrock {
 
-BackendSetBase::BackendSetBase(kj::PromiseFulfillerPair<void> paf)
-    : next(backends.end()),
+class BackendSetBase::CountingCap final: public capnp::Capability::Server {
+  // Wraps a backend, counting calls which have been made through it but haven't yet returned.
+
+public:
+  CountingCap(capnp::Capability::Client inner, kj::Own<CallCounter> counter)
+      : inner(kj::mv(inner)), counter(kj::mv(counter)) {}
+
+  kj::Promise<void> dispatchCall(uint64_t interfaceId, uint16_t methodId,
+      capnp::CallContext<capnp::AnyPointer, capnp::AnyPointer> context) override {
+    auto params = context.getParams();
+    auto req = inner.typelessRequest(interfaceId, methodId, params.targetSize());
+    req.set(params);
+    context.releaseParams();
+
+    // Use a tail call so that pipelined calls on the result still go straight to the backend.
+    ++counter->outstanding;
+    return context.tailCall(kj::mv(req))
+        .attach(kj::defer([c = kj::addRef(*counter)]() { --c->outstanding; }));
+  }
+
+private:
+  capnp::Capability::Client inner;
+  kj::Own<CallCounter> counter;
+};
+
+static constexpr kj::Duration QUARANTINE_MIN = 1 * kj::SECONDS;
+static constexpr kj::Duration QUARANTINE_MAX = 64 * kj::SECONDS;
+// A backend's first failure takes it out of rotation for QUARANTINE_MIN, and each consecutive
+// failure doubles that, up to QUARANTINE_MAX. Failures are considered consecutive unless the
+// backend went QUARANTINE_MAX without failing in between.
+
+BackendSetBase::BackendSetBase(kj::Timer& timer, Policy policy,
+                               kj::PromiseFulfillerPair<void> paf,
+                               kj::PromiseFulfillerPair<void> addedPaf)
+    : timer(timer),
+      policy(policy),
+      next(backends.end()),
+      random(std::random_device()()),
       readyPromise(paf.promise.fork()),
-      readyFulfiller(kj::mv(paf.fulfiller)) {}
+      readyFulfiller(kj::mv(paf.fulfiller)),
+      addedPromise(addedPaf.promise.fork()),
+      addedFulfiller(kj::mv(addedPaf.fulfiller)) {}
 BackendSetBase::~BackendSetBase() noexcept(false) {}
 
 capnp::Capability::Client BackendSetBase::chooseOne() {
@@ -30,17 +69,325 @@ capnp::Capability::Client BackendSetBase::chooseOne() {
     return readyPromise.addBranch().then([this]() {
       return chooseOne();
     });
-  } else {
+  }
+
+  return chooseIterator()->second.client;
+}
+
+capnp::Capability::Client BackendSetBase::chooseOne(kj::ArrayPtr<const byte> affinity) {
+  if (backends.empty()) {
+    auto ownAffinity = kj::heapArray(affinity);
+    return readyPromise.addBranch().then([this,KJ_MVCAP(ownAffinity)]() {
+      return chooseOne(ownAffinity);
+    });
+  }
+
+  return chooseWithAffinity(affinity, timer.now())->second.client;
+}
+
+kj::Promise<BackendSetBase::Choice> BackendSetBase::choose() {
+  if (backends.empty()) {
+    return readyPromise.addBranch().then([this]() {
+      return choose();
+    });
+  }
+
+  auto iter = chooseIterator();
+  Choice choice { iter->first, iter->second.client };
+
+  if (iter->second.quarantinedUntil > timer.now()) {
+    // Every backend is quarantined. Wait for this one to come out rather than hammering it.
+    return timer.atTime(iter->second.quarantinedUntil)
+        .then([KJ_MVCAP(choice)]() mutable { return kj::mv(choice); });
+  }
+
+  return kj::mv(choice);
+}
+
+kj::Promise<BackendSetBase::Choice> BackendSetBase::choose(kj::ArrayPtr<const byte> affinity) {
+  if (backends.empty()) {
+    auto ownAffinity = kj::heapArray(affinity);
+    return readyPromise.addBranch().then([this,KJ_MVCAP(ownAffinity)]() {
+      return choose(ownAffinity);
+    });
+  }
+
+  auto iter = chooseWithAffinity(affinity, timer.now());
+  return Choice { iter->first, iter->second.client };
+}
+
+capnp::Capability::Client BackendSetBase::chooseShard(
+    kj::ArrayPtr<const byte> key, uint shardCount, kj::Duration maxWait) {
+  return chooseShardBefore(key, shardCount, timer.now() + maxWait);
+}
+
+capnp::Capability::Client BackendSetBase::chooseShardBefore(
+    kj::ArrayPtr<const byte> key, uint shardCount, kj::TimePoint deadline) {
+  uint64_t shard = shardFor(key, shardCount);
+  auto iter = backends.find(shard);
+  if (iter == backends.end()) {
+    auto ownKey = kj::heapArray(key);
+    return addedPromise.addBranch().then([this,KJ_MVCAP(ownKey),shardCount,deadline]() {
+      return chooseShardBefore(ownKey, shardCount, deadline);
+    }).exclusiveJoin(timer.atTime(deadline).then([shard]() {
+      return capnp::Capability::Client(
+          KJ_EXCEPTION(DISCONNECTED, "shard is unavailable", shard));
+    }));
+  }
+
+  return iter->second.client;
+}
+
+void BackendSetBase::failed(uint64_t id) {
+  auto iter = backends.find(id);
+  if (iter == backends.end()) return;
+
+  auto& backend = iter->second;
+  auto now = timer.now();
+  if (now - backend.lastFailure > QUARANTINE_MAX) {
+    backend.failures = 0;
+  }
+
+  if (backend.quarantinedUntil > now) {
+    // Already quarantined; this is just another call that was in flight when it went down.
+    return;
+  }
+
+  kj::Duration duration = QUARANTINE_MIN * (int64_t(1) << kj::min(backend.failures, 6u));
+  backend.quarantinedUntil = now + kj::min(duration, QUARANTINE_MAX);
+  backend.lastFailure = now;
+  ++backend.failures;
+}
+
+kj::Array<BackendSetBase::Choice> BackendSetBase::getAll() {
+  auto result = kj::heapArrayBuilder<Choice>(backends.size());
+  for (auto& backend: backends) {
+    result.add(Choice { backend.first, backend.second.client });
+  }
+  return result.finish();
+}
+
+size_t BackendSetBase::available() {
+  auto now = timer.now();
+  size_t count = 0;
+  for (auto& backend: backends) {
+    if (backend.second.quarantinedUntil <= now) ++count;
+  }
+  return count;
+}
+
+bool BackendSetBase::isRetryable(const kj::Exception& exception) {
+  switch (exception.getType()) {
+    case kj::Exception::Type::DISCONNECTED:
+    case kj::Exception::Type::OVERLOADED:
+      return true;
+    default:
+      return false;
+  }
+}
+
+auto BackendSetBase::chooseIterator() -> Iterator {
+  auto now = timer.now();
+  switch (policy) {
+    case Policy::ROUND_ROBIN:
+      return chooseRoundRobin(now);
+    case Policy::LEAST_OUTSTANDING:
+      return chooseLeastOutstanding(now);
+    case Policy::POWER_OF_TWO:
+      return choosePowerOfTwo(now);
+    case Policy::WEIGHTED:
+      return chooseWeighted(now);
+  }
+
+  KJ_UNREACHABLE;
+}
+
+auto BackendSetBase::chooseRoundRobin(kj::TimePoint now) -> Iterator {
+  // Skip quarantined backends, unless they all are.
+  Iterator first = backends.end();
+  for (size_t i = 0; i < backends.size(); i++) {
     if (next == backends.end()) {
       next = backends.begin();
     }
 
-    return (next++)->second.client;
+    Iterator result = next++;
+    if (result->second.quarantinedUntil <= now) {
+      return result;
+    } else if (first == backends.end()) {
+      first = result;
+    }
+  }
+
+  return first;
+}
+
+double BackendSetBase::score(const Backend& backend, kj::TimePoint now) {
+  // Lower is better. Counting the call we're about to make means that a backend with twice the
+  // weight is allowed twice the load even when both are idle.
+  if (backend.weight <= 0 || backend.quarantinedUntil > now) return kj::inf();
+  return (backend.counter->outstanding + 1) / backend.weight;
+}
+
+auto BackendSetBase::chooseLeastOutstanding(kj::TimePoint now) -> Iterator {
+  // Scan starting from the round-robin position so that ties are broken evenly.
+  Iterator start = chooseRoundRobin(now);
+  Iterator best = start;
+  double bestScore = score(best->second, now);
+
+  Iterator iter = start;
+  for (;;) {
+    if (++iter == backends.end()) iter = backends.begin();
+    if (iter == start) break;
+
+    double s = score(iter->second, now);
+    if (s < bestScore) {
+      best = iter;
+      bestScore = s;
+    }
+  }
+
+  return best;
+}
+
+auto BackendSetBase::choosePowerOfTwo(kj::TimePoint now) -> Iterator {
+  size_t count = backends.size();
+  if (count == 1) return backends.begin();
+
+  size_t i = random() % count;
+  size_t j = random() % (count - 1);
+  if (j >= i) ++j;
+
+  // TODO(perf): std::map can't be indexed, so this is O(n). Fine for the handful of machines we
+  //   have per set.
+  Iterator a = std::next(backends.begin(), i);
+  Iterator b = std::next(backends.begin(), j);
+  double scoreA = score(a->second, now);
+  double scoreB = score(b->second, now);
+  if (scoreA == kj::inf() && scoreB == kj::inf()) {
+    // Both unusable; maybe someone else isn't.
+    return chooseRoundRobin(now);
+  }
+  return scoreB < scoreA ? b : a;
+}
+
+auto BackendSetBase::chooseWeighted(kj::TimePoint now) -> Iterator {
+  // Smooth weighted round-robin, as in nginx: every backend earns its weight on each pick and the
+  // winner pays back the total, which interleaves picks rather than sending bursts to the heaviest
+  // backend.
+  double total = 0;
+  Iterator best = backends.end();
+  for (auto iter = backends.begin(); iter != backends.end(); ++iter) {
+    auto& backend = iter->second;
+    if (backend.weight <= 0 || backend.quarantinedUntil > now) continue;
+    backend.currentWeight += backend.weight;
+    total += backend.weight;
+    if (best == backends.end() || backend.currentWeight > best->second.currentWeight) {
+      best = iter;
+    }
+  }
+
+  if (best == backends.end()) {
+    // Everyone claims to be full. Spread the work evenly anyway.
+    return chooseRoundRobin(now);
+  }
+
+  best->second.currentWeight -= total;
+  return best;
+}
+
+static constexpr double AFFINITY_LOAD_FACTOR = 1.25;
+// A backend is only preferred for affinity while its load is at most this many times the average
+// (plus one, so that an idle cluster doesn't cap everyone at zero). This is "consistent hashing
+// with bounded loads": popular resources spill over to other backends rather than overloading
+// their favorite.
+
+static uint64_t rendezvousHash(kj::ArrayPtr<const byte> key, uint64_t id) {
+  // FNV-1a over the key, then mix in the backend ID with splitmix64's finalizer.
+  uint64_t h = 14695981039346656037ull;
+  for (byte b: key) {
+    h = (h ^ b) * 1099511628211ull;
+  }
+  h ^= id + 0x9e3779b97f4a7c15ull;
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+  return h ^ (h >> 31);
+}
+
+uint64_t BackendSetBase::shardFor(kj::ArrayPtr<const byte> key, uint shardCount) {
+  KJ_REQUIRE(shardCount > 0);
+
+  uint64_t best = 0;
+  uint64_t bestHash = rendezvousHash(key, 0);
+  for (uint64_t id = 1; id < shardCount; id++) {
+    uint64_t hash = rendezvousHash(key, id);
+    if (hash > bestHash) {
+      best = id;
+      bestHash = hash;
+    }
+  }
+  return best;
+}
+
+auto BackendSetBase::chooseWithAffinity(kj::ArrayPtr<const byte> affinity, kj::TimePoint now)
+    -> Iterator {
+  uint64_t totalLoad = 0;
+  uint usableCount = 0;
+  for (auto& backend: backends) {
+    if (score(backend.second, now) != kj::inf()) {
+      totalLoad += backend.second.reportedOutstanding + backend.second.assignedSinceReport;
+      ++usableCount;
+    }
+  }
+
+  if (usableCount == 0) return chooseIterator();
+
+  double cap = (double(totalLoad) / usableCount + 1) * AFFINITY_LOAD_FACTOR;
+  auto key = kj::heapString(affinity.asChars());
+
+  Iterator bestWarm = backends.end();
+  Iterator bestCold = backends.end();
+  uint64_t bestWarmHash = 0;
+  uint64_t bestColdHash = 0;
+  for (auto iter = backends.begin(); iter != backends.end(); ++iter) {
+    auto& backend = iter->second;
+    if (score(backend, now) == kj::inf() ||
+        backend.reportedOutstanding + backend.assignedSinceReport >= cap) {
+      continue;
+    }
+
+    uint64_t hash = rendezvousHash(affinity, iter->first);
+    if (backend.warm.count(key) > 0) {
+      if (bestWarm == backends.end() || hash > bestWarmHash) {
+        bestWarm = iter;
+        bestWarmHash = hash;
+      }
+    } else {
+      if (bestCold == backends.end() || hash > bestColdHash) {
+        bestCold = iter;
+        bestColdHash = hash;
+      }
+    }
+  }
+
+  Iterator result = bestWarm != backends.end() ? bestWarm : bestCold;
+  if (result == backends.end()) {
+    // Everyone is over the cap.
+    return chooseIterator();
   }
+
+  ++result->second.assignedSinceReport;
+  return result;
 }
 
 void BackendSetBase::clear() {
+  if (backends.empty()) return;
+
   backends.clear();
+  next = backends.end();
+
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  readyPromise = paf.promise.fork();
+  readyFulfiller = kj::mv(paf.fulfiller);
 }
 
 void BackendSetBase::add(uint64_t id, capnp::Capability::Client client) {
@@ -48,7 +395,17 @@ void BackendSetBase::add(uint64_t id, capnp::Capability::Client client) {
     readyFulfiller->fulfill();
   }
 
-  backends.insert(std::make_pair(id, Backend { kj::mv(client) }));
+  addedFulfiller->fulfill();
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  addedPromise = paf.promise.fork();
+  addedFulfiller = kj::mv(paf.fulfiller);
+
+  auto counter = kj::refcounted<CallCounter>();
+  if (policy == Policy::LEAST_OUTSTANDING || policy == Policy::POWER_OF_TWO) {
+    client = kj::heap<CountingCap>(kj::mv(client), kj::addRef(*counter));
+  }
+
+  backends.insert(std::make_pair(id, Backend(kj::mv(client), kj::mv(counter))));
 }
 
 void BackendSetBase::remove(uint64_t id) {
@@ -64,6 +421,20 @@ void BackendSetBase::remove(uint64_t id) {
   }
 }
 
+void BackendSetBase::setLoad(uint64_t id, BackendLoad::Reader load) {
+  auto iter = backends.find(id);
+  if (iter != backends.end()) {
+    auto& backend = iter->second;
+    backend.weight = load.getWeight();
+    backend.reportedOutstanding = load.getOutstanding();
+    backend.assignedSinceReport = 0;
+    backend.warm.clear();
+    for (auto resource: load.getWarm()) {
+      backend.warm.insert(kj::heapString(resource.asChars()));
+    }
+  }
+}
+
 // =======================================================================================
 
 class BackendSetFeederBase::ConsumerRegistration final: public Registration {
@@ -85,22 +456,68 @@ private:
 
 class BackendSetFeederBase::BackendRegistration final: public Registration {
 public:
-  BackendRegistration(BackendSetFeederBase& feeder, capnp::Capability::Client cap);
+  BackendRegistration(BackendSetFeederBase& feeder, uint64_t id, capnp::Capability::Client cap);
 
   ~BackendRegistration() noexcept(false);
 
 private:
   friend class BackendSetFeederBase;
+  friend class LoadReceiverImpl;
 
   BackendSetFeederBase& feeder;
   uint64_t id;
   capnp::Capability::Client cap;
+  capnp::MallocMessageBuilder load;
+  kj::Maybe<LoadReceiverImpl&> loadReceiver;
   BackendRegistration* next;
   BackendRegistration** prev;
+
+  void setLoad(BackendLoad::Reader newLoad);
+};
+
+class BackendSetFeederBase::LoadReceiverImpl final: public BackendLoadReceiver::Server {
+public:
+  explicit LoadReceiverImpl(BackendRegistration& backend): backend(backend) {}
+
+  ~LoadReceiverImpl() noexcept(false) {
+    KJ_IF_MAYBE(b, backend) {
+      b->loadReceiver = nullptr;
+    }
+  }
+
+protected:
+  kj::Promise<void> update(UpdateContext context) override {
+    KJ_IF_MAYBE(b, backend) {
+      b->setLoad(context.getParams().getLoad());
+      return kj::READY_NOW;
+    } else {
+      // Tell the back-end to stop reporting.
+      return KJ_EXCEPTION(DISCONNECTED, "back-end has been removed from its set");
+    }
+  }
+
+private:
+  friend class BackendRegistration;
+  friend class BackendSetFeederBase;
+
+  kj::Maybe<BackendRegistration&> backend;
 };
 
 auto BackendSetFeederBase::addBackend(capnp::Capability::Client cap) -> kj::Own<Registration> {
-  auto result = kj::heap<BackendRegistration>(*this, kj::mv(cap));
+  KJ_REQUIRE(!explicitIds, "can't mix assigned and explicit backend IDs in one feeder");
+  return registerBackend(kj::mv(cap), nextId++);
+}
+
+auto BackendSetFeederBase::addBackend(capnp::Capability::Client cap, uint64_t id)
+    -> kj::Own<Registration> {
+  KJ_REQUIRE(nextId == 0, "can't mix assigned and explicit backend IDs in one feeder");
+  explicitIds = true;
+  return registerBackend(kj::mv(cap), id);
+}
+
+auto BackendSetFeederBase::registerBackend(capnp::Capability::Client cap, uint64_t id)
+    -> kj::Own<Registration> {
+  auto result = kj::heap<BackendRegistration>(*this, id, kj::mv(cap));
 
   if (ready) {
     // Consumers are already initialized. Add the new backend to each one.
@@ -136,6 +553,18 @@ auto BackendSetFeederBase::addConsumer(BackendSet<>::Client set) -> kj::Own<Regi
   return kj::mv(result);
 }
 
+BackendLoadReceiver::Client BackendSetFeederBase::getLoadReceiver(Registration& backend) {
+  auto& registration = kj::downcast<BackendRegistration>(backend);
+
+  KJ_IF_MAYBE(old, registration.loadReceiver) {
+    old->backend = nullptr;
+  }
+
+  auto result = kj::heap<LoadReceiverImpl>(registration);
+  registration.loadReceiver = *result;
+  return kj::mv(result);
+}
+
 void BackendSetFeederBase::taskFailed(kj::Exception&& exception) {
   KJ_LOG(ERROR, exception);
 }
@@ -168,13 +597,14 @@ void BackendSetFeederBase::ConsumerRegistration::init() {
     auto element = list[i++];
     element.setId(backend->id);
     element.getBackend().setAs<capnp::Capability>(backend->cap);
+    element.setLoad(backend->load.getRoot<BackendLoad>().asReader());
   }
   feeder.tasks.add(req.send().then([](auto&&) {}));
 }
 
 BackendSetFeederBase::BackendRegistration::BackendRegistration(
-    BackendSetFeederBase& feeder, capnp::Capability::Client cap)
-    : feeder(feeder), id(feeder.nextId++), cap(kj::mv(cap)),
+    BackendSetFeederBase& feeder, uint64_t id, capnp::Capability::Client cap)
+    : feeder(feeder), id(id), cap(kj::mv(cap)),
       next(nullptr), prev(feeder.backendsTail) {
   *feeder.backendsTail = this;
   feeder.backendsTail = &next;
@@ -182,6 +612,10 @@ BackendSetFeederBase::BackendRegistration::BackendRegistration(
 }
 
 BackendSetFeederBase::BackendRegistration::~BackendRegistration() noexcept(false) {
+  KJ_IF_MAYBE(receiver, loadReceiver) {
+    receiver->backend = nullptr;
+  }
+
   --feeder.backendCount;
   if (next == nullptr) {
     feeder.backendsTail = prev;
@@ -201,5 +635,23 @@ BackendSetFeederBase::BackendRegistration::~BackendRegistration() noexcept(false
   }
 }
 
-} // namespace blackrock
+void BackendSetFeederBase::BackendRegistration::setLoad(BackendLoad::Reader newLoad) {
+  load.setRoot(newLoad);
+
+  if (!feeder.ready) {
+    // Consumers haven't been initialized yet. They'll receive the load with the initial reset().
+    return;
+  }
+
+  for (ConsumerRegistration* consumer = feeder.consumersHead; consumer != nullptr;
+       consumer = consumer->next) {
+    feeder.tasks.add(kj::evalNow([&]() {
+      auto req = consumer->set.setLoadRequest(capnp::MessageSize {8, 0});
+      req.setId(id);
+      req.setLoad(newLoad);
+      return req.send().then([](auto&&) {});
+    }));
+  }
+}
 
+} // namespace blackrock
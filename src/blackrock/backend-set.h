@@ -20,47 +20,241 @@
 #include "common.h"
 #include <blackrock/cluster-rpc.capnp.h>
 #include <map>
+#include <set>
+#include <random>
 
 namespace blackrock {
 
+struct BackendCallOptions {
+  // Options for BackendSetImpl::call().
+
+  uint maxAttempts = 3;
+  // Total number of attempts, including the first.
+
+  kj::Maybe<kj::Duration> hedgeAfter;
+  // If set, and an attempt hasn't completed after this long, start a second one on a different
+  // backend and use whichever succeeds first; if either fails, wait for the other. This trades
+  // extra load for tail latency, so only use it for cheap, latency-critical reads.
+};
+
 class BackendSetBase {
 public:
-  BackendSetBase(): BackendSetBase(kj::newPromiseAndFulfiller<void>()) {}
+  enum class Policy {
+    ROUND_ROBIN,
+    // Cycle through the backends in order, ignoring load.
+
+    LEAST_OUTSTANDING,
+    // Choose the backend with the fewest calls in flight through this set, relative to its
+    // weight. Capabilities returned by chooseOne() are wrapped in order to count calls.
+
+    POWER_OF_TWO,
+    // Pick two backends at random and choose the one with fewer calls in flight relative to its
+    // weight. Nearly as good as LEAST_OUTSTANDING, but doesn't herd every client onto the same
+    // backend when they all see the same counts. Calls are counted as for LEAST_OUTSTANDING.
+
+    WEIGHTED
+    // Smooth weighted round-robin using the weights that the backends report through
+    // BackendSet.setLoad(). Backends which have never reported have weight 1.
+  };
+
+  explicit BackendSetBase(kj::Timer& timer, Policy policy = Policy::ROUND_ROBIN)
+      : BackendSetBase(timer, policy, kj::newPromiseAndFulfiller<void>()) {}
   ~BackendSetBase() noexcept(false);
 
   capnp::Capability::Client chooseOne();
 
+  capnp::Capability::Client chooseOne(kj::ArrayPtr<const byte> affinity);
+  // Prefer a backend which reports `affinity` among its warm resources (see BackendLoad.warm), as
+  // long as it isn't much busier than average. If no such backend exists, use rendezvous hashing
+  // on `affinity` to pick one, so that the same resource keeps landing on the same backend and
+  // warms it up. Falls back to the normal policy if every backend is over the load cap.
+
+  struct Choice {
+    uint64_t id;
+    capnp::Capability::Client client;
+  };
+
+  kj::Promise<Choice> choose();
+  // Like chooseOne(), but also reports which backend was chosen, so that failures can be
+  // attributed to it. If every backend is quarantined, waits until the chosen one comes out of
+  // quarantine.
+
+  kj::Promise<Choice> choose(kj::ArrayPtr<const byte> affinity);
+  // Like chooseOne(affinity), but also reports which backend was chosen.
+
+  kj::Array<Choice> getAll();
+  // Every backend currently in the set, including quarantined ones, for broadcasting a query.
+
+  capnp::Capability::Client chooseShard(kj::ArrayPtr<const byte> key, uint shardCount,
+                                        kj::Duration maxWait = 30 * kj::SECONDS);
+  // For sets whose backends are shards of a partitioned data set, added to the feeder with IDs
+  // 0 through shardCount - 1: return the shard responsible for `key`, as computed by shardFor().
+  // Load and quarantine are ignored, since no other backend has the data. If that shard isn't in
+  // the set right now, returns a promise that resolves once it is, or fails with DISCONNECTED if
+  // it's still missing after `maxWait`, e.g. because the shard's machine is down.
+
+  static uint64_t shardFor(kj::ArrayPtr<const byte> key, uint shardCount);
+  // Rendezvous hash of `key` over shard IDs 0 through shardCount - 1. Going from n to n + 1 shards
+  // moves only the 1/(n + 1) of keys that land on the new shard.
+
+  void failed(uint64_t id);
+  // Report that a call to the given backend failed in a way that suggests the backend is down or
+  // overloaded. The backend is skipped by all policies for a quarantine period which doubles with
+  // each consecutive failure.
+
+  static bool isRetryable(const kj::Exception& exception);
+  // Does this exception indicate that the same call might succeed on a different backend?
+
+  kj::Timer& getTimer() { return timer; }
+
+  bool contains(uint64_t id) { return backends.count(id) > 0; }
+
+  size_t size() { return backends.size(); }
+
+  size_t available();
+  // Number of backends which aren't quarantined.
+
   void clear();
   void add(uint64_t id, capnp::Capability::Client client);
   void remove(uint64_t id);
+  void setLoad(uint64_t id, BackendLoad::Reader load);
 
 private:
+  struct CallCounter: public kj::Refcounted {
+    uint outstanding = 0;
+  };
+
+  class CountingCap;
+
   struct Backend {
     capnp::Capability::Client client;
+    kj::Own<CallCounter> counter;
+    double weight = 1;
+    double currentWeight = 0;  // for WEIGHTED
+    uint failures = 0;
+    kj::TimePoint lastFailure = kj::origin<kj::TimePoint>();
+    kj::TimePoint quarantinedUntil = kj::origin<kj::TimePoint>();
+    uint reportedOutstanding = 0;
+    uint assignedSinceReport = 0;
+    // Load as of the last report, plus affinity choices made since, so that a burst of work
+    // doesn't all pile onto one backend before its next report arrives.
+    std::set<kj::String> warm;
 
+    Backend(capnp::Capability::Client client, kj::Own<CallCounter> counter)
+        : client(kj::mv(client)), counter(kj::mv(counter)) {}
     Backend(Backend&&) = default;
     Backend(const Backend&) = delete;
     // Convince STL to use the move constructor.
   };
 
+  typedef std::map<uint64_t, Backend>::iterator Iterator;
+
+  kj::Timer& timer;
+  Policy policy;
   std::map<uint64_t, Backend> backends;
-  std::map<uint64_t, Backend>::iterator next;
+  Iterator next;
+  std::minstd_rand random;
   kj::ForkedPromise<void> readyPromise;
   kj::Own<kj::PromiseFulfiller<void>> readyFulfiller;
+  kj::ForkedPromise<void> addedPromise;
+  kj::Own<kj::PromiseFulfiller<void>> addedFulfiller;
+  // Fulfilled (and replaced) each time a backend is added, for chooseShard().
+
+  capnp::Capability::Client chooseShardBefore(kj::ArrayPtr<const byte> key, uint shardCount,
+                                              kj::TimePoint deadline);
+
+  BackendSetBase(kj::Timer& timer, Policy policy, kj::PromiseFulfillerPair<void> paf,
+                 kj::PromiseFulfillerPair<void> addedPaf = kj::newPromiseAndFulfiller<void>());
 
-  explicit BackendSetBase(kj::PromiseFulfillerPair<void> paf);
+  Iterator chooseIterator();
+  Iterator chooseRoundRobin(kj::TimePoint now);
+  Iterator chooseLeastOutstanding(kj::TimePoint now);
+  Iterator choosePowerOfTwo(kj::TimePoint now);
+  Iterator chooseWeighted(kj::TimePoint now);
+  Iterator chooseWithAffinity(kj::ArrayPtr<const byte> affinity, kj::TimePoint now);
+  static double score(const Backend& backend, kj::TimePoint now);
 };
 
 template <typename T>
 class BackendSetImpl: public BackendSet<T>::Server, public kj::Refcounted {
 public:
+  explicit BackendSetImpl(kj::Timer& timer,
+                          BackendSetBase::Policy policy = BackendSetBase::Policy::ROUND_ROBIN)
+      : base(timer, policy) {}
+
   typename T::Client chooseOne() { return base.chooseOne().template castAs<T>(); }
-  // Choose a capability from the set and return it, cycling through the set every time this
-  // method is called. If the backend set is empty, return a promise that resolves once a backend
-  // is available.
-  //
-  // TODO(someady): Would be nice to build in disconnect handling here, e.g. pass in a callback
-  //   function that initiates the work, catches exceptions and retries with a different back-end.
+  // Choose a capability from the set according to the set's policy and return it. If the backend
+  // set is empty, return a promise that resolves once a backend is available.
+
+  typename T::Client chooseOne(kj::ArrayPtr<const byte> affinity) {
+    return base.chooseOne(affinity).template castAs<T>();
+  }
+  // Like chooseOne(), but prefer backends where the resource identified by `affinity` is already
+  // warm. See BackendSetBase::chooseOne(affinity).
+
+  struct Choice {
+    uint64_t id;
+    typename T::Client client;
+  };
+
+  kj::Promise<Choice> choose(kj::ArrayPtr<const byte> affinity) {
+    // Like chooseOne(affinity), but also reports the chosen backend's ID, which stays the same
+    // for as long as the backend remains in the set, so callers can group work by backend.
+    return base.choose(affinity).then([](BackendSetBase::Choice&& choice) {
+      return Choice { choice.id, choice.client.template castAs<T>() };
+    });
+  }
+
+  typename T::Client chooseShard(kj::ArrayPtr<const byte> key, uint shardCount,
+                                 kj::Duration maxWait = 30 * kj::SECONDS) {
+    return base.chooseShard(key, shardCount, maxWait).template castAs<T>();
+  }
+  // Return the shard responsible for `key`. See BackendSetBase::chooseShard().
+
+  kj::Array<Choice> getAll() {
+    return KJ_MAP(choice, base.getAll()) {
+      return Choice { choice.id, choice.client.template castAs<T>() };
+    };
+  }
+  // Every backend currently in the set. See BackendSetBase::getAll().
+
+  bool contains(uint64_t id) { return base.contains(id); }
+  // Is the backend with the given ID (see choose()) still in the set?
+
+  size_t size() { return base.size(); }
+
+  size_t available() { return base.available(); }
+  // Number of backends which aren't quarantined. When zero, the set is either empty, in which case
+  // chooseOne() waits for a backend to be added, or every backend has recently failed.
+
+  template <typename Func>
+  kj::PromiseForResult<Func, Choice> call(
+      Func&& func, BackendCallOptions options = BackendCallOptions()) {
+    // Choose a backend and call `func(choice)`, which should start some work on `choice.client`
+    // and return a promise for its result. If the promise fails with DISCONNECTED or OVERLOADED,
+    // the backend is quarantined and `func` is called again with a different backend, up to
+    // `options.maxAttempts` times in total. Since the work may therefore be started more than once,
+    // only use this for idempotent operations.
+
+    auto ownFunc = kj::heap<kj::Decay<Func>>(kj::fwd<Func>(func));
+    auto& funcRef = *ownFunc;
+    return attempt(funcRef, nullptr, options, 1).attach(kj::mv(ownFunc), kj::addRef(*this));
+  }
+
+  template <typename Func>
+  kj::PromiseForResult<Func, Choice> call(
+      kj::ArrayPtr<const byte> affinity, Func&& func,
+      BackendCallOptions options = BackendCallOptions()) {
+    // Like call(func, options), but choose backends as chooseOne(affinity) does. Hedged attempts
+    // still go wherever the set's policy says, since affinity would pick the same backend again.
+
+    auto ownFunc = kj::heap<kj::Decay<Func>>(kj::fwd<Func>(func));
+    auto& funcRef = *ownFunc;
+    auto ownAffinity = kj::heapArray(affinity);
+    kj::ArrayPtr<const byte> affinityRef = ownAffinity;
+    return attempt(funcRef, affinityRef, options, 1)
+        .attach(kj::mv(ownFunc), kj::mv(ownAffinity), kj::addRef(*this));
+  }
 
 protected:
   typedef typename BackendSet<T>::Server Interface;
@@ -68,6 +262,7 @@ protected:
     base.clear();
     for (auto backend: context.getParams().getBackends()) {
       base.add(backend.getId(), backend.getBackend());
+      base.setLoad(backend.getId(), backend.getLoad());
     }
     return kj::READY_NOW;
   }
@@ -80,9 +275,110 @@ protected:
     base.remove(context.getParams().getId());
     return kj::READY_NOW;
   }
+  kj::Promise<void> setLoad(typename Interface::SetLoadContext context) {
+    auto params = context.getParams();
+    base.setLoad(params.getId(), params.getLoad());
+    return kj::READY_NOW;
+  }
 
 private:
   BackendSetBase base;
+
+  struct HedgeState {
+    bool primaryFailed = false;
+    bool hedgeStarted = false;
+    bool hedgeFailed = false;
+  };
+
+  kj::Promise<BackendSetBase::Choice> chooseFor(kj::Maybe<kj::ArrayPtr<const byte>> affinity) {
+    KJ_IF_MAYBE(a, affinity) {
+      return base.choose(*a);
+    } else {
+      return base.choose();
+    }
+  }
+
+  template <typename Func>
+  kj::PromiseForResult<Func, Choice> attempt(
+      Func& func, kj::Maybe<kj::ArrayPtr<const byte>> affinity, BackendCallOptions options,
+      uint number) {
+    typedef kj::PromiseForResult<Func, Choice> Result;
+
+    return chooseFor(affinity).then([this,&func,affinity,options,number](
+        BackendSetBase::Choice&& choice) {
+      Result promise = nullptr;
+      KJ_IF_MAYBE(delay, options.hedgeAfter) {
+        promise = hedged(func, kj::mv(choice), *delay);
+      } else {
+        promise = callOn(func, kj::mv(choice));
+      }
+
+      return promise.catch_([this,&func,affinity,options,number](kj::Exception&& e) -> Result {
+        if (number >= options.maxAttempts || !BackendSetBase::isRetryable(e)) {
+          return kj::mv(e);
+        }
+        return attempt(func, affinity, options, number + 1);
+      });
+    });
+  }
+
+  template <typename Func>
+  kj::PromiseForResult<Func, Choice> hedged(
+      Func& func, BackendSetBase::Choice&& choice, kj::Duration delay) {
+    // Call `func` on `choice`, and if that hasn't completed after `delay`, on another backend as
+    // well. The first success wins. A failure only counts if the other attempt has failed too, or
+    // was never started; until then, the other attempt may still succeed.
+    typedef kj::PromiseForResult<Func, Choice> Result;
+
+    auto state = kj::heap<HedgeState>();
+    auto& stateRef = *state;
+    uint64_t id = choice.id;
+
+    Result primary = callOn(func, kj::mv(choice))
+        .catch_([&stateRef](kj::Exception&& e) -> Result {
+      stateRef.primaryFailed = true;
+      if (stateRef.hedgeStarted && !stateRef.hedgeFailed) {
+        return kj::NEVER_DONE;
+      }
+      return kj::mv(e);
+    });
+
+    Result hedge = base.getTimer().afterDelay(delay).then([this,&func,&stateRef,id]() {
+      return base.choose().then([this,&func,&stateRef,id](BackendSetBase::Choice&& other)
+                                -> Result {
+        if (other.id == id) {
+          // There's nowhere else to send it.
+          return kj::NEVER_DONE;
+        }
+
+        stateRef.hedgeStarted = true;
+        return callOn(func, kj::mv(other)).catch_([&stateRef](kj::Exception&& e) -> Result {
+          stateRef.hedgeFailed = true;
+          if (stateRef.primaryFailed) {
+            return kj::mv(e);
+          }
+          return kj::NEVER_DONE;
+        });
+      });
+    });
+
+    return primary.exclusiveJoin(kj::mv(hedge)).attach(kj::mv(state));
+  }
+
+  template <typename Func>
+  kj::PromiseForResult<Func, Choice> callOn(Func& func, BackendSetBase::Choice&& choice) {
+    typedef kj::PromiseForResult<Func, Choice> Result;
+
+    uint64_t id = choice.id;
+    Choice typed { choice.id, choice.client.template castAs<T>() };
+    return kj::evalNow([&]() -> Result { return func(kj::mv(typed)); })
+        .catch_([this,id](kj::Exception&& e) -> Result {
+      if (BackendSetBase::isRetryable(e)) {
+        base.failed(id);
+      }
+      return kj::mv(e);
+    });
+  }
 };
 
 // =======================================================================================
@@ -98,22 +394,32 @@ public:
   };
 
   kj::Own<Registration> addBackend(capnp::Capability::Client cap);
+  kj::Own<Registration> addBackend(capnp::Capability::Client cap, uint64_t id);
   kj::Own<Registration> addConsumer(BackendSet<>::Client set);
 
+  BackendLoadReceiver::Client getLoadReceiver(Registration& backend);
+  // Returns a capability through which the back-end behind `backend` -- which must have been
+  // returned by addBackend() -- can push its load. Each report is forwarded to all consumers and
+  // remembered for consumers added later. The capability stops working once `backend` is dropped.
+
 private:
   class BackendRegistration;
   class ConsumerRegistration;
+  class LoadReceiverImpl;
 
   uint minCount;
   bool ready = minCount == 0;  // Becomes true when minCount backends are first available.
   uint64_t backendCount = 0;
   uint64_t nextId = 0;
+  bool explicitIds = false;
   BackendRegistration* backendsHead = nullptr;
   BackendRegistration** backendsTail = &backendsHead;
   ConsumerRegistration* consumersHead = nullptr;
   ConsumerRegistration** consumersTail = &consumersHead;
   kj::TaskSet tasks;
 
+  kj::Own<Registration> registerBackend(capnp::Capability::Client cap, uint64_t id);
+
   void taskFailed(kj::Exception&& exception) override;
 };
 
@@ -142,6 +448,14 @@ public:
     return BackendSetFeederBase::addBackend(kj::mv(cap));
   }
 
+  kj::Own<Registration> addBackend(typename T::Client cap, uint64_t id) KJ_WARN_UNUSED_RESULT {
+    // Like addBackend(cap), but uses the given ID rather than assigning a fresh one, so that a
+    // backend keeps its ID when its machine restarts. Needed for shards (see
+    // BackendSetBase::chooseShard()). A feeder must use either explicit IDs or assigned ones, not
+    // both, and no two registrations alive at the same time may share an ID.
+    return BackendSetFeederBase::addBackend(kj::mv(cap), id);
+  }
+
   kj::Own<Registration> addConsumer(typename BackendSet<T>::Client set) KJ_WARN_UNUSED_RESULT {
     // Inserts all backends into this consumer. When the returned Consumer is dropped (indicating
     // that it has disconnected), stops updating it.
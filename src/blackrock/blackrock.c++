@@ -39,10 +39,13 @@
 #include <sys/mount.h>
 #include "backend-set.h"
 #include "frontend.h"
+#include "coordinator.h"
 #include "local-persistent-registry.h"
 #include <stdio.h>
 #include "nbd-bridge.h"
 #include "gce.h"
+#include "local.h"
+#include "metrics.h"
 #include "bundle.h"
 #include <sandstorm/backup.h>
 #include <sys/time.h>
@@ -98,9 +101,11 @@ class MachineImpl: public Machine::Server {
   //   (But before we do that we probably need to implement Cap'n Proto Level 3.)
 
 public:
-  MachineImpl(kj::AsyncIoContext& ioContext, capnp::RpcSystem<VatPath>& rpcSystem,
+  MachineImpl(kj::AsyncIoContext& ioContext, VatNetwork& network,
+              capnp::RpcSystem<VatPath>& rpcSystem,
               LocalPersistentRegistry& persistentRegistry, SimpleAddress selfAddress)
       : ioContext(ioContext),
+        network(network),
         persistentRegistry(persistentRegistry),
         rpcSystem(rpcSystem),
         subprocessSet(ioContext.unixEventPort),
@@ -116,7 +121,10 @@ public:
       mkdir("/var", 0755);
       mkdir("/var/blackrock", 0755);
       mkdir("/var/blackrock/storage", 0755);
-      auto ptr = kj::heap<StorageInfo>(ioContext, rpcSystem);
+      auto ptr = kj::heap<StorageInfo>(ioContext, kj::heap<FilesystemStorage>(
+          sandstorm::raiiOpen("/var/blackrock/storage", O_RDONLY | O_DIRECTORY | O_CLOEXEC),
+          ioContext.unixEventPort, ioContext.lowLevelProvider->getTimer(),
+          kj::heap<RemoteRestorer>(rpcSystem)));
       info = ptr;
       storageInfo = kj::mv(ptr);
     }
@@ -143,17 +151,40 @@ public:
     // locally). We do this because if we crash then NBD devices could be left in a bad state.
     sandstorm::raiiOpen("/var/blackrock/dirty", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC);
 
-    Worker::Client client = nullptr;
-    KJ_IF_MAYBE(w, worker) {
+    WorkerInfo* info = nullptr;
+    KJ_IF_MAYBE(w, workerInfo) {
       KJ_LOG(INFO, "rebecome worker...");
-      client = *w;
+      info = *w;
     } else {
       KJ_LOG(INFO, "become worker...");
-      client = kj::heap<WorkerImpl>(ioContext, subprocessSet, persistentRegistry);
-      worker = client;
+      auto ptr = kj::heap<WorkerInfo>(
+          kj::heap<WorkerImpl>(ioContext, subprocessSet, persistentRegistry));
+      info = ptr;
+      workerInfo = kj::mv(ptr);
     }
 
-    context.getResults().setWorker(kj::mv(client));
+    context.getResults().setWorker(info->client);
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> becomeCoordinator(BecomeCoordinatorContext context) override {
+    CoordinatorInfo* info = nullptr;
+    KJ_IF_MAYBE(i, coordinatorInfo) {
+      KJ_LOG(INFO, "rebecome coordinator...");
+      info = *i;
+    } else {
+      KJ_LOG(INFO, "become coordinator...");
+      auto ptr = kj::heap<CoordinatorInfo>(
+          kj::heap<CoordinatorImpl>(ioContext.provider->getTimer()));
+      info = ptr;
+      coordinatorInfo = kj::mv(ptr);
+    }
+
+    auto results = context.getResults();
+    results.setCoordinator(info->client);
+    results.setWorkerSet(info->impl->getWorkerBackendSet());
+    results.setStorageRestorerSet(info->impl->getStorageRestorerBackendSet());
+
     return kj::READY_NOW;
   }
 
@@ -161,7 +192,9 @@ public:
     FrontendInfo* info = nullptr;
     KJ_IF_MAYBE(i, frontendInfo) {
       KJ_LOG(INFO, "rebecome frontend...");
-      i->get()->impl->setConfig(context.getParams().getConfig());
+      auto params = context.getParams();
+      i->get()->impl->setConfig(params.getConfig());
+      i->get()->impl->setStorageCount(params.getStorageCount());
       info = *i;
     } else {
       KJ_LOG(INFO, "become frontend...");
@@ -169,7 +202,8 @@ public:
       auto ptr = kj::heap<FrontendInfo>(kj::heap<FrontendImpl>(
           ioContext.provider->getNetwork(),
           ioContext.provider->getTimer(),
-          subprocessSet, params.getConfig(), params.getReplicaNumber()));
+          subprocessSet, params.getConfig(), params.getReplicaNumber(),
+          params.getStorageCount()));
       info = ptr;
       frontendInfo = kj::mv(ptr);
     }
@@ -180,10 +214,14 @@ public:
     results.setStorageFactorySet(info->impl->getStorageFactoryBackendSet());
     results.setWorkerSet(info->impl->getWorkerBackendSet());
     results.setMongoSet(info->impl->getMongoBackendSet());
+    results.setCoordinatorSet(info->impl->getCoordinatorBackendSet());
 
     // TODO(soon): These are placeholders.
-    results.setStorageRestorerSet(kj::refcounted<BackendSetImpl<Restorer<SturdyRef::Stored>>>());
-    results.setHostedRestorerSet(kj::refcounted<BackendSetImpl<Restorer<SturdyRef::Hosted>>>());
+    auto& timer = ioContext.provider->getTimer();
+    results.setStorageRestorerSet(
+        kj::refcounted<BackendSetImpl<Restorer<SturdyRef::Stored>>>(timer));
+    results.setHostedRestorerSet(
+        kj::refcounted<BackendSetImpl<Restorer<SturdyRef::Hosted>>>(timer));
 
     return kj::READY_NOW;
   }
@@ -213,8 +251,58 @@ public:
     }
   }
 
+  kj::Promise<void> getNetworkStats(GetNetworkStatsContext context) override {
+    network.getStats(context.getResults().initStats());
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> getStats(GetStatsContext context) override {
+    MetricsBuilder metrics;
+
+    {
+      // Not getStats(), which would reset the peak reported by getNetworkStats().
+      auto& stats = network.getQueueStats();
+      metrics.gauge("blackrock_network_queued_bytes",
+                    "Bytes waiting to be written, across all peers.", stats.queuedBytes);
+      metrics.gauge("blackrock_network_peak_queued_bytes",
+                    "Most bytes waiting to be written to one peer since the previous "
+                    "getNetworkStats(), or since startup.",
+                    stats.peakQueuedBytes);
+      metrics.counter("blackrock_network_messages_written_total",
+                      "Messages written to peers.", stats.messagesWritten);
+      metrics.counter("blackrock_network_queue_seconds_total",
+                      "Time messages spent waiting to be written.",
+                      stats.totalQueueTime / kj::NANOSECONDS / 1e9);
+      metrics.gauge("blackrock_network_max_queue_seconds",
+                    "Longest time a message has waited to be written.",
+                    stats.maxQueueTime / kj::NANOSECONDS / 1e9);
+      metrics.counter("blackrock_network_read_pauses_total",
+                      "Times reading from a peer paused because our queue to it was full.",
+                      stats.readPauses);
+      metrics.gauge("blackrock_network_peers", "Connected peers.",
+                    network.getConnectedPeerCount());
+    }
+
+    KJ_IF_MAYBE(s, storageInfo) {
+      s->get()->impl->getMetrics(metrics);
+    }
+    KJ_IF_MAYBE(w, workerInfo) {
+      w->get()->impl->getMetrics(metrics);
+    }
+    KJ_IF_MAYBE(c, coordinatorInfo) {
+      c->get()->impl->getMetrics(metrics);
+    }
+    KJ_IF_MAYBE(f, frontendInfo) {
+      f->get()->impl->getMetrics(metrics);
+    }
+
+    metrics.finish(context.getResults().initStats());
+    return kj::READY_NOW;
+  }
+
 private:
   kj::AsyncIoContext& ioContext;
+  VatNetwork& network;
   LocalPersistentRegistry& persistentRegistry;
   capnp::RpcSystem<VatPath>& rpcSystem;
   sandstorm::SubprocessSet subprocessSet;
@@ -222,6 +310,7 @@ private:
 
   struct StorageInfo {
     StorageSibling::Client selfAsSibling;
+    FilesystemStorage* impl;
     StorageRootSet::Client rootSet;
     MasterRestorer<SturdyRef::Stored>::Client restorer;
     StorageFactory::Client factory;
@@ -230,21 +319,29 @@ private:
     kj::Own<BackendSetImpl<Restorer<SturdyRef::Hosted>>> hostedRestorerSet;
     kj::Own<BackendSetImpl<Restorer<SturdyRef::External>>> gatewayRestorerSet;
 
-    StorageInfo(kj::AsyncIoContext& ioContext, capnp::RpcSystem<VatPath>& rpcSystem)
+    StorageInfo(kj::AsyncIoContext& ioContext, kj::Own<FilesystemStorage> impl)
         : selfAsSibling(nullptr),  // TODO(someday)
-          rootSet(kj::heap<FilesystemStorage>(
-              sandstorm::raiiOpen("/var/blackrock/storage", O_RDONLY | O_DIRECTORY | O_CLOEXEC),
-              ioContext.unixEventPort, ioContext.lowLevelProvider->getTimer(),
-              kj::heap<RemoteRestorer>(rpcSystem))),
+          impl(impl),
+          rootSet(kj::mv(impl)),
           restorer(nullptr),       // TODO(someday)
           factory(rootSet.getFactoryRequest().send().getFactory()),
-          siblingSet(kj::refcounted<BackendSetImpl<StorageSibling>>()),
-          hostedRestorerSet(kj::refcounted<BackendSetImpl<Restorer<SturdyRef::Hosted>>>()),
-          gatewayRestorerSet(kj::refcounted<BackendSetImpl<Restorer<SturdyRef::External>>>()) {}
+          siblingSet(kj::refcounted<BackendSetImpl<StorageSibling>>(
+              ioContext.provider->getTimer())),
+          hostedRestorerSet(kj::refcounted<BackendSetImpl<Restorer<SturdyRef::Hosted>>>(
+              ioContext.provider->getTimer())),
+          gatewayRestorerSet(kj::refcounted<BackendSetImpl<Restorer<SturdyRef::External>>>(
+              ioContext.provider->getTimer())) {}
   };
   kj::Maybe<kj::Own<StorageInfo>> storageInfo;
 
-  kj::Maybe<Worker::Client> worker;
+  struct WorkerInfo {
+    WorkerImpl* impl;
+    Worker::Client client;
+
+    WorkerInfo(kj::Own<WorkerImpl> impl)
+        : impl(impl), client(kj::mv(impl)) {}
+  };
+  kj::Maybe<kj::Own<WorkerInfo>> workerInfo;
 
   struct FrontendInfo {
     FrontendImpl* impl;
@@ -255,6 +352,15 @@ private:
   };
   kj::Maybe<kj::Own<FrontendInfo>> frontendInfo;
 
+  struct CoordinatorInfo {
+    CoordinatorImpl* impl;
+    Coordinator::Client client;
+
+    CoordinatorInfo(kj::Own<CoordinatorImpl> impl)
+        : impl(impl), client(kj::mv(impl)) {}
+  };
+  kj::Maybe<kj::Own<CoordinatorInfo>> coordinatorInfo;
+
   kj::Maybe<Mongo::Client> mongo;
 };
 
@@ -313,6 +419,8 @@ public:
         .addSubCommand("backup", KJ_BIND_METHOD(*this, getBackupMain),
             "(internal) backup/restore grain data from/to directory")
         .addSubCommand("log", KJ_BIND_METHOD(*this, getLogMain), "run log client")
+        .addSubCommand("query-logs", KJ_BIND_METHOD(*this, getQueryLogsMain),
+            "search structured log records on the master")
         .build();
   }
 
@@ -342,6 +450,8 @@ public:
             "Redirect console logs to the log sink server at <addr>, self-identifying as <name>.")
         .addOption({'r', "restart"}, KJ_BIND_METHOD(*this, killExisting),
             "Kill any existing slave running on this machine.")
+        .addOption({"compress-rpc"}, KJ_BIND_METHOD(*this, setCompressRpc),
+            "Pack messages sent to other machines in the cluster.")
         .expectArg("<bind-ip>", KJ_BIND_METHOD(*this, setBindIp))
         .callAfterParsing(KJ_BIND_METHOD(*this, runSlave))
         .build();
@@ -351,10 +461,32 @@ public:
     return kj::MainBuilder(context, "Sandstorm Blackrock version " SANDSTORM_VERSION,
                            "Starts Blackrock logger client, which reads from standard input "
                            "and sends the data to the blackrock log server.")
+        .addOption({"records"}, KJ_BIND_METHOD(*this, setShipRecords),
+            "Also read structured log records from file descriptor 3 and send them to the log "
+            "server.")
         .expectArg("<name>", KJ_BIND_METHOD(*this, runLog))
         .build();
   }
 
+  kj::MainFunc getQueryLogsMain() {
+    return kj::MainBuilder(context, "Sandstorm Blackrock version " SANDSTORM_VERSION,
+                           "Prints the structured log records kept by the master's log sink "
+                           "which match all of the given conditions. Each <key>=<value> matches "
+                           "records having that field, e.g. grainId=abc123.")
+        .addOptionWithArg({'d', "dir"}, KJ_BIND_METHOD(*this, setLogQueryDir), "<dir>",
+            "Read records from <dir> rather than the master's default record directory.")
+        .addOptionWithArg({'t', "minutes"}, KJ_BIND_METHOD(*this, setLogQueryMinutes), "<n>",
+            "Only show records logged in the last <n> minutes.")
+        .addOptionWithArg({'s', "severity"}, KJ_BIND_METHOD(*this, setLogQuerySeverity),
+            "<severity>", "Only show records of the given severity: info, warning, error, fatal, "
+            "or debug.")
+        .addOptionWithArg({'m', "machine"}, KJ_BIND_METHOD(*this, setLogQueryMachine),
+            "<machine>", "Only show records from the given machine, e.g. worker3.")
+        .expectZeroOrMoreArgs("<key>=<value>", KJ_BIND_METHOD(*this, addLogQueryTerm))
+        .callAfterParsing(KJ_BIND_METHOD(*this, runQueryLogs))
+        .build();
+  }
+
   kj::MainFunc getSupervisorMain() {
     alternateMain = kj::heap<SupervisorMain>(context);
     return alternateMain->getMain();
@@ -389,6 +521,11 @@ private:
   kj::Vector<kj::StringPtr> machinesToRestart;
 
   kj::Maybe<kj::StringPtr> loggingName;
+  bool shipRecords = false;
+  bool compressRpc = false;
+
+  kj::StringPtr logQueryDir = LOG_RECORD_DIR;
+  LogStore::Query logQuery;
 
   kj::MainBuilder::Validity setLogSink(kj::StringPtr arg) {
     kj::StringPtr addrStr, name;
@@ -435,6 +572,11 @@ private:
     }
   }
 
+  kj::MainBuilder::Validity setCompressRpc() {
+    compressRpc = true;
+    return true;
+  }
+
   kj::MainBuilder::Validity killExisting() {
     pid_t me = getpid();
 
@@ -556,6 +698,10 @@ private:
       case MasterConfig::GCE:
         driver = kj::heap<GceDriver>(subprocessSet, *ioContext.lowLevelProvider, config.getGce());
         break;
+      case MasterConfig::LOCAL:
+        driver = kj::heap<LocalDriver>(subprocessSet, *ioContext.lowLevelProvider,
+                                       config.getLocal());
+        break;
     }
     blackrock::runMaster(ioContext, *driver, config, shouldRestart, machinesToRestart);
     KJ_UNREACHABLE;
@@ -668,18 +814,25 @@ private:
       // Detach from controlling terminal and make ourselves session leader.
       KJ_SYSCALL(setsid());
 
-      // Write logs to log process.
+      // Write logs to log process. Structured log records go to it over a second pipe, which it
+      // sees as fd 3.
+      kj::AutoCloseFd recordsWriteEnd;
       KJ_IF_MAYBE(n, loggingName) {
         int fds[2];
         KJ_SYSCALL(pipe2(fds, O_CLOEXEC));
         kj::AutoCloseFd readEnd(fds[0]);
         kj::AutoCloseFd writeEnd(fds[1]);
 
-        sandstorm::Subprocess::Options options({"blackrock", "log", *n});
+        auto recordsPipe = sandstorm::Pipe::make();
+
+        sandstorm::Subprocess::Options options({"blackrock", "log", "--records", *n});
         options.executable = "/proc/self/exe";
         options.stdin = readEnd;
+        int moreFds[1] = { recordsPipe.readEnd };
+        options.moreFds = moreFds;
         sandstorm::Subprocess(kj::mv(options)).detach();
         KJ_SYSCALL(dup2(writeEnd, STDERR_FILENO));
+        recordsWriteEnd = kj::mv(recordsPipe.writeEnd);
       }
 
       // Create a new pid namespace so that when the blackrock daemon is killed or dies, everything
@@ -700,6 +853,11 @@ private:
       // Redirect stdout to stderr (i.e. the log sink).
       KJ_SYSCALL(dup2(STDERR_FILENO, STDOUT_FILENO));
 
+      kj::Maybe<kj::Own<StructuredLogger>> structuredLogger;
+      KJ_IF_MAYBE(n, loggingName) {
+        structuredLogger = kj::heap<StructuredLogger>(kj::mv(recordsWriteEnd), *n);
+      }
+
       // Make standard input /dev/null.
       KJ_SYSCALL(dup2(sandstorm::raiiOpen("/dev/null", O_RDONLY | O_CLOEXEC), STDIN_FILENO));
 
@@ -707,6 +865,9 @@ private:
       auto ioContext = kj::setupAsyncIo();
       VatNetwork network(ioContext.provider->getNetwork(), ioContext.provider->getTimer(),
                          bindAddress);
+      if (compressRpc) {
+        network.setCompressionFilter([](const SimpleAddress&) { return true; });
+      }
 
       // Write VatPath to pidfile.
       {
@@ -734,7 +895,7 @@ private:
 
       // OK, now we can construct the MachineImpl.
       paf.fulfiller->fulfill(kj::heap<MachineImpl>(
-          ioContext, rpcSystem, persistentRegistry,
+          ioContext, network, rpcSystem, persistentRegistry,
           SimpleAddress(network.getSelf().getAddress())));
 
       // Loop forever handling messages.
@@ -758,15 +919,69 @@ private:
     }
   }
 
+  kj::MainBuilder::Validity setShipRecords() {
+    shipRecords = true;
+    return true;
+  }
+
   bool runLog(kj::StringPtr name) {
     // Rename the task so that when we kill all blackrock processes we can avoid killing the
     // logger, which will die naturally as soon as it finishes up.
     KJ_SYSCALL(prctl(PR_SET_NAME, "blackrock-log", 0, 0, 0));
 
-    runLogClient(name, LOG_ADDRESS_FILE, "/var/log");
+    runLogClient(name, LOG_ADDRESS_FILE, "/var/log",
+                 shipRecords ? kj::Maybe<int>(3) : kj::Maybe<int>(nullptr));
     KJ_UNREACHABLE;
   }
 
+  kj::MainBuilder::Validity setLogQueryDir(kj::StringPtr dir) {
+    logQueryDir = dir;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setLogQueryMinutes(kj::StringPtr arg) {
+    char* end;
+    unsigned long minutes = strtoul(arg.cStr(), &end, 10);
+    if (arg.size() == 0 || *end != '\0') {
+      return "expected a number of minutes";
+    }
+
+    struct timespec now;
+    KJ_SYSCALL(clock_gettime(CLOCK_REALTIME, &now));
+    logQuery.sinceNs = (int64_t(now.tv_sec) - int64_t(minutes) * 60) * 1000000000;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setLogQuerySeverity(kj::StringPtr severity) {
+    logQuery.terms.add(kj::str("severity"), kj::heapString(severity));
+    return true;
+  }
+
+  kj::MainBuilder::Validity setLogQueryMachine(kj::StringPtr machine) {
+    logQuery.terms.add(kj::str("machine"), kj::heapString(machine));
+    return true;
+  }
+
+  kj::MainBuilder::Validity addLogQueryTerm(kj::StringPtr arg) {
+    KJ_IF_MAYBE(pos, arg.findFirst('=')) {
+      logQuery.terms.add(kj::heapString(arg.slice(0, *pos)), kj::heapString(arg.slice(*pos + 1)));
+      return true;
+    } else {
+      return "expected <key>=<value>";
+    }
+  }
+
+  bool runQueryLogs() {
+    kj::FdOutputStream rawOutput(STDOUT_FILENO);
+    kj::BufferedOutputStreamWrapper output(rawOutput);
+    LogStore::query(logQueryDir, logQuery, [&](LogRecord::Reader record) {
+      auto line = formatLogRecord(record);
+      output.write(line.begin(), line.size());
+    });
+    output.flush();
+    return true;
+  }
+
   void dumpFile(int inFd, int outFd) {
     ssize_t n;
     off_t offset = 0;
@@ -0,0 +1,410 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "cluster-rpc.h"
+#include <kj/main.h>
+#include <kj/debug.h>
+#include <kj/vector.h>
+#include <algorithm>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace blackrock {
+
+static uint64_t nowNs() {
+  // kj::Timer only advances once per event loop turn, which is too coarse for latency samples.
+  struct timespec ts;
+  KJ_SYSCALL(clock_gettime(CLOCK_MONOTONIC, &ts));
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+class ClusterRpcBench {
+  // Benchmarks VatNetwork over loopback. Each result is written to stdout as a single-line JSON
+  // object so that runs can be collected and compared by scripts.
+
+public:
+  ClusterRpcBench(kj::ProcessContext& context): context(context) {}
+
+  kj::MainFunc getMain() {
+    return kj::MainBuilder(context, "Blackrock VatNetwork benchmark",
+                           "Measures VatNetwork latency and throughput between vats in this "
+                           "process, over loopback. Runs the named benchmarks, or all of them "
+                           "if none are named. Benchmarks are: ping, pipeline, bulk, handshake, "
+                           "storm. Results are written to stdout, one JSON object per line.")
+        .addOptionWithArg({'n', "iterations"}, KJ_BIND_METHOD(*this, setIterations), "<count>",
+            "number of round trips for ping, and per link for pipeline (default: 10000)")
+        .addOptionWithArg({'w', "window"}, KJ_BIND_METHOD(*this, setWindow), "<count>",
+            "number of pipelined messages in flight per link (default: 64)")
+        .addOptionWithArg({'s', "size"}, KJ_BIND_METHOD(*this, setSize), "<bytes>",
+            "message size for bulk (default: 1048576)")
+        .addOptionWithArg({'b', "bulk-count"}, KJ_BIND_METHOD(*this, setBulkCount), "<count>",
+            "number of messages for bulk (default: 256)")
+        .addOptionWithArg({'c', "connections"}, KJ_BIND_METHOD(*this, setConnections), "<count>",
+            "number of fresh connections for handshake (default: 500)")
+        .addOptionWithArg({'m', "mesh"}, KJ_BIND_METHOD(*this, setMesh), "<vats>",
+            "number of fully-connected vats for pipeline and storm (default: 4)")
+        .addOption({'z', "compress"}, KJ_BIND_METHOD(*this, setCompress),
+            "enable packed framing on all links")
+        .expectZeroOrMoreArgs("<benchmark>", KJ_BIND_METHOD(*this, addBenchmark))
+        .callAfterParsing(KJ_BIND_METHOD(*this, run))
+        .build();
+  }
+
+private:
+  kj::ProcessContext& context;
+  uint iterations = 10000;
+  uint window = 64;
+  uint size = 1 << 20;
+  uint bulkCount = 256;
+  uint connections = 500;
+  uint mesh = 4;
+  bool compress = false;
+  kj::Vector<kj::StringPtr> benchmarks;
+
+  static kj::MainBuilder::Validity parseUint(kj::StringPtr arg, uint& target) {
+    char* end;
+    unsigned long value = strtoul(arg.cStr(), &end, 10);
+    if (arg.size() == 0 || *end != '\0' || value == 0 || uint(value) != value) {
+      return "expected a positive integer";
+    }
+    target = value;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setIterations(kj::StringPtr arg) { return parseUint(arg, iterations); }
+  kj::MainBuilder::Validity setWindow(kj::StringPtr arg) { return parseUint(arg, window); }
+  kj::MainBuilder::Validity setSize(kj::StringPtr arg) { return parseUint(arg, size); }
+  kj::MainBuilder::Validity setBulkCount(kj::StringPtr arg) { return parseUint(arg, bulkCount); }
+  kj::MainBuilder::Validity setConnections(kj::StringPtr arg) {
+    return parseUint(arg, connections);
+  }
+  kj::MainBuilder::Validity setMesh(kj::StringPtr arg) {
+    auto result = parseUint(arg, mesh);
+    if (mesh < 2) return "mesh needs at least two vats";
+    return result;
+  }
+
+  bool setCompress() {
+    compress = true;
+    return true;
+  }
+
+  kj::MainBuilder::Validity addBenchmark(kj::StringPtr name) {
+    if (name != "ping" && name != "pipeline" && name != "bulk" &&
+        name != "handshake" && name != "storm") {
+      return "unknown benchmark";
+    }
+    benchmarks.add(name);
+    return true;
+  }
+
+  bool shouldRun(kj::StringPtr name) {
+    if (benchmarks.size() == 0) return true;
+    for (auto& b: benchmarks) {
+      if (b == name) return true;
+    }
+    return false;
+  }
+
+  bool run() {
+    if (shouldRun("ping")) benchPing();
+    if (shouldRun("pipeline")) benchPipeline();
+    if (shouldRun("bulk")) benchBulk();
+    if (shouldRun("handshake")) benchHandshake();
+    if (shouldRun("storm")) benchStorm();
+    return true;
+  }
+
+  // -------------------------------------------------------------------
+
+  struct Node {
+    VatNetwork network;
+
+    Node(kj::AsyncIoContext& io, bool compress)
+        : network(io.provider->getNetwork(), io.provider->getTimer(),
+                  SimpleAddress::getLocalhost(AF_INET)) {
+      if (compress) {
+        network.setCompressionFilter([](const SimpleAddress&) { return true; });
+      }
+    }
+  };
+
+  struct Link {
+    kj::Own<VatNetwork::Connection> initiator;
+    kj::Own<VatNetwork::Connection> acceptor;
+  };
+
+  kj::Array<kj::Own<Node>> makeNodes(kj::AsyncIoContext& io, uint count) {
+    auto builder = kj::heapArrayBuilder<kj::Own<Node>>(count);
+    for (uint i = 0; i < count; i++) {
+      builder.add(kj::heap<Node>(io, compress));
+    }
+    return builder.finish();
+  }
+
+  Link connect(kj::AsyncIoContext& io, Node& from, Node& to) {
+    // Connect `from` to `to` and exchange a message in each direction so that both ends are
+    // authenticated before anything is measured.
+
+    Link link;
+    link.initiator = KJ_ASSERT_NONNULL(from.network.connect(to.network.getSelf()));
+    sendText(*link.initiator, "hello");
+    link.acceptor = to.network.accept().wait(io.waitScope);
+    receive(io, *link.acceptor);
+    sendText(*link.acceptor, "hello");
+    receive(io, *link.initiator);
+    return link;
+  }
+
+  kj::Vector<Link> connectMesh(kj::AsyncIoContext& io, kj::ArrayPtr<kj::Own<Node>> nodes) {
+    kj::Vector<Link> links;
+    for (uint i = 0; i < nodes.size(); i++) {
+      for (uint j = i + 1; j < nodes.size(); j++) {
+        links.add(connect(io, *nodes[i], *nodes[j]));
+      }
+    }
+    return links;
+  }
+
+  static void sendText(VatNetwork::Connection& conn, kj::StringPtr text) {
+    auto msg = conn.newOutgoingMessage(8);
+    msg->getBody().setAs<capnp::Text>(text);
+    msg->send();
+  }
+
+  static void sendData(VatNetwork::Connection& conn, size_t size) {
+    auto msg = conn.newOutgoingMessage(size / sizeof(capnp::word) + 4);
+    auto data = msg->getBody().initAs<capnp::Data>(size);
+
+    // Fill with non-zero bytes so that packing can't cheat.
+    for (size_t i = 0; i < data.size(); i++) {
+      data[i] = i * 0x9d + 1;
+    }
+
+    msg->send();
+  }
+
+  static kj::Own<capnp::IncomingRpcMessage> receive(
+      kj::AsyncIoContext& io, VatNetwork::Connection& conn) {
+    return KJ_ASSERT_NONNULL(conn.receiveIncomingMessage().wait(io.waitScope),
+                             "unexpected disconnect");
+  }
+
+  kj::Promise<void> echoLoop(VatNetwork::Connection& conn) {
+    // Reply to every incoming message with a small message, until disconnected.
+
+    return conn.receiveIncomingMessage()
+        .then([this,&conn](kj::Maybe<kj::Own<capnp::IncomingRpcMessage>>&& message)
+              -> kj::Promise<void> {
+      if (message == nullptr) return kj::READY_NOW;
+      sendText(conn, "ack");
+      return echoLoop(conn);
+    });
+  }
+
+  struct Flow {
+    // One sender keeping a window of messages in flight on a connection.
+
+    VatNetwork::Connection& conn;
+    uint total;
+    uint sent = 0;
+    uint received = 0;
+    kj::Function<void(VatNetwork::Connection&)> send;
+  };
+
+  kj::Promise<void> flowLoop(Flow& flow) {
+    while (flow.sent < flow.total && flow.sent - flow.received < window) {
+      flow.send(flow.conn);
+      ++flow.sent;
+    }
+
+    if (flow.received == flow.total) return kj::READY_NOW;
+
+    return flow.conn.receiveIncomingMessage()
+        .then([this,&flow](kj::Maybe<kj::Own<capnp::IncomingRpcMessage>>&& message) {
+      KJ_ASSERT(message != nullptr, "unexpected disconnect");
+      ++flow.received;
+      return flowLoop(flow);
+    });
+  }
+
+  // -------------------------------------------------------------------
+
+  kj::StringPtr transport() {
+    return compress ? "packed" : "plain";
+  }
+
+  void report(kj::String json) {
+    auto line = kj::str(json, '\n');
+    kj::FdOutputStream(STDOUT_FILENO).write(line.begin(), line.size());
+  }
+
+  kj::String latencyFields(kj::ArrayPtr<uint64_t> samples) {
+    std::sort(samples.begin(), samples.end());
+
+    uint64_t total = 0;
+    for (auto s: samples) total += s;
+
+    auto percentile = [&](uint permille) {
+      return samples[kj::min(samples.size() - 1, samples.size() * permille / 1000)];
+    };
+
+    return kj::str(
+        "\"samples\":", samples.size(),
+        ",\"mean_ns\":", total / samples.size(),
+        ",\"p50_ns\":", percentile(500),
+        ",\"p90_ns\":", percentile(900),
+        ",\"p99_ns\":", percentile(990),
+        ",\"p999_ns\":", percentile(999),
+        ",\"max_ns\":", samples.back());
+  }
+
+  void benchPing() {
+    auto io = kj::setupAsyncIo();
+    auto nodes = makeNodes(io, 2);
+    auto link = connect(io, *nodes[0], *nodes[1]);
+
+    auto samples = kj::heapArray<uint64_t>(iterations);
+    for (auto& sample: samples) {
+      uint64_t start = nowNs();
+      sendText(*link.initiator, "ping");
+      receive(io, *link.acceptor);
+      sendText(*link.acceptor, "pong");
+      receive(io, *link.initiator);
+      sample = nowNs() - start;
+    }
+
+    report(kj::str("{\"benchmark\":\"ping\",\"transport\":\"", transport(), "\",",
+                   latencyFields(samples), "}"));
+  }
+
+  void benchPipeline() {
+    auto io = kj::setupAsyncIo();
+    auto nodes = makeNodes(io, mesh);
+    auto links = connectMesh(io, nodes);
+
+    // VatNetwork keeps one connection per pair of vats, so each link carries a single flow from
+    // the initiator, echoed by the acceptor.
+    kj::Vector<kj::Own<Flow>> flows;
+    kj::Vector<kj::Promise<void>> echoes;
+    for (auto& link: links) {
+      flows.add(kj::heap<Flow>(Flow {
+          *link.initiator, iterations, 0, 0,
+          [](VatNetwork::Connection& c) { sendText(c, "x"); }}));
+      echoes.add(echoLoop(*link.acceptor).eagerlyEvaluate(nullptr));
+    }
+
+    uint64_t start = nowNs();
+    auto promises = KJ_MAP(flow, flows) { return flowLoop(*flow); };
+    kj::joinPromises(kj::mv(promises)).wait(io.waitScope);
+    uint64_t elapsed = nowNs() - start;
+
+    uint64_t total = uint64_t(iterations) * flows.size();
+    report(kj::str("{\"benchmark\":\"pipeline\",\"transport\":\"", transport(), "\"",
+                   ",\"vats\":", mesh, ",\"flows\":", flows.size(), ",\"window\":", window,
+                   ",\"round_trips\":", total, ",\"elapsed_ns\":", elapsed,
+                   ",\"round_trips_per_sec\":", total * 1000000000ull / elapsed, "}"));
+  }
+
+  void benchBulk() {
+    auto io = kj::setupAsyncIo();
+    auto nodes = makeNodes(io, 2);
+    auto link = connect(io, *nodes[0], *nodes[1]);
+
+    auto echo = echoLoop(*link.acceptor).eagerlyEvaluate(nullptr);
+    uint messageSize = size;
+    Flow flow {
+      *link.initiator, bulkCount, 0, 0,
+      [messageSize](VatNetwork::Connection& c) { sendData(c, messageSize); }
+    };
+
+    uint64_t start = nowNs();
+    flowLoop(flow).wait(io.waitScope);
+    uint64_t elapsed = nowNs() - start;
+
+    uint64_t bytes = uint64_t(size) * bulkCount;
+    report(kj::str("{\"benchmark\":\"bulk\",\"transport\":\"", transport(), "\"",
+                   ",\"message_bytes\":", size, ",\"messages\":", bulkCount,
+                   ",\"window\":", window, ",\"elapsed_ns\":", elapsed,
+                   ",\"mb_per_sec\":", bytes * 1000 / elapsed, "}"));
+  }
+
+  void benchHandshake() {
+    auto io = kj::setupAsyncIo();
+    Node server(io, compress);
+
+    auto samples = kj::heapArray<uint64_t>(connections);
+    uint64_t total = 0;
+    for (auto& sample: samples) {
+      // A fresh client vat each time, so that every connection needs a full handshake.
+      Node client(io, compress);
+
+      uint64_t start = nowNs();
+      auto link = connect(io, client, server);
+      sample = nowNs() - start;
+      total += sample;
+    }
+
+    report(kj::str("{\"benchmark\":\"handshake\",\"transport\":\"", transport(), "\",",
+                   latencyFields(samples),
+                   ",\"handshakes_per_sec\":", uint64_t(connections) * 1000000000ull / total,
+                   "}"));
+  }
+
+  void benchStorm() {
+    auto io = kj::setupAsyncIo();
+    auto nodes = makeNodes(io, mesh);
+    auto links = connectMesh(io, nodes);
+
+    // Drop every link at once.
+    for (auto& link: links) {
+      link.initiator->shutdown().wait(io.waitScope);
+      KJ_ASSERT(link.acceptor->receiveIncomingMessage().wait(io.waitScope) == nullptr);
+    }
+
+    // Now every vat reconnects to every other vat simultaneously. Recovery is complete when each
+    // new connection has delivered its first message.
+    uint64_t start = nowNs();
+
+    kj::Vector<kj::Own<VatNetwork::Connection>> initiators;
+    for (uint i = 0; i < nodes.size(); i++) {
+      for (uint j = i + 1; j < nodes.size(); j++) {
+        auto conn = KJ_ASSERT_NONNULL(nodes[i]->network.connect(nodes[j]->network.getSelf()));
+        sendText(*conn, "hello");
+        initiators.add(kj::mv(conn));
+      }
+    }
+
+    kj::Vector<kj::Own<VatNetwork::Connection>> acceptors;
+    for (uint j = 0; j < nodes.size(); j++) {
+      for (uint i = 0; i < j; i++) {
+        auto conn = nodes[j]->network.accept().wait(io.waitScope);
+        receive(io, *conn);
+        acceptors.add(kj::mv(conn));
+      }
+    }
+
+    uint64_t elapsed = nowNs() - start;
+    report(kj::str("{\"benchmark\":\"storm\",\"transport\":\"", transport(), "\"",
+                   ",\"vats\":", mesh, ",\"connections\":", initiators.size(),
+                   ",\"recovery_ns\":", elapsed, "}"));
+  }
+};
+
+}  // namespace blackrock
+
+KJ_MAIN(blackrock::ClusterRpcBench);
@@ -15,6 +15,7 @@
 // limitations under the License.
 
 #include "cluster-rpc.h"
+#include <capnp/rpc.capnp.h>
 #include <kj/test.h>
 
 namespace blackrock {
@@ -80,6 +81,23 @@ struct TestEnv {
     KJ_EXPECT(msgText == expectedText, msgText, expectedText);
   }
 
+  void sendReturn(VatNetwork::Connection& conn, uint32_t answerId, size_t size) {
+    // Send a capability-free Return message carrying `size` bytes of content.
+    auto msg = conn.newOutgoingMessage(size / sizeof(capnp::word) + 32);
+    auto ret = msg->getBody().initAs<capnp::rpc::Message>().initReturn();
+    ret.setAnswerId(answerId);
+    ret.initResults().getContent().initAs<capnp::Data>(size);
+    msg->send();
+  }
+
+  void expectReturn(VatNetwork::Connection& conn, uint32_t expectedAnswerId) {
+    auto msg = KJ_ASSERT_NONNULL(conn.receiveIncomingMessage().wait(waitScope));
+    auto rpcMessage = msg->getBody().getAs<capnp::rpc::Message>();
+    KJ_ASSERT(rpcMessage.isReturn());
+    uint32_t answerId = rpcMessage.getReturn().getAnswerId();
+    KJ_EXPECT(answerId == expectedAnswerId, answerId, expectedAnswerId);
+  }
+
   kj::Promise<void> shutdown(VatNetwork::Connection& conn) KJ_WARN_UNUSED_RESULT {
     // Asynchronously shut down the given connection.
     return conn.shutdown().eagerlyEvaluate(logException);
@@ -143,6 +161,245 @@ KJ_TEST("can connect and send messages") {
   env.expectShutdown(*conn1);
 }
 
+KJ_TEST("large results don't hold up other messages") {
+  TestEnv env;
+
+  kj::Own<VatNetwork::Connection> conn1 =
+      KJ_ASSERT_NONNULL(env.network1.connect(env.network2.getSelf()));
+  kj::Own<VatNetwork::Connection> conn2 = env.network2.accept().wait(env.waitScope);
+
+  env.sendMessage(*conn2, "foo");
+  env.expectMessage(*conn1, "foo");
+
+  // The first return starts writing immediately. The second is queued in the bulk lane and should
+  // be overtaken by the small message sent after it.
+  env.sendReturn(*conn1, 1, 1 << 20);
+  env.sendReturn(*conn1, 2, 1 << 20);
+  env.sendMessage(*conn1, "bar");
+
+  // Shutdown should wait for both lanes to drain.
+  auto promise1 = env.shutdown(*conn1);
+
+  env.expectReturn(*conn2, 1);
+  env.expectMessage(*conn2, "bar");
+  env.expectReturn(*conn2, 2);
+  env.expectShutdown(*conn2);
+
+  auto promise2 = env.shutdown(*conn2);
+  env.expectShutdown(*conn1);
+}
+
+KJ_TEST("can compress messages") {
+  TestEnv env;
+  env.network1.setCompressionFilter([](const SimpleAddress&) { return true; });
+
+  kj::Own<VatNetwork::Connection> conn1 =
+      KJ_ASSERT_NONNULL(env.network1.connect(env.network2.getSelf()));
+
+  // Optimistic messages are compressed too.
+  env.sendMessage(*conn1, "foo");
+  env.sendReturn(*conn1, 1, 1 << 20);
+
+  kj::Own<VatNetwork::Connection> conn2 = env.network2.accept().wait(env.waitScope);
+
+  env.expectMessage(*conn2, "foo");
+  env.expectReturn(*conn2, 1);
+
+  // network2 compresses in reply even though it wasn't asked to compress on its own.
+  env.sendMessage(*conn2, "bar");
+  env.sendReturn(*conn2, 2, 1 << 20);
+  env.expectMessage(*conn1, "bar");
+  env.expectReturn(*conn1, 2);
+
+  capnp::MallocMessageBuilder message;
+  auto stats = message.initRoot<VatNetworkStats>();
+  env.network2.getStats(stats);
+  KJ_ASSERT(stats.getPeers().size() == 1);
+  KJ_EXPECT(stats.getPeers()[0].getBytesSent() < 1 << 16);
+
+  // Test clean shutdown.
+  auto promise1 = env.shutdown(*conn1);
+  env.expectShutdown(*conn2);
+  auto promise2 = env.shutdown(*conn2);
+  env.expectShutdown(*conn1);
+}
+
+KJ_TEST("doesn't compress to peers that don't advertise it") {
+  TestEnv env;
+  env.network1.setCompressionFilter([](const SimpleAddress&) { return true; });
+
+  // Pretend network2 predates framing. It gets the basic handshake header and unframed messages.
+  capnp::MallocMessageBuilder pathMessage;
+  pathMessage.setRoot(env.network2.getSelf());
+  auto path = pathMessage.getRoot<VatPath>();
+  path.setFeatures(0);
+
+  kj::Own<VatNetwork::Connection> conn1 = KJ_ASSERT_NONNULL(env.network1.connect(path));
+  env.sendReturn(*conn1, 1, 1 << 20);
+
+  kj::Own<VatNetwork::Connection> conn2 = env.network2.accept().wait(env.waitScope);
+  env.expectReturn(*conn2, 1);
+  env.sendMessage(*conn2, "bar");
+  env.expectMessage(*conn1, "bar");
+
+  capnp::MallocMessageBuilder message;
+  auto stats = message.initRoot<VatNetworkStats>();
+  env.network1.getStats(stats);
+  KJ_ASSERT(stats.getPeers().size() == 1);
+  KJ_EXPECT(stats.getPeers()[0].getBytesSent() > 1 << 20);
+
+  auto promise1 = env.shutdown(*conn1);
+  env.expectShutdown(*conn2);
+  auto promise2 = env.shutdown(*conn2);
+  env.expectShutdown(*conn1);
+}
+
+KJ_TEST("collects connection statistics") {
+  TestEnv env;
+
+  kj::Own<VatNetwork::Connection> conn1 =
+      KJ_ASSERT_NONNULL(env.network1.connect(env.network2.getSelf()));
+  kj::Own<VatNetwork::Connection> conn2 = env.network2.accept().wait(env.waitScope);
+
+  env.sendMessage(*conn2, "foo");
+  env.expectMessage(*conn1, "foo");
+  env.sendMessage(*conn1, "bar");
+  env.sendMessage(*conn1, "baz");
+  env.expectMessage(*conn2, "bar");
+  env.expectMessage(*conn2, "baz");
+
+  capnp::MallocMessageBuilder message;
+  auto stats = message.initRoot<VatNetworkStats>();
+  env.network1.getStats(stats);
+
+  KJ_ASSERT(stats.getPeers().size() == 1);
+  auto peer = stats.getPeers()[0];
+  KJ_EXPECT(peer.getState() == VatNetworkStats::Peer::State::AUTHENTICATED);
+  KJ_EXPECT(peer.getMessagesSent() == 2);
+  KJ_EXPECT(peer.getMessagesReceived() == 1);
+  KJ_EXPECT(peer.getBytesSent() > 0);
+  KJ_EXPECT(peer.getOptimisticCount() == 1);
+  KJ_EXPECT(peer.getAuthenticatedCount() == 1);
+  KJ_EXPECT(peer.getQueuedBytes() == 0);
+  KJ_EXPECT(peer.getAddress().getPort() == env.network2.getSelf().getAddress().getPort());
+
+  // Test clean shutdown.
+  auto promise1 = env.shutdown(*conn1);
+  env.expectShutdown(*conn2);
+  auto promise2 = env.shutdown(*conn2);
+  env.expectShutdown(*conn1);
+}
+
+KJ_TEST("measures round-trip time of prompt calls only") {
+  TestEnv env;
+
+  kj::Own<VatNetwork::Connection> conn1 =
+      KJ_ASSERT_NONNULL(env.network1.connect(env.network2.getSelf()));
+  kj::Own<VatNetwork::Connection> conn2 = env.network2.accept().wait(env.waitScope);
+
+  auto call = [&](uint32_t questionId) {
+    auto msg = conn1->newOutgoingMessage(32);
+    msg->getBody().initAs<capnp::rpc::Message>().initCall().setQuestionId(questionId);
+    msg->send();
+    auto received = KJ_ASSERT_NONNULL(conn2->receiveIncomingMessage().wait(env.waitScope));
+    KJ_ASSERT(received->getBody().getAs<capnp::rpc::Message>().isCall());
+  };
+
+  call(1);
+  env.sendReturn(*conn2, 1, 0);
+  env.expectReturn(*conn1, 1);
+
+  // A call which waits for something, like a hanging ping, says nothing about the link.
+  call(2);
+  env.ioContext.provider->getTimer().afterDelay(1100 * kj::MILLISECONDS).wait(env.waitScope);
+  env.sendReturn(*conn2, 2, 0);
+  env.expectReturn(*conn1, 2);
+
+  capnp::MallocMessageBuilder message1;
+  auto stats1 = message1.initRoot<VatNetworkStats>();
+  env.network1.getStats(stats1);
+  KJ_ASSERT(stats1.getPeers().size() == 1);
+  KJ_EXPECT(stats1.getPeers()[0].getRttCount() == 1);
+  KJ_EXPECT(stats1.getPeers()[0].getRttLast() < 1000000000);
+  KJ_EXPECT(stats1.getPeers()[0].getLastHandshakeLatency() > 0);
+
+  // network2 only accepted, so it has no handshake to time.
+  capnp::MallocMessageBuilder message2;
+  auto stats2 = message2.initRoot<VatNetworkStats>();
+  env.network2.getStats(stats2);
+  KJ_ASSERT(stats2.getPeers().size() == 1);
+  KJ_EXPECT(stats2.getPeers()[0].getLastHandshakeLatency() == 0);
+
+  auto promise1 = env.shutdown(*conn1);
+  env.expectShutdown(*conn2);
+  auto promise2 = env.shutdown(*conn2);
+  env.expectShutdown(*conn1);
+}
+
+KJ_TEST("pauses reading while too much is queued for the peer") {
+  TestEnv env;
+  env.network2.setWriteHighWaterMark(1 << 20);
+
+  kj::Own<VatNetwork::Connection> conn1 =
+      KJ_ASSERT_NONNULL(env.network1.connect(env.network2.getSelf()));
+  kj::Own<VatNetwork::Connection> conn2 = env.network2.accept().wait(env.waitScope);
+
+  env.sendMessage(*conn2, "foo");
+  env.expectMessage(*conn1, "foo");
+
+  // conn1 isn't reading, so once the socket buffers fill up these pile up in network2's queue.
+  for (uint i = 0; i < 64; i++) {
+    env.sendReturn(*conn2, i, 1 << 20);
+  }
+  env.sendMessage(*conn1, "bar");
+
+  kj::Maybe<kj::Own<capnp::IncomingRpcMessage>> bar;
+  bool receivedBar = false;
+  auto promise = conn2->receiveIncomingMessage()
+      .then([&](kj::Maybe<kj::Own<capnp::IncomingRpcMessage>>&& message) {
+    bar = kj::mv(message);
+    receivedBar = true;
+  }).eagerlyEvaluate(logException);
+
+  // "bar" has plenty of time to arrive, but network2 shouldn't take on more work from the peer it
+  // can't keep up with.
+  env.ioContext.provider->getTimer().afterDelay(200 * kj::MILLISECONDS).wait(env.waitScope);
+  KJ_EXPECT(!receivedBar);
+  KJ_EXPECT(env.network2.getQueueStats().readPauses > 0);
+
+  {
+    capnp::MallocMessageBuilder message;
+    auto stats = message.initRoot<VatNetworkStats>();
+    env.network2.getStats(stats);
+    KJ_EXPECT(stats.getPeakQueuedBytes() > (1u << 20));
+  }
+
+  // Once conn1 catches up, reading resumes.
+  for (uint i = 0; i < 64; i++) {
+    env.expectReturn(*conn1, i);
+  }
+  promise.wait(env.waitScope);
+  KJ_ASSERT(receivedBar);
+  auto text = KJ_ASSERT_NONNULL(bar)->getBody().getAs<capnp::Text>();
+  KJ_EXPECT(text == "bar", text);
+
+  {
+    // The peak is per report, so once the queue has drained and been reported it goes back to
+    // zero.
+    capnp::MallocMessageBuilder message;
+    auto stats = message.initRoot<VatNetworkStats>();
+    env.network2.getStats(stats);
+    env.network2.getStats(stats);
+    KJ_EXPECT(stats.getPeakQueuedBytes() == 0);
+  }
+
+  // Test clean shutdown.
+  auto promise1 = env.shutdown(*conn1);
+  env.expectShutdown(*conn2);
+  auto promise2 = env.shutdown(*conn2);
+  env.expectShutdown(*conn1);
+}
+
 KJ_TEST("can optimistically send messages") {
   TestEnv env;
 
@@ -252,7 +509,7 @@ KJ_TEST("rejects bogus reply header") {
   env.sendMessage(*conn1, "foo");
 
   auto conn2 = listener->accept().wait(env.waitScope);
-  byte header[64];
+  byte header[72];
   conn2->read(header, sizeof(header)).wait(env.waitScope);
   ++header[32];  // increment connection number
   conn2->write(header, sizeof(header)).wait(env.waitScope);
@@ -27,8 +27,12 @@
 #include <errno.h>
 #include <ifaddrs.h>
 #include <capnp/serialize-async.h>
+#include <capnp/serialize.h>
+#include <capnp/serialize-packed.h>
+#include <capnp/rpc.capnp.h>
 #include <sandstorm/util.h>
 #include <unordered_map>
+#include <deque>
 #include <netdb.h>
 #include <arpa/inet.h>
 
@@ -67,6 +71,20 @@ static inline void toBigEndian64(kj::byte* bytes, uint64_t value) {
   bytes[7] = (value >>  0) & 0xffu;
 }
 
+static inline uint32_t fromLittleEndian32(const kj::byte* bytes) {
+  return (static_cast<uint32_t>(bytes[0]) <<  0) |
+         (static_cast<uint32_t>(bytes[1]) <<  8) |
+         (static_cast<uint32_t>(bytes[2]) << 16) |
+         (static_cast<uint32_t>(bytes[3]) << 24);
+}
+
+static inline void toLittleEndian32(kj::byte* bytes, uint32_t value) {
+  bytes[0] = (value >>  0) & 0xffu;
+  bytes[1] = (value >>  8) & 0xffu;
+  bytes[2] = (value >> 16) & 0xffu;
+  bytes[3] = (value >> 24) & 0xffu;
+}
+
 static inline void toLittleEndian64(kj::byte* bytes, uint64_t value) {
   bytes[0] = (value >>  0) & 0xffu;
   bytes[1] = (value >>  8) & 0xffu;
@@ -450,16 +468,50 @@ auto VatNetwork::PrivateKey::getSharedSecret(PublicKey otherPublic) const -> Sym
 
 class VatNetwork::Header {
 public:
+  enum Features: uint64_t {
+    FRAMED = 1 << 0
+    // All messages sent by the sender of this header on this stream are wrapped in frames, which
+    // may be packed. See the transport protocol notes in cluster-rpc.capnp. In a VatPath, means
+    // that the vat understands framed streams and extended headers.
+  };
+
+  static constexpr size_t BASE_SIZE = 64;
+  // Size of a header without the features word, as sent by and to vats which predate it.
+
   Header(decltype(nullptr))
       : senderPublicKey(nullptr), connectionNumber(nullptr),
-        minIgnoredConnection(nullptr), mac(nullptr) {}
+        minIgnoredConnection(nullptr), mac(nullptr), features(nullptr) {}
 
   Header(const PublicKey& myPublic, uint64_t connectionNumber, uint64_t minIgnoredConnection,
-         const SimpleAddress& myAddress, const PublicKey& peerPublic, const PrivateKey& myPrivate)
+         kj::Maybe<uint64_t> features, const SimpleAddress& myAddress,
+         const PublicKey& peerPublic, const PrivateKey& myPrivate)
       : senderPublicKey(myPublic),
         connectionNumber(connectionNumber),
         minIgnoredConnection(minIgnoredConnection),
-        mac(computeMac(myPrivate.getSharedSecret(peerPublic), myAddress)) {}
+        mac(nullptr),
+        features(uint64_t(0)) {
+    KJ_ASSERT(!(minIgnoredConnection & EXTENDED));
+    KJ_IF_MAYBE(f, features) {
+      this->minIgnoredConnection = minIgnoredConnection | EXTENDED;
+      this->features = *f;
+    }
+    mac = computeMac(myPrivate.getSharedSecret(peerPublic), myAddress);
+  }
+
+  static kj::Promise<void> read(kj::AsyncInputStream& stream, Header& header) {
+    return stream.read(&header, BASE_SIZE).then([&stream,&header]() -> kj::Promise<void> {
+      if (header.isExtended()) {
+        return stream.read(&header.features, sizeof(header.features));
+      } else {
+        return kj::READY_NOW;
+      }
+    });
+  }
+
+  kj::ArrayPtr<const byte> asBytes() const {
+    return kj::arrayPtr(reinterpret_cast<const byte*>(this),
+                        isExtended() ? sizeof(*this) : BASE_SIZE);
+  }
 
   kj::Maybe<PublicKey> verify(const PrivateKey& privateKey, const SimpleAddress& address) {
     // Check the mac.
@@ -474,34 +526,123 @@ public:
     return connectionNumber.get();
   }
   uint64_t getMinIgnoredConnection() {
-    return minIgnoredConnection.get();
+    return minIgnoredConnection.get() & ~EXTENDED;
+  }
+  kj::Maybe<uint64_t> getFeatures() {
+    // Null if the sender predates feature negotiation.
+    if (isExtended()) {
+      return features.get();
+    } else {
+      return nullptr;
+    }
   }
 
 private:
+  static constexpr uint64_t EXTENDED = 1ull << 63;
+  // Set in `minIgnoredConnection` when the features word follows the MAC. Connection numbers
+  // never get anywhere near this high.
+
   PublicKey senderPublicKey;
   LittleEndian64 connectionNumber;
   LittleEndian64 minIgnoredConnection;
   Mac mac;
+  LittleEndian64 features;
 
-  Mac computeMac(const SymmetricKey& secret, const SimpleAddress& address) {
-    size_t headerSize = sizeof(*this) - sizeof(mac);
-    byte data[headerSize + SimpleAddress::FLAT_SIZE];
+  bool isExtended() const {
+    return minIgnoredConnection.get() & EXTENDED;
+  }
 
-    memcpy(data, this, headerSize);
-    address.getFlat(data + headerSize);
+  Mac computeMac(const SymmetricKey& secret, const SimpleAddress& address) {
+    size_t prefixSize = BASE_SIZE - sizeof(mac);
+    byte data[prefixSize + sizeof(features) + SimpleAddress::FLAT_SIZE];
+    byte* pos = data;
+
+    memcpy(pos, this, prefixSize);
+    pos += prefixSize;
+    if (isExtended()) {
+      memcpy(pos, features.getBytes(), sizeof(features));
+      pos += sizeof(features);
+    }
+    address.getFlat(pos);
+    pos += SimpleAddress::FLAT_SIZE;
 
-    return secret.authenticate(kj::arrayPtr(data, sizeof(data)), connectionNumber, 0);
+    return secret.authenticate(kj::arrayPtr(data, pos), connectionNumber, 0);
   }
 };
 
 // -------------------------------------------------------------------
 
+struct VatNetwork::PeerStats {
+  kj::Maybe<ConnectionImpl&> connection;
+  // The most recent connection to this peer, if it still exists.
+
+  kj::Maybe<SimpleAddress> address;
+  // Address of the most recent authenticated connection.
+
+  uint64_t messagesSent = 0;
+  uint64_t bytesSent = 0;
+  uint64_t messagesReceived = 0;
+  uint64_t bytesReceived = 0;
+
+  uint optimisticCount = 0;
+  uint pessimisticCount = 0;
+  uint authenticatedCount = 0;
+  uint failedCount = 0;
+  uint reconnectCount = 0;
+
+  kj::Duration lastHandshakeLatency = 0 * kj::SECONDS;
+
+  uint64_t rttCount = 0;
+  kj::Duration rttMin = 0 * kj::SECONDS;
+  kj::Duration rttSmoothed = 0 * kj::SECONDS;
+  kj::Duration rttLast = 0 * kj::SECONDS;
+};
+
 struct VatNetwork::ConnectionMap {
+  std::unordered_map<PublicKey, PeerStats, PublicKey::Hash> stats;
+  // Statistics for every peer we've ever talked to. Kept separately from `map` so that they
+  // accumulate across reconnects. Declared first so that it outlives the connections.
+
   std::unordered_map<PublicKey, kj::Maybe<kj::Own<ConnectionImpl>>, PublicKey::Hash> map;
 };
 
+static uint64_t serializedSize(capnp::MessageReader& reader) {
+  // Compute the size of the standard serialization of the given message.
+
+  uint64_t result = 0;
+  uint count = 0;
+  for (;;) {
+    auto segment = reader.getSegment(count);
+    if (segment.size() == 0) break;
+    result += segment.size();
+    ++count;
+  }
+  return (result + count / 2 + 1) * sizeof(capnp::word);
+}
+
 // =======================================================================================
 
+static constexpr size_t BULK_MESSAGE_WORDS = 2048;
+// Outgoing messages of at least this size (16k) are candidates for the bulk lane.
+
+static constexpr kj::Duration WRITE_STALL_TIMEOUT = 1 * kj::SECONDS;
+// If no outgoing message has finished writing for this long, consider the connection stalled
+// rather than merely slow, and don't pause reads for backpressure. See setWriteHighWaterMark().
+
+static constexpr size_t FRAME_HEADER_SIZE = 4;
+static constexpr uint32_t FRAME_PACKED = 1u << 31;
+static constexpr uint32_t MAX_FRAME_SIZE = 128u << 20;
+// On framed streams, each message is preceded by a 32-bit little-endian word giving the size of
+// the frame content in bytes, with the top bit set if the content is packed.
+
+static constexpr kj::Duration RTT_SAMPLE_MAX = 1 * kj::SECONDS;
+// Calls which take longer than this to return are left out of the round-trip time statistics.
+
+static constexpr uint PACK_MISS_LIMIT = 4;
+static constexpr uint PACK_SKIP_COUNT = 64;
+// After packing fails to shrink this many consecutive messages to a peer, send the next
+// PACK_SKIP_COUNT unpacked without trying, then try again.
+
 VatNetwork::VatNetwork(kj::Network& network, kj::Timer& timer, SimpleAddress address)
     : network(network),
       timer(timer),
@@ -514,21 +655,46 @@ VatNetwork::VatNetwork(kj::Network& network, kj::Timer& timer, SimpleAddress add
   auto path = self.initRoot<VatPath>();
   publicKey.copyTo(path.getId());
   address.copyTo(path.getAddress());
+  path.setFeatures(Header::FRAMED);
 }
 
 VatNetwork::~VatNetwork() {}
 
+void VatNetwork::setCompressionFilter(kj::Function<bool(const SimpleAddress& peer)> filter) {
+  compressionFilter = kj::mv(filter);
+}
+
+bool VatNetwork::shouldCompress(const SimpleAddress& peer) {
+  KJ_IF_MAYBE(f, compressionFilter) {
+    return (*f)(peer);
+  } else {
+    return false;
+  }
+}
+
 class VatNetwork::ConnectionImpl final: public Connection, public kj::Refcounted,
                                         private kj::TaskSet::ErrorHandler {
 public:
   ConnectionImpl(VatNetwork& network, PublicKey peerKey, uint64_t minConnectionNumber)
       : ConnectionImpl(network, peerKey, minConnectionNumber, kj::newPromiseAndFulfiller<void>()) {}
 
+  ~ConnectionImpl() noexcept(false) {
+    network.queueStats.queuedBytes -= queuedBytes;
+
+    KJ_IF_MAYBE(c, stats.connection) {
+      if (c == this) {
+        stats.connection = nullptr;
+      }
+    }
+  }
+
   inline uint64_t getMinConnectionNumber() { return minConnectionNumber; }
 
-  bool connect(SimpleAddress address) {
+  inline uint64_t getQueuedBytes() { return queuedBytes; }
+
+  bool connect(SimpleAddress address, uint64_t peerVatFeatures) {
     // If this connection is not already established and authenticated, try connecting to the given
-    // address.
+    // address. `peerVatFeatures` are the features advertised in the peer's VatPath.
 
     if (state == FAILED) {
       // This connection has failed, so we'll need to reconnect.
@@ -538,7 +704,7 @@ public:
     if (state == AUTHENTICATED) {
       // If we've already shut down the connection, then the caller will need to create a whole new
       // ConnectionImpl. Otherwise, we're already authenticated, so ignore the new address.
-      return previousWrite != nullptr && !receivedShutdown;
+      return !writeShutdown && !receivedShutdown;
     }
 
     if (state == OPTIMISTIC) {
@@ -552,7 +718,7 @@ public:
       // Crap, the address changed. We need to shift to pessimistic mode until we figure out
       // which address is correct, because if our first introducer forged this address, we don't
       // want to send messages to it on behalf of our second introducer.
-      state = PESSIMISTIC;
+      setState(PESSIMISTIC);
       KJ_LOG(WARNING, "Received multiple addresses for same VatId. Possible spoofing.");
     }
 
@@ -573,13 +739,18 @@ public:
 
     // OK, let's try to connenct.
     auto addrObj = address.onNetwork(network.network);
+    kj::TimePoint connectTime = network.timer.now();
     tasks.add(addrObj->connect().attach(kj::mv(addrObj))
-        .then([this](kj::Own<kj::AsyncIoStream>&& connection) -> kj::Promise<void> {
+        .then([this,peerVatFeatures,connectTime](kj::Own<kj::AsyncIoStream>&& connection)
+              -> kj::Promise<void> {
       if (state == AUTHENTICATED) {
         // Apparently we got a connection in the other direction in the meantime. Ignore.
         return kj::READY_NOW;
       }
 
+      // Only send an extended header to a peer which we know will understand it.
+      peerUnderstandsFraming = peerVatFeatures & Header::FRAMED;
+
       auto connectAddress = SimpleAddress::getPeer(*connection);
 
       bool isOdd = minConnectionNumber % 2;
@@ -593,14 +764,15 @@ public:
       setStream(kj::mv(connection), connectionNumber, connectAddress);
 
       if (state == WAITING) {
-        state = OPTIMISTIC;
+        setState(OPTIMISTIC);
         resendOptimisticMessages();
       }
 
       // Wait for response header.
       auto header = kj::heap<Header>(nullptr);
-      auto promise = stream->read(header.get(), sizeof(Header));
-      return promise.then([this,KJ_MVCAP(header),connectAddress,connectionNumber]() mutable {
+      auto promise = Header::read(*stream, *header);
+      return promise.then([this,KJ_MVCAP(header),connectAddress,connectionNumber,connectTime]()
+                          mutable {
         auto verifiedKey = KJ_ASSERT_NONNULL(header->verify(network.privateKey, connectAddress),
             "peer responded with invalid handshake header");
 
@@ -617,6 +789,18 @@ public:
             "previous optimistic connection attempt actually succeeded when we thought it "
             "failed; must abort");
 
+        KJ_IF_MAYBE(f, header->getFeatures()) {
+          KJ_ASSERT(peerUnderstandsFraming, "peer replied with an extended handshake header to a "
+              "basic one");
+          incomingFramed = *f & Header::FRAMED;
+        } else {
+          incomingFramed = false;
+        }
+
+        // Only connections we initiate have a handshake to time; an accepted connection is
+        // authenticated as soon as its header arrives.
+        stats.lastHandshakeLatency = network.timer.now() - connectTime;
+
         setAuthenticated();
       });
     }).exclusiveJoin(handshakeDone.addBranch()));  // Cancel if another handshake succeeds.
@@ -625,7 +809,8 @@ public:
   }
 
   bool accept(kj::Own<kj::AsyncIoStream>&& stream,
-              uint64_t connectionNumber, uint64_t minIgnoredConnection) {
+              uint64_t connectionNumber, uint64_t minIgnoredConnection,
+              kj::Maybe<uint64_t> features) {
     // Receive an already-authenticated connection.
     //
     // Returns false if a full connection had already been established, in which case the
@@ -656,11 +841,43 @@ public:
     minConnectionNumber = kj::max(minConnectionNumber, connectionNumber + 2);
 
     streamIncomingConnectionNumber = connectionNumber;
+    KJ_IF_MAYBE(f, features) {
+      peerUnderstandsFraming = true;
+      incomingFramed = *f & Header::FRAMED;
+    } else {
+      peerUnderstandsFraming = false;
+      incomingFramed = false;
+    }
     setStream(kj::mv(stream), connectionNumber + 1, nullptr);
     setAuthenticated();
     return true;
   }
 
+  void getStats(VatNetworkStats::Peer::Builder builder) {
+    // Fill in the parts of the peer's statistics that describe the current connection.
+
+    switch (state) {
+      case WAITING:
+        builder.setState(VatNetworkStats::Peer::State::WAITING);
+        break;
+      case OPTIMISTIC:
+        builder.setState(VatNetworkStats::Peer::State::OPTIMISTIC);
+        break;
+      case PESSIMISTIC:
+        builder.setState(VatNetworkStats::Peer::State::PESSIMISTIC);
+        break;
+      case AUTHENTICATED:
+        builder.setState(VatNetworkStats::Peer::State::AUTHENTICATED);
+        break;
+      case FAILED:
+        builder.setState(VatNetworkStats::Peer::State::FAILED);
+        break;
+    }
+
+    builder.setQueuedMessages(controlQueue.size() + bulkQueue.size());
+    builder.setQueuedBytes(queuedBytes);
+  }
+
   VatPath::Reader getPeerVatId() override {
     return peerVatPath.getRoot<VatPath>();
   }
@@ -672,11 +889,26 @@ public:
   kj::Promise<kj::Maybe<kj::Own<capnp::IncomingRpcMessage>>> receiveIncomingMessage() override {
     return kj::evalLater([&]() -> kj::Promise<kj::Maybe<kj::Own<capnp::IncomingRpcMessage>>> {
       if (state == AUTHENTICATED) {
+        if (shouldPauseReading()) {
+          // Apply backpressure: don't accept more work from this peer until we've caught up on
+          // writing to it. Re-check periodically in case the writes stall.
+          ++network.queueStats.readPauses;
+          auto paf = kj::newPromiseAndFulfiller<void>();
+          lowWaterFulfiller = kj::mv(paf.fulfiller);
+          return paf.promise.exclusiveJoin(network.timer.afterDelay(WRITE_STALL_TIMEOUT))
+              .then([this]() { return receiveIncomingMessage(); });
+        }
+
+        if (incomingFramed) {
+          return readFrame();
+        }
+
         return capnp::tryReadMessage(*stream)
             .then([&](kj::Maybe<kj::Own<capnp::MessageReader>>&& message)
                   -> kj::Maybe<kj::Own<capnp::IncomingRpcMessage>> {
           KJ_IF_MAYBE(m, message) {
-            return kj::Own<capnp::IncomingRpcMessage>(kj::heap<IncomingMessageImpl>(kj::mv(*m)));
+            uint64_t size = serializedSize(**m);
+            return received(kj::heap<IncomingMessageImpl>(kj::mv(*m)), size);
           } else {
             receivedShutdown = true;
             return nullptr;
@@ -694,12 +926,24 @@ public:
 
   kj::Promise<void> shutdown() override {
     if (state == AUTHENTICATED) {
-      kj::Promise<void> result = KJ_ASSERT_NONNULL(previousWrite, "already shut down")
-          .then([this]() {
+      KJ_ASSERT(!writeShutdown, "already shut down");
+      writeShutdown = true;
+
+      KJ_IF_MAYBE(e, writeError) {
+        return kj::cp(*e);
+      }
+
+      if (!writing) {
+        stream->shutdownWrite();
+        return kj::READY_NOW;
+      }
+
+      // Wait for both lanes to drain before sending EOF.
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      drainFulfiller = kj::mv(paf.fulfiller);
+      return paf.promise.then([this]() {
         stream->shutdownWrite();
       });
-      previousWrite = nullptr;
-      return kj::mv(result);
     } else if (state == FAILED) {
       return kj::Exception(KJ_ASSERT_NONNULL(failureReason));
     } else {
@@ -716,10 +960,13 @@ private:
   PublicKey peerKey;
   capnp::MallocMessageBuilder peerVatPath;
 
+  PeerStats& stats;
+  // Statistics for this peer, owned by the VatNetwork's ConnectionMap.
+
   uint64_t minConnectionNumber;
   // The minimum connection number that we can create or accept.
 
-  enum {
+  enum State {
     WAITING,
     // We're still waiting for a connection to use.
 
@@ -755,6 +1002,22 @@ private:
   uint64_t streamOutgoingConnectionNumber = kj::maxValue;
   // If `stream` is valid, these are its incoming and outgoing connection numbers.
 
+  bool peerUnderstandsFraming = false;
+  // Whether the peer understands extended handshake headers and framed streams, as learned from
+  // its VatPath when connecting or from its header when accepting. If not, we talk to it the way
+  // vats did before framing existed.
+
+  bool incomingFramed = false;
+  bool outgoingFramed = false;
+  // Whether messages in each direction on `stream` are framed (and possibly packed). Each side
+  // announces its choice in the FRAMED bit of its handshake header.
+
+  uint packMisses = 0;
+  // Consecutive outgoing messages which packing failed to shrink.
+
+  uint packSkip = 0;
+  // Number of upcoming outgoing messages to send unpacked without trying. See notePacking().
+
   class OutgoingMessageImpl;
   kj::Vector<kj::Own<OutgoingMessageImpl>> optimisticMessages;
   // In all states except AUTHENTICATED and FAILED, contains a list of all outgoing messages sent
@@ -774,9 +1037,46 @@ private:
   // The connection number of the last connection that was fully authenticated (and therefore
   // on which we may have received messages), plus one.
 
-  kj::Maybe<kj::Promise<void>> previousWrite;
-  // Promise for the completion of the last `write()` call on `stream`. Only valid if `stream` is
-  // valid. Becomes null when `shutdownWrite()` is called.
+  std::deque<kj::Own<OutgoingMessageImpl>> controlQueue;
+  std::deque<kj::Own<OutgoingMessageImpl>> bulkQueue;
+  // Messages waiting to be written to `stream`, split into two lanes. Whenever the stream becomes
+  // free we write the next control message if there is one, and only otherwise the next bulk
+  // message, so that small calls don't sit behind a backlog of large results. Order is preserved
+  // within each lane. See OutgoingMessageImpl::isBulk() for what may go in the bulk lane.
+
+  kj::Maybe<kj::Promise<void>> writeTask;
+  // Writes the handshake header to `stream` and then drains the queues. Only valid if `stream` is
+  // valid.
+
+  bool writing = false;
+  // True while `writeTask` is still running, i.e. until both queues have been drained. When false,
+  // the next queued message needs to restart `writeTask`.
+
+  bool writeShutdown = false;
+  // Becomes true when `shutdown()` is called. No further messages may be queued.
+
+  kj::Maybe<kj::Exception> writeError;
+  // If a write on the current stream failed, the error. All further writes are skipped. We never
+  // actually handle this exception because we assume the read end will fail as well and it's
+  // cleaner to handle the failure there.
+
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> drainFulfiller;
+  // Fulfilled when `writing` next becomes false, if `shutdown()` is waiting for that.
+
+  uint64_t queuedBytes = 0;
+  // Total size of the messages in `controlQueue` and `bulkQueue` plus the one currently being
+  // written.
+
+  kj::TimePoint lastWriteProgress = kj::origin<kj::TimePoint>();
+  // When a message last finished writing, or when writing last started from idle.
+
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> lowWaterFulfiller;
+  // If reading is paused due to backpressure, fulfilled when `queuedBytes` falls to half of the
+  // high-water mark.
+
+  std::unordered_map<uint32_t, kj::TimePoint> outstandingCalls;
+  // Send times of Call messages we've sent, by question ID, for measuring round-trip time when the
+  // Return arrives. See RTT_SAMPLE_MAX.
 
   kj::Maybe<kj::Promise<void>> pessimisticTimeout;
   // In PESSIMISTIC mode, promise which resolves when we've given up on the current address we're
@@ -788,15 +1088,76 @@ private:
   ConnectionImpl(VatNetwork& network, PublicKey peerKey, uint64_t minConnectionNumber,
                  kj::PromiseFulfillerPair<void> paf)
       : network(network), tasks(*this), peerKey(peerKey), peerVatPath(32),
+        stats(network.connectionMap->stats[peerKey]),
         minConnectionNumber(minConnectionNumber),
         handshakeDone(paf.promise.fork()), handshakeDoneFulfiller(kj::mv(paf.fulfiller)) {
     peerKey.copyTo(peerVatPath.initRoot<VatPath>().initId());
+    stats.connection = *this;
+  }
+
+  void setState(State newState) {
+    state = newState;
+    switch (newState) {
+      case WAITING: break;
+      case OPTIMISTIC: ++stats.optimisticCount; break;
+      case PESSIMISTIC: ++stats.pessimisticCount; break;
+      case AUTHENTICATED: ++stats.authenticatedCount; break;
+      case FAILED: ++stats.failedCount; break;
+    }
+  }
+
+  kj::Own<capnp::IncomingRpcMessage> received(
+      kj::Own<capnp::IncomingRpcMessage>&& message, uint64_t size) {
+    ++stats.messagesReceived;
+    stats.bytesReceived += size;
+
+    if (!outstandingCalls.empty()) {
+      auto body = message->getBody();
+      if (body.isStruct()) {
+        auto rpcMessage = body.getAs<capnp::rpc::Message>();
+        if (rpcMessage.isReturn()) {
+          returnReceived(rpcMessage.getReturn().getAnswerId());
+        }
+      }
+    }
+
+    return kj::mv(message);
+  }
+
+  void callSent(uint32_t questionId) {
+    outstandingCalls[questionId] = network.timer.now();
+  }
+
+  void returnReceived(uint32_t answerId) {
+    auto iter = outstandingCalls.find(answerId);
+    if (iter == outstandingCalls.end()) return;
+
+    auto rtt = network.timer.now() - iter->second;
+    outstandingCalls.erase(iter);
+
+    if (rtt > RTT_SAMPLE_MAX) {
+      // Probably a long poll, a drain, or some other call which waits for something to happen.
+      // That measures the event, not the link.
+      return;
+    }
+
+    if (stats.rttCount == 0) {
+      stats.rttMin = rtt;
+      stats.rttSmoothed = rtt;
+    } else {
+      stats.rttMin = kj::min(stats.rttMin, rtt);
+      stats.rttSmoothed += (rtt - stats.rttSmoothed) / 8;
+    }
+    stats.rttLast = rtt;
+    ++stats.rttCount;
   }
 
   void setStream(kj::Own<kj::AsyncIoStream>&& newStream, uint64_t newOutgoingConnectionNumber,
                  kj::Maybe<SimpleAddress> newConnectAddress) {
     // Cancel all writes.
-    previousWrite = nullptr;
+    writeTask = nullptr;
+    clearQueues();
+    writeError = nullptr;
 
     // Accept the new stream.
     stream = kj::mv(newStream);
@@ -804,11 +1165,199 @@ private:
     streamOutgoingConnectionNumber = newOutgoingConnectionNumber;
     sentCount = 0;
 
+    // Compress if configured to for this peer and the peer can take it. If we're accepting and
+    // the peer is already compressing towards us, compress in our direction too.
+    kj::Maybe<uint64_t> features;
+    outgoingFramed = false;
+    if (peerUnderstandsFraming) {
+      KJ_IF_MAYBE(a, newConnectAddress) {
+        outgoingFramed = network.shouldCompress(*a);
+      } else {
+        outgoingFramed = incomingFramed || network.shouldCompress(SimpleAddress::getPeer(*stream));
+      }
+      features = outgoingFramed ? uint64_t(Header::FRAMED) : uint64_t(0);
+    }
+    packMisses = 0;
+    packSkip = 0;
+
     // Write the new header.
     auto header = kj::heap<Header>(
         network.publicKey, streamOutgoingConnectionNumber, minIgnoredConnectionNumber,
-        SimpleAddress::getLocal(*stream), peerKey, network.privateKey);
-    previousWrite = stream->write(header.get(), sizeof(Header)).attach(kj::mv(header));
+        features, SimpleAddress::getLocal(*stream), peerKey, network.privateKey);
+    auto bytes = header->asBytes();
+    writing = true;
+    startWriteTask(stream->write(bytes.begin(), bytes.size()).attach(kj::mv(header))
+        .then([this]() { return writeLoop(); }));
+  }
+
+  void queueWrite(kj::Own<OutgoingMessageImpl> message) {
+    KJ_ASSERT(!writeShutdown, "already shut down");
+
+    if (writeError != nullptr) {
+      // Stream is broken. Drop the message; the read end will report the failure.
+      return;
+    }
+
+    auto now = network.timer.now();
+    message->setQueuedTime(now);
+    queuedBytes += message->getSize();
+    network.queueStats.queuedBytes += message->getSize();
+    network.queueStats.peakQueuedBytes =
+        kj::max(network.queueStats.peakQueuedBytes, queuedBytes);
+
+    if (message->isBulk()) {
+      bulkQueue.push_back(kj::mv(message));
+    } else {
+      controlQueue.push_back(kj::mv(message));
+    }
+
+    if (!writing) {
+      writing = true;
+      lastWriteProgress = now;
+      startWriteTask(kj::evalNow([this]() { return writeLoop(); }));
+    }
+  }
+
+  kj::Promise<kj::Maybe<kj::Own<capnp::IncomingRpcMessage>>> readFrame() {
+    auto header = kj::heapArray<byte>(FRAME_HEADER_SIZE);
+    auto promise = stream->tryRead(header.begin(), header.size(), header.size());
+    return promise.then([this,KJ_MVCAP(header)](size_t n) mutable
+        -> kj::Promise<kj::Maybe<kj::Own<capnp::IncomingRpcMessage>>> {
+      if (n == 0) {
+        receivedShutdown = true;
+        return kj::Maybe<kj::Own<capnp::IncomingRpcMessage>>(nullptr);
+      } else if (n < header.size()) {
+        return KJ_EXCEPTION(DISCONNECTED, "premature EOF in message frame header");
+      }
+
+      uint32_t sizeAndFlags = fromLittleEndian32(header.begin());
+      uint32_t size = sizeAndFlags & ~FRAME_PACKED;
+      KJ_REQUIRE(size <= MAX_FRAME_SIZE, "incoming message frame too large", size);
+
+      if (sizeAndFlags & FRAME_PACKED) {
+        auto data = kj::heapArray<byte>(size);
+        auto promise = stream->read(data.begin(), data.size());
+        return promise.then([this,KJ_MVCAP(data)]() mutable
+            -> kj::Maybe<kj::Own<capnp::IncomingRpcMessage>> {
+          uint64_t size = FRAME_HEADER_SIZE + data.size();
+          return received(kj::heap<PackedIncomingMessageImpl>(kj::mv(data)), size);
+        });
+      } else {
+        KJ_REQUIRE(size % sizeof(capnp::word) == 0, "unpacked message frame not word-aligned");
+        auto words = kj::heapArray<capnp::word>(size / sizeof(capnp::word));
+        auto promise = stream->read(words.begin(), size);
+        return promise.then([this,KJ_MVCAP(words)]() mutable
+            -> kj::Maybe<kj::Own<capnp::IncomingRpcMessage>> {
+          uint64_t size = FRAME_HEADER_SIZE + words.size() * sizeof(capnp::word);
+          return received(kj::heap<FlatIncomingMessageImpl>(kj::mv(words)), size);
+        });
+      }
+    });
+  }
+
+  void messageWritten(uint64_t size, uint64_t wireSize, kj::TimePoint queuedTime) {
+    ++stats.messagesSent;
+    stats.bytesSent += wireSize;
+
+    auto now = network.timer.now();
+    auto queueTime = now - queuedTime;
+    auto& queueStats = network.queueStats;
+    ++queueStats.messagesWritten;
+    queueStats.totalQueueTime += queueTime;
+    queueStats.maxQueueTime = kj::max(queueStats.maxQueueTime, queueTime);
+
+    queuedBytes -= size;
+    queueStats.queuedBytes -= size;
+    lastWriteProgress = now;
+
+    if (queuedBytes <= network.writeHighWaterMark / 2) {
+      resumeReading();
+    }
+  }
+
+  void clearQueues() {
+    controlQueue.clear();
+    bulkQueue.clear();
+    network.queueStats.queuedBytes -= queuedBytes;
+    queuedBytes = 0;
+    resumeReading();
+  }
+
+  bool shouldPauseReading() {
+    return queuedBytes > network.writeHighWaterMark &&
+        network.timer.now() - lastWriteProgress < WRITE_STALL_TIMEOUT;
+  }
+
+  void resumeReading() {
+    KJ_IF_MAYBE(f, lowWaterFulfiller) {
+      f->get()->fulfill();
+      lowWaterFulfiller = nullptr;
+    }
+  }
+
+  void startWriteTask(kj::Promise<void> promise) {
+    writeTask = promise.eagerlyEvaluate([this](kj::Exception&& exception) {
+      // Drop everything that was waiting to be written; the messages (and any capabilities in
+      // them) would otherwise stick around until the connection is destroyed.
+      clearQueues();
+      KJ_IF_MAYBE(f, drainFulfiller) {
+        f->get()->reject(kj::cp(exception));
+        drainFulfiller = nullptr;
+      }
+      writeError = kj::mv(exception);
+    });
+  }
+
+  kj::Promise<void> writeLoop() {
+    // Write the next queued message, preferring the control lane, and repeat until both lanes are
+    // empty.
+
+    kj::Own<OutgoingMessageImpl> message;
+    if (!controlQueue.empty()) {
+      message = kj::mv(controlQueue.front());
+      controlQueue.pop_front();
+    } else if (!bulkQueue.empty()) {
+      message = kj::mv(bulkQueue.front());
+      bulkQueue.pop_front();
+    } else {
+      writing = false;
+      KJ_IF_MAYBE(f, drainFulfiller) {
+        f->get()->fulfill();
+        drainFulfiller = nullptr;
+      }
+      return kj::READY_NOW;
+    }
+
+    // Note that it's important that the message is attached to the write itself rather than to
+    // the continuation, so that it (and any capabilities in it) is released as soon as the write
+    // completes rather than when the next write completes.
+    uint64_t size = message->getSize();
+    kj::TimePoint queuedTime = message->getQueuedTime();
+    bool tryPacking = outgoingFramed && packSkip == 0;
+    auto promise = message->writeTo(*stream, outgoingFramed, tryPacking);
+    uint64_t wireSize = message->getWireSize();
+    if (outgoingFramed) {
+      notePacking(tryPacking, wireSize < FRAME_HEADER_SIZE + size);
+    }
+    return promise.attach(kj::mv(message)).then([this,size,wireSize,queuedTime]() {
+      messageWritten(size, wireSize, queuedTime);
+      return writeLoop();
+    });
+  }
+
+  void notePacking(bool tried, bool packed) {
+    // Stop packing for a while after it fails to help several messages in a row, so that a peer
+    // sending us incompressible data (say, already-compressed blobs) doesn't cost us a wasted
+    // packing pass per message. We try again every so often in case the traffic changes.
+
+    if (!tried) {
+      --packSkip;
+    } else if (packed) {
+      packMisses = 0;
+    } else if (++packMisses >= PACK_MISS_LIMIT) {
+      packMisses = 0;
+      packSkip = PACK_SKIP_COUNT;
+    }
   }
 
   void resendOptimisticMessages() {
@@ -824,9 +1373,11 @@ private:
         "successfully reached 'authenticated' state twice; shouldn't be possible");
     KJ_ASSERT(state != FAILED);
 
-    state = AUTHENTICATED;
+    setState(AUTHENTICATED);
 
-    SimpleAddress::getPeer(*stream).copyTo(peerVatPath.getRoot<VatPath>().getAddress());
+    auto peerAddress = SimpleAddress::getPeer(*stream);
+    peerAddress.copyTo(peerVatPath.getRoot<VatPath>().getAddress());
+    stats.address = peerAddress;
 
     resendOptimisticMessages();
 
@@ -851,7 +1402,7 @@ private:
     } else if (state == FAILED) {
       KJ_LOG(WARNING, "ignoring connection setup failure because we've already failed", exception);
     } else {
-      state = FAILED;
+      setState(FAILED);
       failureReason = kj::mv(exception);
       optimisticMessages = kj::Vector<kj::Own<OutgoingMessageImpl>>();
       minIgnoredConnectionNumber = streamOutgoingConnectionNumber + 1;
@@ -872,6 +1423,23 @@ private:
     }
 
     void send() override {
+      size = capnp::computeSerializedSizeInWords(message) * sizeof(capnp::word);
+
+      auto body = message.getRoot<capnp::AnyPointer>().asReader();
+      if (body.isStruct()) {
+        auto rpcMessage = body.getAs<capnp::rpc::Message>();
+        switch (rpcMessage.which()) {
+          case capnp::rpc::Message::CALL:
+            connection.callSent(rpcMessage.getCall().getQuestionId());
+            break;
+          case capnp::rpc::Message::RETURN:
+            bulk = isBulkReturn(rpcMessage.getReturn());
+            break;
+          default:
+            break;
+        }
+      }
+
       if (connection.state != AUTHENTICATED) {
         connection.optimisticMessages.add(kj::addRef(*this));
 
@@ -890,22 +1458,79 @@ private:
       connection.sentConnectionNumber = kj::min(
           connection.sentConnectionNumber, connection.streamOutgoingConnectionNumber);
 
-      connection.previousWrite = KJ_ASSERT_NONNULL(connection.previousWrite, "already shut down")
-          .then([&]() {
-        // Note that if the write fails, all further writes will be skipped due to the exception.
-        // We never actually handle this exception because we assume the read end will fail as well
-        // and it's cleaner to handle the failure there.
-        return capnp::writeMessage(*connection.stream, message);
-      }).attach(kj::addRef(*this))
-        // Note that it's important that the eagerlyEvaluate() come *after* the attach() because
-        // otherwise the message (and any capabilities in it) will not be released until a new
-        // message is written! (Kenton once spent all afternoon tracking this down...)
-        .eagerlyEvaluate(nullptr);
+      connection.queueWrite(kj::addRef(*this));
+    }
+
+    inline bool isBulk() { return bulk; }
+    // Whether this message should be written on the bulk lane.
+
+    inline uint64_t getSize() { return size; }
+    // Serialized size in bytes, as computed at send() time.
+
+    inline uint64_t getWireSize() { return wireSize; }
+    // Size in bytes as written by the last writeTo(), including framing.
+
+    inline kj::TimePoint getQueuedTime() { return queuedTime; }
+    inline void setQueuedTime(kj::TimePoint time) { queuedTime = time; }
+
+    kj::Promise<void> writeTo(kj::AsyncOutputStream& stream, bool framed, bool tryPacking) {
+      if (!framed) {
+        wireSize = size;
+        return capnp::writeMessage(stream, message);
+      }
+
+      KJ_REQUIRE(size <= MAX_FRAME_SIZE, "outgoing message too large", size);
+
+      if (!tryPacking) {
+        return writeUnpackedFrame(stream);
+      }
+
+      // Try packing. Packing expands each word by at most a quarter, plus a little slop for
+      // run-length bytes.
+      auto buffer = kj::heapArray<byte>(FRAME_HEADER_SIZE + size / 8 * 10 + 16);
+      kj::ArrayOutputStream packedOutput(buffer.slice(FRAME_HEADER_SIZE, buffer.size()));
+      capnp::writePackedMessage(packedOutput, message);
+      size_t packedSize = packedOutput.getArray().size();
+
+      if (packedSize < size - size / 8) {
+        wireSize = FRAME_HEADER_SIZE + packedSize;
+        toLittleEndian32(buffer.begin(), packedSize | FRAME_PACKED);
+        auto promise = stream.write(buffer.begin(), FRAME_HEADER_SIZE + packedSize);
+        return promise.attach(kj::mv(buffer));
+      } else {
+        // Incompressible; packing saved less than 1/8. Send the segments as-is.
+        return writeUnpackedFrame(stream);
+      }
     }
 
   private:
     ConnectionImpl& connection;
     capnp::MallocMessageBuilder message;
+    bool bulk = false;
+    uint64_t size = 0;
+    uint64_t wireSize = 0;
+    kj::TimePoint queuedTime = kj::origin<kj::TimePoint>();
+
+    kj::Promise<void> writeUnpackedFrame(kj::AsyncOutputStream& stream) {
+      wireSize = FRAME_HEADER_SIZE + size;
+      auto header = kj::heapArray<byte>(FRAME_HEADER_SIZE);
+      toLittleEndian32(header.begin(), size);
+      auto promise = stream.write(header.begin(), header.size());
+      return promise.attach(kj::mv(header)).then([this,&stream]() {
+        return capnp::writeMessage(stream, message);
+      });
+    }
+
+    bool isBulkReturn(capnp::rpc::Return::Reader ret) {
+      // A message may go on the bulk lane -- and thus be overtaken by messages sent after it -- only
+      // if it is large and reordering it cannot be observed by the RPC protocol. Calls must stay
+      // in order with each other (E-order), and anything carrying capabilities takes part in
+      // embargoes and reference counting, so in practice this is limited to capability-free
+      // Return messages, e.g. the results of Volume.read() or Blob.getSlice().
+
+      return size >= BULK_MESSAGE_WORDS * sizeof(capnp::word) &&
+          ret.isResults() && ret.getResults().getCapTable().size() == 0;
+    }
   };
 
   class IncomingMessageImpl final: public capnp::IncomingRpcMessage {
@@ -919,6 +1544,35 @@ private:
   private:
     kj::Own<capnp::MessageReader> message;
   };
+
+  class PackedIncomingMessageImpl final: public capnp::IncomingRpcMessage {
+  public:
+    PackedIncomingMessageImpl(kj::Array<byte> dataParam)
+        : data(kj::mv(dataParam)), input(data), message(input) {}
+
+    capnp::AnyPointer::Reader getBody() override {
+      return message.getRoot<capnp::AnyPointer>();
+    }
+
+  private:
+    kj::Array<byte> data;
+    kj::ArrayInputStream input;
+    capnp::PackedMessageReader message;
+  };
+
+  class FlatIncomingMessageImpl final: public capnp::IncomingRpcMessage {
+  public:
+    FlatIncomingMessageImpl(kj::Array<capnp::word> wordsParam)
+        : words(kj::mv(wordsParam)), message(words) {}
+
+    capnp::AnyPointer::Reader getBody() override {
+      return message.getRoot<capnp::AnyPointer>();
+    }
+
+  private:
+    kj::Array<capnp::word> words;
+    capnp::FlatArrayMessageReader message;
+  };
 };
 
 auto VatNetwork::connect(VatPath::Reader hostId) -> kj::Maybe<kj::Own<Connection>> {
@@ -935,17 +1589,18 @@ auto VatNetwork::connect(VatPath::Reader hostId) -> kj::Maybe<kj::Own<Connection
   uint64_t oldMinConnectionNumber = 0;
 
   KJ_IF_MAYBE(connection, slot) {
-    if (connection->get()->connect(peerAddr)) {
+    if (connection->get()->connect(peerAddr, hostId.getFeatures())) {
       return kj::Own<Connection>(kj::addRef(**connection));
     } else {
       // This connection is dead. Drop it.
       oldMinConnectionNumber = connection->get()->getMinConnectionNumber();
       slot = nullptr;
+      ++connectionMap->stats[peerKey].reconnectCount;
     }
   }
 
   auto connection = kj::refcounted<ConnectionImpl>(*this, peerKey, oldMinConnectionNumber);
-  connection->connect(peerAddr);
+  connection->connect(peerAddr, hostId.getFeatures());
   slot = kj::addRef(*connection);
   return kj::Own<Connection>(kj::mv(connection));
 }
@@ -962,7 +1617,7 @@ auto VatNetwork::accept() -> kj::Promise<kj::Own<Connection>> {
 
     // Use evalNow() to catch exceptions here.
     auto promise = kj::evalNow([&]() {
-      return stream->read(header.get(), sizeof(Header));
+      return Header::read(*stream, *header);
     });
 
     // By the time accept() completes, the other end should have already sent a header, so we can
@@ -983,20 +1638,21 @@ auto VatNetwork::accept() -> kj::Promise<kj::Own<Connection>> {
       auto& slot = connectionMap->map[verifiedKey];
       uint64_t oldMinConnectionNumber = 0;
       KJ_IF_MAYBE(connection, slot) {
-        if (connection->get()->accept(kj::mv(stream),
-              header->getConnectionNumber(), header->getMinIgnoredConnection())) {
+        if (connection->get()->accept(kj::mv(stream), header->getConnectionNumber(),
+              header->getMinIgnoredConnection(), header->getFeatures())) {
           // This is not a new connection, so don't return it. Keep waiting for something new.
           return accept();
         } else {
           // This connection is dead. Drop it.
           oldMinConnectionNumber = connection->get()->getMinConnectionNumber();
           slot = nullptr;
+          ++connectionMap->stats[verifiedKey].reconnectCount;
         }
       }
 
       auto connection = kj::refcounted<ConnectionImpl>(*this, verifiedKey, oldMinConnectionNumber);
-      KJ_ASSERT(connection->accept(kj::mv(stream),
-          header->getConnectionNumber(), header->getMinIgnoredConnection()));
+      KJ_ASSERT(connection->accept(kj::mv(stream), header->getConnectionNumber(),
+          header->getMinIgnoredConnection(), header->getFeatures()));
       slot = kj::addRef(*connection);
       return kj::Own<Connection>(kj::mv(connection));
     }).catch_([this](kj::Exception&& exception) {
@@ -1006,4 +1662,58 @@ auto VatNetwork::accept() -> kj::Promise<kj::Own<Connection>> {
   });
 }
 
+size_t VatNetwork::getConnectedPeerCount() const {
+  size_t count = 0;
+  for (auto& entry: connectionMap->stats) {
+    if (entry.second.connection != nullptr) ++count;
+  }
+  return count;
+}
+
+void VatNetwork::getStats(VatNetworkStats::Builder builder) {
+  builder.setQueuedBytes(queueStats.queuedBytes);
+  builder.setPeakQueuedBytes(queueStats.peakQueuedBytes);
+  builder.setMessagesWritten(queueStats.messagesWritten);
+  builder.setTotalQueueTime(queueStats.totalQueueTime / kj::NANOSECONDS);
+  builder.setMaxQueueTime(queueStats.maxQueueTime / kj::NANOSECONDS);
+  builder.setReadPauses(queueStats.readPauses);
+
+  // The next report covers the peak from now on, starting with what's queued at the moment.
+  queueStats.peakQueuedBytes = 0;
+
+  auto peers = builder.initPeers(connectionMap->stats.size());
+  uint i = 0;
+  for (auto& entry: connectionMap->stats) {
+    auto peer = peers[i++];
+    auto& stats = entry.second;
+
+    PublicKey(entry.first).copyTo(peer.initId());
+    KJ_IF_MAYBE(a, stats.address) {
+      a->copyTo(peer.initAddress());
+    }
+
+    KJ_IF_MAYBE(c, stats.connection) {
+      c->getStats(peer);
+      queueStats.peakQueuedBytes = kj::max(queueStats.peakQueuedBytes, c->getQueuedBytes());
+    } else {
+      peer.setState(VatNetworkStats::Peer::State::DISCONNECTED);
+    }
+
+    peer.setMessagesSent(stats.messagesSent);
+    peer.setBytesSent(stats.bytesSent);
+    peer.setMessagesReceived(stats.messagesReceived);
+    peer.setBytesReceived(stats.bytesReceived);
+    peer.setOptimisticCount(stats.optimisticCount);
+    peer.setPessimisticCount(stats.pessimisticCount);
+    peer.setAuthenticatedCount(stats.authenticatedCount);
+    peer.setFailedCount(stats.failedCount);
+    peer.setReconnectCount(stats.reconnectCount);
+    peer.setLastHandshakeLatency(stats.lastHandshakeLatency / kj::NANOSECONDS);
+    peer.setRttCount(stats.rttCount);
+    peer.setRttMin(stats.rttMin / kj::NANOSECONDS);
+    peer.setRttSmoothed(stats.rttSmoothed / kj::NANOSECONDS);
+    peer.setRttLast(stats.rttLast / kj::NANOSECONDS);
+  }
+}
+
 }  // namespace blackrock
@@ -25,6 +25,7 @@
 #include <netinet/ip.h>
 #include <netinet/ip6.h>
 #include <kj/async-io.h>
+#include <kj/function.h>
 
 namespace blackrock {
 
@@ -92,6 +93,47 @@ public:
   kj::Maybe<kj::Own<Connection>> connect(VatPath::Reader hostId) override;
   kj::Promise<kj::Own<Connection>> accept() override;
 
+  void setWriteHighWaterMark(size_t bytes) { writeHighWaterMark = bytes; }
+  // When more than this many bytes of outgoing messages are queued for a single peer, stop reading
+  // incoming messages from that peer until the queue drains to half the mark. This pushes back on
+  // the RPC system: no new calls from the peer are delivered, so no new results are generated for
+  // it, and once its socket buffer fills the peer's own writes block too. Reading resumes anyway
+  // if our writes stop making progress entirely, since in that case the peer is probably waiting
+  // on us and pausing could deadlock. Defaults to 16MB.
+
+  struct QueueStats {
+    uint64_t queuedBytes = 0;
+    // Bytes currently queued for writing, across all connections.
+
+    uint64_t peakQueuedBytes = 0;
+    // Largest number of bytes queued on a single connection since the last getStats(). That
+    // resets it to the largest amount currently queued on any connection.
+
+    uint64_t messagesWritten = 0;
+    kj::Duration totalQueueTime = 0 * kj::SECONDS;
+    kj::Duration maxQueueTime = 0 * kj::SECONDS;
+    // Time from send() until the message had been completely written to the socket. Divide
+    // `totalQueueTime` by `messagesWritten` to get the mean.
+
+    uint64_t readPauses = 0;
+    // Number of times we stopped reading from a peer because of the high-water mark.
+  };
+
+  const QueueStats& getQueueStats() const { return queueStats; }
+  // Unlike getStats(), doesn't reset the peak queue size.
+
+  size_t getConnectedPeerCount() const;
+
+  void getStats(VatNetworkStats::Builder builder);
+  // Fill in transport statistics for all peers we've ever talked to. Resets the peak queue size.
+
+  void setCompressionFilter(kj::Function<bool(const SimpleAddress& peer)> filter);
+  // Compress messages sent to peers for which `filter` returns true, if they support it. Messages
+  // are packed (see capnp/serialize-packed.h) and sent as-is when packing doesn't help; after
+  // several such misses in a row, we stop trying for a while. When accepting a connection from a
+  // peer which compresses, we compress our side too. Off by default, since on a fast local link
+  // packing costs more CPU than it saves in bandwidth. See MasterConfig.compressRpc.
+
 private:
   class LittleEndian64;
   class Mac;
@@ -140,6 +182,7 @@ private:
   };
 
   class ConnectionImpl;
+  struct PeerStats;
   struct ConnectionMap;
 
   kj::Network& network;
@@ -148,8 +191,14 @@ private:
   PublicKey publicKey;
   SimpleAddress address;
   capnp::MallocMessageBuilder self;
+  size_t writeHighWaterMark = 16u << 20;
+  QueueStats queueStats;
+  kj::Maybe<kj::Function<bool(const SimpleAddress& peer)>> compressionFilter;
   kj::Own<kj::ConnectionReceiver> connectionReceiver;
   kj::Own<ConnectionMap> connectionMap;
+  // Connections update `queueStats` when destroyed, so `connectionMap` must be destroyed first.
+
+  bool shouldCompress(const SimpleAddress& peer);
 };
 
 }  // namespace blackrock
@@ -41,4 +41,12 @@ void writeEvent(int fd, uint64_t value) {
   KJ_ASSERT(n == 8, "wrong-sized write on eventfd", n);
 }
 
+kj::StringPtr storageShardKey(kj::StringPtr rootName) {
+  if (rootName.startsWith("package-")) {
+    return "package";
+  } else {
+    return rootName;
+  }
+}
+
 }  // namespace blackrock
@@ -19,6 +19,7 @@
 
 #include <kj/common.h>
 #include <kj/io.h>
+#include <kj/string.h>
 #include <inttypes.h>
 
 namespace blackrock {
@@ -36,6 +37,13 @@ uint64_t readEvent(int fd);
 void writeEvent(int fd, uint64_t value);
 // TODO(cleanup): Find a better home for these.
 
+kj::StringPtr storageShardKey(kj::StringPtr rootName);
+// The key that decides which storage shard holds the root object `rootName` (see
+// BackendSetBase::shardFor()). Usually that's the name itself, but a package's ID isn't known
+// until its upload finishes, by which point its volume already exists on some shard, so all
+// "package-*" roots share the key "package". There aren't many, and they're read-mostly and
+// cached. The frontend and storage-rebalance must agree on this.
+
 }  // namespace blackrock
 
 #endif // BLACKROCK_COMMON_H_
@@ -0,0 +1,122 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "coordinator.h"
+#include <kj/test.h>
+
+namespace blackrock {
+namespace {
+
+class TestSupervisor final: public sandstorm::Supervisor::Server {};
+
+class TestWorker final: public Worker::Server {
+  // A worker which "starts" grains by handing out a do-nothing supervisor.
+
+public:
+  kj::Maybe<Worker::GrainWatcher::Client> watcher;
+  uint grainsStarted = 0;
+
+protected:
+  kj::Promise<void> newGrain(NewGrainContext context) override {
+    ++grainsStarted;
+    context.getResults().setGrain(kj::heap<TestSupervisor>());
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> watchGrains(WatchGrainsContext context) override {
+    watcher = context.getParams().getWatcher();
+    return kj::READY_NOW;
+  }
+};
+
+struct TestEnv {
+  kj::AsyncIoContext ioContext;
+  kj::WaitScope& waitScope;
+  CoordinatorImpl* coordinator;
+  Coordinator::Client coordinatorCap;
+  TestWorker* worker;
+  BackendSet<Worker>::Client workerSet;
+
+  TestEnv()
+      : ioContext(kj::setupAsyncIo()),
+        waitScope(ioContext.waitScope),
+        coordinator(nullptr),
+        coordinatorCap(newCoordinator()),
+        worker(nullptr),
+        workerSet(coordinator->getWorkerBackendSet()) {
+    auto backend = kj::heap<TestWorker>();
+    worker = backend.get();
+    auto req = workerSet.addRequest();
+    req.setId(7);
+    req.setBackend(kj::mv(backend));
+    req.send().wait(waitScope);
+  }
+
+  Coordinator::Client newCoordinator() {
+    auto result = kj::heap<CoordinatorImpl>(ioContext.provider->getTimer());
+    coordinator = result.get();
+    return kj::mv(result);
+  }
+
+  void newGrain(kj::StringPtr grainId, kj::StringPtr ownerId) {
+    auto req = coordinatorCap.newGrainRequest();
+    req.initPackage().setId(kj::StringPtr("package").asBytes());
+    req.setGrainId(grainId);
+    req.setOwnerId(ownerId);
+    auto response = req.send().wait(waitScope);
+    KJ_EXPECT(response.getLocation().getWorkerId() == 7);
+  }
+
+  bool find(kj::StringPtr grainId, kj::StringPtr ownerId) {
+    auto req = coordinatorCap.findGrainRequest();
+    req.setGrainId(grainId);
+    req.setOwnerId(ownerId);
+    return req.send().wait(waitScope).hasGrain();
+  }
+};
+
+KJ_TEST("coordinator finds grains it placed until their worker reports them exited") {
+  TestEnv env;
+  env.newGrain("grain1", "alice");
+  env.newGrain("grain2", "alice");
+  KJ_EXPECT(env.worker->grainsStarted == 2);
+
+  KJ_EXPECT(env.find("grain1", "alice"));
+  KJ_EXPECT(!env.find("grain1", "bob"));
+  KJ_EXPECT(!env.find("grain3", "alice"));
+
+  auto req = KJ_ASSERT_NONNULL(env.worker->watcher).exitedRequest();
+  req.setGrainId("grain1");
+  req.send().wait(env.waitScope);
+
+  KJ_EXPECT(!env.find("grain1", "alice"));
+  KJ_EXPECT(env.find("grain2", "alice"));
+}
+
+KJ_TEST("coordinator forgets grains on workers that left the set") {
+  TestEnv env;
+  env.newGrain("grain1", "alice");
+  KJ_EXPECT(env.find("grain1", "alice"));
+
+  auto req = env.workerSet.removeRequest();
+  req.setId(7);
+  req.send().wait(env.waitScope);
+
+  KJ_EXPECT(!env.find("grain1", "alice"));
+}
+
+}  // namespace
+}  // namespace blackrock
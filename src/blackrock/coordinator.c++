@@ -0,0 +1,196 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "coordinator.h"
+#include "metrics.h"
+#include <kj/debug.h>
+#include <set>
+
+namespace blackrock {
+
+struct CoordinatorImpl::GrainMap: public kj::Refcounted {
+  // Shared with the GrainWatchers held by workers, which may outlive the coordinator.
+
+  struct Grain {
+    kj::String grainId;
+    kj::String ownerId;
+    sandstorm::Supervisor::Client supervisor;
+    uint64_t workerId;
+    Worker::Client worker;
+  };
+
+  std::map<kj::StringPtr, Grain> grains;
+  // Grains started by this coordinator which haven't exited, keyed by grain ID (pointing into the
+  // value).
+
+  std::set<uint64_t> watchedWorkers;
+  // Workers which we've asked to report grain exits.
+};
+
+class CoordinatorImpl::GrainWatcherImpl final: public Worker::GrainWatcher::Server {
+public:
+  GrainWatcherImpl(kj::Own<GrainMap> map, uint64_t workerId)
+      : map(kj::mv(map)), workerId(workerId) {}
+
+protected:
+  kj::Promise<void> exited(ExitedContext context) override {
+    auto iter = map->grains.find(context.getParams().getGrainId());
+    if (iter != map->grains.end() && iter->second.workerId == workerId) {
+      map->grains.erase(iter);
+    }
+    return kj::READY_NOW;
+  }
+
+private:
+  kj::Own<GrainMap> map;
+  uint64_t workerId;
+};
+
+CoordinatorImpl::CoordinatorImpl(kj::Timer& timer)
+    : workers(kj::refcounted<BackendSetImpl<Worker>>(timer, BackendSetBase::Policy::WEIGHTED)),
+      storageRestorers(kj::refcounted<BackendSetImpl<Restorer<SturdyRef::Stored>>>(timer)),
+      grains(kj::refcounted<GrainMap>()),
+      tasks(*this) {}
+
+CoordinatorImpl::~CoordinatorImpl() noexcept(false) {}
+
+BackendSet<Worker>::Client CoordinatorImpl::getWorkerBackendSet() {
+  return kj::addRef(*workers);
+}
+
+BackendSet<Restorer<SturdyRef::Stored>>::Client CoordinatorImpl::getStorageRestorerBackendSet() {
+  return kj::addRef(*storageRestorers);
+}
+
+void CoordinatorImpl::getMetrics(MetricsBuilder& metrics) {
+  metrics.gauge("blackrock_coordinator_grains", "Running grains known to this coordinator.",
+                grains->grains.size());
+  metrics.gauge("blackrock_coordinator_workers", "Workers available to this coordinator.",
+                workers->size());
+  metrics.gauge("blackrock_coordinator_storage_restorers",
+                "Storage restorers available to this coordinator.", storageRestorers->size());
+}
+
+kj::Promise<void> CoordinatorImpl::newGrain(NewGrainContext context) {
+  auto params = context.getParams();
+  KJ_LOG(INFO, "Coordinator: newGrain", params.getGrainId());
+
+  // A new grain's storage is created by the attempt that starts it, so if a worker dies while
+  // starting the grain, another can start over.
+  return workers->call(params.getPackage().getId(),
+      [this,context](BackendSetImpl<Worker>::Choice&& worker) mutable {
+    auto params = context.getParams();
+    auto req = worker.client.newGrainRequest();
+    req.setPackage(params.getPackage());
+    req.setCommand(params.getCommand());
+    req.setStorage(params.getStorage());
+    req.setGrainId(params.getGrainId());
+    req.setCore(params.getCore());
+
+    return req.send().then([this,context,KJ_MVCAP(worker)](auto&& response) mutable {
+      auto results = context.getResults(capnp::MessageSize { 8, 3 });
+      results.setGrain(response.getGrain());
+      results.setGrainState(response.getGrainState());
+      auto location = results.initLocation();
+      location.setWorker(worker.client);
+      location.setWorkerId(worker.id);
+
+      auto params = context.getParams();
+      addGrain(params.getGrainId(), params.getOwnerId(), kj::mv(worker), response.getGrain());
+    });
+  });
+}
+
+kj::Promise<void> CoordinatorImpl::restoreGrain(RestoreGrainContext context) {
+  auto params = context.getParams();
+  KJ_LOG(INFO, "Coordinator: restoreGrain", params.getGrainId());
+
+  // Not retried here: a worker which got as far as claiming the grain state has made our setter
+  // stale, so a retry would fail on the next worker too. The caller has to start over.
+  return workers->choose(params.getPackage().getId())
+      .then([this,context](BackendSetImpl<Worker>::Choice&& worker) mutable {
+    auto params = context.getParams();
+    auto req = worker.client.restoreGrainRequest();
+    req.setPackage(params.getPackage());
+    req.setCommand(params.getCommand());
+    req.setStorage(params.getStorage());
+    req.setGrainState(params.getGrainState());
+    req.setExclusiveGrainStateSetter(params.getExclusiveGrainStateSetter());
+    req.setGrainId(params.getGrainId());
+    req.setCore(params.getCore());
+
+    return req.send().then([this,context,KJ_MVCAP(worker)](auto&& response) mutable {
+      auto results = context.getResults(capnp::MessageSize { 8, 2 });
+      results.setGrain(response.getGrain());
+      auto location = results.initLocation();
+      location.setWorker(worker.client);
+      location.setWorkerId(worker.id);
+
+      auto params = context.getParams();
+      addGrain(params.getGrainId(), params.getOwnerId(), kj::mv(worker), response.getGrain());
+    });
+  });
+}
+
+kj::Promise<void> CoordinatorImpl::findGrain(FindGrainContext context) {
+  auto params = context.getParams();
+  auto iter = grains->grains.find(params.getGrainId());
+  if (iter == grains->grains.end() || iter->second.ownerId != params.getOwnerId()) {
+    return kj::READY_NOW;
+  }
+
+  auto& grain = iter->second;
+  if (!workers->contains(grain.workerId)) {
+    // The worker has been removed from the set, presumably because it died. Its grains went with
+    // it, though their GrainStates may still say otherwise.
+    grains->grains.erase(iter);
+    return kj::READY_NOW;
+  }
+
+  auto results = context.getResults(capnp::MessageSize { 8, 2 });
+  results.setGrain(grain.supervisor);
+  auto location = results.initLocation();
+  location.setWorker(grain.worker);
+  location.setWorkerId(grain.workerId);
+  return kj::READY_NOW;
+}
+
+void CoordinatorImpl::addGrain(kj::StringPtr grainId, kj::StringPtr ownerId,
+                               BackendSetImpl<Worker>::Choice&& worker,
+                               sandstorm::Supervisor::Client supervisor) {
+  uint64_t workerId = worker.id;
+  if (grains->watchedWorkers.insert(workerId).second) {
+    auto req = worker.client.watchGrainsRequest();
+    req.setWatcher(kj::heap<GrainWatcherImpl>(kj::addRef(*grains), workerId));
+    tasks.add(req.send().then([](auto&&) {}, [this,workerId](kj::Exception&& exception) {
+      KJ_LOG(ERROR, "watchGrains() failed", workerId, exception);
+      grains->watchedWorkers.erase(workerId);
+    }));
+  }
+
+  grains->grains.erase(grainId);
+  auto ownGrainId = kj::heapString(grainId);
+  kj::StringPtr key = ownGrainId;
+  grains->grains.insert(std::make_pair(key, GrainMap::Grain {
+      kj::mv(ownGrainId), kj::heapString(ownerId), kj::mv(supervisor),
+      workerId, kj::mv(worker.client) }));
+}
+
+void CoordinatorImpl::taskFailed(kj::Exception&& exception) {
+  KJ_LOG(ERROR, exception);
+}
+
+}  // namespace blackrock
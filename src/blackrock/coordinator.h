@@ -0,0 +1,67 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BLACKROCK_COORDINATOR_H_
+#define BLACKROCK_COORDINATOR_H_
+
+#include "common.h"
+#include <blackrock/worker.capnp.h>
+#include <kj/async.h>
+#include <map>
+#include "backend-set.h"
+
+namespace blackrock {
+
+class MetricsBuilder;
+
+class CoordinatorImpl: public Coordinator::Server, private kj::TaskSet::ErrorHandler {
+public:
+  explicit CoordinatorImpl(kj::Timer& timer);
+  ~CoordinatorImpl() noexcept(false);
+
+  BackendSet<Worker>::Client getWorkerBackendSet();
+  BackendSet<Restorer<SturdyRef::Stored>>::Client getStorageRestorerBackendSet();
+
+  void getMetrics(MetricsBuilder& metrics);
+
+protected:
+  kj::Promise<void> newGrain(NewGrainContext context) override;
+  kj::Promise<void> restoreGrain(RestoreGrainContext context) override;
+  kj::Promise<void> findGrain(FindGrainContext context) override;
+
+private:
+  class GrainWatcherImpl;
+  struct GrainMap;
+
+  kj::Own<BackendSetImpl<Worker>> workers;
+  kj::Own<BackendSetImpl<Restorer<SturdyRef::Stored>>> storageRestorers;
+  // Restorers for refs stored by the coordinator domain, one per storage node.
+  //
+  // TODO(someday): Serve hosted SturdyRefs, restoring them through these.
+  kj::Own<GrainMap> grains;
+  kj::TaskSet tasks;
+
+  void addGrain(kj::StringPtr grainId, kj::StringPtr ownerId,
+                BackendSetImpl<Worker>::Choice&& worker, sandstorm::Supervisor::Client supervisor);
+  // Record that the grain is running on the given worker, and make sure the worker will tell us
+  // when it exits.
+
+  void taskFailed(kj::Exception&& exception) override;
+};
+
+}  // namespace blackrock
+
+#endif // BLACKROCK_COORDINATOR_H_
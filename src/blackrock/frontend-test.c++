@@ -0,0 +1,590 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "frontend.h"
+#include <kj/test.h>
+#include <kj/vector.h>
+#include <set>
+
+namespace blackrock {
+namespace {
+
+class TestWorker final: public Worker::Server {
+  // A worker which only knows how to report exits and answer keep-alives, treating the grains
+  // listed in `running` as running.
+
+public:
+  kj::Maybe<Worker::GrainWatcher::Client> watcher;
+  std::set<kj::StringPtr> running;
+  kj::Vector<kj::String> keptAlive;
+
+protected:
+  kj::Promise<void> watchGrains(WatchGrainsContext context) override {
+    watcher = context.getParams().getWatcher();
+    context.releaseParams();
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> keepAliveGrains(KeepAliveGrainsContext context) override {
+    auto grainIds = context.getParams().getGrainIds();
+    auto results = context.getResults().initRunning(grainIds.size());
+    for (auto i: kj::indices(grainIds)) {
+      keptAlive.add(kj::heapString(grainIds[i]));
+      results.set(i, running.count(grainIds[i]) > 0);
+    }
+    return kj::READY_NOW;
+  }
+};
+
+struct TestEnv {
+  kj::AsyncIoContext ioContext;
+  kj::Timer& timer;
+  kj::WaitScope& waitScope;
+  TestWorker* worker;
+  Worker::Client workerCap;
+  ActiveGrainTable table;
+
+  TestEnv()
+      : ioContext(kj::setupAsyncIo()),
+        timer(ioContext.provider->getTimer()),
+        waitScope(ioContext.waitScope),
+        worker(nullptr),
+        workerCap(newWorker()),
+        table(timer) {}
+
+  Worker::Client newWorker() {
+    auto result = kj::heap<TestWorker>();
+    worker = result.get();
+    return kj::mv(result);
+  }
+
+  void add(kj::StringPtr grainId) {
+    table.add("alice", grainId, 0, workerCap, nullptr);
+  }
+
+  bool has(kj::StringPtr grainId) {
+    return table.find("alice", grainId) != nullptr;
+  }
+
+  void settle() {
+    timer.afterDelay(10 * kj::MILLISECONDS).wait(waitScope);
+  }
+};
+
+KJ_TEST("active grains are found only for their owner") {
+  TestEnv env;
+  env.add("grain1");
+
+  KJ_EXPECT(env.has("grain1"));
+  KJ_EXPECT(env.table.find("bob", "grain1") == nullptr);
+  KJ_EXPECT(!env.has("grain2"));
+}
+
+KJ_TEST("active grains are dropped when their worker reports them exited") {
+  TestEnv env;
+  env.add("grain1");
+  env.add("grain2");
+  env.settle();
+
+  auto req = KJ_ASSERT_NONNULL(env.worker->watcher).exitedRequest();
+  req.setGrainId("grain1");
+  req.send().wait(env.waitScope);
+
+  KJ_EXPECT(!env.has("grain1"));
+  KJ_EXPECT(env.has("grain2"));
+}
+
+KJ_TEST("active grains are dropped when their worker stops watching") {
+  TestEnv env;
+  env.add("grain1");
+  env.settle();
+  KJ_ASSERT(env.worker->watcher != nullptr);
+
+  // As happens when the worker disconnects.
+  env.worker->watcher = nullptr;
+  env.settle();
+
+  KJ_EXPECT(!env.has("grain1"));
+
+  // Adding a grain again registers a new watcher.
+  env.add("grain1");
+  env.settle();
+  KJ_EXPECT(env.worker->watcher != nullptr);
+  KJ_EXPECT(env.has("grain1"));
+}
+
+KJ_TEST("keep-alive covers used grains only and drops those not running") {
+  TestEnv env;
+  env.add("grain1");
+  env.add("grain2");
+  env.add("grain3");
+  env.worker->running.insert("grain1");
+
+  KJ_EXPECT(env.has("grain1"));
+  KJ_EXPECT(env.has("grain2"));
+  env.table.keepAlive().wait(env.waitScope);
+
+  KJ_ASSERT(env.worker->keptAlive.size() == 2);
+  KJ_EXPECT(env.worker->keptAlive[0] == "grain1");
+  KJ_EXPECT(env.worker->keptAlive[1] == "grain2");
+
+  KJ_EXPECT(env.has("grain1"));
+  KJ_EXPECT(!env.has("grain2"));
+  KJ_EXPECT(env.has("grain3"));  // Not checked since it wasn't used.
+}
+
+class TestStorage final: public StorageRootSet::Server {
+  // A storage shard which reports each root's size as 100 bytes per character of its name, except
+  // that roots named "missing..." don't exist. Calls wait for `release` while it's set. Roots
+  // which are set() are only recorded.
+
+public:
+  kj::Vector<kj::Array<kj::String>> calls;
+  kj::Maybe<kj::ForkedPromise<void>> release;
+  kj::Vector<kj::String> roots;
+
+protected:
+  kj::Promise<void> set(SetContext context) override {
+    roots.add(kj::heapString(context.getParams().getName()));
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> getStorageUsage(GetStorageUsageContext context) override {
+    auto names = context.getParams().getNames();
+    calls.add(KJ_MAP(name, names) { return kj::heapString(name); });
+
+    auto results = context.getResults().initTotalBytes(names.size());
+    for (auto i: kj::indices(names)) {
+      results.set(i, names[i].startsWith("missing") ? 0 : names[i].size() * 100);
+    }
+
+    KJ_IF_MAYBE(r, release) {
+      return r->addBranch();
+    } else {
+      return kj::READY_NOW;
+    }
+  }
+};
+
+struct StorageUsageTestEnv {
+  // Two storage shards.
+
+  kj::AsyncIoContext ioContext;
+  kj::WaitScope& waitScope;
+  kj::Own<BackendSetImpl<StorageRootSet>> storageRoots;
+  TestStorage* shards[2];
+  StorageUsageBatcher batcher;
+
+  StorageUsageTestEnv()
+      : ioContext(kj::setupAsyncIo()),
+        waitScope(ioContext.waitScope),
+        storageRoots(kj::refcounted<BackendSetImpl<StorageRootSet>>(
+            ioContext.provider->getTimer())),
+        batcher(*storageRoots, 2) {
+    for (uint i = 0; i < 2; i++) {
+      auto shard = kj::heap<TestStorage>();
+      shards[i] = shard.get();
+      BackendSet<StorageRootSet>::Client set = kj::addRef(*storageRoots);
+      auto req = set.addRequest();
+      req.setId(i);
+      req.setBackend(kj::mv(shard));
+      req.send().wait(waitScope);
+    }
+  }
+
+  TestStorage& shardFor(kj::StringPtr name) {
+    return *shards[BackendSetBase::shardFor(storageShardKey(name).asBytes(), 2)];
+  }
+};
+
+KJ_TEST("storage usage queries made together go out as one call per shard") {
+  StorageUsageTestEnv env;
+
+  kj::StringPtr names[] = { "user-a", "user-bb", "user-ccc", "user-dddd", "missing-e" };
+  auto promises = KJ_MAP(name, kj::arrayPtr(names, kj::size(names))) {
+    return env.batcher.getStorageUsage(kj::heapString(name));
+  };
+  for (auto i: kj::indices(promises)) {
+    uint64_t expected = names[i].startsWith("missing") ? 0 : names[i].size() * 100;
+    KJ_EXPECT(promises[i].wait(env.waitScope) == expected, names[i]);
+  }
+
+  for (auto shard: env.shards) {
+    KJ_EXPECT(shard->calls.size() <= 1);
+  }
+  KJ_EXPECT(env.shards[0]->calls.size() + env.shards[1]->calls.size() > 0);
+  for (auto name: names) {
+    auto& calls = env.shardFor(name).calls;
+    KJ_ASSERT(calls.size() == 1);
+    bool found = false;
+    for (auto& sent: calls[0]) {
+      if (sent == name) found = true;
+    }
+    KJ_EXPECT(found, name);
+  }
+}
+
+KJ_TEST("storage usage queries made during a call wait and go out together in the next") {
+  StorageUsageTestEnv env;
+  auto& shard = env.shardFor("user-a");
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  shard.release = paf.promise.fork();
+
+  auto first = env.batcher.getStorageUsage(kj::str("user-a"));
+  env.ioContext.provider->getTimer().afterDelay(10 * kj::MILLISECONDS).wait(env.waitScope);
+  KJ_ASSERT(shard.calls.size() == 1);
+
+  // Find two more names on the same shard.
+  kj::Vector<kj::Promise<uint64_t>> more;
+  for (uint i = 0; more.size() < 2; i++) {
+    auto name = kj::str("user-", i);
+    if (&env.shardFor(name) == &shard) {
+      more.add(env.batcher.getStorageUsage(kj::mv(name)));
+    }
+  }
+  env.ioContext.provider->getTimer().afterDelay(10 * kj::MILLISECONDS).wait(env.waitScope);
+  KJ_EXPECT(shard.calls.size() == 1);
+
+  shard.release = nullptr;
+  paf.fulfiller->fulfill();
+  KJ_EXPECT(first.wait(env.waitScope) == 600);
+  for (auto& promise: more) {
+    promise.wait(env.waitScope);
+  }
+  KJ_ASSERT(shard.calls.size() == 2);
+  KJ_EXPECT(shard.calls[1].size() == 2);
+}
+
+class TestBlob final: public OwnedBlob::Server {};
+
+class TestBlobStream final: public sandstorm::ByteStream::Server {
+  // A blob's initializer stream which acknowledges each write only once told to.
+
+public:
+  kj::Vector<kj::Own<kj::PromiseFulfiller<void>>> acks;  // one per write received, in order
+  bool finished = false;
+
+protected:
+  kj::Promise<void> write(WriteContext context) override {
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    acks.add(kj::mv(paf.fulfiller));
+    return kj::mv(paf.promise);
+  }
+
+  kj::Promise<void> done(DoneContext context) override {
+    finished = true;
+    return kj::READY_NOW;
+  }
+};
+
+struct BackupUploadTestEnv {
+  kj::AsyncIoContext ioContext;
+  kj::WaitScope& waitScope;
+  TestStorage* storage;
+  StorageRootSet::Client storageCap;
+  TestBlobStream* blobStream;
+  sandstorm::ByteStream::Client blobStreamCap;
+  sandstorm::ByteStream::Client upload;
+
+  BackupUploadTestEnv()
+      : ioContext(kj::setupAsyncIo()),
+        waitScope(ioContext.waitScope),
+        storage(nullptr), storageCap(nullptr),
+        blobStream(nullptr), blobStreamCap(nullptr),
+        upload(nullptr) {
+    // Hold our own references to the fakes, so that they outlive an abandoned upload.
+    auto ownStorage = kj::heap<TestStorage>();
+    storage = ownStorage.get();
+    storageCap = kj::mv(ownStorage);
+    auto ownStream = kj::heap<TestBlobStream>();
+    blobStream = ownStream.get();
+    blobStreamCap = kj::mv(ownStream);
+    upload = kj::heap<BackupUploadStream>(storageCap, kj::str("backup-abc"),
+                                          kj::heap<TestBlob>(), blobStreamCap);
+  }
+
+  kj::Promise<void> write() {
+    auto req = upload.writeRequest();
+    req.setData(kj::StringPtr("chunk").asBytes());
+    return req.send().ignoreResult();
+  }
+
+  void settle() {
+    ioContext.provider->getTimer().afterDelay(10 * kj::MILLISECONDS).wait(waitScope);
+  }
+};
+
+KJ_TEST("backup upload pushes back once too many writes wait on storage") {
+  BackupUploadTestEnv env;
+
+  for (uint i = 0; i < 16; i++) {
+    env.write().wait(env.waitScope);
+  }
+  env.settle();
+  KJ_EXPECT(env.blobStream->acks.size() == 16);
+
+  bool returned = false;
+  auto promise = env.write().then([&returned]() { returned = true; });
+  env.settle();
+  KJ_EXPECT(env.blobStream->acks.size() == 17);
+  KJ_EXPECT(!returned);
+
+  env.blobStream->acks[0]->fulfill();
+  promise.wait(env.waitScope);
+  KJ_EXPECT(returned);
+}
+
+KJ_TEST("backup upload becomes a storage root only once every write lands") {
+  BackupUploadTestEnv env;
+
+  env.write().wait(env.waitScope);
+  env.write().wait(env.waitScope);
+  env.settle();
+  KJ_ASSERT(env.blobStream->acks.size() == 2);
+
+  bool finished = false;
+  auto promise = env.upload.doneRequest().send().then([&finished](auto&&) { finished = true; });
+  env.blobStream->acks[0]->fulfill();
+  env.settle();
+  KJ_EXPECT(!finished);
+  KJ_EXPECT(!env.blobStream->finished);
+  KJ_EXPECT(env.storage->roots.size() == 0);
+
+  env.blobStream->acks[1]->fulfill();
+  promise.wait(env.waitScope);
+  KJ_EXPECT(env.blobStream->finished);
+  KJ_ASSERT(env.storage->roots.size() == 1);
+  KJ_EXPECT(env.storage->roots[0] == "backup-abc");
+}
+
+KJ_TEST("an abandoned backup upload never becomes a storage root") {
+  BackupUploadTestEnv env;
+
+  env.write().wait(env.waitScope);
+  env.settle();
+  KJ_ASSERT(env.blobStream->acks.size() == 1);
+  env.blobStream->acks[0]->fulfill();
+  env.upload = nullptr;
+  env.settle();
+  KJ_EXPECT(!env.blobStream->finished);
+  KJ_EXPECT(env.storage->roots.size() == 0);
+}
+
+class TestAccount final: public OwnedAssignable<AccountStorage>::Server {
+  // An account whose value is a single grain named after the account and its version.
+
+public:
+  explicit TestAccount(kj::StringPtr name): name(kj::heapString(name)) {}
+
+  kj::String name;
+  uint64_t version = 1;
+  uint gets = 0;
+
+protected:
+  kj::Promise<void> get(GetContext context) override {
+    ++gets;
+    context.getResults().initValue().initGrains(1)[0].setId(kj::str(name, '@', version));
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> getVersion(GetVersionContext context) override {
+    context.getResults().setVersion(version);
+    return kj::READY_NOW;
+  }
+};
+
+struct AccountCacheTestEnv {
+  kj::AsyncIoContext ioContext;
+  kj::WaitScope& waitScope;
+  TestAccount* lastOpened = nullptr;
+  uint opens = 0;
+  AssignableCache<AccountStorage> cache;
+
+  AccountCacheTestEnv()
+      : ioContext(kj::setupAsyncIo()),
+        waitScope(ioContext.waitScope),
+        cache([this](kj::StringPtr name) -> OwnedAssignable<AccountStorage>::Client {
+          ++opens;
+          auto account = kj::heap<TestAccount>(name);
+          lastOpened = account.get();
+          return kj::mv(account);
+        }, 2) {}
+
+  kj::String get(kj::StringPtr name) {
+    auto entry = cache.get(name).wait(waitScope);
+    return kj::heapString(entry->getValue().getGrains()[0].getId());
+  }
+};
+
+KJ_TEST("account cache evicts the least recently used entry") {
+  AccountCacheTestEnv env;
+  KJ_EXPECT(env.get("user-a") == "user-a@1");
+  KJ_EXPECT(env.get("user-b") == "user-b@1");
+  KJ_EXPECT(env.opens == 2);
+
+  // Using user-a makes user-b the least recently used.
+  KJ_EXPECT(env.get("user-a") == "user-a@1");
+  KJ_EXPECT(env.opens == 2);
+  KJ_EXPECT(env.get("user-c") == "user-c@1");
+  KJ_EXPECT(env.opens == 3);
+  KJ_EXPECT(env.cache.size() == 2);
+
+  KJ_EXPECT(env.get("user-a") == "user-a@1");
+  KJ_EXPECT(env.opens == 3);
+  KJ_EXPECT(env.get("user-b") == "user-b@1");
+  KJ_EXPECT(env.opens == 4);
+  KJ_EXPECT(env.cache.size() == 2);
+}
+
+KJ_TEST("account cache rereads a value only when its version changes") {
+  AccountCacheTestEnv env;
+  KJ_EXPECT(env.get("user-a") == "user-a@1");
+  KJ_ASSERT(env.lastOpened != nullptr);
+  auto& account = *env.lastOpened;
+  KJ_EXPECT(account.gets == 1);
+
+  KJ_EXPECT(env.get("user-a") == "user-a@1");
+  KJ_EXPECT(account.gets == 1);
+
+  account.version = 2;
+  KJ_EXPECT(env.get("user-a") == "user-a@2");
+  KJ_EXPECT(account.gets == 2);
+  KJ_EXPECT(env.opens == 1);
+}
+
+template <typename T>
+struct InFlightTestEnv: private kj::TaskSet::ErrorHandler {
+  kj::AsyncIoContext ioContext;
+  kj::WaitScope& waitScope;
+  kj::TaskSet tasks;
+  InFlightTable<T> table;
+
+  InFlightTestEnv()
+      : ioContext(kj::setupAsyncIo()),
+        waitScope(ioContext.waitScope),
+        tasks(*this),
+        table(tasks) {}
+
+  kj::Promise<T> join(kj::StringPtr key) {
+    auto joined = table.find(key);
+    KJ_IF_MAYBE(promise, joined) {
+      return kj::mv(*promise);
+    }
+    KJ_FAIL_ASSERT("not in flight", key);
+  }
+
+  void settle() {
+    ioContext.provider->getTimer().afterDelay(10 * kj::MILLISECONDS).wait(waitScope);
+  }
+
+  void taskFailed(kj::Exception&& exception) override {
+    KJ_FAIL_EXPECT(exception);
+  }
+};
+
+KJ_TEST("concurrent starts of one grain share one operation") {
+  InFlightTestEnv<uint> env;
+  auto paf = kj::newPromiseAndFulfiller<uint>();
+  auto first = env.table.add("grain-a", kj::mv(paf.promise));
+  auto second = env.join("grain-a");
+  KJ_EXPECT(env.table.find("grain-b") == nullptr);
+
+  paf.fulfiller->fulfill(123);
+  KJ_EXPECT(first.wait(env.waitScope) == 123);
+  KJ_EXPECT(second.wait(env.waitScope) == 123);
+
+  env.settle();
+  KJ_EXPECT(env.table.find("grain-a") == nullptr);
+  KJ_EXPECT(env.table.size() == 0);
+}
+
+KJ_TEST("a failed start leaves the table so the next one tries again") {
+  InFlightTestEnv<uint> env;
+  auto paf = kj::newPromiseAndFulfiller<uint>();
+  auto first = env.table.add("grain-a", kj::mv(paf.promise));
+  auto second = env.join("grain-a");
+
+  paf.fulfiller->reject(KJ_EXCEPTION(DISCONNECTED, "worker died"));
+  KJ_EXPECT_THROW(DISCONNECTED, first.wait(env.waitScope));
+  KJ_EXPECT_THROW(DISCONNECTED, second.wait(env.waitScope));
+
+  env.settle();
+  KJ_EXPECT(env.table.find("grain-a") == nullptr);
+  KJ_EXPECT(env.table.add("grain-a", kj::Promise<uint>(456u)).wait(env.waitScope) == 456);
+}
+
+KJ_TEST("a start keeps going after every caller cancels") {
+  InFlightTestEnv<uint> env;
+  auto paf = kj::newPromiseAndFulfiller<uint>();
+  bool finished = false;
+  {
+    auto first = env.table.add("grain-a", paf.promise.then([&finished](uint value) {
+      finished = true;
+      return value;
+    }));
+    auto second = env.join("grain-a");
+  }
+
+  // Callers arriving now still join the running start.
+  KJ_EXPECT(env.table.find("grain-a") != nullptr);
+
+  paf.fulfiller->fulfill(123);
+  env.settle();
+  KJ_EXPECT(finished);
+  KJ_EXPECT(env.table.size() == 0);
+}
+
+class TestSupervisor final: public sandstorm::Supervisor::Server {
+public:
+  uint keepAlives = 0;
+
+protected:
+  kj::Promise<void> keepAlive(KeepAliveContext context) override {
+    ++keepAlives;
+    return kj::READY_NOW;
+  }
+};
+
+KJ_TEST("callers can pipeline on a grain's supervisor while it starts") {
+  InFlightTestEnv<sandstorm::Supervisor::Client> env;
+
+  auto paf = kj::newPromiseAndFulfiller<sandstorm::Supervisor::Client>();
+  sandstorm::Supervisor::Client first = env.table.add("grain-a", kj::mv(paf.promise));
+  sandstorm::Supervisor::Client second = env.join("grain-a");
+  auto firstCall = first.keepAliveRequest().send();
+  auto secondCall = second.keepAliveRequest().send();
+
+  auto supervisor = kj::heap<TestSupervisor>();
+  auto& supervisorRef = *supervisor;
+  paf.fulfiller->fulfill(kj::mv(supervisor));
+  firstCall.wait(env.waitScope);
+  secondCall.wait(env.waitScope);
+  KJ_EXPECT(supervisorRef.keepAlives == 2);
+}
+
+KJ_TEST("calls pipelined on a grain's supervisor fail if the start fails") {
+  InFlightTestEnv<sandstorm::Supervisor::Client> env;
+
+  auto paf = kj::newPromiseAndFulfiller<sandstorm::Supervisor::Client>();
+  sandstorm::Supervisor::Client supervisor = env.table.add("grain-a", kj::mv(paf.promise));
+  auto call = supervisor.keepAliveRequest().send();
+
+  paf.fulfiller->reject(KJ_EXCEPTION(DISCONNECTED, "worker died"));
+  KJ_EXPECT_THROW(DISCONNECTED, call.wait(env.waitScope));
+}
+
+}  // namespace
+}  // namespace blackrock
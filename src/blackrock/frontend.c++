@@ -15,6 +15,7 @@
 // limitations under the License.
 
 #include "frontend.h"
+#include "metrics.h"
 #include <grp.h>
 #include <signal.h>
 #include <sandstorm/version.h>
@@ -26,6 +27,8 @@
 #include <sodium/randombytes.h>
 #include <unistd.h>
 #include <limits.h>
+#include <kj/function.h>
+#include <map>
 #include "bundle.h"
 
 namespace blackrock {
@@ -34,7 +37,23 @@ class FrontendImpl::BackendImpl: public sandstorm::Backend::Server {
 public:
   BackendImpl(FrontendImpl& frontend, kj::Timer& timer,
               sandstorm::SandstormCoreFactory::Client&& sandstormCoreFactory)
-      : frontend(frontend), timer(timer), coreFactory(kj::mv(sandstormCoreFactory)) {}
+      : frontend(frontend), timer(timer), coreFactory(kj::mv(sandstormCoreFactory)),
+        accountCache([&frontend](kj::StringPtr name) {
+          auto req = frontend.chooseStorage(name).getOrCreateAssignableRequest<AccountStorage>();
+          req.setName(name);
+          req.initDefaultValue();
+          return req.send().getObject();
+        }),
+        packageCache([&frontend](kj::StringPtr name) {
+          auto req = frontend.chooseStorage(name).getRequest<Assignable<PackageStorage>>();
+          req.setName(name);
+          return req.send().getObject().castAs<OwnedAssignable<PackageStorage>>();
+        }),
+        startingGrains(frontend.tasks),
+        activeGrains(timer),
+        keepAliveTask(keepAliveLoop().eagerlyEvaluate([](kj::Exception&& exception) {
+          KJ_LOG(ERROR, "grain keep-alive loop failed", exception);
+        })) {}
 
 protected:
   kj::Promise<void> ping(PingContext context) override {
@@ -47,79 +66,77 @@ protected:
     auto grainId = params.getGrainId();
     KJ_LOG(INFO, "Backend: startGrain", grainId, packageId);
 
+    if (!params.getIsNew()) {
+      KJ_IF_MAYBE(supervisor, activeGrains.find(params.getOwnerId(), grainId)) {
+        context.getResults(capnp::MessageSize { 4, 1 }).setSupervisor(kj::mv(*supervisor));
+        return kj::READY_NOW;
+      }
+
+      auto starting = startingGrains.find(grainId);
+      KJ_IF_MAYBE(promise, starting) {
+        // Someone else is already starting this grain. Rather than race them for the GrainState,
+        // share their supervisor.
+        sandstorm::Supervisor::Client supervisor = kj::mv(*promise);
+        context.getResults(capnp::MessageSize { 4, 1 }).setSupervisor(kj::mv(supervisor));
+        return kj::READY_NOW;
+      }
+
+      // Other callers may join this start, so it must not depend on our call context staying
+      // alive. Copy the params.
+      auto paramsCopy = kj::heap<capnp::MallocMessageBuilder>(params.totalSize().wordCount + 4);
+      paramsCopy->setRoot(params);
+      auto ownParams = paramsCopy->getRoot<sandstorm::Backend::StartGrainParams>().asReader();
+
+      // If the coordinator knows where the grain is running, we don't need to touch storage.
+      auto promise = findOnCoordinator(ownParams.getOwnerId(), ownParams.getGrainId())
+          .then([this,ownParams](kj::Maybe<sandstorm::Supervisor::Client>&& found)
+                -> kj::Promise<sandstorm::Supervisor::Client> {
+        KJ_IF_MAYBE(supervisor, found) {
+          return kj::mv(*supervisor);
+        }
+        return continueGrainFromStorage(ownParams);
+      }).attach(kj::mv(paramsCopy));
+
+      // Return a promise capability right away rather than waiting for the grain to start, so
+      // that the caller can pipeline its first calls (e.g. getMainView()) on it. If the start
+      // fails, those calls fail with the same error. The start keeps going even if every caller
+      // cancels, since the grain is probably half-started.
+      sandstorm::Supervisor::Client supervisor = startingGrains.add(grainId, kj::mv(promise));
+      context.getResults(capnp::MessageSize { 4, 1 }).setSupervisor(kj::mv(supervisor));
+
+      return kj::READY_NOW;
+    }
+
     sandstorm::SandstormCore::Client core = ({
       auto req = coreFactory.getSandstormCoreRequest();
       req.setGrainId(grainId);
       req.send().getCore();
     });
 
-    StorageRootSet::Client storage = frontend.storageRoots->chooseOne();
+    StorageRootSet::Client storage =
+        frontend.chooseStorage(kj::str("user-", params.getOwnerId()));
     StorageFactory::Client storageFactory = storage.getFactoryRequest().send().getFactory();
 
     // Load the package volume.
-    auto packageVolume = ({
-      auto req = storage.getRequest<Assignable<PackageStorage>>();
-      req.setName(kj::str("package-", packageId));
-      req.send().getObject().castAs<OwnedAssignable<PackageStorage>>()
-          .getRequest().send().getValue().getVolume();
-    });
-
-    // Get the owner user data.
-    auto owner = ({
-      auto userObjectName = kj::str("user-", params.getOwnerId());
+    Volume::Client packageVolume = loadPackageVolume(packageId);
 
+    // We're going to modify the owner's grain list, so we need a fresh setter.
+    auto ownerGet = ({
       auto req = storage.getOrCreateAssignableRequest<AccountStorage>();
-      req.setName(userObjectName);
+      req.setName(kj::str("user-", params.getOwnerId()));
       req.initDefaultValue();
-      req.send().getObject();
+      req.send().getObject().getRequest().send();
     });
 
-    auto ownerGet = owner.getRequest().send();
-
-    if (params.getIsNew()) {
-      Worker::Client worker = frontend.workers->chooseOne();
-
-      auto promise = ({
-        auto req = worker.newGrainRequest();
-        auto packageInfo = req.initPackage();
-        packageInfo.setId(packageId.asBytes());  // TODO(perf): parse ID hex to bytes?
-        packageInfo.setVolume(kj::mv(packageVolume));
-        req.setCommand(params.getCommand());
-        req.setStorage(kj::mv(storageFactory));
-        req.setGrainId(grainId);
-        req.setCore(core);
-        req.send();
-      });
-
-      context.getResults(capnp::MessageSize { 4, 1 }).setSupervisor(promise.getGrain());
-      auto grainState = promise.getGrainState();
+    return placeNewGrain(params, kj::mv(packageVolume), kj::mv(storageFactory), kj::mv(core))
+        .then([this,context,params,KJ_MVCAP(ownerGet)](PlacedGrain&& grain) mutable {
+      context.getResults(capnp::MessageSize { 4, 1 }).setSupervisor(grain.supervisor);
+      activeGrains.add(params.getOwnerId(), params.getGrainId(),
+                       grain.workerId, kj::mv(grain.worker), grain.supervisor);
 
       // Update owner.
-      return addGrainToUser(kj::mv(ownerGet), grainId, kj::mv(grainState));
-    } else {
-      return ownerGet.then(
-          [this,context,params,packageId,grainId,
-           KJ_MVCAP(storageFactory),KJ_MVCAP(packageVolume),KJ_MVCAP(core)]
-          (auto&& getResults) mutable {
-        for (auto grainInfo: getResults.getValue().getGrains()) {
-          if (grainInfo.getId() == grainId) {
-            // This is the grain we're looking for.
-
-            // TODO(perf): It would be cool to return a promise for the supervisor without waiting
-            //   for continueGrain() to finish, but we need `packageId` and `command` to stay
-            //   live in the continueGrain() loop. Make a copy?
-            return continueGrain({grainInfo.getState(), kj::mv(storageFactory),
-                    kj::mv(packageVolume), packageId, grainId, params.getCommand(),
-                    kj::mv(core)})
-                .then([context](sandstorm::Supervisor::Client supervisor) mutable {
-              context.getResults(capnp::MessageSize { 4, 1 })
-                  .setSupervisor(kj::mv(supervisor));
-            });
-          }
-        }
-        KJ_FAIL_REQUIRE("no such grain", grainId);
-      });
-    }
+      return addGrainToUser(kj::mv(ownerGet), params.getGrainId(), kj::mv(grain.grainState));
+    });
   }
 
   kj::Promise<void> getGrain(GetGrainContext context) override {
@@ -127,55 +144,59 @@ protected:
     auto grainId = params.getGrainId();
     KJ_LOG(INFO, "Backend: getGrain", grainId);
 
-    StorageRootSet::Client storage = frontend.storageRoots->chooseOne();
-
-    auto owner = ({
-      auto userObjectName = kj::str("user-", params.getOwnerId());
-
-      auto req = storage.getOrCreateAssignableRequest<AccountStorage>();
-      req.setName(userObjectName);
-      req.initDefaultValue();
-      req.send().getObject();
-    });
-
-    return owner.getRequest().send()
-        .then([this,params,grainId,context](auto&& getResults) mutable -> kj::Promise<void> {
-      auto userInfo = getResults.getValue();
+    KJ_IF_MAYBE(supervisor, activeGrains.find(params.getOwnerId(), grainId)) {
+      context.getResults(capnp::MessageSize {4, 1}).setSupervisor(kj::mv(*supervisor));
+      return kj::READY_NOW;
+    }
 
-      for (auto grain: userInfo.getGrains()) {
-        if (grain.getId() == grainId) {
-          return grain.getState().getRequest().send()
-              .then([this,context,grainId](auto&& response) mutable -> kj::Promise<void> {
-            auto grainState = response.getValue();
-            if (grainState.isActive()) {
-              auto supervisor = grainState.getActive();
-
-              // Create a new SandstormCore to send along.
-              auto coreReq = coreFactory.getSandstormCoreRequest();
-              coreReq.setGrainId(grainId);
-              auto keepAliveReq = supervisor.keepAliveRequest();
-              keepAliveReq.setCore(coreReq.send().getCore());
-
-              return timer.timeoutAfter(4 * kj::SECONDS, keepAliveReq.send())
-                  .then([KJ_MVCAP(supervisor),context](auto) mutable -> kj::Promise<void> {
-                context.getResults(capnp::MessageSize {4, 1}).setSupervisor(kj::mv(supervisor));
-                return kj::READY_NOW;
-              }, [grainId](kj::Exception&& e) -> kj::Promise<void> {
-                KJ_LOG(INFO, "RARE: (getGrain) GrainState is active, but supervisor appears dead.",
-                       grainId, e);
+    return findOnCoordinator(params.getOwnerId(), grainId)
+        .then([this,params,grainId,context](kj::Maybe<sandstorm::Supervisor::Client>&& found)
+              mutable -> kj::Promise<void> {
+      KJ_IF_MAYBE(supervisor, found) {
+        context.getResults(capnp::MessageSize {4, 1}).setSupervisor(kj::mv(*supervisor));
+        return kj::READY_NOW;
+      }
 
-                // Threw exception. Assume dead.
-                return KJ_EXCEPTION(DISCONNECTED, "grain supervisor is dead");
-              });
-            } else {
-              // Not currently active.
-              return KJ_EXCEPTION(DISCONNECTED, "grain is inactive");
-            }
-          });
+      return accountCache.get(kj::str("user-", params.getOwnerId()))
+          .then([this,params,grainId,context]
+                (kj::Own<AssignableCache<AccountStorage>::Entry>&& owner) mutable
+                -> kj::Promise<void> {
+        auto userInfo = owner->getValue();
+
+        for (auto grain: userInfo.getGrains()) {
+          if (grain.getId() == grainId) {
+            return grain.getState().getRequest().send()
+                .then([this,params,context,grainId](auto&& response) mutable
+                      -> kj::Promise<void> {
+              auto grainState = response.getValue();
+              if (grainState.isActive()) {
+                // Create a new SandstormCore to send along.
+                auto coreReq = coreFactory.getSandstormCoreRequest();
+                coreReq.setGrainId(grainId);
+
+                return findOnWorkers(params.getOwnerId(), grainId, coreReq.send().getCore())
+                    .then([context,grainId](kj::Maybe<sandstorm::Supervisor::Client>&& found)
+                          mutable -> kj::Promise<void> {
+                  KJ_IF_MAYBE(supervisor, found) {
+                    context.getResults(capnp::MessageSize {4, 1})
+                        .setSupervisor(kj::mv(*supervisor));
+                    return kj::READY_NOW;
+                  }
+
+                  KJ_LOG(INFO, "RARE: (getGrain) GrainState is active, but no worker is running "
+                               "the grain.", grainId);
+                  return KJ_EXCEPTION(DISCONNECTED, "grain supervisor is dead");
+                });
+              } else {
+                // Not currently active.
+                return KJ_EXCEPTION(DISCONNECTED, "grain is inactive");
+              }
+            });
+          }
         }
-      }
 
-      return KJ_EXCEPTION(FAILED, "no such grain");
+        return KJ_EXCEPTION(FAILED, "no such grain");
+      });
     });
   }
 
@@ -184,7 +205,8 @@ protected:
     auto grainId = params.getGrainId();
     KJ_LOG(INFO, "Backend: deleteGrain", grainId);
 
-    StorageRootSet::Client storage = frontend.storageRoots->chooseOne();
+    StorageRootSet::Client storage =
+        frontend.chooseStorage(kj::str("user-", params.getOwnerId()));
 
     auto owner = ({
       auto userObjectName = kj::str("user-", params.getOwnerId());
@@ -295,7 +317,7 @@ protected:
     auto userObjectName = kj::str("user-", userId);
     context.releaseParams();
 
-    auto req = frontend.storageRoots->chooseOne().removeRequest();
+    auto req = frontend.chooseStorage(userObjectName).removeRequest();
     req.setName(userObjectName);
     return req.send().then([](auto&&){});
   }
@@ -306,7 +328,8 @@ protected:
     KJ_LOG(INFO, "Backend: installPackage");
 
     Worker::Client worker = frontend.workers->chooseOne();
-    StorageRootSet::Client storage = frontend.storageRoots->chooseOne();
+    // The package's ID isn't known until the upload finishes, but all packages share a shard.
+    StorageRootSet::Client storage = frontend.chooseStorage("package-");
     StorageFactory::Client storageFactory = storage.getFactoryRequest().send().getFactory();
 
     auto stream = ({
@@ -324,9 +347,10 @@ protected:
     auto packageId = context.getParams().getPackageId();
     KJ_LOG(INFO, "Backend: tryGetPackage", packageId);
 
-    StorageRootSet::Client storage = frontend.storageRoots->chooseOne();
+    auto name = kj::str("package-", packageId);
+    StorageRootSet::Client storage = frontend.chooseStorage(name);
     auto req = storage.tryGetRequest<Assignable<PackageStorage>>();
-    req.setName(kj::str("package-", packageId));
+    req.setName(name);
     context.releaseParams();
 
     return req.send().then([this,context](auto&& outerResult) mutable -> kj::Promise<void> {
@@ -367,9 +391,10 @@ protected:
     auto packageId = context.getParams().getPackageId();
     KJ_LOG(INFO, "Backend: deletePackage", packageId);
 
-    StorageRootSet::Client storage = frontend.storageRoots->chooseOne();
+    auto name = kj::str("package-", packageId);
+    StorageRootSet::Client storage = frontend.chooseStorage(name);
     auto req = storage.removeRequest();
-    req.setName(kj::str("package-", packageId));
+    req.setName(name);
     context.releaseParams();
     return req.send().ignoreResult();
   }
@@ -382,18 +407,13 @@ protected:
     auto backupId = params.getBackupId();
     KJ_LOG(INFO, "Backend: backupGrain", grainId, backupId);
 
-    Worker::Client worker = frontend.workers->chooseOne();
-    StorageRootSet::Client storage = frontend.storageRoots->chooseOne();
+    StorageRootSet::Client storage = frontend.chooseStorage(kj::str("backup-", backupId));
     StorageFactory::Client storageFactory = storage.getFactoryRequest().send().getFactory();
 
-    auto req = storage.getOrCreateAssignableRequest<AccountStorage>();
-    req.setName(kj::str("user-", params.getOwnerId()));
-    req.initDefaultValue();
-    return req.send().getObject().getRequest().send().then(
-        [this,context,params,grainId,backupId,
-         KJ_MVCAP(worker),KJ_MVCAP(storage),KJ_MVCAP(storageFactory)]
-        (auto&& getResults) mutable {
-      for (auto grainInfo: getResults.getValue().getGrains()) {
+    return accountCache.get(kj::str("user-", params.getOwnerId())).then(
+        [this,context,params,grainId,backupId,KJ_MVCAP(storage),KJ_MVCAP(storageFactory)]
+        (kj::Own<AssignableCache<AccountStorage>::Entry>&& owner) mutable {
+      for (auto grainInfo: owner->getValue().getGrains()) {
         if (grainInfo.getId() == grainId) {
           // This is the grain we're looking for!
 
@@ -423,16 +443,25 @@ protected:
             }
           });
 
-          // Make request to the Worker to pack this backup.
+          // Make request to a Worker to pack this backup. Packing creates a new blob in storage,
+          // so if the worker dies partway, it may already have created one which nobody would
+          // clean up after a retry. Make one attempt; a failure still quarantines the worker.
           auto metadata = params.getInfo();
           auto sizeHint = metadata.totalSize();
           sizeHint.wordCount += 8;
           sizeHint.capCount += 2;
-          auto req = worker.packBackupRequest(sizeHint);
-          req.setVolume(kj::mv(volume));
-          req.setMetadata(metadata);
-          req.setStorage(kj::mv(storageFactory));
-          return req.send().then([this,backupId,KJ_MVCAP(storage)](auto&& response) mutable {
+          BackendCallOptions options;
+          options.maxAttempts = 1;
+          return frontend.workers->call(
+              [KJ_MVCAP(volume),metadata,sizeHint,storageFactory](
+                  BackendSetImpl<Worker>::Choice&& worker) mutable
+              -> kj::Promise<capnp::Response<Worker::PackBackupResults>> {
+            auto req = worker.client.packBackupRequest(sizeHint);
+            req.setVolume(volume);
+            req.setMetadata(metadata);
+            req.setStorage(storageFactory);
+            return req.send();
+          }, options).then([this,backupId,KJ_MVCAP(storage)](auto&& response) mutable {
             auto req2 = storage.setRequest<sandstorm::Blob>(capnp::MessageSize {4, 1});
             req2.setName(kj::str("backup-", backupId));
             req2.setObject(response.getData());
@@ -450,22 +479,32 @@ protected:
     auto backupId = params.getBackupId();
     KJ_LOG(INFO, "Backend: restoreGrain", grainId, backupId);
 
-    Worker::Client worker = frontend.workers->chooseOne();
-    StorageRootSet::Client storage = frontend.storageRoots->chooseOne();
+    StorageRootSet::Client storage =
+        frontend.chooseStorage(kj::str("user-", params.getOwnerId()));
     StorageFactory::Client storageFactory = storage.getFactoryRequest().send().getFactory();
 
     auto blob = ({
-      auto req = storage.getRequest<sandstorm::Blob>();
+      auto req = frontend.chooseStorage(kj::str("backup-", backupId))
+          .getRequest<sandstorm::Blob>();
       req.setName(kj::str("backup-", backupId));
       req.send().getObject().castAs<sandstorm::Blob>();
     });
 
-    auto req = worker.unpackBackupRequest();
-    req.setData(kj::mv(blob));
-    req.setStorage(storageFactory);
-
-    return req.send().then([this,context,params,grainId,KJ_MVCAP(storage),KJ_MVCAP(storageFactory)]
-                           (auto&& response) mutable {
+    // Unpacking creates a new volume, which a retry would orphan if the worker died after
+    // creating it, so as with packBackup(), make one attempt.
+    BackendCallOptions options;
+    options.maxAttempts = 1;
+    auto promise = frontend.workers->call(
+        [KJ_MVCAP(blob),storageFactory](BackendSetImpl<Worker>::Choice&& worker) mutable
+        -> kj::Promise<capnp::Response<Worker::UnpackBackupResults>> {
+      auto req = worker.client.unpackBackupRequest();
+      req.setData(blob);
+      req.setStorage(storageFactory);
+      return req.send();
+    }, options);
+
+    return promise.then([this,context,params,grainId,KJ_MVCAP(storage),KJ_MVCAP(storageFactory)]
+                        (auto&& response) mutable {
       auto grainState = ({
         auto req = storageFactory.newAssignableRequest<GrainState>();
         auto state = req.initInitialValue();
@@ -494,21 +533,16 @@ protected:
     auto backupId = context.getParams().getBackupId();
     KJ_LOG(INFO, "Backend: uploadBackup", backupId);
 
-    StorageRootSet::Client storage = frontend.storageRoots->chooseOne();
+    auto name = kj::str("backup-", backupId);
+    StorageRootSet::Client storage = frontend.chooseStorage(name);
     StorageFactory::Client storageFactory = storage.getFactoryRequest().send().getFactory();
 
     auto upload = storageFactory.uploadBlobRequest().send();
-
-    auto req = storage.setRequest<sandstorm::Blob>();
-    req.setName(kj::str("backup-", backupId));
-    req.setObject(upload.getBlob());
     context.releaseParams();
 
-    // TODO(perf): Pipelining could be improved here by wrapping the returned stream such that
-    //   it only requires the StorageRoot.set() request to complete when done() is called. Probably
-    //   not worth the effort, though.
-    context.getResults(capnp::MessageSize {4,1}).setStream(upload.getStream());
-    return req.send().then([](auto&&) {});
+    context.getResults(capnp::MessageSize {4,1}).setStream(kj::heap<BackupUploadStream>(
+        kj::mv(storage), kj::mv(name), upload.getBlob(), upload.getStream()));
+    return kj::READY_NOW;
   }
 
   kj::Promise<void> downloadBackup(DownloadBackupContext context) override {
@@ -517,10 +551,11 @@ protected:
     auto backupId = params.getBackupId();
     KJ_LOG(INFO, "Backend: downloadBackup", backupId);
 
-    StorageRootSet::Client storage = frontend.storageRoots->chooseOne();
+    auto name = kj::str("backup-", backupId);
+    StorageRootSet::Client storage = frontend.chooseStorage(name);
 
     auto req = storage.getRequest<sandstorm::Blob>();
-    req.setName(kj::str("backup-", backupId));
+    req.setName(name);
     context.releaseParams();
 
     auto req2 = req.send().getObject().castAs<sandstorm::Blob>().writeToRequest();
@@ -532,8 +567,9 @@ protected:
     auto backupId = context.getParams().getBackupId();
     KJ_LOG(INFO, "Backend: deleteBackup", backupId);
 
-    auto req = frontend.storageRoots->chooseOne().removeRequest();
-    req.setName(kj::str("backup-", backupId));
+    auto name = kj::str("backup-", backupId);
+    auto req = frontend.chooseStorage(name).removeRequest();
+    req.setName(name);
     context.releaseParams();
     return req.send().then([](auto&&) {});
   }
@@ -541,20 +577,12 @@ protected:
   // ---------------------------------------------------------------------------
 
   kj::Promise<void> getUserStorageUsage(GetUserStorageUsageContext context) override {
-    StorageRootSet::Client storage = frontend.storageRoots->chooseOne();
-
-    auto owner = ({
-      auto userObjectName = kj::str("user-", context.getParams().getUserId());
-      context.releaseParams();
-
-      auto req = storage.getOrCreateAssignableRequest<AccountStorage>();
-      req.setName(userObjectName);
-      req.initDefaultValue();
-      req.send().getObject();
-    });
+    auto userObjectName = kj::str("user-", context.getParams().getUserId());
+    context.releaseParams();
 
-    return owner.getStorageUsageRequest().send().then([context](auto&& result) mutable {
-      context.getResults(capnp::MessageSize { 4, 0 }).setSize(result.getTotalBytes());
+    return frontend.storageUsage.getStorageUsage(kj::mv(userObjectName))
+        .then([context](uint64_t size) mutable {
+      context.getResults(capnp::MessageSize { 4, 0 }).setSize(size);
     });
   }
 
@@ -562,20 +590,10 @@ protected:
     auto params = context.getParams();
     auto grainId = params.getGrainId();
 
-    StorageRootSet::Client storage = frontend.storageRoots->chooseOne();
-
-    auto owner = ({
-      auto userObjectName = kj::str("user-", params.getOwnerId());
-
-      auto req = storage.getOrCreateAssignableRequest<AccountStorage>();
-      req.setName(userObjectName);
-      req.initDefaultValue();
-      req.send().getObject();
-    });
-
-    return owner.getRequest().send()
-        .then([grainId,context](auto&& getResults) mutable -> kj::Promise<void> {
-      for (auto grainInfo: getResults.getValue().getGrains()) {
+    return accountCache.get(kj::str("user-", params.getOwnerId()))
+        .then([grainId,context](kj::Own<AssignableCache<AccountStorage>::Entry>&& owner) mutable
+              -> kj::Promise<void> {
+      for (auto grainInfo: owner->getValue().getGrains()) {
         if (grainInfo.getId() == grainId) {
           // This is the grain we're looking for!
           return grainInfo.getState().getStorageUsageRequest().send()
@@ -593,6 +611,30 @@ private:
   FrontendImpl& frontend;
   kj::Timer& timer;
   sandstorm::SandstormCoreFactory::Client coreFactory;
+  AssignableCache<AccountStorage> accountCache;
+  AssignableCache<PackageStorage> packageCache;
+
+  InFlightTable<sandstorm::Supervisor::Client> startingGrains;
+  // Grains currently being started by startGrain(), keyed by grain ID.
+  // Concurrent starts of the same grain share one promise rather than racing on the GrainState.
+
+  static constexpr kj::Duration GRAIN_KEEPALIVE_INTERVAL = 15 * kj::SECONDS;
+  static constexpr kj::Duration FIND_GRAIN_TIMEOUT = 8 * kj::SECONDS;
+  // How long to wait for each worker's answer to findGrain() before assuming it's gone.
+
+  ActiveGrainTable activeGrains;
+  // Grains which we started or found through the coordinator or the workers, so that startGrain()
+  // and getGrain() can answer without touching storage, the coordinator, or the worker.
+
+  kj::Promise<void> keepAliveTask;
+
+  kj::Promise<void> keepAliveLoop() {
+    return timer.afterDelay(GRAIN_KEEPALIVE_INTERVAL).then([this]() {
+      return activeGrains.keepAlive();
+    }).then([this]() {
+      return keepAliveLoop();
+    });
+  }
 
   class PackageUploadStreamImpl: public sandstorm::Backend::PackageUploadStream::Server {
   public:
@@ -696,16 +738,269 @@ private:
     });
   }
 
+  Volume::Client loadPackageVolume(capnp::Text::Reader packageId) {
+    return packageCache.get(kj::str("package-", packageId))
+        .then([](kj::Own<AssignableCache<PackageStorage>::Entry>&& package) -> Volume::Client {
+      return package->getValue().getVolume();
+    });
+  }
+
+  struct PlacedGrain {
+    sandstorm::Supervisor::Client supervisor;
+    OwnedAssignable<GrainState>::Client grainState;  // null for restored grains
+    uint64_t workerId;  // ID of the worker in `frontend.workers`.
+    Worker::Client worker;
+  };
+
+  bool haveCoordinator() {
+    // Grains are placed through a coordinator, which tracks where they run, when one is reachable.
+    // Otherwise we place them on workers ourselves, so that a coordinator outage costs only the
+    // tracking rather than stopping grains from opening. Coordinators are chosen by hashing the
+    // grain ID, so that with several of them, each grain's lookups go where it was placed.
+    return frontend.coordinators->available() > 0;
+  }
+
+  template <typename Request>
+  static void initNewGrain(Request& req, sandstorm::Backend::StartGrainParams::Reader params,
+                           Volume::Client& packageVolume, StorageFactory::Client& storageFactory,
+                           sandstorm::SandstormCore::Client& core) {
+    auto packageInfo = req.initPackage();
+    packageInfo.setId(params.getPackageId().asBytes());  // TODO(perf): parse ID hex to bytes?
+    packageInfo.setVolume(packageVolume);
+    req.setCommand(params.getCommand());
+    req.setStorage(storageFactory);
+    req.setGrainId(params.getGrainId());
+    req.setCore(core);
+  }
+
+  kj::Promise<PlacedGrain> placeNewGrain(
+      sandstorm::Backend::StartGrainParams::Reader params, Volume::Client packageVolume,
+      StorageFactory::Client storageFactory, sandstorm::SandstormCore::Client core) {
+    // Start a new grain through a coordinator if possible, otherwise directly on a worker. `params`
+    // must remain valid until the returned promise completes.
+
+    if (!haveCoordinator()) {
+      return placeNewGrainOnWorker(
+          params, kj::mv(packageVolume), kj::mv(storageFactory), kj::mv(core));
+    }
+
+    // Don't retry on another coordinator: the coordinator already retries across workers, and if
+    // it's the coordinator that failed we'd rather skip it.
+    BackendCallOptions options;
+    options.maxAttempts = 1;
+    auto promise = frontend.coordinators->call(params.getGrainId().asBytes(),
+        [params,packageVolume,storageFactory,core]
+        (BackendSetImpl<Coordinator>::Choice&& coordinator) mutable -> kj::Promise<PlacedGrain> {
+      auto req = coordinator.client.newGrainRequest();
+      initNewGrain(req, params, packageVolume, storageFactory, core);
+      req.setOwnerId(params.getOwnerId());
+      return req.send().then([](auto&& response) {
+        auto location = response.getLocation();
+        return PlacedGrain { response.getGrain(), response.getGrainState(),
+                             location.getWorkerId(), location.getWorker() };
+      });
+    }, options);
+
+    return promise.catch_(
+        [this,params,KJ_MVCAP(packageVolume),KJ_MVCAP(storageFactory),KJ_MVCAP(core)]
+        (kj::Exception&& exception) mutable -> kj::Promise<PlacedGrain> {
+      if (!BackendSetBase::isRetryable(exception)) {
+        return kj::mv(exception);
+      }
+
+      // A new grain's storage is created by the attempt that starts it, so starting over is safe
+      // even if the coordinator got as far as starting the grain.
+      KJ_LOG(ERROR, "coordinator newGrain() failed; placing grain directly", exception);
+      return placeNewGrainOnWorker(
+          params, kj::mv(packageVolume), kj::mv(storageFactory), kj::mv(core));
+    });
+  }
+
+  kj::Promise<PlacedGrain> placeNewGrainOnWorker(
+      sandstorm::Backend::StartGrainParams::Reader params, Volume::Client packageVolume,
+      StorageFactory::Client storageFactory, sandstorm::SandstormCore::Client core) {
+    // Start a new grain on a worker of our own choosing, preferably one that already has the
+    // package mounted, as the coordinator would.
+
+    return frontend.workers->call(params.getPackageId().asBytes(),
+        [params,KJ_MVCAP(packageVolume),KJ_MVCAP(storageFactory),KJ_MVCAP(core)]
+        (BackendSetImpl<Worker>::Choice&& worker) mutable -> kj::Promise<PlacedGrain> {
+      auto req = worker.client.newGrainRequest();
+      initNewGrain(req, params, packageVolume, storageFactory, core);
+      return req.send().then([KJ_MVCAP(worker)](auto&& response) mutable {
+        return PlacedGrain { response.getGrain(), response.getGrainState(),
+                             worker.id, kj::mv(worker.client) };
+      });
+    });
+  }
+
+  kj::Promise<kj::Maybe<sandstorm::Supervisor::Client>> findOnCoordinator(
+      kj::StringPtr ownerId, kj::StringPtr grainId) {
+    // Ask the coordinator whether the grain is running, and if so, start routing to it.
+
+    if (!haveCoordinator()) {
+      return kj::Maybe<sandstorm::Supervisor::Client>(nullptr);
+    }
+
+    // A failure quarantines the coordinator, so that subsequent opens skip it.
+    BackendCallOptions options;
+    options.maxAttempts = 1;
+    auto promise = frontend.coordinators->call(grainId.asBytes(),
+        [ownerId=kj::heapString(ownerId),grainId=kj::heapString(grainId)]
+        (BackendSetImpl<Coordinator>::Choice&& coordinator)
+        -> kj::Promise<capnp::Response<Coordinator::FindGrainResults>> {
+      auto req = coordinator.client.findGrainRequest();
+      req.setGrainId(kj::StringPtr(grainId));
+      req.setOwnerId(kj::StringPtr(ownerId));
+      return req.send();
+    }, options);
+
+    return promise.then(
+        [this,ownerId=kj::heapString(ownerId),grainId=kj::heapString(grainId)](auto&& response)
+        -> kj::Maybe<sandstorm::Supervisor::Client> {
+      if (!response.hasGrain()) {
+        return nullptr;
+      }
+
+      auto supervisor = response.getGrain();
+      auto location = response.getLocation();
+      activeGrains.add(ownerId, grainId, location.getWorkerId(), location.getWorker(), supervisor);
+      return kj::mv(supervisor);
+    }, [](kj::Exception&& e) -> kj::Maybe<sandstorm::Supervisor::Client> {
+      // The GrainState in storage is still authoritative, so carry on without the coordinator.
+      KJ_LOG(ERROR, "coordinator findGrain() failed; falling back to storage", e);
+      return nullptr;
+    });
+  }
+
+  struct FoundGrain {
+    uint64_t workerId;
+    Worker::Client worker;
+    sandstorm::Supervisor::Client supervisor;
+  };
+
+  kj::Promise<kj::Maybe<sandstorm::Supervisor::Client>> findOnWorkers(
+      kj::StringPtr ownerId, kj::StringPtr grainId, sandstorm::SandstormCore::Client core) {
+    // Ask every worker whether it's running a grain whose GrainState says it's active, and if one
+    // is, start routing to it. A worker on which the grain is shutting down answers only once the
+    // GrainState is inactive (see Worker.findGrain()), so a null result means that the grain may
+    // be taken over right away.
+
+    auto found = kj::heap<kj::Maybe<FoundGrain>>(nullptr);
+    auto& foundRef = *found;
+    auto promises = KJ_MAP(worker, frontend.workers->getAll()) {
+      auto req = worker.client.findGrainRequest();
+      req.setGrainId(grainId);
+      req.setCore(core);
+      return timer.timeoutAfter(FIND_GRAIN_TIMEOUT, req.send())
+          .then([&foundRef,KJ_MVCAP(worker)](auto&& response) mutable {
+        if (response.hasGrain()) {
+          foundRef = FoundGrain { worker.id, kj::mv(worker.client), response.getGrain() };
+        }
+      }, [workerId=worker.id](kj::Exception&& e) {
+        // Presumably the worker is gone, and its grains with it.
+        KJ_LOG(INFO, "findGrain() failed", workerId, e);
+      });
+    };
+
+    return kj::joinPromises(kj::mv(promises))
+        .then([this,KJ_MVCAP(found),ownerId=kj::heapString(ownerId),
+               grainId=kj::heapString(grainId)]() mutable
+              -> kj::Maybe<sandstorm::Supervisor::Client> {
+      KJ_IF_MAYBE(f, *found) {
+        activeGrains.add(ownerId, grainId, f->workerId, kj::mv(f->worker), f->supervisor);
+        return kj::mv(f->supervisor);
+      } else {
+        return nullptr;
+      }
+    });
+  }
+
+  kj::Promise<sandstorm::Supervisor::Client> continueGrainFromStorage(
+      sandstorm::Backend::StartGrainParams::Reader params) {
+    // Find an existing grain's GrainState in its owner's grain list and continue it. `params`
+    // must remain valid until the returned promise completes.
+
+    sandstorm::SandstormCore::Client core = ({
+      auto req = coreFactory.getSandstormCoreRequest();
+      req.setGrainId(params.getGrainId());
+      req.send().getCore();
+    });
+
+    StorageFactory::Client storageFactory =
+        frontend.chooseStorage(kj::str("user-", params.getOwnerId()))
+        .getFactoryRequest().send().getFactory();
+    Volume::Client packageVolume = loadPackageVolume(params.getPackageId());
+
+    return accountCache.get(kj::str("user-", params.getOwnerId())).then(
+        [this,params,KJ_MVCAP(storageFactory),KJ_MVCAP(packageVolume),KJ_MVCAP(core)]
+        (kj::Own<AssignableCache<AccountStorage>::Entry>&& owner) mutable
+        -> kj::Promise<sandstorm::Supervisor::Client> {
+      auto grainId = params.getGrainId();
+      for (auto grainInfo: owner->getValue().getGrains()) {
+        if (grainInfo.getId() == grainId) {
+          // This is the grain we're looking for.
+          return continueGrain({grainInfo.getState(), kj::mv(storageFactory),
+                  kj::mv(packageVolume), params.getPackageId(), params.getOwnerId(),
+                  grainId, params.getCommand(), kj::mv(core)});
+        }
+      }
+      KJ_FAIL_REQUIRE("no such grain", grainId);
+    });
+  }
+
   struct ContinueParams {
     sandstorm::Assignable<GrainState>::Client grainAssignable;
     StorageFactory::Client storageFactory;
     Volume::Client packageVolume;
     capnp::Text::Reader packageId;
+    capnp::Text::Reader ownerId;
     capnp::Text::Reader grainId;
     sandstorm::spk::Manifest::Command::Reader command;
     sandstorm::SandstormCore::Client core;
   };
 
+  template <typename Request>
+  static void initRestoreGrain(
+      Request& req, ContinueParams& params, GrainState::Reader grainState,
+      sandstorm::Assignable<GrainState>::Setter::Client setter) {
+    auto packageInfo = req.initPackage();
+    // TODO(perf): parse ID hex to bytes? Be sure to update worker.c++ which logs
+    //   id.asChars() in some places.
+    packageInfo.setId(params.packageId.asBytes());
+    packageInfo.setVolume(params.packageVolume);
+    req.setCommand(params.command);
+    req.setStorage(params.storageFactory);
+    req.setGrainState(grainState);
+    req.setExclusiveGrainStateSetter(kj::mv(setter));
+    req.setGrainId(params.grainId);
+    req.setCore(params.core);
+  }
+
+  kj::Promise<sandstorm::Supervisor::Client> finishRestore(
+      kj::Promise<PlacedGrain> promise, ContinueParams params, uint retryCount) {
+    // Start routing to a grain placed by continueGrain(), or retry if placement was disconnected.
+
+    auto ownerId = params.ownerId;
+    auto grainId = params.grainId;
+    return promise.then([this,ownerId,grainId](PlacedGrain&& grain)
+                        -> kj::Promise<sandstorm::Supervisor::Client> {
+      activeGrains.add(ownerId, grainId, grain.workerId, kj::mv(grain.worker), grain.supervisor);
+      return kj::mv(grain.supervisor);
+    }, [this,KJ_MVCAP(params),retryCount](kj::Exception&& exception) mutable
+        -> kj::Promise<sandstorm::Supervisor::Client> {
+      if (exception.getType() != kj::Exception::Type::DISCONNECTED) {
+        return kj::mv(exception);
+      }
+
+      // Disconnected exception, presumably because the grain state assignable was concurrently
+      // modified, or because the coordinator is down. Retry.
+      KJ_LOG(INFO, "RARE: restoreGrain() threw DISCONNECTED, probably due to concurrent "
+                   "calls; retrying", retryCount);
+      return continueGrain(kj::mv(params), retryCount + 1);
+    });
+  }
+
   kj::Promise<sandstorm::Supervisor::Client> continueGrain(
       ContinueParams params, uint retryCount = 0) {
     // Try to continue a grain that already exists. Called as part of startGrain() but may recurse.
@@ -722,107 +1017,81 @@ private:
 
       switch (grainState.which()) {
         case GrainState::INACTIVE: {
-          // Grain is not running. Start it.
-
-          Worker::Client worker = frontend.workers->chooseOne();
-
-          auto req = worker.restoreGrainRequest();
-          auto packageInfo = req.initPackage();
-          // TODO(perf): parse ID hex to bytes? Be sure to update worker.c++ which logs
-          //   id.asChars() in some places.
-          packageInfo.setId(params.packageId.asBytes());
-          packageInfo.setVolume(params.packageVolume);
-          req.setCommand(params.command);
-          req.setStorage(params.storageFactory);
-          req.setGrainState(grainState);
-          req.setExclusiveGrainStateSetter(grainGetResult.getSetter());
-          req.setGrainId(params.grainId);
-          req.setCore(params.core);
-
-          return req.send()
-              .then([](auto&& response) -> kj::Promise<sandstorm::Supervisor::Client> {
-            return response.getGrain();
-          }, [this,KJ_MVCAP(params),retryCount](kj::Exception&& exception) mutable
-              -> kj::Promise<sandstorm::Supervisor::Client> {
-            if (exception.getType() != kj::Exception::Type::DISCONNECTED) {
-              return kj::mv(exception);
-            }
+          // Grain is not running. Have the coordinator start it, unless there's none reachable or
+          // this is a retry, which may mean that the coordinator failed.
+          if (retryCount == 0 && haveCoordinator()) {
+            auto req = frontend.coordinators->chooseOne(params.grainId.asBytes())
+                .restoreGrainRequest();
+            initRestoreGrain(req, params, grainState, grainGetResult.getSetter());
+            req.setOwnerId(params.ownerId);
+            auto promise = req.send().then([](auto&& response) {
+              auto location = response.getLocation();
+              return PlacedGrain { response.getGrain(), nullptr,
+                                   location.getWorkerId(), location.getWorker() };
+            });
+            return finishRestore(kj::mv(promise), kj::mv(params), retryCount);
+          }
 
-            // Disconnected exception, presumably because the grain state assignable was
-            // concurrently modified. Retry.
-            KJ_LOG(INFO, "RARE: restoreGrain() threw DISCONNECTED, probably due to concurrent "
-                         "calls; retrying", retryCount);
-            return continueGrain(kj::mv(params), retryCount + 1);
+          // Not retried on other workers; see CoordinatorImpl::restoreGrain().
+          auto packageId = params.packageId;
+          return frontend.workers->choose(packageId.asBytes())
+              .then([this,KJ_MVCAP(params),KJ_MVCAP(grainGetResult),retryCount]
+                    (BackendSetImpl<Worker>::Choice&& worker) mutable {
+            auto req = worker.client.restoreGrainRequest();
+            initRestoreGrain(req, params, grainGetResult.getValue(), grainGetResult.getSetter());
+            auto promise = req.send().then([KJ_MVCAP(worker)](auto&& response) mutable {
+              return PlacedGrain { response.getGrain(), nullptr, worker.id, kj::mv(worker.client) };
+            });
+            return finishRestore(kj::mv(promise), kj::mv(params), retryCount);
           });
         }
 
         case GrainState::ACTIVE: {
-          // Attempt to keep-alive the old supervisor.
-          auto supervisor = grainState.getActive();
-          auto keepAliveReq = supervisor.keepAliveRequest();
-          keepAliveReq.setCore(params.core);
-          auto promise = timer.timeoutAfter(4 * kj::SECONDS, keepAliveReq.send());
-          return promise.then([KJ_MVCAP(supervisor)](auto&&) mutable
+          // Find the worker running the grain, so that we can route to it.
+          auto promise = findOnWorkers(params.ownerId, params.grainId, params.core);
+          return promise.then(
+              [this,KJ_MVCAP(params),KJ_MVCAP(grainGetResult),grainState,retryCount]
+              (kj::Maybe<sandstorm::Supervisor::Client>&& found) mutable
               -> kj::Promise<sandstorm::Supervisor::Client> {
-            // Keep-alive succeeded. Use existing supervisor.
-            return kj::mv(supervisor);
-          }, [this,KJ_MVCAP(params),KJ_MVCAP(grainGetResult),grainState,retryCount]
-             (kj::Exception&& e) mutable
-              -> kj::Promise<sandstorm::Supervisor::Client> {
-            // Keep-alive failed. Possibilities:
-            // 1. The grain is in the midst of shutting down. The supervisor has already exited
-            //    but we're still waiting for clean unmount. We should pause for a short time to
-            //    give it a chance to clean up.
-            // 2. The worker died while the grain was running and as a result never managed to
-            //    update the grain state to reflect that it is no longer live. We can simply take
-            //    ownership.
-            // 3. The worker is unhealthy but still executing. This state is dangerous, since we
-            //    cannot support concurrent access to the same underlying volume. Luckily each
-            //    grain takes out an "exclusive" Volume capability which will disconnect itself
-            //    the moment we attempt to take over. We may lose some data that was not yet
-            //    written, but given that the worker appears unhealthy that data was probably
-            //    in bad shape already.
-            //
-            // To cover all cases, waiting a few seconds should be sufficient.
-            //
-            // TODO(integrity): We could handle case (1) more precisely by observing the GrainState,
-            //   waiting for the previous worker to set it to `inactive`. Then we could pause much
-            //   longer, so that we don't interrupt an unmount that has a lot of data to flush.
-            //   This should be exceedingly rare, though. In fact, this whole branch is rare.
-            KJ_LOG(INFO, "RARE: (startGrain) GrainState is active, but supervisor appears dead.",
-                   params.grainId, e);
-
-            return timer.afterDelay(4 * kj::SECONDS)
-                .then([KJ_MVCAP(grainGetResult),grainState]() {
-              // OK, a few seconds have gone by. Let's attempt to switch this grain's state to
-              // "inactive".
-              auto setter = grainGetResult.getSetter();
-              auto sizeHint = grainState.totalSize();
-              sizeHint.wordCount += 16;
-              auto req = setter.setRequest(sizeHint);
-              req.setValue(grainState);
-
-              // TODO(cleanup): Calling setInactive() doesn't actually remove the `active` pointer;
-              //   it just sets the union discriminant to "inactive". Unfortunately the storage
-              //   server just sees the pointers. Is this a bug in Cap'n Proto? It seems
-              //   challenging to fix, except perhaps by introducing the native-mutable-objects
-              //   idea.
-              req.getValue().disownActive();
-
-              req.getValue().setInactive();
-              return req.send().then([](auto) -> kj::Promise<void> {
-                // successfully updated
+            KJ_IF_MAYBE(supervisor, found) {
+              return kj::mv(*supervisor);
+            }
+
+            // No worker is running the grain, or has it shutting down. Either its worker died
+            // while the grain was running, and so never updated the GrainState, or the worker is
+            // unreachable. We can simply take ownership. If the worker is in fact still executing,
+            // the grain's "exclusive" Volume capability will disconnect the moment we take over.
+            // We may lose some data that was not yet written, but given that the worker appears
+            // unhealthy that data was probably in bad shape already.
+            KJ_LOG(INFO, "RARE: (startGrain) GrainState is active, but no worker is running the "
+                         "grain.", params.grainId);
+
+            auto setter = grainGetResult.getSetter();
+            auto sizeHint = grainState.totalSize();
+            sizeHint.wordCount += 16;
+            auto req = setter.setRequest(sizeHint);
+            req.setValue(grainState);
+
+            // TODO(cleanup): Calling setInactive() doesn't actually remove the `active` pointer;
+            //   it just sets the union discriminant to "inactive". Unfortunately the storage
+            //   server just sees the pointers. Is this a bug in Cap'n Proto? It seems
+            //   challenging to fix, except perhaps by introducing the native-mutable-objects
+            //   idea.
+            req.getValue().disownActive();
+
+            req.getValue().setInactive();
+            return req.send().then([](auto) -> kj::Promise<void> {
+              // successfully updated
+              return kj::READY_NOW;
+            }, [](kj::Exception&& e) -> kj::Promise<void> {
+              if (e.getType() == kj::Exception::Type::DISCONNECTED) {
+                // Concurrent modification blocked our update. That's fine, we were about to
+                // start over anyway.
                 return kj::READY_NOW;
-              }, [](kj::Exception&& e) -> kj::Promise<void> {
-                if (e.getType() == kj::Exception::Type::DISCONNECTED) {
-                  // Concurrent modification blocked our update. That's fine, we were about to
-                  // start over anyway.
-                  return kj::READY_NOW;
-                } else {
-                  // Other exception.
-                  return kj::mv(e);
-                }
-              });
+              } else {
+                // Other exception.
+                return kj::mv(e);
+              }
             }).then([this,KJ_MVCAP(params),retryCount]() mutable {
               // OK, try again now.
               return continueGrain(kj::mv(params), retryCount + 1);
@@ -835,6 +1104,308 @@ private:
   }
 };
 
+constexpr kj::Duration FrontendImpl::BackendImpl::GRAIN_KEEPALIVE_INTERVAL;
+constexpr kj::Duration FrontendImpl::BackendImpl::FIND_GRAIN_TIMEOUT;
+
+// =======================================================================================
+
+static constexpr kj::Duration GRAIN_ALIVE_TTL = 30 * kj::SECONDS;
+// Entries unused for this long are dropped, since nothing has kept their grains alive.
+static constexpr kj::Duration GRAIN_KEEPALIVE_TIMEOUT = 8 * kj::SECONDS;
+
+struct ActiveGrainTable::WatcherTarget: public kj::Refcounted {
+  kj::Maybe<ActiveGrainTable&> table;
+  explicit WatcherTarget(ActiveGrainTable& table): table(table) {}
+};
+
+class ActiveGrainTable::WatcherImpl final: public Worker::GrainWatcher::Server {
+public:
+  WatcherImpl(kj::Own<WatcherTarget> target, uint64_t workerId, uint watcherNumber)
+      : target(kj::mv(target)), workerId(workerId), watcherNumber(watcherNumber) {}
+
+  ~WatcherImpl() noexcept(false) {
+    // The worker stopped reporting exits, so we can no longer trust our entries for it.
+    KJ_IF_MAYBE(table, target->table) {
+      table->watcherDropped(workerId, watcherNumber);
+    }
+  }
+
+protected:
+  kj::Promise<void> exited(ExitedContext context) override {
+    KJ_IF_MAYBE(table, target->table) {
+      table->exited(workerId, context.getParams().getGrainId());
+      return kj::READY_NOW;
+    } else {
+      // Tell the worker to stop reporting.
+      return KJ_EXCEPTION(DISCONNECTED, "front-end has shut down");
+    }
+  }
+
+private:
+  kj::Own<WatcherTarget> target;
+  uint64_t workerId;
+  uint watcherNumber;
+};
+
+ActiveGrainTable::ActiveGrainTable(kj::Timer& timer)
+    : timer(timer), watcherTarget(kj::refcounted<WatcherTarget>(*this)), tasks(*this) {}
+
+ActiveGrainTable::~ActiveGrainTable() noexcept(false) {
+  watcherTarget->table = nullptr;
+}
+
+kj::Maybe<sandstorm::Supervisor::Client> ActiveGrainTable::find(
+    kj::StringPtr ownerId, kj::StringPtr grainId) {
+  auto iter = grains.find(grainId);
+  if (iter == grains.end() || iter->second.ownerId != ownerId ||
+      timer.now() - iter->second.lastAlive > GRAIN_ALIVE_TTL) {
+    return nullptr;
+  }
+  iter->second.used = true;
+  return iter->second.supervisor;
+}
+
+void ActiveGrainTable::add(
+    kj::StringPtr ownerId, kj::StringPtr grainId, uint64_t workerId,
+    Worker::Client worker, sandstorm::Supervisor::Client supervisor) {
+  if (workers.find(workerId) == workers.end()) {
+    uint watcherNumber = watcherCounter++;
+    auto req = worker.watchGrainsRequest();
+    req.setWatcher(kj::heap<WatcherImpl>(kj::addRef(*watcherTarget), workerId, watcherNumber));
+    tasks.add(req.send().then([](auto&&) {}, [this,workerId,watcherNumber](kj::Exception&& e) {
+      // Without exit reports our entries could go stale unnoticed.
+      KJ_LOG(INFO, "watchGrains() failed; forgetting worker's grains", workerId, e);
+      watcherDropped(workerId, watcherNumber);
+    }));
+    workers.insert(std::make_pair(workerId, GrainWorker { kj::mv(worker), watcherNumber }));
+  }
+
+  grains.erase(grainId);
+  auto ownGrainId = kj::heapString(grainId);
+  kj::StringPtr key = ownGrainId;
+  grains.insert(std::make_pair(key, Grain {
+      kj::mv(ownGrainId), kj::heapString(ownerId), kj::mv(supervisor),
+      workerId, timer.now(), false }));
+}
+
+kj::Promise<void> ActiveGrainTable::keepAlive() {
+  auto now = timer.now();
+
+  std::map<uint64_t, kj::Vector<kj::StringPtr>> batches;
+  for (auto iter = grains.begin(); iter != grains.end();) {
+    auto& grain = iter->second;
+    if (grain.used) {
+      grain.used = false;
+      batches[grain.workerId].add(grain.grainId);
+      ++iter;
+    } else if (now - grain.lastAlive > GRAIN_ALIVE_TTL) {
+      iter = grains.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+
+  auto promises = kj::heapArrayBuilder<kj::Promise<void>>(batches.size());
+  for (auto& batch: batches) {
+    uint64_t workerId = batch.first;
+    auto worker = workers.find(workerId);
+    KJ_ASSERT(worker != workers.end());
+
+    auto req = worker->second.client.keepAliveGrainsRequest();
+    auto list = req.initGrainIds(batch.second.size());
+    for (auto i: kj::indices(batch.second)) {
+      list.set(i, batch.second[i]);
+    }
+    auto grainIds = KJ_MAP(grainId, batch.second) { return kj::heapString(grainId); };
+
+    promises.add(timer.timeoutAfter(GRAIN_KEEPALIVE_TIMEOUT, req.send())
+        .then([this,workerId,now,KJ_MVCAP(grainIds)](auto&& response) {
+      auto running = response.getRunning();
+      for (auto i: kj::indices(grainIds)) {
+        auto iter = grains.find(grainIds[i]);
+        if (iter == grains.end() || iter->second.workerId != workerId) {
+          // Exited or restarted elsewhere in the meantime.
+          continue;
+        }
+        if (i < running.size() && running[i]) {
+          iter->second.lastAlive = now;
+        } else {
+          grains.erase(iter);
+        }
+      }
+    }, [this,workerId](kj::Exception&& exception) {
+      // The worker is probably gone. Its grains will be looked up in storage next time.
+      KJ_LOG(INFO, "keepAliveGrains() failed; forgetting worker's grains", workerId, exception);
+      forgetWorker(workerId);
+    }));
+  }
+
+  return kj::joinPromises(promises.finish());
+}
+
+void ActiveGrainTable::exited(uint64_t workerId, kj::StringPtr grainId) {
+  auto iter = grains.find(grainId);
+  if (iter != grains.end() && iter->second.workerId == workerId) {
+    grains.erase(iter);
+  }
+}
+
+void ActiveGrainTable::watcherDropped(uint64_t workerId, uint watcherNumber) {
+  auto iter = workers.find(workerId);
+  if (iter != workers.end() && iter->second.watcherNumber == watcherNumber) {
+    forgetWorker(workerId);
+  }
+}
+
+void ActiveGrainTable::forgetWorker(uint64_t workerId) {
+  for (auto iter = grains.begin(); iter != grains.end();) {
+    if (iter->second.workerId == workerId) {
+      iter = grains.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+
+  auto iter = workers.find(workerId);
+  if (iter != workers.end()) {
+    // Releasing the worker may release our watcher, which calls back into watcherDropped(), so
+    // only do so once the maps are consistent.
+    auto worker = kj::mv(iter->second.client);
+    workers.erase(iter);
+  }
+}
+
+void ActiveGrainTable::taskFailed(kj::Exception&& exception) {
+  KJ_LOG(ERROR, exception);
+}
+
+// =======================================================================================
+
+static constexpr size_t STORAGE_USAGE_BATCH_SIZE = 1024;
+// Most root names to send in one StorageRootSet.getStorageUsage() call.
+
+StorageUsageBatcher::StorageUsageBatcher(
+    BackendSetImpl<StorageRootSet>& storageRoots, uint storageCount)
+    : storageRoots(storageRoots), storageCount(storageCount), tasks(*this) {}
+
+kj::Promise<uint64_t> StorageUsageBatcher::getStorageUsage(kj::String rootName) {
+  uint64_t shardId = BackendSetBase::shardFor(storageShardKey(rootName).asBytes(), storageCount);
+  auto& shard = shards[shardId];
+
+  auto paf = kj::newPromiseAndFulfiller<uint64_t>();
+  shard.names.add(kj::mv(rootName));
+  shard.fulfillers.add(kj::mv(paf.fulfiller));
+
+  if (!shard.sending) {
+    // Wait for the rest of this turn's queries before sending.
+    shard.sending = true;
+    tasks.add(kj::evalLater([this,shardId]() { return send(shardId); }));
+  }
+
+  return kj::mv(paf.promise);
+}
+
+kj::Promise<void> StorageUsageBatcher::send(uint64_t shardId) {
+  auto& shard = shards[shardId];
+  if (shard.names.empty()) {
+    shard.sending = false;
+    return kj::READY_NOW;
+  }
+
+  size_t count = kj::min(shard.names.size(), STORAGE_USAGE_BATCH_SIZE);
+  auto names = kj::heapArray<kj::String>(count);
+  auto fulfillers = kj::heapArray<kj::Own<kj::PromiseFulfiller<uint64_t>>>(count);
+  for (auto i: kj::indices(names)) {
+    names[i] = kj::mv(shard.names[i]);
+    fulfillers[i] = kj::mv(shard.fulfillers[i]);
+  }
+  {
+    kj::Vector<kj::String> remainingNames;
+    kj::Vector<kj::Own<kj::PromiseFulfiller<uint64_t>>> remainingFulfillers;
+    for (size_t i = count; i < shard.names.size(); i++) {
+      remainingNames.add(kj::mv(shard.names[i]));
+      remainingFulfillers.add(kj::mv(shard.fulfillers[i]));
+    }
+    shard.names = kj::mv(remainingNames);
+    shard.fulfillers = kj::mv(remainingFulfillers);
+  }
+
+  auto req = storageRoots.chooseShard(storageShardKey(names[0]).asBytes(), storageCount)
+      .getStorageUsageRequest();
+  auto list = req.initNames(names.size());
+  for (auto i: kj::indices(names)) {
+    list.set(i, names[i]);
+  }
+
+  kj::ArrayPtr<kj::Own<kj::PromiseFulfiller<uint64_t>>> fulfillersPtr = fulfillers;
+  return req.send().then([fulfillersPtr](auto&& response) {
+    auto totals = response.getTotalBytes();
+    KJ_ASSERT(totals.size() == fulfillersPtr.size(), "storage returned wrong number of sizes");
+    for (auto i: kj::indices(fulfillersPtr)) {
+      fulfillersPtr[i]->fulfill(uint64_t(totals[i]));
+    }
+  }).catch_([fulfillersPtr](kj::Exception&& exception) {
+    for (auto& fulfiller: fulfillersPtr) {
+      fulfiller->reject(kj::Exception(exception));
+    }
+  }).attach(kj::mv(fulfillers)).then([this,shardId]() {
+    return send(shardId);
+  });
+}
+
+void StorageUsageBatcher::taskFailed(kj::Exception&& exception) {
+  KJ_LOG(ERROR, exception);
+}
+
+// =======================================================================================
+
+static constexpr uint BACKUP_WRITES_IN_FLIGHT = 16;
+// Most backup chunks forwarded to storage and not yet acknowledged before write() pushes back.
+
+BackupUploadStream::BackupUploadStream(StorageRootSet::Client storage, kj::String name,
+                                       OwnedBlob::Client blob, sandstorm::ByteStream::Client inner)
+    : storage(kj::mv(storage)), name(kj::mv(name)), blob(kj::mv(blob)), inner(kj::mv(inner)) {}
+
+kj::Promise<void> BackupUploadStream::write(WriteContext context) {
+  auto params = context.getParams();
+  auto req = inner.writeRequest(params.totalSize());
+  req.setData(params.getData());
+  context.releaseParams();
+  inFlight.push(req.send().then([](auto&&) {}));
+
+  if (inFlight.size() > BACKUP_WRITES_IN_FLIGHT) {
+    auto oldest = kj::mv(inFlight.front());
+    inFlight.pop();
+    return kj::mv(oldest);
+  } else {
+    return kj::READY_NOW;
+  }
+}
+
+kj::Promise<void> BackupUploadStream::done(DoneContext context) {
+  auto builder = kj::heapArrayBuilder<kj::Promise<void>>(inFlight.size());
+  while (!inFlight.empty()) {
+    builder.add(kj::mv(inFlight.front()));
+    inFlight.pop();
+  }
+
+  return kj::joinPromises(builder.finish()).then([this]() {
+    return inner.doneRequest().send();
+  }).then([this](auto&&) {
+    auto req = storage.setRequest<sandstorm::Blob>();
+    req.setName(name);
+    req.setObject(blob);
+    return req.send().ignoreResult();
+  });
+}
+
+kj::Promise<void> BackupUploadStream::expectSize(ExpectSizeContext context) {
+  auto params = context.getParams();
+  auto req = inner.expectSizeRequest(params.totalSize());
+  req.setSize(params.getSize());
+  return context.tailCall(kj::mv(req));
+}
+
 // =======================================================================================
 
 struct FrontendImpl::MongoInfo {
@@ -854,15 +1425,18 @@ struct FrontendImpl::MongoInfo {
 
 FrontendImpl::FrontendImpl(kj::Network& network, kj::Timer& timer,
                            sandstorm::SubprocessSet& subprocessSet,
-                           FrontendConfig::Reader config, uint replicaNumber,
+                           FrontendConfig::Reader config, uint replicaNumber, uint storageCount,
                            kj::PromiseFulfillerPair<sandstorm::Backend::Client> paf)
     : timer(timer),
       subprocessSet(subprocessSet),
       capnpServer(kj::mv(paf.promise)),
-      storageRoots(kj::refcounted<BackendSetImpl<StorageRootSet>>()),
-      storageFactories(kj::refcounted<BackendSetImpl<StorageFactory>>()),
-      workers(kj::refcounted<BackendSetImpl<Worker>>()),
-      mongos(kj::refcounted<BackendSetImpl<Mongo>>()),
+      storageRoots(kj::refcounted<BackendSetImpl<StorageRootSet>>(timer)),
+      storageFactories(kj::refcounted<BackendSetImpl<StorageFactory>>(timer)),
+      workers(kj::refcounted<BackendSetImpl<Worker>>(timer, BackendSetBase::Policy::WEIGHTED)),
+      mongos(kj::refcounted<BackendSetImpl<Mongo>>(timer)),
+      coordinators(kj::refcounted<BackendSetImpl<Coordinator>>(timer)),
+      storageCount(storageCount),
+      storageUsage(*storageRoots, storageCount),
       tasks(*this) {
   paf.fulfiller->fulfill(kj::heap<BackendImpl>(*this, timer,
       capnpServer.getBootstrap().castAs<sandstorm::SandstormCoreFactory>()));
@@ -876,7 +1450,10 @@ FrontendImpl::FrontendImpl(kj::Network& network, kj::Timer& timer,
   sandstorm::recursivelyCreateParent(outsideSandboxSocketPath);
   unlink(outsideSandboxSocketPath.cStr());
 
-  auto mongoInfoPromise = mongos->chooseOne().getConnectionInfoRequest().send();
+  auto mongoInfoPromise = mongos->call([](BackendSetImpl<Mongo>::Choice&& mongo)
+      -> kj::Promise<capnp::Response<Mongo::GetConnectionInfoResults>> {
+    return mongo.client.getConnectionInfoRequest().send();
+  });
 
   auto promise = network.parseAddress(kj::str("unix:", outsideSandboxSocketPath));
   tasks.add(promise.then([this,KJ_MVCAP(outsideSandboxSocketPath),KJ_MVCAP(mongoInfoPromise),
@@ -920,6 +1497,20 @@ void FrontendImpl::setConfig(FrontendConfig::Reader config) {
   }
 }
 
+void FrontendImpl::setStorageCount(uint count) {
+  if (count != storageCount) {
+    // Roots only move to their new shards when storage-rebalance runs, which needs the storage
+    // nodes stopped, so they can't have moved yet. Keep using the old count until we restart.
+    KJ_LOG(ERROR, "storage shard count changed while running; ignoring until restart "
+                  "(stop the cluster and run storage-rebalance first)",
+           storageCount, count);
+  }
+}
+
+StorageRootSet::Client FrontendImpl::chooseStorage(kj::StringPtr rootName) {
+  return storageRoots->chooseShard(storageShardKey(rootName).asBytes(), storageCount);
+}
+
 BackendSet<StorageRootSet>::Client FrontendImpl::getStorageRootBackendSet() {
   return kj::addRef(*storageRoots);
 }
@@ -932,6 +1523,18 @@ BackendSet<Worker>::Client FrontendImpl::getWorkerBackendSet() {
 BackendSet<Mongo>::Client FrontendImpl::getMongoBackendSet() {
   return kj::addRef(*mongos);
 }
+BackendSet<Coordinator>::Client FrontendImpl::getCoordinatorBackendSet() {
+  return kj::addRef(*coordinators);
+}
+
+void FrontendImpl::getMetrics(MetricsBuilder& metrics) {
+  metrics.gauge("blackrock_frontend_storage_backends", "Storage shards this front-end can reach.",
+                storageRoots->size());
+  metrics.gauge("blackrock_frontend_worker_backends", "Workers this front-end can reach.",
+                workers->size());
+  metrics.gauge("blackrock_frontend_coordinator_backends",
+                "Coordinators this front-end can reach.", coordinators->size());
+}
 
 static kj::AutoCloseFd raiiSocket(int domain, int type, int protocol) {
   int fd;
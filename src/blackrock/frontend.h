@@ -30,22 +30,311 @@
 #include <capnp/rpc-twoparty.h>
 #include "backend-set.h"
 #include "cluster-rpc.h"
+#include <map>
+#include <kj/vector.h>
+#include <kj/function.h>
+#include <list>
+#include <queue>
 
 namespace blackrock {
 
+class MetricsBuilder;
+
+template <typename T>
+class AssignableCache {
+  // Caches the values of Assignables stored in a StorageRootSet under names like "user-<id>".
+  //
+  // A lookup which hits makes a single getVersion() call on the cached capability, rather than
+  // reopening the object by name and reading its whole value. Only values are cached, not setters:
+  // callers which intend to modify a value must get() it fresh, so that concurrent modifications
+  // are still caught by the setter's optimistic version check.
+
+public:
+  struct Entry: public kj::Refcounted {
+    kj::String name;
+    typename OwnedAssignable<T>::Client object;
+    uint64_t version;
+    capnp::MallocMessageBuilder message;
+    typename std::list<Entry*>::iterator lruPosition;  // valid while cached
+
+    Entry(kj::String name, typename OwnedAssignable<T>::Client object, uint64_t version)
+        : name(kj::mv(name)), object(kj::mv(object)), version(version) {}
+
+    typename T::Reader getValue() { return message.getRoot<T>().asReader(); }
+  };
+
+  explicit AssignableCache(kj::Function<typename OwnedAssignable<T>::Client(kj::StringPtr)> open,
+                           size_t maxEntries = 16384)
+      : open(kj::mv(open)), maxEntries(maxEntries) {}
+  // `open` opens the object with the given name in storage. Once `maxEntries` values are cached,
+  // caching another evicts the least recently used.
+
+  kj::Promise<kj::Own<Entry>> get(kj::StringPtr name) {
+    auto iter = entries.find(name);
+    if (iter == entries.end()) {
+      return fetch(kj::heapString(name), open(name));
+    }
+
+    lru.splice(lru.begin(), lru, iter->second->lruPosition);
+    auto entry = kj::addRef(*iter->second);
+    auto promise = entry->object.getVersionRequest(capnp::MessageSize {4, 0}).send();
+    return promise.then([this,KJ_MVCAP(entry)](auto&& response) mutable
+                        -> kj::Promise<kj::Own<Entry>> {
+      uint64_t version = response.getVersion();
+      if (version == entry->version) {
+        return kj::mv(entry);
+      }
+
+      return fetch(kj::heapString(entry->name), entry->object, version);
+    }, [this,name=kj::heapString(name)](kj::Exception&& e) mutable
+        -> kj::Promise<kj::Own<Entry>> {
+      if (e.getType() != kj::Exception::Type::DISCONNECTED) {
+        return kj::mv(e);
+      }
+
+      // The cached capability broke, probably because storage restarted. Reopen by name.
+      evict(name);
+      auto object = open(name);
+      return fetch(kj::mv(name), kj::mv(object));
+    });
+  }
+
+  size_t size() { return entries.size(); }
+
+private:
+  kj::Function<typename OwnedAssignable<T>::Client(kj::StringPtr)> open;
+  size_t maxEntries;
+  std::map<kj::StringPtr, kj::Own<Entry>> entries;  // keys point into Entry::name
+  std::list<Entry*> lru;  // cached entries, most recently used first
+
+  void evict(kj::StringPtr name) {
+    auto iter = entries.find(name);
+    if (iter != entries.end()) {
+      lru.erase(iter->second->lruPosition);
+      entries.erase(iter);
+    }
+  }
+
+  kj::Promise<kj::Own<Entry>> fetch(kj::String name, typename OwnedAssignable<T>::Client object) {
+    auto version = object.getVersionRequest(capnp::MessageSize {4, 0}).send()
+        .then([](auto&& response) { return response.getVersion(); });
+    return fetch(kj::mv(name), kj::mv(object), kj::mv(version));
+  }
+
+  kj::Promise<kj::Own<Entry>> fetch(kj::String name, typename OwnedAssignable<T>::Client object,
+                                    kj::Promise<uint64_t> version) {
+    // `version` must have been requested before calling this, so that it describes a value no
+    // newer than the one we get() here.
+
+    auto value = object.getRequest().send();
+    return version.then([this,KJ_MVCAP(name),KJ_MVCAP(object),KJ_MVCAP(value)]
+                        (uint64_t version) mutable {
+      return value.then([this,KJ_MVCAP(name),KJ_MVCAP(object),version](auto&& response) mutable {
+        auto entry = kj::refcounted<Entry>(kj::mv(name), kj::mv(object), version);
+        entry->message.setRoot(response.getValue());
+
+        evict(entry->name);
+        if (entries.size() >= maxEntries && !lru.empty()) {
+          evict(lru.back()->name);
+        }
+        lru.push_front(entry.get());
+        entry->lruPosition = lru.begin();
+        entries[entry->name] = kj::addRef(*entry);
+
+        return kj::mv(entry);
+      });
+    });
+  }
+};
+
+template <typename T>
+class InFlightTable {
+  // Operations in progress, keyed by name, so that concurrent requests for the same thing can
+  // share one operation rather than racing each other. An operation keeps running even if every
+  // caller cancels, and leaves the table once it completes or fails.
+
+public:
+  explicit InFlightTable(kj::TaskSet& tasks): tasks(tasks) {}
+
+  kj::Maybe<kj::Promise<T>> find(kj::StringPtr key) {
+    // Joins the operation running under `key`, if any.
+
+    auto iter = entries.find(key);
+    if (iter == entries.end()) {
+      return nullptr;
+    }
+    return iter->second.promise.addBranch();
+  }
+
+  kj::Promise<T> add(kj::StringPtr key, kj::Promise<T> promise) {
+    // Records `promise` as the operation running under `key` and returns a branch of it for the
+    // first caller. `key` must not already be in flight.
+
+    KJ_REQUIRE(entries.count(key) == 0, "operation already in flight", key);
+
+    auto ownKey = kj::heapString(key);
+    auto forked = promise.fork();
+    auto result = forked.addBranch();
+
+    auto remover = [this,keyPtr = kj::StringPtr(ownKey)]() {
+      entries.erase(keyPtr);
+    };
+    tasks.add(forked.addBranch().then([remover](auto&&) { remover(); },
+                                      [remover](kj::Exception&&) { remover(); }));
+
+    kj::StringPtr keyPtr = ownKey;
+    entries.insert(std::make_pair(keyPtr, Entry { kj::mv(ownKey), kj::mv(forked) }));
+    return kj::mv(result);
+  }
+
+  size_t size() { return entries.size(); }
+
+private:
+  struct Entry {
+    kj::String key;
+    kj::ForkedPromise<T> promise;
+  };
+
+  kj::TaskSet& tasks;
+  std::map<kj::StringPtr, Entry> entries;  // keys point into Entry::key
+};
+
+class ActiveGrainTable: private kj::TaskSet::ErrorHandler {
+  // Grains which a front-end started (or found through a coordinator or worker) and believes are
+  // still running, so that repeat opens can be answered without touching storage or the worker.
+  //
+  // Each worker hosting an entry is asked to report grain exits through Worker.watchGrains(). An
+  // entry is dropped when its worker reports that the grain exited, when the worker drops our
+  // watcher (e.g. because it disconnected), when a keep-alive round finds it dead, or when it goes
+  // unused for a while.
+
+public:
+  explicit ActiveGrainTable(kj::Timer& timer);
+  ~ActiveGrainTable() noexcept(false);
+
+  kj::Maybe<sandstorm::Supervisor::Client> find(kj::StringPtr ownerId, kj::StringPtr grainId);
+  // Returns the grain's supervisor if the grain is in the table and belongs to `ownerId`. Marks the
+  // entry as used, so that the next keep-alive round covers it.
+
+  void add(kj::StringPtr ownerId, kj::StringPtr grainId, uint64_t workerId,
+           Worker::Client worker, sandstorm::Supervisor::Client supervisor);
+  // Record that the grain is running on `worker`, whose ID in the front-end's worker BackendSet is
+  // `workerId`.
+
+  kj::Promise<void> keepAlive();
+  // Send one keepAliveGrains() call to each worker covering all of its grains which were used since
+  // the last round, standing in for the keepAlive() that each request would otherwise send, and
+  // drop the ones that aren't running. Unused grains aren't kept alive, so that they can idle out.
+  // Never fails.
+
+private:
+  class WatcherImpl;
+  struct WatcherTarget;
+
+  struct Grain {
+    kj::String grainId;
+    kj::String ownerId;
+    sandstorm::Supervisor::Client supervisor;
+    uint64_t workerId;
+    kj::TimePoint lastAlive;
+    bool used;  // Requested since the last keep-alive round.
+  };
+
+  struct GrainWorker {
+    Worker::Client client;
+    uint watcherNumber;  // Identifies the watcher registered with this worker.
+  };
+
+  kj::Timer& timer;
+  std::map<kj::StringPtr, Grain> grains;  // keyed by grain ID (pointing into the value)
+  std::map<uint64_t, GrainWorker> workers;  // workers hosting entries in `grains`
+  kj::Own<WatcherTarget> watcherTarget;
+  // Shared with the watchers held by workers, which may outlive us.
+  uint watcherCounter = 0;
+  kj::TaskSet tasks;
+
+  void exited(uint64_t workerId, kj::StringPtr grainId);
+  void watcherDropped(uint64_t workerId, uint watcherNumber);
+  void forgetWorker(uint64_t workerId);
+
+  void taskFailed(kj::Exception&& exception) override;
+};
+
+class StorageUsageBatcher: private kj::TaskSet::ErrorHandler {
+  // Answers storage usage queries for root objects, combining those for the same storage shard
+  // into one StorageRootSet.getStorageUsage() call, which storage answers from object metadata
+  // without loading the objects. While a call to a shard is outstanding, further queries for it
+  // wait and go out together in the next, so that a sweep over many users (e.g. for billing)
+  // costs a few large calls rather than a round trip each.
+
+public:
+  StorageUsageBatcher(BackendSetImpl<StorageRootSet>& storageRoots, uint storageCount);
+
+  kj::Promise<uint64_t> getStorageUsage(kj::String rootName);
+  // Bytes used by the named root object and everything it owns, or zero if there's no such root.
+
+private:
+  struct Shard {
+    bool sending = false;
+    kj::Vector<kj::String> names;
+    kj::Vector<kj::Own<kj::PromiseFulfiller<uint64_t>>> fulfillers;
+  };
+
+  BackendSetImpl<StorageRootSet>& storageRoots;
+  uint storageCount;
+  std::map<uint64_t, Shard> shards;
+  kj::TaskSet tasks;
+
+  kj::Promise<void> send(uint64_t shardId);
+
+  void taskFailed(kj::Exception&& exception) override;
+};
+
+class BackupUploadStream: public sandstorm::ByteStream::Server {
+  // The stream returned by Backend.uploadBackup(). Forwards each chunk to the storage blob right
+  // away, but once too many are waiting on storage, write() doesn't return until the oldest is
+  // acknowledged, so that a slow storage server pushes back on the client. The blob is only made
+  // the storage root `name` once done() succeeds, so an abandoned upload is simply
+  // garbage-collected.
+
+public:
+  BackupUploadStream(StorageRootSet::Client storage, kj::String name,
+                     OwnedBlob::Client blob, sandstorm::ByteStream::Client inner);
+  // `inner` is the stream which initializes `blob`.
+
+protected:
+  kj::Promise<void> write(WriteContext context) override;
+  kj::Promise<void> done(DoneContext context) override;
+  kj::Promise<void> expectSize(ExpectSizeContext context) override;
+
+private:
+  StorageRootSet::Client storage;
+  kj::String name;
+  OwnedBlob::Client blob;
+  sandstorm::ByteStream::Client inner;
+  std::queue<kj::Promise<void>> inFlight;
+  // Writes forwarded to `inner` which haven't been waited on yet, oldest first.
+};
+
 class FrontendImpl: public Frontend::Server, private kj::TaskSet::ErrorHandler {
 public:
   FrontendImpl(kj::Network& network, kj::Timer& timer, sandstorm::SubprocessSet& subprocessSet,
-               FrontendConfig::Reader config, uint replicaNumber,
+               FrontendConfig::Reader config, uint replicaNumber, uint storageCount,
                kj::PromiseFulfillerPair<sandstorm::Backend::Client> paf =
                    kj::newPromiseAndFulfiller<sandstorm::Backend::Client>());
 
   void setConfig(FrontendConfig::Reader config);
+  void setStorageCount(uint count);
+  // Logs an error if `count` differs from the count we started with, which we keep using: roots
+  // can't have been rebalanced onto the new shards while we were running.
 
   BackendSet<StorageRootSet>::Client getStorageRootBackendSet();
   BackendSet<StorageFactory>::Client getStorageFactoryBackendSet();
   BackendSet<Worker>::Client getWorkerBackendSet();
   BackendSet<Mongo>::Client getMongoBackendSet();
+  BackendSet<Coordinator>::Client getCoordinatorBackendSet();
+
+  void getMetrics(MetricsBuilder& metrics);
 
 private:
   class BackendImpl;
@@ -61,6 +350,9 @@ private:
   kj::Own<BackendSetImpl<StorageFactory>> storageFactories;
   kj::Own<BackendSetImpl<Worker>> workers;
   kj::Own<BackendSetImpl<Mongo>> mongos;
+  kj::Own<BackendSetImpl<Coordinator>> coordinators;
+  uint storageCount;
+  StorageUsageBatcher storageUsage;
 
   kj::Array<pid_t> frontendPids = 0;
   kj::TaskSet tasks;
@@ -70,6 +362,11 @@ private:
   kj::Promise<void> execLoop(MongoInfo&& mongoInfo, uint replicaNumber,
                              kj::AutoCloseFd&& http, kj::AutoCloseFd&& smtp, pid_t& pid);
 
+  StorageRootSet::Client chooseStorage(kj::StringPtr rootName);
+  // Returns the storage shard holding the root object named `rootName`. Objects which that root
+  // will own must be created with the same shard's factory, since ownership can't cross storage
+  // nodes.
+
   void taskFailed(kj::Exception&& exception) override;
 };
 
@@ -15,6 +15,7 @@
 // limitations under the License.
 
 #include "fs-storage.h"
+#include "backend-set.h"
 #include <kj/test.h>
 #include <sandstorm/util.h>
 #include <stdlib.h>
@@ -25,6 +26,10 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/xattr.h>
+#include <fcntl.h>
+#include <string.h>
+#include <capnp/serialize.h>
 #include "fs-storage-test.capnp.h"
 #undef BLOCK_SIZE
 
@@ -187,6 +192,19 @@ KJ_TEST("use after reload") {
   KJ_EXPECT(root.getStorageUsageRequest().send().wait(env.io.waitScope).getTotalBytes() == 4096*4);
 }
 
+KJ_TEST("batched root storage usage") {
+  StorageTestFixture env;
+
+  auto req = env.storage.getStorageUsageRequest();
+  auto names = req.initNames(2);
+  names.set(0, "root");
+  names.set(1, "no-such-root");
+  auto totals = req.send().wait(env.io.waitScope).getTotalBytes();
+  KJ_ASSERT(totals.size() == 2);
+  KJ_EXPECT(totals[0] == 4096*4);
+  KJ_EXPECT(totals[1] == 0);
+}
+
 // Current state of storage:
 //
 // root = (text = "bar", sub1 = x, sub2 = y)
@@ -640,6 +658,125 @@ KJ_TEST("blob interleaved initialization partial download with expected size") {
   KJ_EXPECT(KJ_ASSERT_NONNULL(stream->expectedSize) == 2);
 }
 
+struct RebalanceTestDir {
+  // A storage directory laid out by hand, as a stopped storage node would leave it, plus an
+  // outbox next to it.
+
+  kj::AutoCloseFd fd;
+  kj::AutoCloseFd mainFd;
+  kj::AutoCloseFd rootsFd;
+  kj::AutoCloseFd outboxFd;
+
+  RebalanceTestDir() {
+    if (faccessat(testTempdir.fd, "rebalance", F_OK, 0) >= 0) {
+      sandstorm::recursivelyDelete(kj::str(TestTempdir::PATH, "/rebalance"));
+    }
+    KJ_SYSCALL(mkdirat(testTempdir.fd, "rebalance", 0777));
+    fd = sandstorm::raiiOpenAt(testTempdir.fd, "rebalance", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    KJ_SYSCALL(mkdirat(fd, "main", 0777));
+    KJ_SYSCALL(mkdirat(fd, "roots", 0777));
+    KJ_SYSCALL(mkdirat(fd, "outbox", 0777));
+    mainFd = sandstorm::raiiOpenAt(fd, "main", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    rootsFd = sandstorm::raiiOpenAt(fd, "roots", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    outboxFd = sandstorm::raiiOpenAt(fd, "outbox", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  }
+
+  FilesystemStorage::ObjectId addObject(
+      FilesystemStorage::ObjectKey& key, FilesystemStorage::Type type,
+      kj::ArrayPtr<const FilesystemStorage::ObjectId> children = nullptr) {
+    key = FilesystemStorage::ObjectKey::generate();
+    FilesystemStorage::ObjectId id(key);
+    auto file = sandstorm::raiiOpenAt(mainFd, id.filename('o').begin(),
+                                      O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+
+    FilesystemStorage::Xattr xattr;
+    memset(&xattr, 0, sizeof(xattr));
+    xattr.type = type;
+    KJ_SYSCALL(fsetxattr(file, FilesystemStorage::Xattr::NAME, &xattr, sizeof(xattr), 0));
+
+    if (FilesystemStorage::isStoredObjectType(type)) {
+      capnp::MallocMessageBuilder message;
+      auto list = message.initRoot<StoredChildIds>().initChildren(children.size());
+      for (auto i: kj::indices(children)) {
+        children[i].copyTo(list[i]);
+      }
+      capnp::writeMessageToFd(file, message);
+    }
+    return id;
+  }
+
+  kj::Array<FilesystemStorage::ObjectId> addRoot(kj::StringPtr name) {
+    // Adds an assignable root owning one blob. Returns both objects' IDs.
+
+    FilesystemStorage::ObjectKey blobKey;
+    auto blob = addObject(blobKey, FilesystemStorage::Type::BLOB);
+    FilesystemStorage::ObjectKey rootKey;
+    auto root = addObject(rootKey, FilesystemStorage::Type::ASSIGNABLE, kj::arrayPtr(&blob, 1));
+
+    capnp::MallocMessageBuilder message;
+    rootKey.copyTo(message.initRoot<StoredRoot>().initKey());
+    capnp::writeMessageToFd(sandstorm::raiiOpenAt(rootsFd, name,
+        O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600), message);
+    return kj::heapArray<FilesystemStorage::ObjectId>({root, blob});
+  }
+
+  bool has(kj::StringPtr path) {
+    return faccessat(fd, path.cStr(), F_OK, 0) >= 0;
+  }
+};
+
+KJ_TEST("rebalance moves roots to the shards the frontend will look on") {
+  RebalanceTestDir dir;
+
+  // Going from one shard to four.
+  const kj::StringPtr NAMES[] = {
+    "user-alice", "user-bob", "user-carol", "user-dave", "grain-1", "grain-2", "backup-3",
+    "package-aaaa", "package-bbbb", "package-cccc", "package-dddd", "package-eeee",
+  };
+  auto names = kj::arrayPtr(NAMES, kj::size(NAMES));
+  auto objects = KJ_MAP(name, names) { return dir.addRoot(name); };
+
+  kj::Vector<kj::String> reported;
+  auto counts = rebalanceStorage(dir.fd, 0, 4, dir.outboxFd.get(),
+      [&](kj::StringPtr name, uint64_t shard, size_t objectCount) {
+    KJ_EXPECT(objectCount == 2, name);
+    reported.add(kj::str(name));
+  });
+  KJ_EXPECT(counts.roots == reported.size());
+  KJ_EXPECT(counts.objects == reported.size() * 2);
+  KJ_EXPECT(counts.roots > 0);
+
+  uint64_t packageShard = BackendSetBase::shardFor(kj::StringPtr("package").asBytes(), 4);
+  for (auto i: kj::indices(names)) {
+    uint64_t shard = BackendSetBase::shardFor(storageShardKey(names[i]).asBytes(), 4);
+    if (names[i].startsWith("package-")) {
+      // All packages stay together, wherever their own IDs would hash.
+      KJ_EXPECT(shard == packageShard);
+    }
+
+    auto root = kj::str("roots/", names[i]);
+    auto moved = kj::str("outbox/", shard, "/roots/", names[i]);
+    KJ_EXPECT(dir.has(root) == (shard == 0), names[i]);
+    KJ_EXPECT(dir.has(moved) == (shard != 0), names[i]);
+    for (auto& id: objects[i]) {
+      auto filename = id.filename('o');
+      KJ_EXPECT(dir.has(kj::str("main/", filename.begin())) == (shard == 0), names[i]);
+      KJ_EXPECT(dir.has(kj::str("outbox/", shard, "/main/", filename.begin())) == (shard != 0),
+                names[i]);
+    }
+  }
+
+  // Nothing is left to move, and a dry run only reports.
+  KJ_EXPECT(rebalanceStorage(dir.fd, 0, 4, dir.outboxFd.get(),
+      [](kj::StringPtr, uint64_t, size_t) {}).roots == 0);
+  rebalanceStorage(dir.fd, 0, 8, nullptr, [](kj::StringPtr, uint64_t, size_t) {});
+  for (auto name: names) {
+    if (BackendSetBase::shardFor(storageShardKey(name).asBytes(), 4) == 0) {
+      KJ_EXPECT(dir.has(kj::str("roots/", name)), name);
+    }
+  }
+}
+
 // TODO(test): journal recovery
 // TODO(test): recursive delete
 // TODO(test): volumes
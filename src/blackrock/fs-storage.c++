@@ -15,6 +15,8 @@
 // limitations under the License.
 
 #include "fs-storage.h"
+#include "metrics.h"
+#include "backend-set.h"
 #include <kj/debug.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -195,48 +197,6 @@ kj::FixedArray<char, 24> FilesystemStorage::ObjectId::filename(char prefix) cons
   return result;
 }
 
-enum class FilesystemStorage::Type: uint8_t {
-  // (zero skipped to help detect errors)
-  BLOB = 1,
-  VOLUME,
-  IMMUTABLE,
-  ASSIGNABLE,
-  COLLECTION,
-  OPAQUE,
-  REFERENCE
-};
-
-struct FilesystemStorage::Xattr {
-  // Format of the xattr block stored on each file. On ext4 we have about 76 bytes available in
-  // the inode to store this attribute, but in theory this space could get smaller in the future,
-  // so we should try to keep this minimal.
-
-  static constexpr const char* NAME = "user.sandstor";
-  // Extended attribute name. Abbreviated to be 8 bytes to avoid losing space to alignment (ext4
-  // doesn't store the "user." prefix). Actually short for "sandstore", not "sandstorm". :)
-
-  Type type;
-
-  bool readOnly;
-  // For volumes, prevents the volume from being modified. For Blobs, indicates that initialization
-  // has completed with a `done()` call, indicating the entire stream was received (otherwise,
-  // either the stream is still uploading, or it failed to fully upload). Once set this
-  // can never be unset.
-
-  byte reserved[2];
-  // Must be zero.
-
-  uint32_t accountedBlockCount;
-  // The number of 4k blocks consumed by this object the last time we considered it for
-  // accounting/quota purposes. The on-disk size could have changed in the meantime.
-
-  uint64_t transitiveBlockCount;
-  // The number of 4k blocks in this object and all child objects.
-
-  ObjectId owner;
-  // What object owns this one?
-};
-
 class FilesystemStorage::DeathRow {
 public:
   explicit DeathRow(FilesystemStorage& storage)
@@ -368,6 +328,15 @@ public:
     return storage.createTempFile();
   }
 
+  void getMetrics(MetricsBuilder& metrics) {
+    metrics.gauge("blackrock_storage_journal_unsynced_bytes",
+                  "Journal bytes written but not yet synced to disk.", journalEnd - journalSynced);
+    metrics.gauge("blackrock_storage_journal_unexecuted_bytes",
+                  "Journal bytes not yet applied to the main store.", journalEnd - journalExecuted);
+    metrics.gauge("blackrock_storage_journal_cached_objects",
+                  "Objects with journaled changes not yet applied.", cache.size());
+  }
+
   class Transaction: private kj::ExceptionCallback {
   public:
     explicit Transaction(Journal& journal): journal(journal) {
@@ -1560,9 +1529,26 @@ public:
     return kj::READY_NOW;
   }
 
+  kj::Promise<void> getVersion(GetVersionContext context) override {
+    context.releaseParams();
+    context.getResults(capnp::MessageSize { 4, 0 })
+        .setVersion(static_cast<uint64_t>(incarnation) << 32 | version);
+    return kj::READY_NOW;
+  }
+
 private:
   uint version = 1;
 
+  uint32_t incarnation = randomIncarnation();
+  // `version` starts over at 1 each time the object is loaded from disk, so getVersion() also
+  // reports this random per-load number to keep versions from repeating.
+
+  static uint32_t randomIncarnation() {
+    uint32_t result;
+    randombytes_buf(&result, sizeof(result));
+    return result;
+  }
+
   class SetterImpl: public sandstorm::Assignable<>::Setter::Server {
   public:
     SetterImpl(AssignableImpl& object, capnp::Capability::Client client, uint expectedVersion = 0)
@@ -1672,9 +1658,10 @@ public:
         }
       });
 
-      return sizeHintPromise.exclusiveJoin(writeLoop(offset, kj::mv(target)));
+      return sizeHintPromise.exclusiveJoin(
+          writeLoop(offset, kj::mv(target), kj::heap<std::queue<kj::Promise<void>>>()));
     } else {
-      return writeLoop(offset, kj::mv(target));
+      return writeLoop(offset, kj::mv(target), kj::heap<std::queue<kj::Promise<void>>>());
     }
   }
 
@@ -1820,7 +1807,20 @@ private:
 
   kj::Maybe<Initializer&> currentInitializer;
 
-  kj::Promise<void> writeLoop(uint64_t offset, sandstorm::ByteStream::Client target) {
+  static constexpr uint MAX_WRITES_IN_FLIGHT = 16;
+  // How many 8k chunks writeLoop() sends before waiting for the oldest to be acknowledged. Enough
+  // to fill the pipe on a typical link without letting a slow reader make us buffer much.
+
+  kj::Promise<void> writeLoop(uint64_t offset, sandstorm::ByteStream::Client target,
+                              kj::Own<std::queue<kj::Promise<void>>> inFlight) {
+    if (inFlight->size() >= MAX_WRITES_IN_FLIGHT) {
+      auto oldest = kj::mv(inFlight->front());
+      inFlight->pop();
+      return oldest.then([this,offset,KJ_MVCAP(target),KJ_MVCAP(inFlight)]() mutable {
+        return writeLoop(offset, kj::mv(target), kj::mv(inFlight));
+      });
+    }
+
     int fd = openRaw();
 
     auto req = target.writeRequest(capnp::MessageSize { 2052, 0 });
@@ -1836,21 +1836,28 @@ private:
       }
       req.adoptData(kj::mv(orphan));
       offset += n;
-      // TODO(perf): flow control / parallel writes
-      return req.send().then([this,offset,KJ_MVCAP(target)](auto&&) mutable {
-        return writeLoop(offset, kj::mv(target));
+      inFlight->push(req.send().then([](auto&&) {}));
+      return kj::evalLater([this,offset,KJ_MVCAP(target),KJ_MVCAP(inFlight)]() mutable {
+        return writeLoop(offset, kj::mv(target), kj::mv(inFlight));
       });
     } else if (getXattrRef().readOnly) {
-      // EOF, and file is finalized.
-      return target.doneRequest().send().then([](auto&&) {});
+      // EOF, and file is finalized. Make sure every write succeeded before calling done().
+      auto builder = kj::heapArrayBuilder<kj::Promise<void>>(inFlight->size());
+      while (!inFlight->empty()) {
+        builder.add(kj::mv(inFlight->front()));
+        inFlight->pop();
+      }
+      return kj::joinPromises(builder.finish()).then([KJ_MVCAP(target)]() mutable {
+        return target.doneRequest().send().then([](auto&&) {});
+      });
     } else KJ_IF_MAYBE(i, currentInitializer) {
       // Still uploading. Wait for more data to be available.
       //
       // Note that we don't set up to directly copy data from the initializer capability to the
       // output stream because if the output stream backs up we don't want to buffer data
       // in-memory. Doing so could lead to DoS, etc.
-      return i->onNextData().then([this,offset,KJ_MVCAP(target)]() mutable {
-        return writeLoop(offset, kj::mv(target));
+      return i->onNextData().then([this,offset,KJ_MVCAP(target),KJ_MVCAP(inFlight)]() mutable {
+        return writeLoop(offset, kj::mv(target), kj::mv(inFlight));
       });
     } else {
       // Blob is incomplete and no longer being initialized.
@@ -2238,6 +2245,10 @@ FilesystemStorage::FilesystemStorage(
 
 FilesystemStorage::~FilesystemStorage() noexcept(false) {}
 
+void FilesystemStorage::getMetrics(MetricsBuilder& metrics) {
+  journal->getMetrics(metrics);
+}
+
 kj::Promise<void> FilesystemStorage::set(SetContext context) {
   auto params = context.getParams();
   auto object = params.getObject();
@@ -2343,6 +2354,29 @@ kj::Promise<void> FilesystemStorage::getFactory(GetFactoryContext context) {
   return kj::READY_NOW;
 }
 
+kj::Promise<void> FilesystemStorage::getStorageUsage(GetStorageUsageContext context) {
+  auto names = context.getParams().getNames();
+  auto results = context.getResults(capnp::MessageSize { 4 + names.size(), 0 })
+      .initTotalBytes(names.size());
+
+  for (auto i: kj::indices(names)) {
+    KJ_IF_MAYBE(file, sandstorm::raiiOpenAtIfExists(
+        rootsFd, names[i], O_RDONLY | O_CLOEXEC)) {
+      capnp::StreamFdMessageReader message(kj::mv(*file));
+      ObjectId id = ObjectKey(message.getRoot<StoredRoot>().getKey());
+
+      // Go through the journal rather than the object cache so that we see the effect of
+      // uncommitted transactions without instantiating the object.
+      Xattr xattr;
+      if (journal->openObject(id, xattr) != nullptr) {
+        results.set(i, xattr.transitiveBlockCount * Volume::BLOCK_SIZE);
+      }
+    }
+  }
+
+  return kj::READY_NOW;
+}
+
 kj::Maybe<kj::AutoCloseFd> FilesystemStorage::openObject(ObjectId id) {
   return sandstorm::raiiOpenAtIfExists(mainDirFd, id.filename('o').begin(), O_RDWR | O_CLOEXEC);
 }
@@ -2574,4 +2608,85 @@ bool FilesystemStorage::isStoredObjectType(Type type) {
   KJ_FAIL_ASSERT("unknown object type on disk", (uint)type);
 }
 
+// =======================================================================================
+
+namespace {
+
+kj::AutoCloseFd openOrCreateDirectory(int parentFd, kj::StringPtr name) {
+  mkdirat(parentFd, name.cStr(), 0777);
+  return sandstorm::raiiOpenAt(parentFd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+void collectObjects(int mainFd, FilesystemStorage::ObjectId id,
+                    kj::Vector<FilesystemStorage::ObjectId>& objects) {
+  // Add `id` and everything it transitively owns to `objects`, parents before children.
+  // Objects which are missing were moved by an earlier, interrupted run, along with all of
+  // their children (since we move children first), so we skip them.
+
+  auto filename = id.filename('o');
+  KJ_IF_MAYBE(fd, sandstorm::raiiOpenAtIfExists(mainFd, filename.begin(), O_RDONLY | O_CLOEXEC)) {
+    objects.add(id);
+
+    FilesystemStorage::Xattr xattr;
+    memset(&xattr, 0, sizeof(xattr));
+    KJ_SYSCALL(fgetxattr(*fd, FilesystemStorage::Xattr::NAME, &xattr, sizeof(xattr)),
+               filename.begin());
+
+    // Fails on types we don't know about, rather than guess whether they own anything.
+    if (FilesystemStorage::isStoredObjectType(xattr.type)) {
+      capnp::StreamFdMessageReader reader(fd->get());
+      for (auto child: reader.getRoot<StoredChildIds>().getChildren()) {
+        collectObjects(mainFd, child, objects);
+      }
+    }
+  }
+}
+
+}  // namespace
+
+StorageRebalanceCounts rebalanceStorage(
+    int directoryFd, uint index, uint count, kj::Maybe<int> outboxFd,
+    kj::Function<void(kj::StringPtr rootName, uint64_t shard, size_t objectCount)> onMove) {
+  KJ_REQUIRE(index < count, "shard index out of range", index, count);
+
+  auto mainFd = sandstorm::raiiOpenAt(directoryFd, "main", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  auto rootsFd = sandstorm::raiiOpenAt(directoryFd, "roots", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+  StorageRebalanceCounts counts;
+  for (auto& name: sandstorm::listDirectoryFd(rootsFd)) {
+    uint64_t shard = BackendSetBase::shardFor(storageShardKey(name).asBytes(), count);
+    if (shard == index) continue;
+
+    FilesystemStorage::ObjectId rootId = ({
+      capnp::StreamFdMessageReader message(
+          sandstorm::raiiOpenAt(rootsFd, name, O_RDONLY | O_CLOEXEC));
+      FilesystemStorage::ObjectKey key(message.getRoot<StoredRoot>().getKey());
+      FilesystemStorage::ObjectId(key);
+    });
+
+    kj::Vector<FilesystemStorage::ObjectId> objects;
+    collectObjects(mainFd, rootId, objects);
+    ++counts.roots;
+    counts.objects += objects.size();
+    onMove(name, shard, objects.size());
+
+    KJ_IF_MAYBE(outbox, outboxFd) {
+      auto shardFd = openOrCreateDirectory(*outbox, kj::str(shard));
+      auto shardMainFd = openOrCreateDirectory(shardFd, "main");
+      auto shardRootsFd = openOrCreateDirectory(shardFd, "roots");
+
+      // Children before parents, and the root file last, so that an interrupted run can pick up
+      // where it left off.
+      for (size_t i = objects.size(); i > 0; i--) {
+        auto filename = objects[i - 1].filename('o');
+        KJ_SYSCALL(renameat(mainFd, filename.begin(), shardMainFd, filename.begin()),
+                   filename.begin());
+      }
+      KJ_SYSCALL(renameat(rootsFd, name.cStr(), shardRootsFd, name.cStr()), name);
+    }
+  }
+
+  return counts;
+}
+
 }  // namespace blackrock
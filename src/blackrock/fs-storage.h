@@ -21,6 +21,7 @@
 #include <blackrock/storage.capnp.h>
 #include <blackrock/fs-storage.capnp.h>
 #include <kj/io.h>
+#include <kj/function.h>
 #include <sodium/utils.h>
 
 namespace kj {
@@ -30,12 +31,16 @@ namespace kj {
 
 namespace blackrock {
 
+class MetricsBuilder;
+
 class FilesystemStorage: public StorageRootSet::Server {
 public:
   FilesystemStorage(int directoryFd, kj::UnixEventPort& eventPort, kj::Timer& timer,
                     Restorer<SturdyRef>::Client&& restorer);
   ~FilesystemStorage() noexcept(false);
 
+  void getMetrics(MetricsBuilder& metrics);
+
 protected:
   kj::Promise<void> set(SetContext context) override;
   kj::Promise<void> get(GetContext context) override;
@@ -43,6 +48,7 @@ protected:
   kj::Promise<void> getOrCreateAssignable(GetOrCreateAssignableContext context) override;
   kj::Promise<void> remove(RemoveContext context) override;
   kj::Promise<void> getFactory(GetFactoryContext context) override;
+  kj::Promise<void> getStorageUsage(GetStorageUsageContext context) override;
 
 public:
   struct ObjectKey {
@@ -100,6 +106,54 @@ public:
     kj::FixedArray<char, 24> filename(char prefix) const;
   };
 
+  enum class Type: uint8_t {
+    // Type of a stored object, as recorded in its Xattr. Public so that offline tools (e.g.
+    // storage-rebalance) can read the storage directory.
+
+    // (zero skipped to help detect errors)
+    BLOB = 1,
+    VOLUME,
+    IMMUTABLE,
+    ASSIGNABLE,
+    COLLECTION,
+    OPAQUE,
+    REFERENCE
+  };
+
+  struct Xattr {
+    // Format of the xattr block stored on each file. On ext4 we have about 76 bytes available in
+    // the inode to store this attribute, but in theory this space could get smaller in the future,
+    // so we should try to keep this minimal.
+
+    static constexpr const char* NAME = "user.sandstor";
+    // Extended attribute name. Abbreviated to be 8 bytes to avoid losing space to alignment (ext4
+    // doesn't store the "user." prefix). Actually short for "sandstore", not "sandstorm". :)
+
+    Type type;
+
+    bool readOnly;
+    // For volumes, prevents the volume from being modified. For Blobs, indicates that
+    // initialization has completed with a `done()` call, indicating the entire stream was received
+    // (otherwise, either the stream is still uploading, or it failed to fully upload). Once set
+    // this can never be unset.
+
+    byte reserved[2];
+    // Must be zero.
+
+    uint32_t accountedBlockCount;
+    // The number of 4k blocks consumed by this object the last time we considered it for
+    // accounting/quota purposes. The on-disk size could have changed in the meantime.
+
+    uint64_t transitiveBlockCount;
+    // The number of 4k blocks in this object and all child objects.
+
+    ObjectId owner;
+    // What object owns this one?
+  };
+
+  static bool isStoredObjectType(Type type);
+  // Does an object of this type start with a StoredChildIds message listing the objects it owns?
+
 private:
   class ObjectBase;
   class BlobImpl;
@@ -109,8 +163,6 @@ private:
   class CollectionImpl;
   class OpaqueImpl;
   class StorageFactoryImpl;
-  enum class Type: uint8_t;
-  struct Xattr;
   class Journal;
   class DeathRow;
   class ObjectFactory;
@@ -138,10 +190,22 @@ private:
   void setAttributesIfExists(ObjectId objectId, const Xattr& attributes);
   void moveToDeathRowIfExists(ObjectId id, bool notify = true);
   void sync();
+};
 
-  static bool isStoredObjectType(Type type);
+struct StorageRebalanceCounts {
+  uint roots = 0;
+  uint objects = 0;
 };
 
+StorageRebalanceCounts rebalanceStorage(
+    int directoryFd, uint index, uint count, kj::Maybe<int> outboxFd,
+    kj::Function<void(kj::StringPtr rootName, uint64_t shard, size_t objectCount)> onMove);
+// Moves every root in the stopped storage directory `directoryFd`, which is shard `index`, that
+// belongs on a different shard once there are `count` shards, along with everything it owns, to
+// `<outbox>/<shard>`, which is laid out like a storage directory. Calls `onMove` for each such
+// root first. With a null `outboxFd`, moves nothing. Roots are assigned to shards the same way
+// the frontend does, by storageShardKey(). Used by storage-rebalance, which see.
+
 }  // namespace blackrock
 
 #endif  // BLACKROCK_VOLUME_H_
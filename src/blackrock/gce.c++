@@ -57,7 +57,7 @@ GceDriver::GceDriver(sandstorm::SubprocessSet& subprocessSet,
                      GceConfig::Reader config)
     : subprocessSet(subprocessSet), ioProvider(ioProvider), config(config), image(getImageName()),
       masterBindAddress(SimpleAddress::getInterfaceAddress(AF_INET, "eth0")),
-      logTask(nullptr), logSinkAddress(masterBindAddress) {
+      logSink(ioProvider.getTimer()), logTask(nullptr), logSinkAddress(masterBindAddress) {
   // Create socket for the log sink acceptor.
   int sock;
   KJ_SYSCALL(sock = socket(masterBindAddress.family(),
@@ -243,7 +243,8 @@ kj::Promise<VatPath::Reader> GceDriver::run(
   auto addr = kj::str(logSinkAddress, '/', name);
   auto target = kj::str("root@", name);
   kj::Vector<kj::StringPtr> args;
-  auto command = kj::str("/blackrock/bin/blackrock slave --log ", addr, " if4:eth0");
+  auto command = kj::str("/blackrock/bin/blackrock slave --log ", addr,
+                         compressRpc ? " --compress-rpc" : "", " if4:eth0");
   args.addAll(kj::ArrayPtr<const kj::StringPtr>({
       "ssh", target, "--command", command, "-q"}));
   if (requireRestartProcess) args.add("-r");
@@ -0,0 +1,310 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "local.h"
+#include <kj/debug.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mount.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sandstorm/util.h>
+#include <capnp/serialize.h>
+#include <capnp/serialize-async.h>
+
+namespace blackrock {
+
+namespace {
+
+static constexpr const char INIT_NAME[] = "blackrock-local";
+// Process name of each machine's init, used to make sure that a PID recorded on disk still
+// belongs to the machine before we kill it.
+
+void bindMount(kj::StringPtr from, kj::StringPtr to) {
+  KJ_SYSCALL(mount(from.cStr(), to.cStr(), nullptr, MS_BIND | MS_REC, nullptr), from, to);
+}
+
+int runInit(kj::StringPtr logAddress, bool compressRpc) {
+  // Runs as PID 1 of a machine's PID namespace, with the machine's mounts already in place. Starts
+  // the slave, then hangs around reaping processes. Once none are left, the machine has died, and
+  // we exit, which tears down the namespaces.
+
+  KJ_SYSCALL(setsid());
+  KJ_SYSCALL(prctl(PR_SET_NAME, INIT_NAME, 0, 0, 0));
+
+  // Mount a /proc for our PID namespace, so that the slave only sees (and, with `--restart`,
+  // kills) its own machine's processes.
+  KJ_SYSCALL(mount("proc", "/proc", "proc", MS_NOSUID | MS_NODEV | MS_NOEXEC, nullptr));
+
+  pid_t pid;
+  KJ_SYSCALL(pid = fork());
+  if (pid == 0) {
+    if (compressRpc) {
+      KJ_SYSCALL(execl("/proc/self/exe", "blackrock", "slave", "--log", logAddress.cStr(),
+                       "--compress-rpc", "if4:lo", (char*)nullptr));
+    } else {
+      KJ_SYSCALL(execl("/proc/self/exe", "blackrock", "slave", "--log", logAddress.cStr(),
+                       "if4:lo", (char*)nullptr));
+    }
+    KJ_UNREACHABLE;
+  }
+
+  // Only the slave should hold the master's pipes, so that the master sees EOF if it fails.
+  auto devNull = sandstorm::raiiOpen("/dev/null", O_RDWR | O_CLOEXEC);
+  KJ_SYSCALL(dup2(devNull, STDIN_FILENO));
+  KJ_SYSCALL(dup2(devNull, STDOUT_FILENO));
+
+  for (;;) {
+    if (wait(nullptr) < 0) {
+      int error = errno;
+      if (error == EINTR) continue;
+      if (error == ECHILD) return 0;
+      KJ_FAIL_SYSCALL("wait()", error);
+    }
+  }
+}
+
+kj::Promise<void> waitForExit(kj::Timer& timer, pid_t pid) {
+  if (kill(pid, 0) < 0 && errno == ESRCH) {
+    return kj::READY_NOW;
+  }
+
+  return timer.afterDelay(100 * kj::MILLISECONDS).then([&timer,pid]() {
+    return waitForExit(timer, pid);
+  });
+}
+
+}  // namespace
+
+LocalDriver::LocalDriver(sandstorm::SubprocessSet& subprocessSet,
+                         kj::LowLevelAsyncIoProvider& ioProvider,
+                         LocalConfig::Reader config)
+    : subprocessSet(subprocessSet), ioProvider(ioProvider), config(config),
+      masterBindAddress(SimpleAddress::getInterfaceAddress(AF_INET, "lo")),
+      logSink(ioProvider.getTimer()), logTask(nullptr), logSinkAddress(masterBindAddress) {
+  // Create socket for the log sink acceptor.
+  int sock;
+  KJ_SYSCALL(sock = socket(masterBindAddress.family(),
+      SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0));
+  {
+    KJ_ON_SCOPE_FAILURE(close(sock));
+    logSinkAddress.setPort(0);
+    KJ_SYSCALL(bind(sock, logSinkAddress.asSockaddr(), logSinkAddress.getSockaddrSize()));
+    KJ_SYSCALL(listen(sock, SOMAXCONN));
+
+    // Read back the assigned port number.
+    logSinkAddress = SimpleAddress::getLocal(sock);
+  }
+
+  // Accept log connections.
+  auto listener = ioProvider.wrapListenSocketFd(sock,
+      kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP |
+      kj::LowLevelAsyncIoProvider::ALREADY_CLOEXEC |
+      kj::LowLevelAsyncIoProvider::ALREADY_NONBLOCK);
+
+  logTask = logSink.acceptLoop(kj::mv(listener))
+      .eagerlyEvaluate([](kj::Exception&& exception) {
+    KJ_LOG(ERROR, "LogSink accept loop failed", exception);
+  });
+}
+
+LocalDriver::~LocalDriver() noexcept(false) {}
+
+SimpleAddress LocalDriver::getMasterBindAddress() {
+  return masterBindAddress;
+}
+
+auto LocalDriver::listMachines() -> kj::Promise<kj::Array<MachineId>> {
+  kj::Vector<MachineId> result;
+  if (access(config.getRoot().cStr(), F_OK) == 0) {
+    for (auto& name: sandstorm::listDirectory(config.getRoot())) {
+      result.add(MachineId(name));
+    }
+  }
+  return result.releaseAsArray();
+}
+
+kj::Promise<void> LocalDriver::boot(MachineId id) {
+  auto dir = getMachineDir(id);
+  for (auto subdir: {"/var/blackrock/bundle", "/var/run", "/var/log", "/var/tmp", "/tmp"}) {
+    sandstorm::recursivelyCreateParent(kj::str(dir, subdir, "/dummy"));
+  }
+  KJ_SYSCALL(chmod(kj::str(dir, "/tmp").cStr(), 01777));
+  KJ_SYSCALL(chmod(kj::str(dir, "/var/tmp").cStr(), 01777));
+  return kj::READY_NOW;
+}
+
+kj::Promise<VatPath::Reader> LocalDriver::run(
+    MachineId id, blackrock::VatId::Reader masterVatId, bool requireRestartProcess) {
+  kj::Promise<void> promise = kj::READY_NOW;
+  if (requireRestartProcess) {
+    promise = killMachine(id);
+  }
+
+  return promise.then([this,id,masterVatId]() -> kj::Promise<VatPath::Reader> {
+    KJ_IF_MAYBE(path, attach(id, masterVatId)) {
+      return *path;
+    } else {
+      return launch(id, masterVatId);
+    }
+  });
+}
+
+kj::Promise<kj::Maybe<VatPath::Reader>> LocalDriver::findRunning(
+    MachineId id, blackrock::VatId::Reader masterVatId) {
+  return kj::evalNow([&]() { return attach(id, masterVatId); });
+}
+
+kj::Maybe<VatPath::Reader> LocalDriver::attach(MachineId id, VatId::Reader masterVatId) {
+  auto dir = getMachineDir(id);
+  auto pidfile = sandstorm::raiiOpen(kj::str(dir, "/var/run/blackrock-slave"),
+      O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  int l;
+  KJ_NONBLOCKING_SYSCALL(l = flock(pidfile, LOCK_EX | LOCK_NB));
+  if (l >= 0) {
+    // No slave is running. Drop our lock so that a new one can take it.
+    return nullptr;
+  }
+
+  // The slave is already running, so do what `blackrock slave` would do in this case: tell it
+  // about the (possibly new) master and return the VatPath it saved in its pidfile.
+  {
+    auto next = kj::str(dir, "/var/run/master-vatid.next");
+    capnp::MallocMessageBuilder message(masterVatId.totalSize().wordCount + 4);
+    message.setRoot(masterVatId);
+    capnp::writeMessageToFd(
+        sandstorm::raiiOpen(next, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600), message);
+    KJ_SYSCALL(rename(next.cStr(), kj::str(dir, "/var/run/master-vatid").cStr()));
+  }
+
+  auto reader = kj::heap<capnp::StreamFdMessageReader>(pidfile.get());
+  auto path = reader->getRoot<VatPath>();
+  vatPaths[id] = kj::mv(reader);
+  return path;
+}
+
+kj::Promise<void> LocalDriver::stop(MachineId id) {
+  return killMachine(id).then([this,id]() {
+    vatPaths.erase(id);
+    sandstorm::recursivelyDelete(getMachineDir(id));
+  });
+}
+
+kj::String LocalDriver::getMachineDir(MachineId id) {
+  return kj::str(config.getRoot(), '/', id);
+}
+
+kj::Maybe<pid_t> LocalDriver::getInitPid(MachineId id) {
+  KJ_IF_MAYBE(fd, sandstorm::raiiOpenIfExists(
+      kj::str(getMachineDir(id), "/init.pid"), O_RDONLY | O_CLOEXEC)) {
+    KJ_IF_MAYBE(pid, sandstorm::parseUInt(sandstorm::trim(sandstorm::readAll(*fd)), 10)) {
+      KJ_IF_MAYBE(comm, sandstorm::raiiOpenIfExists(
+          kj::str("/proc/", *pid, "/comm"), O_RDONLY | O_CLOEXEC)) {
+        if (sandstorm::trim(sandstorm::readAll(*comm)) == INIT_NAME) {
+          return pid_t(*pid);
+        }
+      }
+    }
+  }
+  return nullptr;
+}
+
+kj::Promise<void> LocalDriver::killMachine(MachineId id) {
+  KJ_IF_MAYBE(pid, getInitPid(id)) {
+    // Killing the init of a PID namespace kills everything in it.
+    KJ_SYSCALL(kill(*pid, SIGKILL));
+    return waitForExit(ioProvider.getTimer(), *pid);
+  } else {
+    return kj::READY_NOW;
+  }
+}
+
+kj::Promise<VatPath::Reader> LocalDriver::launch(MachineId id, VatId::Reader masterVatId) {
+  auto dir = getMachineDir(id);
+  auto logAddress = kj::str(logSinkAddress, '/', id);
+
+  int fds[2];
+  KJ_SYSCALL(pipe2(fds, O_CLOEXEC));
+  kj::AutoCloseFd stdinReadEnd(fds[0]);
+  auto stdinWriteEnd = ioProvider.wrapOutputFd(fds[1],
+      kj::LowLevelAsyncIoProvider::Flags::TAKE_OWNERSHIP |
+      kj::LowLevelAsyncIoProvider::Flags::ALREADY_CLOEXEC);
+  KJ_SYSCALL(pipe2(fds, O_CLOEXEC));
+  kj::AutoCloseFd stdoutWriteEnd(fds[1]);
+  auto stdoutReadEnd = ioProvider.wrapInputFd(fds[0],
+      kj::LowLevelAsyncIoProvider::Flags::TAKE_OWNERSHIP |
+      kj::LowLevelAsyncIoProvider::Flags::ALREADY_CLOEXEC);
+
+  // Open this before mounting over /var, which may hide it.
+  auto initPidFile = sandstorm::raiiOpen(kj::str(dir, "/init.pid"),
+      O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC);
+
+  sandstorm::Subprocess launcher([&]() -> int {
+    KJ_SYSCALL(dup2(stdinReadEnd, STDIN_FILENO));
+    KJ_SYSCALL(dup2(stdoutWriteEnd, STDOUT_FILENO));
+
+    KJ_SYSCALL(unshare(CLONE_NEWNS | CLONE_NEWPID));
+    KJ_SYSCALL(mount("none", "/", nullptr, MS_REC | MS_PRIVATE, nullptr));
+
+    // Order matters: the paths under `dir` may themselves be under /var.
+    if (access("/var/blackrock/bundle", F_OK) == 0) {
+      bindMount("/var/blackrock/bundle", kj::str(dir, "/var/blackrock/bundle"));
+    }
+    bindMount(kj::str(dir, "/tmp"), "/tmp");
+    bindMount(kj::str(dir, "/var"), "/var");
+
+    // Our first child becomes PID 1 of the new PID namespace.
+    pid_t pid;
+    KJ_SYSCALL(pid = fork());
+    if (pid == 0) {
+      return runInit(logAddress, compressRpc);
+    }
+
+    auto pidText = kj::str(pid);
+    kj::FdOutputStream(initPidFile.get()).write(pidText.begin(), pidText.size());
+    return 0;
+  });
+
+  // Only the launcher (and then the slave) should hold these.
+  initPidFile = nullptr;
+  stdinReadEnd = nullptr;
+  stdoutWriteEnd = nullptr;
+
+  auto exitPromise = subprocessSet.waitForSuccess(kj::mv(launcher));
+
+  auto message = kj::heap<capnp::MallocMessageBuilder>(masterVatId.totalSize().wordCount + 4);
+  message->setRoot(masterVatId);
+
+  auto& stdoutReadEndRef = *stdoutReadEnd;
+  return capnp::writeMessage(*stdinWriteEnd, *message)
+      .attach(kj::mv(stdinWriteEnd), kj::mv(message))
+      .then([&stdoutReadEndRef]() {
+    return capnp::readMessage(stdoutReadEndRef);
+  }).then([this,id,KJ_MVCAP(exitPromise),KJ_MVCAP(stdoutReadEnd)](
+      kj::Own<capnp::MessageReader> reader) mutable {
+    auto path = reader->getRoot<VatPath>();
+    vatPaths[id] = kj::mv(reader);
+    return exitPromise.then([path]() { return path; });
+  });
+}
+
+} // namespace blackrock
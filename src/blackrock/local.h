@@ -0,0 +1,72 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BLACKROCK_LOCAL_H_
+#define BLACKROCK_LOCAL_H_
+
+#include "master.h"
+#include <blackrock/master.capnp.h>
+
+namespace blackrock {
+
+class LocalDriver: public ComputeDriver {
+  // Runs each machine as a `blackrock slave` process on this host. Each machine gets its own mount
+  // and PID namespaces, in which its directory under `config.root` is mounted over /var and /tmp
+  // (except for /var/blackrock/bundle, which is shared), and listens on its own port on the
+  // loopback interface. A "booted" machine is one whose directory exists.
+
+public:
+  LocalDriver(sandstorm::SubprocessSet& subprocessSet, kj::LowLevelAsyncIoProvider& ioProvider,
+              LocalConfig::Reader config);
+  ~LocalDriver() noexcept(false);
+
+  SimpleAddress getMasterBindAddress() override;
+  kj::Promise<kj::Array<MachineId>> listMachines() override;
+  kj::Promise<void> boot(MachineId id) override;
+  kj::Promise<VatPath::Reader> run(MachineId id, VatId::Reader masterVatId,
+                                   bool requireRestartProcess) override;
+  kj::Promise<void> stop(MachineId id) override;
+  kj::Promise<kj::Maybe<VatPath::Reader>> findRunning(
+      MachineId id, VatId::Reader masterVatId) override;
+
+private:
+  sandstorm::SubprocessSet& subprocessSet;
+  kj::LowLevelAsyncIoProvider& ioProvider;
+  LocalConfig::Reader config;
+  std::map<ComputeDriver::MachineId, kj::Own<capnp::MessageReader>> vatPaths;
+  SimpleAddress masterBindAddress;
+
+  LogSink logSink;
+  kj::Promise<void> logTask;
+  SimpleAddress logSinkAddress;
+
+  kj::String getMachineDir(MachineId id);
+
+  kj::Maybe<VatPath::Reader> attach(MachineId id, VatId::Reader masterVatId);
+  // If the machine's slave is running, tell it about the master and return its VatPath.
+
+  kj::Maybe<pid_t> getInitPid(MachineId id);
+  // Host PID of the process at the root of the machine's PID namespace, if it's running.
+
+  kj::Promise<void> killMachine(MachineId id);
+  // Kill all of the machine's processes, if any, and wait for them to go away.
+
+  kj::Promise<VatPath::Reader> launch(MachineId id, VatId::Reader masterVatId);
+};
+
+} // namespace blackrock
+
+#endif // BLACKROCK_LOCAL_H_
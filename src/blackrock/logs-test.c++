@@ -0,0 +1,415 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "logs.h"
+#include <kj/test.h>
+#include <capnp/message.h>
+#include <sandstorm/util.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <string.h>
+
+namespace blackrock {
+namespace {
+
+kj::AutoCloseFd newRingFile() {
+  return sandstorm::raiiOpen("/var/tmp", O_RDWR | O_TMPFILE | O_CLOEXEC, 0600);
+}
+
+void append(LogRing& ring, kj::StringPtr text) {
+  ring.append(text.asBytes());
+}
+
+kj::String readAll(LogRing& ring) {
+  auto batch = ring.read(1024);
+  ring.consume(batch.end);
+  return kj::heapString(reinterpret_cast<const char*>(batch.bytes.begin()), batch.bytes.size());
+}
+
+KJ_TEST("LogRing wraps around the end of the buffer") {
+  LogRing ring(newRingFile(), 16);
+  append(ring, "aaaa\nbbbb\ncccc\n");
+  KJ_EXPECT(readAll(ring) == "aaaa\nbbbb\ncccc\n");
+  KJ_EXPECT(ring.empty());
+
+  // Starts at offset 15 of 16.
+  append(ring, "dddddd\n");
+  KJ_EXPECT(ring.size() == 7);
+  KJ_EXPECT(readAll(ring) == "dddddd\n");
+  KJ_EXPECT(ring.getDroppedBytes() == 0);
+}
+
+KJ_TEST("LogRing drops the oldest whole lines when full") {
+  LogRing ring(newRingFile(), 16);
+  append(ring, "line1\n");
+  append(ring, "line2\n");
+  append(ring, "line3\n");
+
+  KJ_EXPECT(ring.getDroppedBytes() == 6);
+  KJ_EXPECT(ring.getDropCount() == 1);
+  KJ_EXPECT(readAll(ring) == "line2\nline3\n");
+
+  // A single append larger than the ring keeps its end.
+  append(ring, "0123456789abcdefghi\n");
+  KJ_EXPECT(ring.getDroppedBytes() == 10);
+  KJ_EXPECT(ring.getDropCount() == 2);
+  KJ_EXPECT(readAll(ring) == "456789abcdefghi\n");
+}
+
+KJ_TEST("LogRing resumes a ring left in its file") {
+  auto fd = newRingFile();
+  {
+    LogRing ring(kj::AutoCloseFd(dup(fd)), 16);
+    append(ring, "line1\n");
+    append(ring, "line2\n");
+    append(ring, "line3\n");
+    ring.setReportedDroppedBytes(ring.getDroppedBytes());
+  }
+
+  {
+    LogRing ring(kj::AutoCloseFd(dup(fd)), 16);
+    KJ_EXPECT(ring.getDroppedBytes() == 6);
+    KJ_EXPECT(ring.getReportedDroppedBytes() == 6);
+    KJ_EXPECT(readAll(ring) == "line2\nline3\n");
+    append(ring, "line4\n");
+  }
+
+  // A ring of another size starts over.
+  LogRing ring(kj::AutoCloseFd(dup(fd)), 32);
+  KJ_EXPECT(ring.empty());
+  KJ_EXPECT(ring.getDroppedBytes() == 0);
+}
+
+KJ_TEST("parseLogText splits KJ_LOG() text into severity, message and fields") {
+  capnp::MallocMessageBuilder message;
+  auto record = message.initRoot<LogRecord>();
+
+  parseLogText("error: grain died; grainId = abc; exception = foo; bar\n", record);
+  KJ_EXPECT(record.getSeverity() == LogRecord::Severity::ERROR);
+  KJ_EXPECT(record.getMessage() == "grain died");
+  auto fields = record.getFields();
+  KJ_ASSERT(fields.size() == 2);
+  KJ_EXPECT(fields[0].getKey() == "grainId");
+  KJ_EXPECT(fields[0].getValue() == "abc");
+  KJ_EXPECT(fields[1].getKey() == "exception");
+  KJ_EXPECT(fields[1].getValue() == "foo; bar");
+
+  parseLogText("no severity; x = 1 + 1", record);
+  KJ_EXPECT(record.getSeverity() == LogRecord::Severity::INFO);
+  KJ_EXPECT(record.getMessage() == "no severity");
+  KJ_ASSERT(record.getFields().size() == 1);
+  KJ_EXPECT(record.getFields()[0].getValue() == "1 + 1");
+}
+
+struct TestStoreDir {
+  static constexpr char PATH[] = "/var/tmp/blackrock-logs-test";
+
+  TestStoreDir() {
+    if (access(PATH, F_OK) >= 0) {
+      sandstorm::recursivelyDelete(PATH);
+    }
+  }
+  ~TestStoreDir() noexcept(false) {
+    sandstorm::recursivelyDelete(PATH);
+  }
+};
+constexpr char TestStoreDir::PATH[];
+
+void addRecords(LogStore& store, int64_t timeNs, kj::ArrayPtr<const kj::StringPtr> texts) {
+  // Adds one record per text, a second apart starting at `timeNs`, from machine "worker0".
+
+  capnp::MallocMessageBuilder message;
+  auto records = message.initRoot<LogBatch>().initRecords(texts.size());
+  for (auto i: kj::indices(texts)) {
+    records[i].setTimeNs(timeNs + int64_t(i) * 1000000000);
+    parseLogText(texts[i], records[i]);
+  }
+  store.add(message.getRoot<LogBatch>().asReader(), "worker0");
+}
+
+kj::Array<kj::String> runQuery(const LogStore::Query& query) {
+  // Messages of the matching records, in order.
+
+  kj::Vector<kj::String> result;
+  LogStore::query(TestStoreDir::PATH, query, [&](LogRecord::Reader record) {
+    KJ_EXPECT(record.getMachine() == "worker0");
+    result.add(kj::heapString(record.getMessage()));
+  });
+  return result.releaseAsArray();
+}
+
+const kj::StringPtr FIRST_RUN[] = {
+  "info: started",
+  "error: grain died; grainId = a",
+  "error: grain died; grainId = b",
+  "warning: slow; grainId = a",
+};
+
+const kj::StringPtr SECOND_RUN[] = {
+  "error: grain died again; grainId = a",
+  "info: idle; grainId = a",
+};
+
+KJ_TEST("LogStore queries the open segment by field, severity and time") {
+  TestStoreDir dir;
+  LogStore store(TestStoreDir::PATH);
+  addRecords(store, 1000000000000, kj::arrayPtr(FIRST_RUN, kj::size(FIRST_RUN)));
+
+  LogStore::Query q;
+  q.terms.add(kj::heapString("grainId"), kj::heapString("a"));
+  auto result = runQuery(q);
+  KJ_ASSERT(result.size() == 2);
+  KJ_EXPECT(result[0] == "grain died");
+  KJ_EXPECT(result[1] == "slow");
+
+  q.terms.add(kj::heapString("severity"), kj::heapString("error"));
+  KJ_EXPECT(runQuery(q).size() == 1);
+
+  LogStore::Query recent;
+  recent.sinceNs = 1002000000000;
+  result = runQuery(recent);
+  KJ_ASSERT(result.size() == 2);
+  KJ_EXPECT(result[0] == "grain died");
+  KJ_EXPECT(result[1] == "slow");
+}
+
+KJ_TEST("LogStore indexes the previous segment on restart and queries across segments") {
+  TestStoreDir dir;
+  {
+    LogStore store(TestStoreDir::PATH);
+    addRecords(store, 1000000000000, kj::arrayPtr(FIRST_RUN, kj::size(FIRST_RUN)));
+  }
+
+  LogStore store(TestStoreDir::PATH);
+  addRecords(store, 2000000000000, kj::arrayPtr(SECOND_RUN, kj::size(SECOND_RUN)));
+
+  // The first segment is now answered from its index, the second by scanning.
+  LogStore::Query q;
+  q.terms.add(kj::heapString("grainId"), kj::heapString("a"));
+  q.terms.add(kj::heapString("severity"), kj::heapString("error"));
+  auto result = runQuery(q);
+  KJ_ASSERT(result.size() == 2);
+  KJ_EXPECT(result[0] == "grain died");
+  KJ_EXPECT(result[1] == "grain died again");
+
+  LogStore::Query missing;
+  missing.terms.add(kj::heapString("grainId"), kj::heapString("z"));
+  KJ_EXPECT(runQuery(missing).size() == 0);
+
+  // Skips the first segment entirely.
+  LogStore::Query recent;
+  recent.sinceNs = 2000000000000;
+  KJ_EXPECT(runQuery(recent).size() == 2);
+}
+
+struct TestLogDir {
+  static constexpr char PATH[] = "/var/tmp/blackrock-rotate-test";
+  kj::AutoCloseFd fd;
+
+  TestLogDir() {
+    if (access(PATH, F_OK) >= 0) {
+      sandstorm::recursivelyDelete(PATH);
+    }
+    KJ_SYSCALL(mkdir(PATH, 0777));
+    fd = sandstorm::raiiOpen(PATH, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  }
+  ~TestLogDir() noexcept(false) {
+    sandstorm::recursivelyDelete(PATH);
+  }
+
+  bool has(kj::StringPtr name) {
+    return faccessat(fd, name.cStr(), F_OK, 0) >= 0;
+  }
+};
+constexpr char TestLogDir::PATH[];
+
+kj::String readSegment(TestLogDir& dir, kj::StringPtr name, uint64_t offset, size_t size) {
+  auto bytes = readLogSegment(dir.fd, name, offset, size);
+  return kj::heapString(reinterpret_cast<const char*>(bytes.begin()), bytes.size());
+}
+
+KJ_TEST("rotateLogs splits logs into segments and compresses them in indexed frames") {
+  TestLogDir dir;
+
+  // 16-byte lines, so that every 8k read ends at a line break. That makes for two full segments of
+  // 1.5MB (two frames each) and 256k in the open segment.
+  static constexpr uint64_t SEGMENT_SIZE = 1536 << 10;
+  static constexpr uint LINE_COUNT = 212992;
+  auto text = kj::heapString(LINE_COUNT * 16);
+  for (uint i = 0; i < LINE_COUNT; i++) {
+    char line[17];
+    snprintf(line, sizeof(line), "line %010u\n", i);
+    memcpy(text.begin() + i * 16, line, 16);
+  }
+
+  {
+    auto input = newRingFile();
+    kj::FdOutputStream(input.get()).write(text.begin(), text.size());
+    KJ_SYSCALL(lseek(input, 0, SEEK_SET));
+    rotateLogs(input, dir.fd, SEGMENT_SIZE);
+  }
+
+  kj::Maybe<kj::String> dayName;
+  for (auto& name: sandstorm::listDirectory(TestLogDir::PATH)) {
+    if (name.endsWith(".0000.zst")) {
+      dayName = kj::heapString(name.slice(0, name.size() - strlen(".0000.zst")));
+    }
+  }
+  auto& day = KJ_ASSERT_NONNULL(dayName);
+  auto segment0 = kj::str(day, ".0000");
+  auto segment1 = kj::str(day, ".0001");
+  auto segment2 = kj::str(day, ".0002");
+
+  KJ_EXPECT(!dir.has(segment0));
+  KJ_EXPECT(!dir.has(segment1));
+  KJ_EXPECT(dir.has(kj::str(segment1, ".zst")));
+  KJ_EXPECT(dir.has(segment2));
+  KJ_EXPECT(!dir.has(kj::str(segment2, ".zst")));
+
+  auto index = sandstorm::splitLines(sandstorm::readAll(
+      kj::str(TestLogDir::PATH, '/', segment1, ".zst.idx")));
+  KJ_ASSERT(index.size() == 2);
+  KJ_EXPECT(index[0] == "0 0");
+  KJ_EXPECT(index[1].startsWith("1048576 "));
+
+  // Across the frame boundary, within one frame, to the end, and past it.
+  auto expected = [&](uint64_t offset, size_t size) {
+    return kj::heapString(text.begin() + offset, size);
+  };
+  KJ_EXPECT(readSegment(dir, segment1, 1048536, 100) == expected(SEGMENT_SIZE + 1048536, 100));
+  KJ_EXPECT(readSegment(dir, segment1, 1048576 + 32, 48) ==
+            expected(SEGMENT_SIZE + 1048576 + 32, 48));
+  KJ_EXPECT(readSegment(dir, segment0, 0, 1 << 30) == expected(0, SEGMENT_SIZE));
+  KJ_EXPECT(readSegment(dir, segment1, SEGMENT_SIZE, 16) == "");
+
+  // The open segment, uncompressed.
+  KJ_EXPECT(readSegment(dir, segment2, 16, 32) == expected(SEGMENT_SIZE * 2 + 16, 32));
+}
+
+// =======================================================================================
+
+struct LogSinkTestEnv {
+  // A LogSink writing its text to a temporary file, listening on a loopback port.
+
+  kj::AsyncIoContext io;
+  kj::WaitScope& waitScope;
+  kj::AutoCloseFd output;
+  LogSink sink;
+  uint port;
+  kj::Promise<void> acceptTask;
+
+  LogSinkTestEnv()
+      : io(kj::setupAsyncIo()),
+        waitScope(io.waitScope),
+        output(newRingFile()),
+        sink(io.provider->getTimer(), output),
+        acceptTask(nullptr) {
+    auto listener = io.provider->getNetwork().parseAddress("127.0.0.1")
+        .wait(waitScope)->listen();
+    port = listener->getPort();
+    acceptTask = sink.acceptLoop(kj::mv(listener)).eagerlyEvaluate(nullptr);
+  }
+
+  kj::Own<kj::AsyncIoStream> connect(kj::StringPtr name) {
+    auto stream = io.provider->getNetwork().parseAddress("127.0.0.1", port)
+        .wait(waitScope)->connect().wait(waitScope);
+    send(*stream, kj::str(name, '\n'));
+    return stream;
+  }
+
+  void send(kj::AsyncIoStream& stream, kj::StringPtr text) {
+    stream.write(text.begin(), text.size()).wait(waitScope);
+  }
+
+  void sleep(kj::Duration duration) {
+    io.provider->getTimer().afterDelay(duration).wait(waitScope);
+  }
+
+  kj::String readOutput() {
+    struct stat stats;
+    KJ_SYSCALL(fstat(output, &stats));
+    auto result = kj::heapString(stats.st_size);
+    ssize_t n;
+    KJ_SYSCALL(n = pread(output, result.begin(), result.size(), 0));
+    KJ_ASSERT(n == stats.st_size);
+    return result;
+  }
+};
+
+uint countLines(kj::StringPtr text) {
+  uint result = 0;
+  for (char c: text) {
+    if (c == '\n') ++result;
+  }
+  return result;
+}
+
+KJ_TEST("LogSink buffers lines from all clients until the flush delay passes") {
+  LogSinkTestEnv env;
+  auto alice = env.connect("alice");
+  auto bob = env.connect("bob");
+  env.send(*alice, "hello from alice\n");
+  env.send(*bob, "hello from bob\n");
+
+  // Well short of the 100ms flush delay.
+  env.sleep(20 * kj::MILLISECONDS);
+  KJ_EXPECT(env.readOutput() == "");
+
+  env.sleep(200 * kj::MILLISECONDS);
+  auto text = env.readOutput();
+  KJ_EXPECT(countLines(text) == 4, text);
+  KJ_EXPECT(strstr(text.cStr(), " [alice           ] hello from alice\n") != nullptr, text);
+  KJ_EXPECT(strstr(text.cStr(), " [bob             ] hello from bob\n") != nullptr, text);
+}
+
+KJ_TEST("LogSink writes out a full buffer without waiting for the flush delay") {
+  LogSinkTestEnv env;
+  auto client = env.connect("alice");
+
+  // Each line takes a bit over 8k in the buffer with its timestamp and prefix, so the ninth
+  // doesn't fit in 64k.
+  auto line = kj::str(kj::repeat('x', 8000), '\n');
+  for (uint i = 0; i < 9; i++) {
+    env.send(*client, line);
+  }
+
+  env.sleep(20 * kj::MILLISECONDS);
+  KJ_EXPECT(countLines(env.readOutput()) == 9);  // CONNECTED, then eight lines
+
+  env.sleep(200 * kj::MILLISECONDS);
+  KJ_EXPECT(countLines(env.readOutput()) == 10);
+}
+
+KJ_TEST("LogSink writes out buffered lines when destroyed") {
+  kj::AutoCloseFd output = newRingFile();
+  {
+    LogSinkTestEnv env;
+    output = kj::AutoCloseFd(dup(env.output));
+    auto client = env.connect("alice");
+    env.send(*client, "goodbye\n");
+    env.sleep(20 * kj::MILLISECONDS);
+    KJ_EXPECT(env.readOutput() == "");
+  }
+
+  struct stat stats;
+  KJ_SYSCALL(fstat(output, &stats));
+  KJ_EXPECT(stats.st_size > 0);
+}
+
+}  // namespace
+}  // namespace blackrock
@@ -98,7 +98,7 @@ private:
     // Close log pipe on scope exit, so that thread stops.
     KJ_DEFER(KJ_SYSCALL(dup2(STDERR_FILENO, STDOUT_FILENO)));
 
-    LogSink sink;
+    LogSink sink(io.provider->getTimer());
     sink.acceptLoop(listen(io.provider->getNetwork())).wait(io.waitScope);
     return true;
   }
@@ -17,15 +17,30 @@
 #include "logs.h"
 #include "cluster-rpc.h"
 #include <sandstorm/util.h>
+#include <capnp/serialize.h>
+#include <capnp/serialize-async.h>
 #include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/sendfile.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
 
 namespace blackrock {
 
+static constexpr const char RECORDS_HEADER[] = "+records ";
+// A client sends this, followed by its name and a newline, in place of the name line to open a
+// records connection. It can't be mistaken for a name, since names can't contain '+'.
+
 class LogSink::ClientHandler {
 public:
   ClientHandler(LogSink& sink, kj::Own<kj::AsyncIoStream> stream, kj::String addr)
@@ -53,6 +68,18 @@ public:
       uint lineStart = 0;
       for (uint i = 0; i < amount; i++) {
         if (buffer[i] == '\n') {
+          size_t headerSize = strlen(RECORDS_HEADER);
+          if (prefix == nullptr && lineStart == 0 && i >= headerSize &&
+              memcmp(buffer, RECORDS_HEADER, headerSize) == 0) {
+            // This is a RecordShipper, not a stream of text. The rest of the stream is LogBatches;
+            // hand over whatever part of that we've already read.
+            auto name = kj::heapString(buffer + headerSize, i - headerSize);
+            auto rest = kj::heapArray<byte>(reinterpret_cast<byte*>(buffer) + i + 1,
+                                            amount - i - 1);
+            return sink.receiveRecords(
+                kj::heap<PrefixedInputStream>(kj::mv(rest), kj::mv(stream)), kj::mv(name));
+          }
+
           writeLine(kj::arrayPtr(buffer + lineStart, i + 1 - lineStart));
           lineStart = i + 1;
         } else if (i - lineStart >= 8192) {
@@ -144,7 +171,40 @@ private:
   }
 };
 
-LogSink::LogSink(): tasks(*this) {}
+class LogSink::PrefixedInputStream: public kj::AsyncInputStream {
+  // Returns `prefix` before anything read from `inner`.
+
+public:
+  PrefixedInputStream(kj::Array<byte> prefix, kj::Own<kj::AsyncInputStream> inner)
+      : prefix(kj::mv(prefix)), inner(kj::mv(inner)) {}
+
+  kj::Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+    if (offset < prefix.size()) {
+      size_t n = kj::min(maxBytes, prefix.size() - offset);
+      memcpy(buffer, prefix.begin() + offset, n);
+      offset += n;
+      if (n >= minBytes) return n;
+      return inner->tryRead(reinterpret_cast<byte*>(buffer) + n, minBytes - n, maxBytes - n)
+          .then([n](size_t more) { return n + more; });
+    }
+    return inner->tryRead(buffer, minBytes, maxBytes);
+  }
+
+private:
+  kj::Array<byte> prefix;
+  size_t offset = 0;
+  kj::Own<kj::AsyncInputStream> inner;
+};
+
+static constexpr size_t LOG_BUFFER_SIZE = 65536;
+static constexpr kj::Duration LOG_FLUSH_DELAY = 100 * kj::MILLISECONDS;
+
+LogSink::LogSink(kj::Timer& timer, int outputFd)
+    : timer(timer), outputFd(outputFd), buffer(kj::heapArray<char>(LOG_BUFFER_SIZE)), tasks(*this) {}
+
+LogSink::~LogSink() noexcept(false) {
+  flush();
+}
 
 kj::Promise<void> LogSink::acceptLoop(kj::Own<kj::ConnectionReceiver> receiver) {
   auto promise = receiver->accept();
@@ -158,16 +218,85 @@ kj::Promise<void> LogSink::acceptLoop(kj::Own<kj::ConnectionReceiver> receiver)
 }
 
 void LogSink::write(kj::ArrayPtr<const char> part1, kj::ArrayPtr<const char> part2) {
-  char timestampBuf[128];
   time_t now = time(nullptr);
-  struct tm local;
-  KJ_ASSERT(gmtime_r(&now, &local) != nullptr);
-  size_t n = strftime(timestampBuf, sizeof(timestampBuf), "%Y-%m-%d_%H-%M-%S", &local);
+  if (now != timestampTime || timestampSize == 0) {
+    struct tm local;
+    KJ_ASSERT(gmtime_r(&now, &local) != nullptr);
+    timestampSize = strftime(timestamp, sizeof(timestamp), "%Y-%m-%d_%H-%M-%S", &local);
+    timestampTime = now;
+  }
+
+  size_t size = timestampSize + part1.size() + part2.size();
+  if (bufferUsed + size > buffer.size()) {
+    flush();
+
+    if (size > buffer.size()) {
+      // Won't fit at all. Can't happen with lines from ClientHandler, which are at most 8k.
+      kj::ArrayPtr<const byte> pieces[3] = {
+        kj::arrayPtr(timestamp, timestampSize).asBytes(), part1.asBytes(), part2.asBytes() };
+      kj::FdOutputStream(outputFd).write(pieces);
+      return;
+    }
+  }
+
+  char* pos = buffer.begin() + bufferUsed;
+  memcpy(pos, timestamp, timestampSize);
+  pos += timestampSize;
+  memcpy(pos, part1.begin(), part1.size());
+  pos += part1.size();
+  memcpy(pos, part2.begin(), part2.size());
+  bufferUsed += size;
+
+  if (!flushScheduled) {
+    flushScheduled = true;
+    flushTask = timer.afterDelay(LOG_FLUSH_DELAY).then([this]() {
+      flushScheduled = false;
+      flush();
+    }).eagerlyEvaluate([](kj::Exception&& exception) {
+      KJ_LOG(ERROR, "failed to write logs", exception);
+    });
+  }
+}
+
+void LogSink::flush() {
+  if (bufferUsed == 0) return;
+
+  size_t size = bufferUsed;
+  bufferUsed = 0;
+  kj::FdOutputStream(outputFd).write(buffer.begin(), size);
+}
 
-  kj::StringPtr timestamp(timestampBuf, n);
+kj::Maybe<LogStore&> LogSink::getStore() {
+  if (store == nullptr && !storeFailed) {
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      store = kj::heap<LogStore>(LOG_RECORD_DIR);
+    })) {
+      // Don't keep trying (and complaining) on every batch. The text logs still work.
+      KJ_LOG(ERROR, "couldn't open log record store; discarding log records", *exception);
+      storeFailed = true;
+    }
+  }
 
-  kj::ArrayPtr<const byte> pieces[3] = { timestamp.asBytes(), part1.asBytes(), part2.asBytes() };
-  kj::FdOutputStream(STDOUT_FILENO).write(pieces);
+  KJ_IF_MAYBE(s, store) {
+    return **s;
+  } else {
+    return nullptr;
+  }
+}
+
+kj::Promise<void> LogSink::receiveRecords(kj::Own<kj::AsyncInputStream> stream, kj::String name) {
+  auto promise = capnp::tryReadMessage(*stream);
+  return promise.then([this,KJ_MVCAP(stream),KJ_MVCAP(name)](
+      kj::Maybe<kj::Own<capnp::MessageReader>>&& message) mutable -> kj::Promise<void> {
+    KJ_IF_MAYBE(m, message) {
+      KJ_IF_MAYBE(s, getStore()) {
+        s->add(m->get()->getRoot<LogBatch>(), name);
+      }
+      return receiveRecords(kj::mv(stream), kj::mv(name));
+    } else {
+      return kj::READY_NOW;
+    }
+  });
 }
 
 void LogSink::taskFailed(kj::Exception&& exception) {
@@ -182,11 +311,315 @@ static time_t currentDay() {
   return time(nullptr) / 86400;
 }
 
-void rotateLogs(int input, int logDirFd) {
+static constexpr size_t LOG_FRAME_SIZE = 1u << 20;
+static constexpr uint64_t LOG_RETAINED_SIZE = 4ull << 30;
+
+static kj::Array<kj::String> listFiles(int dirFd, kj::StringPtr prefix) {
+  // Names of all files in the directory which start with `prefix`, sorted.
+
+  int fd;
+  KJ_SYSCALL(fd = dup(dirFd));
+  DIR* dir = fdopendir(fd);
+  if (dir == nullptr) {
+    int error = errno;
+    close(fd);
+    KJ_FAIL_SYSCALL("fdopendir", error);
+  }
+  KJ_DEFER(closedir(dir));
+
+  // The duplicate shares its offset with `dirFd`, which may have been read before.
+  rewinddir(dir);
+
+  kj::Vector<kj::String> result;
+  while (struct dirent* entry = readdir(dir)) {
+    kj::StringPtr name = entry->d_name;
+    if (name.startsWith(prefix)) {
+      result.add(kj::heapString(name));
+    }
+  }
+
+  std::sort(result.begin(), result.end(), [](const kj::String& a, const kj::String& b) {
+    return kj::StringPtr(a) < kj::StringPtr(b);
+  });
+  return result.releaseAsArray();
+}
+
+static kj::Array<kj::String> listLogFiles(int logDirFd) {
+  // Names of all log files in the directory, other than the `blackrock.current` link, sorted. This
+  // also sorts them chronologically.
+
+  kj::Vector<kj::String> result;
+  for (auto& name: listFiles(logDirFd, "blackrock.")) {
+    if (name != "blackrock.current") {
+      result.add(kj::mv(name));
+    }
+  }
+  return result.releaseAsArray();
+}
+
+static kj::String segmentName(kj::StringPtr dayName, uint index) {
+  char suffix[16];
+  snprintf(suffix, sizeof(suffix), "%04u", index);
+  return kj::str(dayName, '.', suffix);
+}
+
+static kj::String chooseSegment(int logDirFd, kj::StringPtr dayName, uint64_t segmentSize) {
+  // Returns the name of the segment of the given day's log to append to: the last one, if it
+  // hasn't been compressed and isn't full (e.g. because we restarted), otherwise a new one.
+
+  auto prefix = kj::str(dayName, '.');
+  kj::Maybe<uint> last;
+  for (auto& name: listLogFiles(logDirFd)) {
+    if (!name.startsWith(prefix)) continue;
+
+    auto rest = name.slice(prefix.size());
+    char* end;
+    uint index = strtoul(rest.begin(), &end, 10);
+    if (end != rest.begin() + 4) continue;
+
+    KJ_IF_MAYBE(l, last) {
+      if (index > *l) last = index;
+    } else {
+      last = index;
+    }
+  }
+
+  KJ_IF_MAYBE(l, last) {
+    auto name = segmentName(dayName, *l);
+    struct stat stats;
+    if (fstatat(logDirFd, name.cStr(), &stats, 0) >= 0 && uint64_t(stats.st_size) < segmentSize) {
+      return name;
+    }
+    return segmentName(dayName, *l + 1);
+  } else {
+    return segmentName(dayName, 0);
+  }
+}
+
+static void preadExactly(int fd, void* buffer, size_t size, uint64_t offset) {
+  byte* pos = reinterpret_cast<byte*>(buffer);
+  while (size > 0) {
+    ssize_t n;
+    KJ_SYSCALL(n = pread(fd, pos, size, offset));
+    KJ_REQUIRE(n > 0, "unexpected end of file");
+    pos += n;
+    size -= n;
+    offset += n;
+  }
+}
+
+static kj::Array<uint64_t> findZstdFrames(int fd) {
+  // Returns the offset at which each frame of the zstd-compressed file `fd` starts, found by
+  // walking the frame and block headers (see RFC 8878, section 3.1.1).
+
+  struct stat stats;
+  KJ_SYSCALL(fstat(fd, &stats));
+  uint64_t size = stats.st_size;
+
+  kj::Vector<uint64_t> result;
+  uint64_t offset = 0;
+  while (offset < size) {
+    result.add(offset);
+
+    byte header[6];  // magic number, frame header descriptor, window descriptor
+    preadExactly(fd, header, sizeof(header), offset);
+    uint32_t magic = header[0] | (header[1] << 8) | (header[2] << 16) | (uint32_t(header[3]) << 24);
+    KJ_REQUIRE(magic == 0xFD2FB528u, "not a zstd frame", offset);
+
+    static const uint DICT_ID_SIZES[4] = { 0, 1, 2, 4 };
+    byte descriptor = header[4];
+    bool singleSegment = descriptor & 0x20;
+    uint contentSizeFlag = descriptor >> 6;
+    uint contentSizeSize = contentSizeFlag == 0 ? (singleSegment ? 1 : 0) : 1u << contentSizeFlag;
+    offset += 5 + (singleSegment ? 0 : 1) + DICT_ID_SIZES[descriptor & 3] + contentSizeSize;
+
+    for (;;) {
+      byte block[3];
+      preadExactly(fd, block, sizeof(block), offset);
+      uint32_t blockHeader = block[0] | (block[1] << 8) | (block[2] << 16);
+      uint type = (blockHeader >> 1) & 3;
+      KJ_REQUIRE(type != 3, "reserved zstd block type", offset);
+      // RLE blocks hold a single byte, repeated.
+      offset += 3 + (type == 1 ? 1 : blockHeader >> 3);
+      if (blockHeader & 1) break;  // last block
+    }
+
+    if (descriptor & 0x04) offset += 4;  // content checksum
+  }
+  KJ_REQUIRE(offset == size, "truncated zstd frame");
+
+  return result.releaseAsArray();
+}
+
+static void compressSegment(int logDirFd, kj::StringPtr name) {
+  // Replaces `name` with `name.zst`, written as a series of independent zstd frames each holding
+  // LOG_FRAME_SIZE bytes of the input, plus `name.zst.idx`, which lists the uncompressed and
+  // compressed offsets at which each frame starts, one pair per line. `zstdcat` reads the result
+  // as usual, while readLogSegment() uses the index to decompress just the frames it needs.
+  //
+  // A single zstd process compresses the whole segment: it's given a pipe per frame as a separate
+  // input file, and compresses each input file into a frame of its own. We feed the pipes in
+  // order, and afterwards find where each frame ended up.
+
+  auto input = sandstorm::raiiOpenAt(logDirFd, name, O_RDONLY | O_CLOEXEC);
+  struct stat stats;
+  KJ_SYSCALL(fstat(input, &stats));
+  // An empty segment still gets one (empty) frame.
+  size_t frameCount = kj::max((uint64_t(stats.st_size) + LOG_FRAME_SIZE - 1) / LOG_FRAME_SIZE,
+                              uint64_t(1));
+
+  auto zstName = kj::str(name, ".zst");
+  auto tmpName = kj::str(zstName, ".tmp");
+  auto idxName = kj::str(zstName, ".idx");
+  auto idxTmpName = kj::str(idxName, ".tmp");
+  KJ_ON_SCOPE_FAILURE({
+    unlinkat(logDirFd, tmpName.cStr(), 0);
+    unlinkat(logDirFd, idxTmpName.cStr(), 0);
+  });
+
+  auto output = sandstorm::raiiOpenAt(logDirFd, tmpName, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC);
+
+  {
+    auto pipeBuilder = kj::heapArrayBuilder<sandstorm::Pipe>(frameCount);
+    for (size_t i = 0; i < frameCount; i++) {
+      pipeBuilder.add(sandstorm::Pipe::make());
+    }
+    auto pipes = pipeBuilder.finish();
+
+    auto readEnds = kj::heapArray<int>(frameCount);
+    kj::Vector<kj::String> paths;
+    kj::Vector<kj::StringPtr> args;
+    args.addAll(kj::ArrayPtr<const kj::StringPtr>({"zstd", "-q", "-c"}));
+    for (auto i: kj::indices(pipes)) {
+      readEnds[i] = pipes[i].readEnd;
+      // moreFds start at 3.
+      paths.add(kj::str("/dev/fd/", i + 3));
+      args.add(paths[i]);
+    }
+
+    sandstorm::Subprocess::Options options(args.asPtr());
+    options.stdout = output;
+    options.moreFds = readEnds;
+    sandstorm::Subprocess zstd(kj::mv(options));
+    for (auto& pipe: pipes) {
+      pipe.readEnd = nullptr;
+    }
+
+    auto frame = kj::heapArray<byte>(LOG_FRAME_SIZE);
+    for (auto& pipe: pipes) {
+      size_t n = kj::FdInputStream(input.get()).tryRead(frame.begin(), frame.size(), frame.size());
+      kj::FdOutputStream(pipe.writeEnd.get()).write(frame.begin(), n);
+      pipe.writeEnd = nullptr;
+    }
+    zstd.waitForSuccess();
+  }
+
+  auto frames = findZstdFrames(output);
+  KJ_ASSERT(frames.size() == frameCount, "zstd didn't write one frame per input",
+            frames.size(), frameCount);
+
+  kj::Vector<kj::String> index;
+  for (auto i: kj::indices(frames)) {
+    index.add(kj::str(i * LOG_FRAME_SIZE, ' ', frames[i], '\n'));
+  }
+  auto indexText = kj::strArray(index, "");
+  kj::FdOutputStream(sandstorm::raiiOpenAt(logDirFd, idxTmpName,
+                                           O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC))
+      .write(indexText.begin(), indexText.size());
+
+  // The index goes first, so that every `.zst` has one.
+  KJ_SYSCALL(renameat(logDirFd, idxTmpName.cStr(), logDirFd, idxName.cStr()));
+  KJ_SYSCALL(renameat(logDirFd, tmpName.cStr(), logDirFd, zstName.cStr()));
+  KJ_SYSCALL(unlinkat(logDirFd, name.cStr(), 0));
+}
+
+static void archiveLogs(int logDirFd, kj::StringPtr current) {
+  // Compresses every log file other than `current` that isn't already compressed, then deletes the
+  // oldest files until the total is within LOG_RETAINED_SIZE. A file that can't be compressed
+  // (e.g. because zstd is missing) is left as is, and still counts toward the total. Run in a child
+  // process, so that rotateLogs() can keep reading logs meanwhile.
+
+  for (auto& name: listLogFiles(logDirFd)) {
+    if (name == current || name.endsWith(".zst") || name.endsWith(".idx") ||
+        name.endsWith(".tmp")) {
+      continue;
+    }
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      compressSegment(logDirFd, name);
+    })) {
+      KJ_LOG(ERROR, "couldn't compress log segment; leaving it uncompressed", name, *exception);
+    }
+  }
+
+  auto names = listLogFiles(logDirFd);
+  auto sizes = kj::heapArray<uint64_t>(names.size());
+  uint64_t total = 0;
+  for (auto i: kj::indices(names)) {
+    struct stat stats;
+    if (fstatat(logDirFd, names[i].cStr(), &stats, 0) < 0) {
+      // Deleted meanwhile, most likely.
+      sizes[i] = 0;
+      continue;
+    }
+    sizes[i] = stats.st_size;
+    total += stats.st_size;
+  }
+
+  for (auto i: kj::indices(names)) {
+    if (total <= LOG_RETAINED_SIZE) break;
+    if (names[i] == current) continue;
+
+    if (unlinkat(logDirFd, names[i].cStr(), 0) < 0 && errno != ENOENT) {
+      KJ_LOG(ERROR, "couldn't delete old log file", names[i], strerror(errno));
+      continue;
+    }
+    total -= sizes[i];
+  }
+}
+
+static pid_t startArchiver(int logDirFd, kj::StringPtr current) {
+  pid_t pid;
+  KJ_SYSCALL(pid = fork());
+  if (pid == 0) {
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      archiveLogs(logDirFd, current);
+    })) {
+      KJ_LOG(ERROR, "log archiving failed", *exception);
+      _exit(1);
+    }
+    _exit(0);
+  }
+  return pid;
+}
+
+static bool reapArchiver(kj::Maybe<pid_t>& archiver, bool block) {
+  // Returns true if no archiver is running anymore, after collecting its exit status. Doesn't wait
+  // for it unless `block` is true.
+
+  KJ_IF_MAYBE(pid, archiver) {
+    int status;
+    pid_t result;
+    KJ_SYSCALL(result = waitpid(*pid, &status, block ? 0 : WNOHANG));
+    if (result == 0) return false;
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      // Whatever it didn't get to will be retried next time.
+      KJ_LOG(ERROR, "log archiver failed", status);
+    }
+    archiver = nullptr;
+  }
+  return true;
+}
+
+void rotateLogs(int input, int logDirFd, uint64_t segmentSize) {
   char buffer [8192];
 
   time_t day = currentDay();
   kj::AutoCloseFd output;
+  kj::String outputName;
+  uint64_t outputSize = 0;
+  kj::Maybe<pid_t> archiver;
+  bool archivePending = false;
   for (;;) {
     ssize_t n;
     KJ_SYSCALL(n = read(input, buffer, sizeof(buffer)));
@@ -199,7 +632,12 @@ void rotateLogs(int input, int logDirFd) {
       KJ_ASSERT(gmtime_r(&now, &local) != nullptr);
       strftime(timestamp, sizeof(timestamp), "blackrock.%Y-%m-%d", &local);
 
-      output = sandstorm::raiiOpenAt(logDirFd, timestamp, O_WRONLY | O_CREAT | O_APPEND);
+      outputName = chooseSegment(logDirFd, timestamp, segmentSize);
+      output = sandstorm::raiiOpenAt(logDirFd, outputName,
+                                     O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC);
+      struct stat stats;
+      KJ_SYSCALL(fstat(output, &stats));
+      outputSize = stats.st_size;
 
       while (unlinkat(logDirFd, "blackrock.current", 0) < 0) {
         int error = errno;
@@ -211,39 +649,769 @@ void rotateLogs(int input, int logDirFd) {
         }
       }
 
-      KJ_SYSCALL(symlinkat(timestamp, logDirFd, "blackrock.current"));
+      KJ_SYSCALL(symlinkat(outputName.cStr(), logDirFd, "blackrock.current"));
+
+      // Compress the segment we just closed, and any left over from before we restarted.
+      archivePending = true;
+    }
+
+    // If the previous archiver is still busy, we'll start the next one once it's done, rather than
+    // stop reading logs to wait for it.
+    if (archivePending && reapArchiver(archiver, false)) {
+      archiver = startArchiver(logDirFd, outputName);
+      archivePending = false;
     }
 
     kj::FdOutputStream(output.get()).write(buffer, n);
+    outputSize += n;
 
     time_t newDay = currentDay();
-    if (newDay > day && buffer[n-1] == '\n') {
-      // A new day just started and we just saw a line break. Start a new file.
+    if ((newDay > day || outputSize >= segmentSize) && buffer[n-1] == '\n') {
+      // A new day just started, or the segment is full, and we just saw a line break. Start a new
+      // file.
       output = nullptr;
       day = newDay;
     }
   }
+
+  reapArchiver(archiver, true);
+  if (archivePending) {
+    archiver = startArchiver(logDirFd, outputName);
+    reapArchiver(archiver, true);
+  }
+}
+
+kj::Array<byte> readLogSegment(int logDirFd, kj::StringPtr name, uint64_t offset, size_t size) {
+  KJ_IF_MAYBE(fd, sandstorm::raiiOpenAtIfExists(logDirFd, name, O_RDONLY | O_CLOEXEC)) {
+    struct stat stats;
+    KJ_SYSCALL(fstat(*fd, &stats));
+    uint64_t fileSize = stats.st_size;
+    size = kj::min(uint64_t(size), fileSize - kj::min(offset, fileSize));
+
+    auto result = kj::heapArray<byte>(size);
+    size_t total = 0;
+    while (total < size) {
+      ssize_t n;
+      KJ_SYSCALL(n = pread(*fd, result.begin() + total, size - total, offset + total));
+      if (n == 0) break;
+      total += n;
+    }
+    return kj::heapArray<byte>(result.slice(0, total));
+  }
+
+  // Compressed meanwhile, or long ago. Find the frames covering the range in the index.
+  auto zstName = kj::str(name, ".zst");
+  auto zstFd = sandstorm::raiiOpenAt(logDirFd, zstName, O_RDONLY | O_CLOEXEC);
+  uint64_t firstUncompressed = 0;
+  uint64_t firstCompressed = 0;
+  kj::Maybe<uint64_t> endCompressed;
+  auto indexText = sandstorm::readAll(
+      sandstorm::raiiOpenAt(logDirFd, kj::str(zstName, ".idx"), O_RDONLY | O_CLOEXEC));
+  for (auto& line: sandstorm::splitLines(kj::mv(indexText))) {
+    char* end;
+    uint64_t uncompressed = strtoull(line.cStr(), &end, 10);
+    uint64_t compressed = strtoull(end, &end, 10);
+    KJ_REQUIRE(*end == '\0', "bad log index line", zstName, line);
+
+    if (uncompressed <= offset) {
+      firstUncompressed = uncompressed;
+      firstCompressed = compressed;
+    } else if (uncompressed >= offset + size) {
+      endCompressed = compressed;
+      break;
+    }
+  }
+
+  uint64_t compressedEnd;
+  KJ_IF_MAYBE(e, endCompressed) {
+    compressedEnd = *e;
+  } else {
+    struct stat stats;
+    KJ_SYSCALL(fstat(zstFd, &stats));
+    compressedEnd = stats.st_size;
+  }
+
+  // zstd reads just those frames from a temporary copy, so that we can read its output as it
+  // comes without risking a deadlock.
+  auto frames = sandstorm::raiiOpenAt(logDirFd, ".", O_RDWR | O_TMPFILE | O_CLOEXEC, 0600);
+  off_t copyOffset = firstCompressed;
+  uint64_t remaining = compressedEnd - firstCompressed;
+  while (remaining > 0) {
+    ssize_t n;
+    KJ_SYSCALL(n = sendfile(frames, zstFd, &copyOffset, remaining));
+    KJ_REQUIRE(n > 0, "log archive shrank while reading", zstName);
+    remaining -= n;
+  }
+  KJ_SYSCALL(lseek(frames, 0, SEEK_SET));
+
+  auto pipe = sandstorm::Pipe::make();
+  sandstorm::Subprocess::Options options({"zstd", "-d", "-q", "-c"});
+  options.stdin = frames;
+  options.stdout = pipe.writeEnd;
+  sandstorm::Subprocess zstd(kj::mv(options));
+  pipe.writeEnd = nullptr;
+  auto text = sandstorm::readAll(pipe.readEnd);
+  zstd.waitForSuccess();
+
+  uint64_t skip = kj::min(offset - firstUncompressed, uint64_t(text.size()));
+  auto bytes = text.asBytes().slice(skip, text.size());
+  return kj::heapArray(bytes.slice(0, kj::min(size, bytes.size())));
+}
+
+// =======================================================================================
+
+static const char* const SEVERITY_NAMES[] = { "info", "warning", "error", "fatal", "debug" };
+// Indexed by LogRecord::Severity. These are also the prefixes KJ puts on log text.
+
+static kj::StringPtr severityName(LogRecord::Severity severity) {
+  uint i = static_cast<uint>(severity);
+  return i < kj::size(SEVERITY_NAMES) ? kj::StringPtr(SEVERITY_NAMES[i]) : "unknown";
+}
+
+void parseLogText(kj::StringPtr text, LogRecord::Builder record) {
+  // KJ formats log text as "<severity>: <part>; <part>; ...\n", where each parameter to KJ_LOG()
+  // other than a string literal is formatted as "<expression> = <value>". Those become fields, the
+  // rest the message. Values may themselves contain "; " (exception descriptions do), so a part
+  // that doesn't look like a field is taken to continue the preceding field, if any.
+
+  size_t size = text.size();
+  if (size > 0 && text[size - 1] == '\n') --size;
+  auto body = kj::heapString(text.begin(), size);
+  kj::StringPtr rest = body;
+
+  record.setSeverity(LogRecord::Severity::INFO);
+  for (uint i = 0; i < kj::size(SEVERITY_NAMES); i++) {
+    auto prefix = kj::str(SEVERITY_NAMES[i], ": ");
+    if (rest.startsWith(prefix)) {
+      record.setSeverity(static_cast<LogRecord::Severity>(i));
+      rest = rest.slice(prefix.size());
+      break;
+    }
+  }
+
+  kj::Vector<kj::String> message;
+  kj::Vector<std::pair<kj::String, kj::String>> fields;
+  for (;;) {
+    const char* end = strstr(rest.cStr(), "; ");
+    kj::ArrayPtr<const char> part(rest.begin(), end == nullptr ? rest.end() : end);
+
+    const char* equals = strstr(rest.cStr(), " = ");
+    if (equals != nullptr && equals > part.begin() && equals < part.end() &&
+        memchr(part.begin(), ' ', equals - part.begin()) == nullptr) {
+      fields.add(kj::heapString(part.begin(), equals - part.begin()),
+                 kj::heapString(equals + 3, part.end() - (equals + 3)));
+    } else if (fields.size() > 0) {
+      auto& value = fields[fields.size() - 1].second;
+      value = kj::str(value, "; ", part);
+    } else {
+      message.add(kj::heapString(part));
+    }
+
+    if (end == nullptr) break;
+    rest = kj::StringPtr(end + 2);
+  }
+
+  record.setMessage(kj::strArray(message, "; "));
+  auto list = record.initFields(fields.size());
+  for (auto i: kj::indices(fields)) {
+    list[i].setKey(fields[i].first);
+    list[i].setValue(fields[i].second);
+  }
+}
+
+StructuredLogger::StructuredLogger(kj::AutoCloseFd fd, kj::StringPtr machine)
+    : fd(kj::mv(fd)), machine(kj::heapString(machine)) {}
+
+void StructuredLogger::logMessage(const char* file, int line, int contextDepth,
+                                  kj::String&& text) {
+  if (!broken) {
+    // Careful not to log anything in here, since it would come right back to us.
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      struct timespec now;
+      KJ_SYSCALL(clock_gettime(CLOCK_REALTIME, &now));
+
+      capnp::MallocMessageBuilder message(256);
+      auto record = message.initRoot<LogRecord>();
+      record.setTimeNs(int64_t(now.tv_sec) * 1000000000 + now.tv_nsec);
+      record.setMachine(machine);
+      record.setFile(file);
+      record.setLine(line);
+      parseLogText(text, record);
+      capnp::writeMessageToFd(fd, message);
+    })) {
+      // Presumably the log client went away. The text logs will have to do.
+      broken = true;
+    }
+  }
+
+  next.logMessage(file, line, contextDepth, kj::mv(text));
+}
+
+// ---------------------------------------------------------------------------------------
+
+static constexpr uint64_t RECORD_SEGMENT_SIZE = 64ull << 20;
+static constexpr uint64_t RECORD_RETAINED_SIZE = 2ull << 30;
+static constexpr uint RECORD_TIME_INTERVAL = 1024;
+static constexpr size_t MAX_INDEXED_VALUE_SIZE = 64;
+static constexpr int64_t RECORD_TIME_SLACK_NS = 5ll * 60 * 1000000000;
+
+static kj::String recordSegmentName(uint number) {
+  char name[32];
+  snprintf(name, sizeof(name), "records.%06u", number);
+  return kj::str(name);
+}
+
+static kj::String recordIndexName(uint number) {
+  return kj::str(recordSegmentName(number), ".index");
+}
+
+static std::map<uint, bool> listRecordSegments(int dirFd) {
+  // Maps the number of each segment in the directory to whether it has been indexed.
+
+  std::map<uint, bool> result;
+  for (auto& name: listFiles(dirFd, "records.")) {
+    auto rest = name.slice(strlen("records."));
+    char* end;
+    uint number = strtoul(rest.begin(), &end, 10);
+    if (end != rest.begin() + 6) continue;
+
+    // A segment sorts before its index.
+    if (*end == '\0') {
+      result.insert(std::make_pair(number, false));
+    } else if (kj::StringPtr(end) == ".index") {
+      auto iter = result.find(number);
+      if (iter != result.end()) {
+        iter->second = true;
+      }
+    }
+  }
+  return result;
+}
+
+class RecordSegmentReader {
+  // Maps a segment into memory to read records from it.
+
+public:
+  RecordSegmentReader(int dirFd, kj::StringPtr name) {
+    auto fd = sandstorm::raiiOpenAt(dirFd, name, O_RDONLY | O_CLOEXEC);
+    struct stat stats;
+    KJ_SYSCALL(fstat(fd, &stats));
+
+    // The segment may be in the middle of being appended to, so ignore any partial word.
+    size = stats.st_size / sizeof(capnp::word) * sizeof(capnp::word);
+    if (size > 0) {
+      void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapping == MAP_FAILED) {
+        KJ_FAIL_SYSCALL("mmap(segment)", errno, name);
+      }
+      words = reinterpret_cast<const capnp::word*>(mapping);
+    }
+  }
+
+  ~RecordSegmentReader() noexcept(false) {
+    if (size > 0) {
+      KJ_SYSCALL(munmap(const_cast<capnp::word*>(words), size));
+    }
+  }
+
+  KJ_DISALLOW_COPY(RecordSegmentReader);
+
+  uint64_t getSize() { return size; }
+
+  template <typename Func>
+  kj::Maybe<uint64_t> read(uint64_t offset, Func&& func) {
+    // Calls `func` on the record at `offset` and returns the offset of the next one, or returns
+    // null if the record is cut off by the end of the segment.
+
+    KJ_REQUIRE(offset % sizeof(capnp::word) == 0 && offset < size, "bad log record offset", offset);
+
+    kj::Own<capnp::FlatArrayMessageReader> reader;
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      reader = kj::heap<capnp::FlatArrayMessageReader>(kj::arrayPtr(
+          words + offset / sizeof(capnp::word), words + size / sizeof(capnp::word)));
+    })) {
+      return nullptr;
+    }
+
+    func(reader->getRoot<LogRecord>());
+    return (reader->getEnd() - words) * sizeof(capnp::word);
+  }
+
+private:
+  uint64_t size;
+  const capnp::word* words = nullptr;
+};
+
+template <typename Func>
+static void scanSegment(RecordSegmentReader& reader, uint64_t offset, Func&& func) {
+  // Calls func(offset, record) on each record from `offset` to the end of the segment, or up to a
+  // record that's cut off because it's still being written (or we crashed while writing it).
+
+  while (offset < reader.getSize()) {
+    KJ_IF_MAYBE(next, reader.read(offset, [&](LogRecord::Reader record) {
+      func(offset, record);
+    })) {
+      offset = *next;
+    } else {
+      break;
+    }
+  }
+}
+
+class LogStore::Indexer {
+public:
+  void add(uint64_t offset, LogRecord::Reader record) {
+    int64_t time = record.getTimeNs();
+    if (count == 0 || time < startTimeNs) startTimeNs = time;
+    if (count == 0 || time > endTimeNs) endTimeNs = time;
+    if (count % RECORD_TIME_INTERVAL == 0) {
+      times.add(TimeEntry { time, offset });
+    }
+    ++count;
+
+    addTerm("severity", severityName(record.getSeverity()), offset);
+    addTerm("machine", record.getMachine(), offset);
+    for (auto field: record.getFields()) {
+      addTerm(field.getKey(), field.getValue(), offset);
+    }
+  }
+
+  void write(int dirFd, kj::StringPtr name) {
+    capnp::MallocMessageBuilder message;
+    auto index = message.initRoot<LogSegmentIndex>();
+    index.setStartTimeNs(startTimeNs);
+    index.setEndTimeNs(endTimeNs);
+
+    auto timeList = index.initTimes(times.size());
+    for (auto i: kj::indices(times)) {
+      timeList[i].setTimeNs(times[i].timeNs);
+      timeList[i].setOffset(times[i].offset);
+    }
+
+    auto termList = index.initTerms(terms.size());
+    uint i = 0;
+    for (auto& entry: terms) {
+      auto& term = entry.second;
+      auto builder = termList[i++];
+      builder.setKey(term.key);
+      builder.setValue(term.value);
+      auto offsets = builder.initOffsets(term.offsets.size());
+      for (auto j: kj::indices(term.offsets)) {
+        offsets.set(j, term.offsets[j]);
+      }
+    }
+
+    // Write to a temporary file first so that readers never see a partial index.
+    auto tmpName = kj::str(name, ".tmp");
+    capnp::writeMessageToFd(sandstorm::raiiOpenAt(dirFd, tmpName,
+                                                  O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC),
+                            message);
+    KJ_SYSCALL(renameat(dirFd, tmpName.cStr(), dirFd, name.cStr()));
+  }
+
+private:
+  struct TimeEntry {
+    int64_t timeNs;
+    uint64_t offset;
+  };
+
+  struct Term {
+    kj::String id;
+    // The key and value separated by a NUL, so that sorting by ID sorts by key, then value, which
+    // is the order query() expects.
+
+    kj::String key;
+    kj::String value;
+    kj::Vector<uint64_t> offsets;
+  };
+
+  uint64_t count = 0;
+  int64_t startTimeNs = 0;
+  int64_t endTimeNs = 0;
+  kj::Vector<TimeEntry> times;
+  std::map<kj::StringPtr, Term> terms;
+  // Keyed by Term::id.
+
+  void addTerm(kj::StringPtr key, kj::StringPtr value, uint64_t offset) {
+    if (value.size() > MAX_INDEXED_VALUE_SIZE) return;
+
+    auto id = kj::str(key, '\0', value);
+    auto iter = terms.find(id);
+    if (iter == terms.end()) {
+      kj::StringPtr idPtr = id;
+      iter = terms.insert(std::make_pair(idPtr, Term {
+          kj::mv(id), kj::heapString(key), kj::heapString(value), {} })).first;
+    }
+    iter->second.offsets.add(offset);
+  }
+};
+
+LogStore::LogStore(kj::StringPtr dir) {
+  sandstorm::recursivelyCreateParent(kj::str(dir, "/dummy"));
+  dirFd = sandstorm::raiiOpen(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+  segmentNumber = 0;
+  for (auto& entry: listRecordSegments(dirFd)) {
+    if (!entry.second) {
+      // The previous log sink didn't get to finish this one, probably because it crashed.
+      Indexer recoveredIndexer;
+      RecordSegmentReader reader(dirFd, recordSegmentName(entry.first));
+      scanSegment(reader, 0, [&](uint64_t offset, LogRecord::Reader record) {
+        recoveredIndexer.add(offset, record);
+      });
+      recoveredIndexer.write(dirFd, recordIndexName(entry.first));
+    }
+    segmentNumber = entry.first + 1;
+  }
+
+  startSegment();
+}
+
+LogStore::~LogStore() noexcept(false) {
+  finishSegment();
+}
+
+void LogStore::add(LogBatch::Reader batch, kj::StringPtr defaultMachine) {
+  auto records = batch.getRecords();
+  if (records.size() == 0) return;
+
+  auto messages = kj::heapArrayBuilder<kj::Own<capnp::MallocMessageBuilder>>(records.size());
+  auto flatMessages = kj::heapArrayBuilder<kj::Array<capnp::word>>(records.size());
+  size_t totalWords = 0;
+  for (auto record: records) {
+    auto message = kj::heap<capnp::MallocMessageBuilder>(record.totalSize().wordCount + 16);
+    message->setRoot(record);
+    if (record.getMachine().size() == 0) {
+      message->getRoot<LogRecord>().setMachine(defaultMachine);
+    }
+    auto words = capnp::messageToFlatWords(*message);
+    totalWords += words.size();
+    messages.add(kj::mv(message));
+    flatMessages.add(kj::mv(words));
+  }
+
+  // Write the whole batch at once, so that it takes one syscall and so that a query scanning the
+  // open segment rarely sees a partial record.
+  auto buffer = kj::heapArray<capnp::word>(totalWords);
+  capnp::word* pos = buffer.begin();
+  for (auto& words: flatMessages) {
+    memcpy(pos, words.begin(), words.asBytes().size());
+    pos += words.size();
+  }
+  kj::FdOutputStream(segment.get()).write(buffer.begin(), buffer.asBytes().size());
+
+  for (auto i: kj::indices(messages)) {
+    indexer->add(segmentSize, messages[i]->getRoot<LogRecord>().asReader());
+    segmentSize += flatMessages[i].asBytes().size();
+  }
+
+  if (segmentSize >= RECORD_SEGMENT_SIZE) {
+    finishSegment();
+    ++segmentNumber;
+    startSegment();
+    deleteOldSegments();
+  }
+}
+
+void LogStore::startSegment() {
+  segment = sandstorm::raiiOpenAt(dirFd, recordSegmentName(segmentNumber),
+                                  O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC);
+  segmentSize = 0;
+  indexer = kj::heap<Indexer>();
+}
+
+void LogStore::finishSegment() {
+  segment = nullptr;
+  indexer->write(dirFd, recordIndexName(segmentNumber));
+}
+
+void LogStore::deleteOldSegments() {
+  // Deletes the oldest segments, and their indexes, until the total is within
+  // RECORD_RETAINED_SIZE.
+
+  auto current = recordSegmentName(segmentNumber);
+  auto names = listFiles(dirFd, "records.");
+  auto sizes = kj::heapArray<uint64_t>(names.size());
+  uint64_t total = 0;
+  for (auto i: kj::indices(names)) {
+    struct stat stats;
+    KJ_SYSCALL(fstatat(dirFd, names[i].cStr(), &stats, 0));
+    sizes[i] = stats.st_size;
+    total += stats.st_size;
+  }
+
+  for (auto i: kj::indices(names)) {
+    if (total <= RECORD_RETAINED_SIZE) break;
+    if (names[i].startsWith(current)) continue;
+
+    KJ_SYSCALL(unlinkat(dirFd, names[i].cStr(), 0));
+    total -= sizes[i];
+  }
+}
+
+static kj::Maybe<capnp::List<uint64_t>::Reader> findTerm(
+    LogSegmentIndex::Reader index, kj::StringPtr key, kj::StringPtr value) {
+  // Binary search; the Indexer writes terms sorted by key, then value.
+
+  auto terms = index.getTerms();
+  uint begin = 0;
+  uint end = terms.size();
+  while (begin < end) {
+    uint mid = (begin + end) / 2;
+    auto term = terms[mid];
+    kj::StringPtr termKey = term.getKey();
+    if (termKey < key || (termKey == key && term.getValue() < value)) {
+      begin = mid + 1;
+    } else {
+      end = mid;
+    }
+  }
+
+  if (begin < terms.size() && terms[begin].getKey() == key && terms[begin].getValue() == value) {
+    return terms[begin].getOffsets();
+  } else {
+    return nullptr;
+  }
+}
+
+static kj::Vector<uint64_t> intersectOffsets(
+    kj::ArrayPtr<const uint64_t> a, capnp::List<uint64_t>::Reader b) {
+  // Both are in increasing order.
+
+  kj::Vector<uint64_t> result;
+  uint j = 0;
+  for (uint64_t offset: a) {
+    while (j < b.size() && b[j] < offset) ++j;
+    if (j == b.size()) break;
+    if (b[j] == offset) result.add(offset);
+  }
+  return result;
+}
+
+static bool matchesQuery(LogRecord::Reader record, const LogStore::Query& query) {
+  if (record.getTimeNs() < query.sinceNs) return false;
+
+  for (auto& term: query.terms) {
+    if (term.first == "severity") {
+      if (severityName(record.getSeverity()) != term.second) return false;
+    } else if (term.first == "machine") {
+      if (record.getMachine() != term.second) return false;
+    } else {
+      bool found = false;
+      for (auto field: record.getFields()) {
+        if (field.getKey() == term.first && field.getValue() == term.second) {
+          found = true;
+          break;
+        }
+      }
+      if (!found) return false;
+    }
+  }
+
+  return true;
+}
+
+void LogStore::query(kj::StringPtr dir, const Query& query,
+                     kj::Function<void(LogRecord::Reader)> callback) {
+  auto dirFd = sandstorm::raiiOpen(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+  auto filter = [&](uint64_t, LogRecord::Reader record) {
+    if (matchesQuery(record, query)) {
+      callback(record);
+    }
+  };
+
+  for (auto& entry: listRecordSegments(dirFd)) {
+    if (!entry.second) {
+      // Not indexed yet; normally this is just the open segment. Scan the whole thing.
+      RecordSegmentReader reader(dirFd, recordSegmentName(entry.first));
+      scanSegment(reader, 0, filter);
+      continue;
+    }
+
+    capnp::StreamFdMessageReader indexMessage(
+        sandstorm::raiiOpenAt(dirFd, recordIndexName(entry.first), O_RDONLY | O_CLOEXEC));
+    auto index = indexMessage.getRoot<LogSegmentIndex>();
+    if (index.getEndTimeNs() < query.sinceNs) continue;
+
+    // Narrow down to the records having every indexed term. Long values aren't indexed, so those
+    // terms are only checked by `filter`.
+    kj::Maybe<kj::Vector<uint64_t>> candidates;
+    for (auto& term: query.terms) {
+      if (term.second.size() > MAX_INDEXED_VALUE_SIZE) continue;
+
+      auto found = findTerm(index, term.first, term.second);
+      KJ_IF_MAYBE(offsets, found) {
+        KJ_IF_MAYBE(c, candidates) {
+          candidates = intersectOffsets(c->asPtr(), *offsets);
+        } else {
+          kj::Vector<uint64_t> all(offsets->size());
+          for (uint64_t offset: *offsets) {
+            all.add(offset);
+          }
+          candidates = kj::mv(all);
+        }
+      } else {
+        candidates = kj::Vector<uint64_t>();
+        break;
+      }
+    }
+
+    RecordSegmentReader reader(dirFd, recordSegmentName(entry.first));
+    KJ_IF_MAYBE(c, candidates) {
+      for (uint64_t offset: *c) {
+        reader.read(offset, [&](LogRecord::Reader record) {
+          filter(offset, record);
+        });
+      }
+    } else {
+      // Nothing to narrow it down by except time. Records are only roughly in time order, so
+      // start from the last time entry comfortably before `sinceNs`.
+      uint64_t start = 0;
+      for (auto time: index.getTimes()) {
+        if (time.getTimeNs() >= query.sinceNs - RECORD_TIME_SLACK_NS) break;
+        start = time.getOffset();
+      }
+      scanSegment(reader, start, filter);
+    }
+  }
+}
+
+kj::String formatLogRecord(LogRecord::Reader record) {
+  time_t seconds = record.getTimeNs() / 1000000000;
+  struct tm local;
+  KJ_ASSERT(gmtime_r(&seconds, &local) != nullptr);
+  char timestamp[32];
+  strftime(timestamp, sizeof(timestamp), "%Y-%m-%d_%H-%M-%S", &local);
+
+  kj::Vector<kj::String> parts;
+  if (record.getMessage().size() > 0) {
+    parts.add(kj::heapString(record.getMessage()));
+  }
+  for (auto field: record.getFields()) {
+    parts.add(kj::str(field.getKey(), " = ", field.getValue()));
+  }
+
+  return kj::str(timestamp, " [", record.getMachine(), "] ",
+                 severityName(record.getSeverity()), ": ", kj::strArray(parts, "; "), '\n');
 }
 
 // =======================================================================================
 
+static constexpr size_t LOG_BACKLOG_SIZE = 32u << 20;
+static constexpr size_t LOG_REPLAY_BATCH_SIZE = 1u << 20;
+static constexpr kj::Duration RECONNECT_DELAY_MIN = 250 * kj::MILLISECONDS;
+static constexpr kj::Duration RECONNECT_DELAY_MAX = 10 * kj::SECONDS;
+
+static kj::Promise<kj::Own<kj::AsyncIoStream>> connectToLogSink(
+    kj::Network& network, kj::StringPtr logAddressFile) {
+  return kj::evalNow([&]() {
+    // Read the log address from the file.
+    SimpleAddress address = nullptr;
+    kj::FdInputStream(sandstorm::raiiOpen(logAddressFile, O_RDONLY | O_CLOEXEC))
+        .read(&address, sizeof(address));
+
+    // Connect to it.
+    auto addressObj = address.onNetwork(network);
+    auto promise = addressObj->connect();
+    return promise.attach(kj::mv(addressObj));
+  });
+}
+
+static constexpr uint64_t LOG_RING_MAGIC = 0x474e69526b636c42ull;  // "BlckRiNG"
+
+LogRing::LogRing(kj::AutoCloseFd fdParam, size_t capacity)
+    : fd(kj::mv(fdParam)), capacity(capacity), mappingSize(sizeof(Header) + capacity) {
+  struct stat stats;
+  KJ_SYSCALL(fstat(fd, &stats));
+  if (uint64_t(stats.st_size) != mappingSize) {
+    // New, or left by a ring of another size. Start over with zeros.
+    KJ_SYSCALL(ftruncate(fd, 0));
+    KJ_SYSCALL(ftruncate(fd, mappingSize));
+  }
+
+  void* mapping = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    KJ_FAIL_SYSCALL("mmap(backlog)", errno);
+  }
+  header = reinterpret_cast<Header*>(mapping);
+  data = reinterpret_cast<byte*>(header + 1);
+
+  if (header->magic != LOG_RING_MAGIC || header->capacity != capacity ||
+      header->head > header->tail || header->tail - header->head > capacity) {
+    memset(header, 0, sizeof(Header));
+    header->magic = LOG_RING_MAGIC;
+    header->capacity = capacity;
+  }
+}
+
+LogRing::~LogRing() noexcept(false) {
+  KJ_SYSCALL(munmap(header, mappingSize));
+}
+
+void LogRing::append(kj::ArrayPtr<const byte> bytes) {
+  if (bytes.size() > capacity) {
+    drop(bytes.size() - capacity);
+    bytes = bytes.slice(bytes.size() - capacity, bytes.size());
+  }
+
+  if (header->tail - header->head + bytes.size() > capacity) {
+    // Drop the oldest lines to make room. We move the head forward to a line boundary so that
+    // the replay doesn't start in the middle of a line.
+    uint64_t newHead = header->tail + bytes.size() - capacity;
+    while (newHead < header->tail && at(newHead - 1) != '\n') {
+      ++newHead;
+    }
+    drop(newHead - header->head);
+    header->head = newHead;
+  }
+
+  size_t offset = header->tail % capacity;
+  size_t first = kj::min(bytes.size(), capacity - offset);
+  memcpy(data + offset, bytes.begin(), first);
+  memcpy(data, bytes.begin() + first, bytes.size() - first);
+  header->tail += bytes.size();
+}
+
+LogRing::Batch LogRing::read(size_t maxSize) {
+  uint64_t start = header->head;
+  size_t size = kj::min(header->tail - start, uint64_t(maxSize));
+  auto bytes = kj::heapArray<byte>(size);
+  size_t offset = start % capacity;
+  size_t first = kj::min(size, capacity - offset);
+  memcpy(bytes.begin(), data + offset, first);
+  memcpy(bytes.begin() + first, data, size - first);
+  return { kj::mv(bytes), start + size };
+}
+
+void LogRing::consume(uint64_t end) {
+  // If the ring overflowed meanwhile, the head may already be past `end`.
+  if (end > header->head) {
+    header->head = end;
+  }
+}
+
+void LogRing::drop(uint64_t bytes) {
+  header->droppedBytes += bytes;
+  ++header->dropCount;
+}
+
 class LogClient {
 public:
   LogClient(kj::Network& network, kj::Timer& timer, kj::StringPtr name,
             kj::StringPtr backlogDir, kj::StringPtr logAddressFile,
-            kj::Own<kj::AsyncInputStream> input)
+            kj::Own<kj::AsyncInputStream> input, kj::Own<kj::AsyncInputStream> ownLogs)
       : network(network),
         timer(timer),
         nameLine(kj::str(name, '\n')),
         logAddressFile(logAddressFile),
         input(kj::mv(input)),
-        backlogName(kj::str(backlogDir, "/blackrock-backlog.", time(nullptr), '.', getpid())),
-        backlog(sandstorm::raiiOpen(backlogName, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600)),
-        reconnectTask(reconnect()) {}
-
-  void redirectToBacklog(int fd) {
-    KJ_SYSCALL(dup2(backlog, fd));
-  }
+        ownLogs(kj::mv(ownLogs)),
+        backlog(openBacklog(backlogDir, name), LOG_BACKLOG_SIZE),
+        reconnectTask(reconnect()),
+        ownLogsTask(readOwnLogs().eagerlyEvaluate([](kj::Exception&& e) {
+          KJ_LOG(ERROR, "failed to read log client's own logs", e);
+        })) {}
 
   kj::Promise<void> run() {
     return input->tryRead(buffer, 1, sizeof(buffer)).then([this](size_t size) {
@@ -253,45 +1421,15 @@ public:
           // In case we're not currently connected, we'll keep trying to reconnect and upload logs
           // for 30 seconds. If we don't manage to do so, we'll leave our log file on local disk.
           return reconnectTask.then([this]() {
-            // Successfully uploaded the logs, so let's delete the file.
-            KJ_SYSCALL(unlink(backlogName.cStr()));
+            // Successfully uploaded the logs, so let's delete the file. Otherwise, the next log
+            // client will pick it up.
+            KJ_IF_MAYBE(name, backlogName) {
+              KJ_SYSCALL(unlink(name->cStr()));
+            }
           }).exclusiveJoin(timer.afterDelay(30 * kj::SECONDS));
         });
       } else {
-        auto data = kj::heapArray<byte>(buffer, size);
-        kj::ArrayPtr<const byte> dataPtr = data;
-        writeQueue = writeQueue.then([this,size,dataPtr]() -> kj::Promise<void> {
-          KJ_IF_MAYBE(c, connection) {
-            if (receivedEof) {
-              // It appears that we've received an EOF from the other end, therefore anything we
-              // write() now may be silently lost.
-              connection = nullptr;
-              writeBacklog(dataPtr);
-              reconnectTask = reconnect();
-              return kj::READY_NOW;
-            } else {
-              return kj::evalNow([&]() {
-                return c->get()->write(dataPtr.begin(), dataPtr.size());
-              }).catch_([this,dataPtr](kj::Exception&& exception) {
-                // Cancel existing reconnect task (which may still be looping in awaitEof(), which
-                // uses `connection`, which we're about to destroy).
-                reconnectTask = nullptr;
-
-                // Discard the connection.
-                connection = nullptr;
-                if (expectDisconnected(exception)) {
-                  KJ_LOG(ERROR, "log sink disconnected (write error); trying to reconnect");
-                }
-                writeBacklog(dataPtr);
-                reconnectTask = reconnect();
-              });
-            }
-          } else {
-            writeBacklog(dataPtr);
-            return kj::READY_NOW;
-          }
-        }).attach(kj::mv(data));
-
+        send(kj::heapArray<byte>(buffer, size));
         return run();
       }
     });
@@ -303,19 +1441,87 @@ private:
   kj::String nameLine;
   kj::StringPtr logAddressFile;
   kj::Own<kj::AsyncInputStream> input;
-  kj::String backlogName;
-  kj::AutoCloseFd backlog;
+  kj::Own<kj::AsyncInputStream> ownLogs;
+  kj::Maybe<kj::String> backlogName;  // null if the backlog file is anonymous
+  LogRing backlog;
 
   kj::Maybe<kj::Own<kj::AsyncIoStream>> connection;
+  bool receivedEof = false;
+  kj::Duration reconnectDelay = RECONNECT_DELAY_MIN;
   kj::Promise<void> writeQueue = kj::READY_NOW;
   kj::Promise<void> reconnectTask;
-  bool receivedEof = false;
-  off_t backlogOffset = 0;
+  kj::Promise<void> ownLogsTask;
   byte buffer[4096];
-  byte backlogBuffer[4096];
+  byte ownLogsBuffer[1024];
+
+  kj::AutoCloseFd openBacklog(kj::StringPtr backlogDir, kj::StringPtr name) {
+    // Opens the backlog file for clients called `name`, which may hold lines that a previous
+    // client didn't get to upload. If another client of the same name is still running and holds
+    // the file, falls back to an anonymous file, which disappears with us.
+
+    auto safeName = kj::heapString(name);
+    for (char& c: safeName) {
+      if (c == '/') c = '_';
+    }
+    auto path = kj::str(backlogDir, "/blackrock-backlog.", safeName);
+    auto fd = sandstorm::raiiOpen(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+    int result;
+    KJ_NONBLOCKING_SYSCALL(result = flock(fd, LOCK_EX | LOCK_NB));
+    if (result >= 0) {
+      backlogName = kj::mv(path);
+      return kj::mv(fd);
+    }
+
+    KJ_LOG(WARNING, "backlog file in use by another log client; using an anonymous one", path);
+    return sandstorm::raiiOpen(backlogDir, O_RDWR | O_TMPFILE | O_CLOEXEC, 0600);
+  }
 
-  void writeBacklog(kj::ArrayPtr<const byte> data) {
-    kj::FdOutputStream(backlog.get()).write(data.begin(), data.size());
+  void send(kj::Array<byte> data) {
+    kj::ArrayPtr<const byte> dataPtr = data;
+    writeQueue = writeQueue.then([this,dataPtr]() -> kj::Promise<void> {
+      KJ_IF_MAYBE(c, connection) {
+        if (receivedEof) {
+          // It appears that we've received an EOF from the other end, therefore anything we
+          // write() now may be silently lost.
+          connection = nullptr;
+          backlog.append(dataPtr);
+          reconnectTask = reconnect();
+          return kj::READY_NOW;
+        } else {
+          return kj::evalNow([&]() {
+            return c->get()->write(dataPtr.begin(), dataPtr.size());
+          }).catch_([this,dataPtr](kj::Exception&& exception) {
+            // Cancel existing reconnect task (which may still be looping in awaitEof(), which
+            // uses `connection`, which we're about to destroy).
+            reconnectTask = nullptr;
+
+            // Discard the connection.
+            connection = nullptr;
+            if (expectDisconnected(exception)) {
+              KJ_LOG(ERROR, "log sink disconnected (write error); trying to reconnect");
+            }
+            backlog.append(dataPtr);
+            reconnectTask = reconnect();
+          });
+        }
+      } else {
+        backlog.append(dataPtr);
+        return kj::READY_NOW;
+      }
+    }).attach(kj::mv(data)).eagerlyEvaluate(nullptr);
+  }
+
+  kj::Promise<void> readOwnLogs() {
+    // Our own stdout and stderr are fed back to us through a pipe, so that our complaints reach
+    // the log sink along with everything else.
+
+    return ownLogs->tryRead(ownLogsBuffer, 1, sizeof(ownLogsBuffer))
+        .then([this](size_t size) -> kj::Promise<void> {
+      if (size == 0) return kj::READY_NOW;
+      send(kj::heapArray<byte>(ownLogsBuffer, size));
+      return readOwnLogs();
+    });
   }
 
   kj::Promise<void> reconnect() {
@@ -326,17 +1532,8 @@ private:
   }
 
   kj::Promise<void> reconnectLoop() {
-    return kj::evalNow([&]() {
-      // Read the log address from the file.
-      SimpleAddress address = nullptr;
-      kj::FdInputStream(sandstorm::raiiOpen(logAddressFile, O_RDONLY | O_CLOEXEC))
-          .read(&address, sizeof(address));
-
-      // Connect to it.
-      auto addressObj = address.onNetwork(network);
-      auto promise = addressObj->connect();
-      return promise.attach(kj::mv(addressObj));
-    }).then([this](kj::Own<kj::AsyncIoStream>&& newConnection) -> kj::Promise<void> {
+    return connectToLogSink(network, logAddressFile)
+        .then([this](kj::Own<kj::AsyncIoStream>&& newConnection) -> kj::Promise<void> {
       // Connected, start writing the backlog to the new connection.
 
       auto promise = kj::evalNow([&]() {
@@ -344,54 +1541,68 @@ private:
       });
 
       return promise.then([this,KJ_MVCAP(newConnection)]() mutable {
-        return writeBacklog(kj::mv(newConnection));
+        reconnectDelay = RECONNECT_DELAY_MIN;
+        return replayBacklog(kj::mv(newConnection));
       }, [this](kj::Exception&& exception) {
         // Dang, connection failed right away. Keep trying.
         expectDisconnected(exception);
-        return reconnectLoop();
+        return retryLater();
       });
     }, [this](kj::Exception&& exception) {
-      // Connection failed. Try again in 10 seconds.
+      // Connection failed. Try again soon.
       expectDisconnected(exception);
-      return timer.afterDelay(10 * kj::SECONDS).then([this]() {
-        return reconnectLoop();
-      });
+      return retryLater();
     });
   }
 
-  kj::Promise<void> writeBacklog(kj::Own<kj::AsyncIoStream> newConnection) {
-    ssize_t n;
-    KJ_SYSCALL(n = pread(backlog, backlogBuffer, sizeof(backlogBuffer), backlogOffset));
+  kj::Promise<void> retryLater() {
+    // Retry with exponential back-off, so that we reconnect quickly after a blip but don't hammer
+    // a log sink that's down for a while.
 
-    if (n == 0) {
-      // We're all caught up!
+    auto delay = reconnectDelay;
+    reconnectDelay = kj::min(reconnectDelay * 2, RECONNECT_DELAY_MAX);
+    return timer.afterDelay(delay).then([this]() {
+      return reconnectLoop();
+    });
+  }
 
-      // Truncate the backlog; it's all saved.
-      KJ_SYSCALL(lseek(backlog, 0, SEEK_SET));
-      KJ_SYSCALL(ftruncate(backlog, 0));
-      backlogOffset = 0;
+  kj::Promise<void> replayBacklog(kj::Own<kj::AsyncIoStream> newConnection) {
+    kj::Array<byte> bytes;
+    uint64_t end = 0;
+    uint64_t dropped = backlog.getDroppedBytes();
 
-      // Now we can continue on.
+    if (dropped > backlog.getReportedDroppedBytes()) {
+      // Let whoever reads the logs know that some are missing.
+      auto notice = kj::str("log client backlog overflowed; dropped ",
+                            dropped - backlog.getReportedDroppedBytes(), " bytes (",
+                            backlog.getDropCount(), " overflows in total)\n");
+      bytes = kj::heapArray(notice.asBytes());
+    } else if (!backlog.empty()) {
+      auto batch = backlog.read(LOG_REPLAY_BATCH_SIZE);
+      bytes = kj::mv(batch.bytes);
+      end = batch.end;
+    } else {
+      // We're all caught up! Now we can continue on.
       receivedEof = false;
       auto promise = awaitEof(*newConnection);
       connection = kj::mv(newConnection);
       return promise;
-    } else {
-      backlogOffset += n;
+    }
 
-      // Send backlog up to server.
-      auto promise = kj::evalNow([&]() {
-        return newConnection->write(backlogBuffer, n);
-      });
+    // Send backlog up to server.
+    auto promise = kj::evalNow([&]() {
+      return newConnection->write(bytes.begin(), bytes.size());
+    }).attach(kj::mv(bytes));
 
-      return promise.then([this,KJ_MVCAP(newConnection)]() mutable {
-        return writeBacklog(kj::mv(newConnection));
-      }, [this](kj::Exception&& exception) {
-        // Dang, failed while trying to upload the backlog.
-        expectDisconnected(exception);
-        return reconnectLoop();
-      });
-    }
+    return promise.then([this,KJ_MVCAP(newConnection),end,dropped]() mutable {
+      backlog.consume(end);
+      backlog.setReportedDroppedBytes(dropped);
+      return replayBacklog(kj::mv(newConnection));
+    }, [this](kj::Exception&& exception) {
+      // Dang, failed while trying to upload the backlog.
+      expectDisconnected(exception);
+      return retryLater();
+    });
   }
 
   bool expectDisconnected(const kj::Exception& exception) {
@@ -424,15 +1635,176 @@ private:
   }
 };
 
-void runLogClient(kj::StringPtr name, kj::StringPtr logAddressFile, kj::StringPtr backlogDir) {
+static constexpr size_t RECORD_BATCH_SIZE = 256;
+static constexpr kj::Duration RECORD_BATCH_DELAY = 1 * kj::SECONDS;
+static constexpr size_t RECORD_PENDING_MAX = 4096;
+
+class RecordShipper: private kj::TaskSet::ErrorHandler {
+  // Reads LogRecords written by a StructuredLogger and sends them to the log sink in LogBatches,
+  // on a connection of their own, at most RECORD_BATCH_SIZE per batch. Unlike text, records don't
+  // go through the backlog: while the log sink is unreachable or falling behind, up to
+  // RECORD_PENDING_MAX of them wait in memory, and beyond that the oldest are dropped.
+
+public:
+  RecordShipper(kj::Network& network, kj::Timer& timer, kj::StringPtr name,
+                kj::StringPtr logAddressFile, kj::Own<kj::AsyncInputStream> input)
+      : network(network),
+        timer(timer),
+        header(kj::str(RECORDS_HEADER, name, '\n')),
+        logAddressFile(logAddressFile),
+        input(kj::mv(input)),
+        tasks(*this) {
+    connect();
+  }
+
+  kj::Promise<void> run() {
+    return capnp::tryReadMessage(*input)
+        .then([this](kj::Maybe<kj::Own<capnp::MessageReader>>&& message) -> kj::Promise<void> {
+      KJ_IF_MAYBE(m, message) {
+        pending.push_back(kj::mv(*m));
+        if (pending.size() > RECORD_PENDING_MAX) {
+          pending.pop_front();
+          ++droppedRecords;
+        }
+
+        if (pending.size() >= RECORD_BATCH_SIZE) {
+          flush();
+        } else if (!flushScheduled) {
+          flushScheduled = true;
+          tasks.add(timer.afterDelay(RECORD_BATCH_DELAY).then([this]() {
+            flushScheduled = false;
+            flush();
+          }));
+        }
+        return run();
+      } else {
+        // The main process exited. Send what we have, if we can.
+        flush();
+        return kj::READY_NOW;
+      }
+    });
+  }
+
+private:
+  kj::Network& network;
+  kj::Timer& timer;
+  kj::String header;
+  kj::StringPtr logAddressFile;
+  kj::Own<kj::AsyncInputStream> input;
+
+  kj::Maybe<kj::Own<kj::AsyncIoStream>> connection;
+  std::deque<kj::Own<capnp::MessageReader>> pending;
+  bool flushScheduled = false;
+  bool sending = false;
+  // Only one batch is in flight at a time; records arriving meanwhile make up the next one.
+
+  kj::Duration reconnectDelay = RECONNECT_DELAY_MIN;
+  uint64_t droppedRecords = 0;
+  kj::TaskSet tasks;
+
+  void flush() {
+    if (pending.size() == 0 || sending) return;
+
+    KJ_IF_MAYBE(c, connection) {
+      uint count = kj::min(pending.size(), RECORD_BATCH_SIZE);
+      auto message = kj::heap<capnp::MallocMessageBuilder>();
+      auto records = message->initRoot<LogBatch>().initRecords(count);
+      for (uint i = 0; i < count; i++) {
+        records.setWithCaveats(i, pending.front()->getRoot<LogRecord>());
+        pending.pop_front();
+      }
+
+      sending = true;
+      auto promise = capnp::writeMessage(**c, *message);
+      tasks.add(promise.attach(kj::mv(message)).then([this]() {
+        sending = false;
+        reportDrops();
+        flush();
+      }, [this](kj::Exception&& exception) {
+        // The batch is lost.
+        if (exception.getType() != kj::Exception::Type::DISCONNECTED) {
+          KJ_LOG(ERROR, "unexpected exception sending log records", exception);
+        }
+        sending = false;
+        connection = nullptr;
+        connect();
+      }));
+    }
+  }
+
+  void reportDrops() {
+    if (droppedRecords > 0) {
+      KJ_LOG(WARNING, "dropped log records while log sink was unreachable or slow",
+             droppedRecords);
+      droppedRecords = 0;
+    }
+  }
+
+  void connect() {
+    tasks.add(connectToLogSink(network, logAddressFile)
+        .then([this](kj::Own<kj::AsyncIoStream>&& newConnection) {
+      auto promise = newConnection->write(header.begin(), header.size());
+      return promise.then([this,KJ_MVCAP(newConnection)]() mutable {
+        reconnectDelay = RECONNECT_DELAY_MIN;
+        reportDrops();
+        connection = kj::mv(newConnection);
+        flush();
+      });
+    }).catch_([this](kj::Exception&& exception) {
+      if (exception.getType() != kj::Exception::Type::DISCONNECTED) {
+        KJ_LOG(ERROR, "unexpected exception connecting to log sink for records", exception);
+      }
+
+      // Same back-off as LogClient.
+      auto delay = reconnectDelay;
+      reconnectDelay = kj::min(reconnectDelay * 2, RECONNECT_DELAY_MAX);
+      return timer.afterDelay(delay).then([this]() {
+        connect();
+      });
+    }));
+  }
+
+  void taskFailed(kj::Exception&& exception) override {
+    KJ_LOG(ERROR, "exception in log record shipper", exception);
+  }
+};
+
+void runLogClient(kj::StringPtr name, kj::StringPtr logAddressFile, kj::StringPtr backlogDir,
+                  kj::Maybe<int> recordFd) {
   auto ioContext = kj::setupAsyncIo();
 
+  // The write end is non-blocking so that we can't deadlock writing to ourselves. If the pipe is
+  // ever full, our own messages are lost.
+  int ownLogsPipe[2];
+  KJ_SYSCALL(pipe2(ownLogsPipe, O_CLOEXEC | O_NONBLOCK));
+  kj::AutoCloseFd ownLogsWriteEnd(ownLogsPipe[1]);
+  auto ownLogs = ioContext.lowLevelProvider->wrapInputFd(ownLogsPipe[0],
+      kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP |
+      kj::LowLevelAsyncIoProvider::ALREADY_CLOEXEC |
+      kj::LowLevelAsyncIoProvider::ALREADY_NONBLOCK);
+
   LogClient client(ioContext.provider->getNetwork(),
                    ioContext.lowLevelProvider->getTimer(),
                    name, backlogDir, logAddressFile,
-                   ioContext.lowLevelProvider->wrapInputFd(STDIN_FILENO));
-  client.redirectToBacklog(STDOUT_FILENO);
-  client.redirectToBacklog(STDERR_FILENO);
+                   ioContext.lowLevelProvider->wrapInputFd(STDIN_FILENO),
+                   kj::mv(ownLogs));
+
+  kj::Maybe<kj::Own<RecordShipper>> shipper;
+  kj::Promise<void> shipperTask = nullptr;
+  KJ_IF_MAYBE(fd, recordFd) {
+    auto newShipper = kj::heap<RecordShipper>(
+        ioContext.provider->getNetwork(), ioContext.lowLevelProvider->getTimer(), name,
+        logAddressFile, ioContext.lowLevelProvider->wrapInputFd(
+            *fd, kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP));
+    shipperTask = newShipper->run().eagerlyEvaluate([](kj::Exception&& e) {
+      KJ_LOG(ERROR, "failed to read log records", e);
+    });
+    shipper = kj::mv(newShipper);
+  }
+
+  KJ_SYSCALL(dup2(ownLogsWriteEnd, STDOUT_FILENO));
+  KJ_SYSCALL(dup2(ownLogsWriteEnd, STDERR_FILENO));
+  ownLogsWriteEnd = nullptr;
   client.run().wait(ioContext.waitScope);
   KJ_UNREACHABLE;
 }
@@ -18,8 +18,14 @@
 #define BLACKROCK_LOGS_H_
 
 #include "common.h"
+#include <blackrock/logs.capnp.h>
 #include <kj/async-io.h>
+#include <kj/function.h>
+#include <kj/vector.h>
 #include <set>
+#include <map>
+#include <time.h>
+#include <unistd.h>
 
 namespace sandstorm {
   class Subprocess;
@@ -29,30 +35,202 @@ namespace blackrock {
 
 class SimpleAddress;
 
+static constexpr const char LOG_RECORD_DIR[] = "/var/blackrock/log/records";
+// Where the master's log sink keeps the LogRecords it receives.
+
+class StructuredLogger: public kj::ExceptionCallback {
+  // While in scope, turns every KJ_LOG() message into a LogRecord, written as a framed message to
+  // `fd` (normally a pipe to `blackrock log --records`), in addition to logging it as text as
+  // usual.
+
+public:
+  StructuredLogger(kj::AutoCloseFd fd, kj::StringPtr machine);
+
+  void logMessage(const char* file, int line, int contextDepth, kj::String&& text) override;
+
+private:
+  kj::AutoCloseFd fd;
+  kj::String machine;
+  bool broken = false;
+};
+
+class LogStore {
+  // Append-only store of LogRecords in a directory. Records are written, framed, to segments named
+  // `records.NNNNNN`. When a segment fills up, a LogSegmentIndex is written next to it as
+  // `records.NNNNNN.index`, so that queries can skip to the records they want; only the open
+  // segment has to be scanned.
+
+public:
+  explicit LogStore(kj::StringPtr dir);
+  // Indexes any segments left unindexed by a previous run, and starts a new one.
+
+  ~LogStore() noexcept(false);
+
+  void add(LogBatch::Reader batch, kj::StringPtr defaultMachine);
+  // Append the records, filling in `defaultMachine` where the machine is missing.
+
+  struct Query {
+    int64_t sinceNs = 0;
+    // Only records logged at or after this time.
+
+    kj::Vector<std::pair<kj::String, kj::String>> terms;
+    // Only records having all of these fields. As in the index, the keys "severity" and "machine"
+    // match the record's severity and machine.
+  };
+
+  static void query(kj::StringPtr dir, const Query& query,
+                    kj::Function<void(LogRecord::Reader)> callback);
+  // Calls `callback` on every matching record in the store, in storage order.
+
+private:
+  class Indexer;
+
+  kj::AutoCloseFd dirFd;
+  uint segmentNumber;
+  kj::AutoCloseFd segment;
+  uint64_t segmentSize = 0;
+  kj::Own<Indexer> indexer;
+
+  void startSegment();
+  void finishSegment();
+  void deleteOldSegments();
+};
+
+kj::String formatLogRecord(LogRecord::Reader record);
+// Formats the record as a line of text, like those in the text logs.
+
+void parseLogText(kj::StringPtr text, LogRecord::Builder record);
+// Fills in the record's severity, message and fields from the text of a KJ_LOG() message.
+
 class LogSink: private kj::TaskSet::ErrorHandler {
 public:
-  LogSink();
+  explicit LogSink(kj::Timer& timer, int outputFd = STDOUT_FILENO);
+  // Text logs are written to `outputFd`.
+
+  ~LogSink() noexcept(false);
 
   kj::Promise<void> acceptLoop(kj::Own<kj::ConnectionReceiver> receiver);
 
 private:
   class ClientHandler;
+  class PrefixedInputStream;
 
+  kj::Timer& timer;
+  int outputFd;
   std::set<kj::String> namesSeen;
 
+  kj::Maybe<kj::Own<LogStore>> store;
+  bool storeFailed = false;
+  // Opened when the first records connection arrives.
+
+  kj::Array<char> buffer;
+  size_t bufferUsed = 0;
+  // Lines from all clients, waiting to be written to stdout.
+
+  bool flushScheduled = false;
+  kj::Promise<void> flushTask = nullptr;
+
+  time_t timestampTime = 0;
+  char timestamp[32];
+  size_t timestampSize = 0;
+  // The timestamp prefix only changes once per second, so we only format it that often.
+
   kj::TaskSet tasks;
 
   void write(kj::ArrayPtr<const char> part1, kj::ArrayPtr<const char> part2 = nullptr);
-  // Write a line to the log file, prefixed by a timestamp.
+  // Write a line to the log file, prefixed by a timestamp. The line is buffered; it's written out
+  // when the buffer fills up or shortly after, whichever comes first.
+
+  void flush();
+
+  kj::Maybe<LogStore&> getStore();
+
+  kj::Promise<void> receiveRecords(kj::Own<kj::AsyncInputStream> stream, kj::String name);
+  // Handles a connection from a log client's RecordShipper: reads LogBatches and adds them to
+  // `store`.
 
   void taskFailed(kj::Exception&& exception) override;
 };
 
-void rotateLogs(int input, int logDirFd);
+void rotateLogs(int input, int logDirFd, uint64_t segmentSize = 64ull << 20);
 // Read logs on `input` and write them to files in `logDirFd`, rotated to avoid any file becoming
-// overly large.
+// overly large. Each day's log is split into segments named `blackrock.YYYY-MM-DD.NNNN`, a new one
+// starting at the first line break after the current one reaches `segmentSize` bytes. Closed
+// segments are compressed in the background (see compressSegment() in logs.c++), and the oldest
+// files are deleted once the directory grows past a total size limit. `blackrock.current` links
+// to the open segment.
+
+kj::Array<byte> readLogSegment(int logDirFd, kj::StringPtr name, uint64_t offset, size_t size);
+// Reads up to `size` bytes at `offset` of the log segment `name` written by rotateLogs(), whether
+// or not it has been compressed yet. For a compressed segment, only the frames covering the range
+// are decompressed.
+
+class LogRing {
+  // Fixed-size ring buffer of log text in a memory-mapped file, which the log client keeps its
+  // backlog in. Appending costs no syscalls, and the contents survive the log client dying, to be
+  // replayed by the next one. When the ring is full, the oldest lines are dropped to make room, and
+  // counted.
+
+public:
+  LogRing(kj::AutoCloseFd fd, size_t capacity);
+  // Maps `fd`, resuming the ring already stored in it if it holds one of the same capacity, and
+  // otherwise starting out empty.
+
+  ~LogRing() noexcept(false);
+  KJ_DISALLOW_COPY(LogRing);
 
-void runLogClient(kj::StringPtr name, kj::StringPtr logAddressFile, kj::StringPtr backlogDir);
+  bool empty() { return header->head == header->tail; }
+  uint64_t size() { return header->tail - header->head; }
+
+  uint64_t getDroppedBytes() { return header->droppedBytes; }
+  uint64_t getDropCount() { return header->dropCount; }
+
+  uint64_t getReportedDroppedBytes() { return header->reportedDroppedBytes; }
+  void setReportedDroppedBytes(uint64_t bytes) { header->reportedDroppedBytes = bytes; }
+  // How many of the dropped bytes the log server has been told about, so that a resumed ring
+  // doesn't report them again.
+
+  void append(kj::ArrayPtr<const byte> bytes);
+
+  struct Batch {
+    kj::Array<byte> bytes;
+    uint64_t end;
+    // Pass to consume() once `bytes` has been delivered.
+  };
+
+  Batch read(size_t maxSize);
+  // Copies out up to `maxSize` of the oldest bytes. We copy, rather than writing directly from
+  // the mapping, because appends during the write may overwrite that part of the ring.
+
+  void consume(uint64_t end);
+
+private:
+  struct Header {
+    uint64_t magic;
+    uint64_t capacity;
+
+    uint64_t head;
+    uint64_t tail;
+    // Offsets, counted from the first byte ever appended, of the oldest byte still in the ring and
+    // of the end of the newest. Byte `i` is stored at `data[i % capacity]`.
+
+    uint64_t droppedBytes;
+    uint64_t dropCount;
+    uint64_t reportedDroppedBytes;
+  };
+
+  kj::AutoCloseFd fd;  // Kept open to hold any lock on the file.
+  size_t capacity;
+  size_t mappingSize;
+  Header* header;
+  byte* data;
+
+  byte at(uint64_t position) { return data[position % capacity]; }
+  void drop(uint64_t bytes);
+};
+
+void runLogClient(kj::StringPtr name, kj::StringPtr logAddressFile, kj::StringPtr backlogDir,
+                  kj::Maybe<int> recordFd = nullptr);
 // Reads logs from standard input and upload them to the log sink server, reconnecting to the
 // server as needed, buffering logs to a local file when the log server is unreachable. Note that
 // some logs may be lost around the moment of a disconnect; this is not intended to be 100%
@@ -61,6 +239,10 @@ void runLogClient(kj::StringPtr name, kj::StringPtr logAddressFile, kj::StringPt
 // `logAddressFile` is the name of a file on the hard drive which contains the address (in
 // SimpleAddress format). The file is re-read every time a reconnect is attempted. This allows an
 // external entity to update the log server address without restarting the process.
+//
+// If `recordFd` is given, LogRecords written to it by a StructuredLogger are also sent to the log
+// sink, in batches, on a separate connection. Records are dropped while the log sink is
+// unreachable; the text logs remain the complete record.
 
 } // namespace blackrock
 
@@ -0,0 +1,391 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "master.h"
+#include <capnp/message.h>
+#include <kj/test.h>
+#include <kj/vector.h>
+#include <string.h>
+
+namespace blackrock {
+namespace {
+
+struct TestDetector {
+  // A detector using the default config, except for a window of 10, fed heartbeats on a fake
+  // clock.
+
+  capnp::MallocMessageBuilder message;
+  HeartbeatConfig::Builder config;
+  kj::TimePoint now = kj::origin<kj::TimePoint>();
+  kj::Own<PhiAccrualDetector> detector;
+
+  TestDetector(): config(message.initRoot<HeartbeatConfig>()) {
+    config.setWindowSize(10);
+    detector = kj::heap<PhiAccrualDetector>(config.asReader(), now);
+  }
+
+  void beat(uint intervalMs) {
+    now = now + intervalMs * kj::MILLISECONDS;
+    detector->heartbeat(now);
+  }
+
+  double phiAfter(uint silenceMs) {
+    return detector->phi(now + silenceMs * kj::MILLISECONDS);
+  }
+};
+
+KJ_TEST("phi stays low until a heartbeat is well overdue, then crosses the threshold") {
+  TestDetector d;
+  for (uint i = 0; i < 10; i++) d.beat(500);
+
+  double threshold = d.config.getPhiThreshold();
+  KJ_EXPECT(d.phiAfter(0) < 0.01);
+  KJ_EXPECT(d.phiAfter(1000) < 0.01);
+  KJ_EXPECT(d.phiAfter(3500) < 1);  // At the mean plus the acceptable pause, phi is ~0.3.
+
+  double last = 0;
+  for (uint ms = 0; ms <= 5000; ms += 100) {
+    double phi = d.phiAfter(ms);
+    KJ_EXPECT(phi >= last, ms, phi, last);
+    last = phi;
+  }
+
+  KJ_EXPECT(d.phiAfter(3800) < threshold);
+  KJ_EXPECT(d.phiAfter(5000) > threshold);
+}
+
+KJ_TEST("phi gives jittery machines more slack, but only for the last windowSize intervals") {
+  TestDetector regular;
+  TestDetector jittery;
+  for (uint i = 0; i < 5; i++) {
+    regular.beat(500);
+    regular.beat(500);
+    jittery.beat(100);
+    jittery.beat(900);
+  }
+
+  double threshold = regular.config.getPhiThreshold();
+  KJ_EXPECT(regular.phiAfter(4100) > threshold);
+  KJ_EXPECT(jittery.phiAfter(4100) < threshold);
+
+  // Once ten regular intervals have pushed the jitter out of the window, the two agree.
+  for (uint i = 0; i < 10; i++) jittery.beat(500);
+  KJ_EXPECT(jittery.phiAfter(4100) == regular.phiAfter(4100));
+}
+
+KJ_TEST("phi uses the configured interval before any heartbeat arrives") {
+  TestDetector d;
+  double threshold = d.config.getPhiThreshold();
+  KJ_EXPECT(d.phiAfter(1000) < 0.01);
+  KJ_EXPECT(d.phiAfter(5000) > threshold);
+}
+
+KJ_TEST("heartbeat config with a zero interval is rejected") {
+  capnp::MallocMessageBuilder message;
+  auto config = message.initRoot<HeartbeatConfig>();
+  validateHeartbeatConfig(config.asReader());
+
+  config.setIntervalMs(0);
+  KJ_EXPECT_THROW(FAILED, validateHeartbeatConfig(config.asReader()));
+
+  config.setIntervalMs(500);
+  config.setPhiThreshold(0);
+  KJ_EXPECT_THROW(FAILED, validateHeartbeatConfig(config.asReader()));
+}
+
+class TestLoadReceiver final: public BackendLoadReceiver::Server {
+protected:
+  kj::Promise<void> update(UpdateContext context) override {
+    return kj::READY_NOW;
+  }
+};
+
+struct TestAutoscaler {
+  // An autoscaler between 1 and 3 workers with no cooldown, whose checks the test runs by hand.
+  // Removed workers stay "stopping" until the test fulfills `stopped`.
+
+  kj::AsyncIoContext ioContext;
+  kj::WaitScope& waitScope;
+  capnp::MallocMessageBuilder message;
+  AutoscaleConfig::Builder config;
+  kj::Vector<uint> added;
+  kj::Vector<uint> removed;
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> stopped;
+  kj::Own<Autoscaler> autoscaler;
+
+  explicit TestAutoscaler(uint initialCount)
+      : ioContext(kj::setupAsyncIo()),
+        waitScope(ioContext.waitScope),
+        config(message.initRoot<AutoscaleConfig>()) {
+    config.setMinWorkers(1);
+    config.setMaxWorkers(3);
+    config.setCooldownSeconds(0);
+    config.setCheckIntervalSeconds(3600);
+    autoscaler = kj::heap<Autoscaler>(ioContext.provider->getTimer(), config.asReader(),
+                                      initialCount, [this](uint index) {
+      added.add(index);
+    }, [this](uint index) {
+      removed.add(index);
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      stopped = kj::mv(paf.fulfiller);
+      return kj::mv(paf.promise);
+    });
+  }
+
+  void report(uint index, float cpuUsed) {
+    BackendLoadReceiver::Client receiver =
+        autoscaler->wrapLoadReceiver(index, kj::heap<TestLoadReceiver>());
+    auto req = receiver.updateRequest();
+    req.initLoad().setCpuUsed(cpuUsed);
+    req.send().wait(waitScope);
+  }
+};
+
+KJ_TEST("autoscaler adds and removes the highest-numbered worker") {
+  TestAutoscaler env(2);
+  env.report(0, 0.9);
+  env.report(1, 0.9);
+  env.autoscaler->check();
+  KJ_ASSERT(env.added.size() == 1);
+  KJ_EXPECT(env.added[0] == 2);
+  KJ_EXPECT(env.autoscaler->getCount() == 3);
+
+  // At the maximum.
+  env.report(2, 0.9);
+  env.autoscaler->check();
+  KJ_EXPECT(env.added.size() == 1);
+
+  env.report(0, 0.1);
+  env.report(1, 0.1);
+  env.report(2, 0.1);
+  env.autoscaler->check();
+  KJ_ASSERT(env.removed.size() == 1);
+  KJ_EXPECT(env.removed[0] == 2);
+  KJ_EXPECT(env.autoscaler->getCount() == 2);
+}
+
+KJ_TEST("autoscaler doesn't reuse a removed worker's index until it has stopped") {
+  TestAutoscaler env(3);
+  env.autoscaler->check();  // All idle.
+  KJ_ASSERT(env.removed.size() == 1);
+  KJ_EXPECT(env.removed[0] == 2);
+
+  env.report(0, 0.9);
+  env.report(1, 0.9);
+  env.autoscaler->check();
+  KJ_EXPECT(env.added.size() == 0);
+  KJ_EXPECT(env.autoscaler->getCount() == 2);
+
+  KJ_ASSERT_NONNULL(env.stopped)->fulfill();
+  env.ioContext.provider->getTimer().afterDelay(10 * kj::MILLISECONDS).wait(env.waitScope);
+
+  env.autoscaler->check();
+  KJ_ASSERT(env.added.size() == 1);
+  KJ_EXPECT(env.added[0] == 2);
+}
+
+KJ_TEST("autoscale config needs a cooldown longer than a worker drain") {
+  capnp::MallocMessageBuilder message;
+  auto config = message.initRoot<AutoscaleConfig>();
+  validateAutoscaleConfig(config.asReader());  // Disabled.
+
+  config.setMaxWorkers(4);
+  validateAutoscaleConfig(config.asReader());
+
+  config.setCooldownSeconds(60);
+  KJ_EXPECT_THROW(FAILED, validateAutoscaleConfig(config.asReader()));
+
+  config.setCooldownSeconds(300);
+  config.setMinWorkers(5);
+  KJ_EXPECT_THROW(FAILED, validateAutoscaleConfig(config.asReader()));
+}
+
+struct TestMetrics {
+  // ClusterMetrics listing the top two machines, fed stats for one metric at a time.
+
+  kj::AsyncIoContext ioContext;
+  capnp::MallocMessageBuilder message;
+  MetricsConfig::Builder config;
+  kj::Own<ClusterMetrics> metrics;
+
+  TestMetrics()
+      : ioContext(kj::setupAsyncIo()),
+        config(message.initRoot<MetricsConfig>()) {
+    config.setTopCount(2);
+    metrics = kj::heap<ClusterMetrics>(ioContext.provider->getTimer(), config.asReader());
+  }
+
+  void update(ComputeDriver::MachineType type, uint index, kj::StringPtr name,
+              MachineStats::Metric::Kind kind, double value) {
+    capnp::MallocMessageBuilder statsMessage;
+    auto metric = statsMessage.initRoot<MachineStats>().initMetrics(1)[0];
+    metric.setName(name);
+    metric.setHelp("Test metric.");
+    metric.setKind(kind);
+    metric.setValue(value);
+    metrics->update({type, index}, statsMessage.getRoot<MachineStats>().asReader());
+  }
+
+  void sleep() {
+    // Lets the clock advance between samples.
+    ioContext.provider->getTimer().afterDelay(10 * kj::MILLISECONDS).wait(ioContext.waitScope);
+  }
+
+  bool hasLine(kj::StringPtr line) {
+    auto text = kj::str('\n', metrics->render());
+    return strstr(text.cStr(), kj::str('\n', line, '\n').cStr()) != nullptr;
+  }
+
+  bool hasLineStartingWith(kj::StringPtr prefix) {
+    auto text = kj::str('\n', metrics->render());
+    return strstr(text.cStr(), kj::str('\n', prefix).cStr()) != nullptr;
+  }
+};
+
+KJ_TEST("cluster metrics report each gauge per machine and its distribution per machine type") {
+  TestMetrics env;
+  auto GAUGE = MachineStats::Metric::Kind::GAUGE;
+  env.update(ComputeDriver::MachineType::WORKER, 0, "test_grains", GAUGE, 1);
+  env.update(ComputeDriver::MachineType::WORKER, 1, "test_grains", GAUGE, 2);
+  env.update(ComputeDriver::MachineType::WORKER, 2, "test_grains", GAUGE, 3);
+  env.update(ComputeDriver::MachineType::STORAGE, 0, "test_grains", GAUGE, 10);
+
+  KJ_EXPECT(env.hasLine("# HELP test_grains Test metric."));
+  KJ_EXPECT(env.hasLine("# TYPE test_grains gauge"));
+  KJ_EXPECT(env.hasLine("test_grains{machine=\"worker1\"} 2"));
+  KJ_EXPECT(env.hasLine("test_grains{machine=\"storage0\"} 10"));
+
+  KJ_EXPECT(env.hasLine("# TYPE test_grains_cluster summary"));
+  KJ_EXPECT(env.hasLine("test_grains_cluster{type=\"worker\",quantile=\"0.5\"} 2"));
+  KJ_EXPECT(env.hasLine("test_grains_cluster{type=\"worker\",quantile=\"0.99\"} 3"));
+  KJ_EXPECT(env.hasLine("test_grains_cluster_sum{type=\"worker\"} 6"));
+  KJ_EXPECT(env.hasLine("test_grains_cluster_count{type=\"worker\"} 3"));
+  KJ_EXPECT(env.hasLine("test_grains_cluster{type=\"storage\",quantile=\"0.5\"} 10"));
+
+  KJ_EXPECT(env.hasLine(
+      "test_grains_cluster_top{type=\"worker\",rank=\"1\",machine=\"worker2\"} 3"));
+  KJ_EXPECT(env.hasLine(
+      "test_grains_cluster_top{type=\"worker\",rank=\"2\",machine=\"worker1\"} 2"));
+  KJ_EXPECT(!env.hasLineStartingWith("test_grains_cluster_top{type=\"worker\",rank=\"3\""));
+
+  // Removed machines drop out, and so does a series once no machine reports it.
+  env.metrics->remove({ComputeDriver::MachineType::WORKER, 2});
+  KJ_EXPECT(!env.hasLineStartingWith("test_grains{machine=\"worker2\"}"));
+  KJ_EXPECT(env.hasLine("test_grains_cluster_count{type=\"worker\"} 2"));
+
+  env.metrics->remove({ComputeDriver::MachineType::WORKER, 0});
+  env.metrics->remove({ComputeDriver::MachineType::WORKER, 1});
+  env.metrics->remove({ComputeDriver::MachineType::STORAGE, 0});
+  KJ_EXPECT(env.metrics->render() == "");
+}
+
+KJ_TEST("cluster metrics sum the rate of each counter per machine type") {
+  TestMetrics env;
+  auto COUNTER = MachineStats::Metric::Kind::COUNTER;
+  env.update(ComputeDriver::MachineType::WORKER, 0, "test_total", COUNTER, 100);
+  env.update(ComputeDriver::MachineType::WORKER, 1, "test_total", COUNTER, 100);
+
+  // One sample has no rate yet.
+  KJ_EXPECT(env.hasLine("# TYPE test_total counter"));
+  KJ_EXPECT(env.hasLine("test_total{machine=\"worker0\"} 100"));
+  KJ_EXPECT(env.hasLine("# TYPE test_total_rate gauge"));
+  KJ_EXPECT(!env.hasLineStartingWith("test_total_rate{"));
+
+  env.sleep();
+  env.update(ComputeDriver::MachineType::WORKER, 0, "test_total", COUNTER, 150);
+  env.update(ComputeDriver::MachineType::WORKER, 1, "test_total", COUNTER, 100);
+  KJ_EXPECT(env.hasLineStartingWith("test_total_rate{type=\"worker\"} "));
+  KJ_EXPECT(env.hasLineStartingWith(
+      "test_total_rate_top{type=\"worker\",rank=\"1\",machine=\"worker0\"} "));
+  KJ_EXPECT(env.hasLine(
+      "test_total_rate_top{type=\"worker\",rank=\"2\",machine=\"worker1\"} 0"));
+
+  // A counter that went backwards was reset by a restart and has no rate for one sample.
+  env.sleep();
+  env.update(ComputeDriver::MachineType::WORKER, 0, "test_total", COUNTER, 5);
+  env.update(ComputeDriver::MachineType::WORKER, 1, "test_total", COUNTER, 0);
+  KJ_EXPECT(!env.hasLineStartingWith("test_total_rate{"));
+}
+
+class TestDrainWorker final: public Worker::Server {
+  // A worker whose drain() calls all finish when `finish` is fulfilled.
+
+public:
+  uint drains = 0;
+  kj::ForkedPromise<void> finished;
+
+  explicit TestDrainWorker(kj::Promise<void> finish): finished(finish.fork()) {}
+
+protected:
+  kj::Promise<void> drain(DrainContext context) override {
+    ++drains;
+    return finished.addBranch();
+  }
+};
+
+class TestMachine final: public Machine::Server {
+public:
+  explicit TestMachine(Worker::Client worker): worker(kj::mv(worker)) {}
+
+protected:
+  kj::Promise<void> ping(PingContext context) override {
+    return kj::READY_NOW;
+  }
+
+  kj::Promise<void> becomeWorker(BecomeWorkerContext context) override {
+    context.getResults().setWorker(worker);
+    return kj::READY_NOW;
+  }
+
+private:
+  Worker::Client worker;
+};
+
+KJ_TEST("concurrent drains of one worker all wait for it to finish") {
+  auto ioContext = kj::setupAsyncIo();
+  auto& timer = ioContext.provider->getTimer();
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  auto worker = kj::heap<TestDrainWorker>(kj::mv(paf.promise));
+  auto& workerRef = *worker;
+  Machine::Client machine = kj::heap<TestMachine>(kj::mv(worker));
+  ComputeDriver::MachineId id(ComputeDriver::MachineType::WORKER, 0);
+
+  // E.g. the autoscaler removes the worker while its harness restarts it.
+  uint drained = 0;
+  auto first = drainWorker(timer, machine, id).then([&]() { ++drained; }).eagerlyEvaluate(nullptr);
+  auto second = drainWorker(timer, machine, id).then([&]() { ++drained; }).eagerlyEvaluate(nullptr);
+  timer.afterDelay(10 * kj::MILLISECONDS).wait(ioContext.waitScope);
+  KJ_EXPECT(workerRef.drains == 2);
+  KJ_EXPECT(drained == 0);
+
+  paf.fulfiller->fulfill();
+  first.wait(ioContext.waitScope);
+  second.wait(ioContext.waitScope);
+  KJ_EXPECT(drained == 2);
+}
+
+KJ_TEST("drainWorker() doesn't fail when the worker can't be drained") {
+  auto ioContext = kj::setupAsyncIo();
+  auto& timer = ioContext.provider->getTimer();
+  Machine::Client machine = kj::heap<TestMachine>(kj::heap<TestDrainWorker>(
+      KJ_EXCEPTION(DISCONNECTED, "worker went away")));
+  ComputeDriver::MachineId id(ComputeDriver::MachineType::WORKER, 0);
+
+  drainWorker(timer, machine, id).wait(ioContext.waitScope);
+}
+
+}  // namespace
+}  // namespace blackrock
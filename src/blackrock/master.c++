@@ -17,6 +17,9 @@
 #include "master.h"
 #include <map>
 #include <set>
+#include <algorithm>
+#include <math.h>
+#include <string.h>
 #include <kj/debug.h>
 #include <kj/vector.h>
 #include <blackrock/machine.capnp.h>
@@ -76,6 +79,41 @@ RegistrationArray registrationArray(Params&&... params) {
   return addEach(builder, kj::fwd<Params>(params)...);
 }
 
+kj::StringPtr machineTypeName(ComputeDriver::MachineType type) {
+  switch (type) {
+    case ComputeDriver::MachineType::STORAGE    : return "storage"    ;
+    case ComputeDriver::MachineType::WORKER     : return "worker"     ;
+    case ComputeDriver::MachineType::COORDINATOR: return "coordinator";
+    case ComputeDriver::MachineType::FRONTEND   : return "frontend"   ;
+    case ComputeDriver::MachineType::MONGO      : return "mongo"      ;
+  }
+  KJ_UNREACHABLE;
+}
+
+static constexpr kj::Duration WORKER_DRAIN_TIMEOUT = 4 * kj::MINUTES;
+// validateAutoscaleConfig() requires the autoscaler's cooldown to be longer, so that a removed
+// worker has normally stopped before the next change.
+
+kj::Promise<void> drainIfRunning(kj::Timer& timer, capnp::RpcSystem<VatPath>& rpcSystem,
+                                 VatId::Reader self, ComputeDriver& driver,
+                                 ComputeDriver::MachineId id) {
+  // Drains the worker `id` if its process is running. A worker that isn't running has no grains
+  // to move, so it isn't started just to be drained.
+
+  return driver.findRunning(id, self)
+      .then([&timer,&rpcSystem,id](kj::Maybe<VatPath::Reader> path) -> kj::Promise<void> {
+    KJ_IF_MAYBE(p, path) {
+      return drainWorker(timer, rpcSystem.bootstrap(*p).castAs<Machine>(), id);
+    } else {
+      KJ_LOG(INFO, "worker isn't running; nothing to drain", id);
+      return kj::READY_NOW;
+    }
+  }, [id](kj::Exception&& exception) -> kj::Promise<void> {
+    KJ_LOG(WARNING, "couldn't find worker process; its grains will be killed", id, exception);
+    return kj::READY_NOW;
+  });
+}
+
 class MachineHarness {
   // Runs one machine, booting it and automatically restarting it as needed. A callback is provided
   // which is called each time a connection to the machine is established in order to add it to
@@ -83,11 +121,12 @@ class MachineHarness {
 
 public:
   MachineHarness(kj::Timer& timer, capnp::RpcSystem<VatPath>& rpcSystem, VatId::Reader self,
+                 HeartbeatConfig::Reader heartbeatConfig, ClusterMetrics& metrics,
                  ComputeDriver& driver, ComputeDriver::MachineId id,
                  bool alreadyBooted, bool requireRestartProcess,
                  kj::Function<RegistrationArray(Machine::Client)> setup)
-      : timer(timer), rpcSystem(rpcSystem), self(self), driver(driver), id(id),
-        setup(kj::mv(setup)), booted(alreadyBooted),
+      : timer(timer), rpcSystem(rpcSystem), self(self), heartbeatConfig(heartbeatConfig),
+        metrics(metrics), driver(driver), id(id), setup(kj::mv(setup)), booted(alreadyBooted),
         runTask(run(requireRestartProcess ? RESTART : RECONNECT)
             .eagerlyEvaluate([](kj::Exception&& exception) {
           // Shouldn't happen! Don't let cluster end up in broken state.
@@ -95,14 +134,25 @@ public:
           abort();
         })) {}
 
+  ~MachineHarness() noexcept(false) {
+    metrics.remove(id);
+  }
+
+  kj::Maybe<Machine::Client> getConnection() { return connected; }
+  // The machine's Blackrock process, if we're currently connected to it.
+
 private:
   kj::Timer& timer;
   capnp::RpcSystem<VatPath>& rpcSystem;
   VatId::Reader self;
+  HeartbeatConfig::Reader heartbeatConfig;
+  ClusterMetrics& metrics;
   ComputeDriver& driver;
   ComputeDriver::MachineId id;
   kj::Function<RegistrationArray(Machine::Client)> setup;
   bool booted;
+  kj::Maybe<Machine::Client> connected;
+  // The machine's Blackrock process, while we're connected to it.
   kj::Promise<void> runTask;
 
   enum RetryStage {
@@ -115,7 +165,9 @@ private:
     if (booted) {
       // Already booted. Should we reboot?
       if (retryStage == REBOOT) {
-        return driver.stop(id).then([this]() {
+        return drainIfWorker().then([this]() {
+          return driver.stop(id);
+        }).then([this]() {
           booted = false;
           // Since we're not booted, the stage we pass to run() here is irrelevant.
           return run(RECONNECT);
@@ -129,8 +181,10 @@ private:
       });
     }
 
-    return driver.run(id, self, retryStage == RESTART)
-        .then([this,retryStage](VatPath::Reader path) {
+    auto drained = retryStage == RESTART ? drainIfWorker() : kj::Promise<void>(kj::READY_NOW);
+    return drained.then([this,retryStage]() {
+      return driver.run(id, self, retryStage == RESTART);
+    }).then([this,retryStage](VatPath::Reader path) {
       auto machine = rpcSystem.bootstrap(path).castAs<Machine>();
 
       // Try to send a ping, giving up after 60 seconds.
@@ -138,6 +192,7 @@ private:
       return timer.timeoutAfter(60 * kj::SECONDS, kj::mv(initialPing))
           .then([this,KJ_MVCAP(machine)]() mutable {
         // Successfully pinged. The machine is up.
+        connected = machine;
 
         // Call the setup function.
         auto registrations = setup(machine);
@@ -146,13 +201,17 @@ private:
         auto req = machine.pingRequest();
         req.setHang(true);
         return req.send().then([](auto&&) {})
-            .exclusiveJoin(pingLoop(machine))
+            .exclusiveJoin(heartbeatLoop(
+                kj::heap<Heartbeat>(machine, heartbeatConfig, timer.now())))
+            .exclusiveJoin(statsLoop(machine))
             .attach(kj::mv(registrations))
             .then([this]() {
           KJ_LOG(ERROR, "monitoring for machine returned without error? reconnecting", id);
         }, [this](kj::Exception&& exception) {
           KJ_LOG(ERROR, "lost connection to machine; reconnecting", id, exception);
         }).then([this]() {
+          connected = nullptr;
+          metrics.remove(id);
           return run(RECONNECT);
         });
       }, [this,retryStage](kj::Exception&& exception) {
@@ -174,13 +233,68 @@ private:
     });
   }
 
-  kj::Promise<void> pingLoop(Machine::Client machine) {
-    return timer.afterDelay(60 * kj::SECONDS)
-        .then([this,KJ_MVCAP(machine)]() mutable {
-      auto ping = machine.pingRequest().send().then([](auto&&) {});
-      return timer.timeoutAfter(60 * kj::SECONDS, kj::mv(ping))
+  kj::Promise<void> drainIfWorker() {
+    // Before a worker's process is killed, give its grains a chance to move.
+
+    if (id.type != ComputeDriver::MachineType::WORKER) return kj::READY_NOW;
+    KJ_IF_MAYBE(machine, connected) {
+      return drainWorker(timer, *machine, id);
+    } else {
+      return drainIfRunning(timer, rpcSystem, self, driver, id);
+    }
+  }
+
+  struct Heartbeat {
+    Machine::Client machine;
+    PhiAccrualDetector detector;
+
+    kj::Promise<void> ping = nullptr;
+    bool pingInFlight = false;
+    // The most recent ping. We don't send another until it returns, so a machine that has stalled
+    // doesn't accumulate a queue of them.
+
+    Heartbeat(Machine::Client machine, HeartbeatConfig::Reader config, kj::TimePoint now)
+        : machine(kj::mv(machine)), detector(config, now) {}
+  };
+
+  kj::Promise<void> heartbeatLoop(kj::Own<Heartbeat> heartbeat) {
+    return timer.afterDelay(heartbeatConfig.getIntervalMs() * kj::MILLISECONDS)
+        .then([this,KJ_MVCAP(heartbeat)]() mutable -> kj::Promise<void> {
+      auto now = timer.now();
+      double phi = heartbeat->detector.phi(now);
+      if (phi > heartbeatConfig.getPhiThreshold()) {
+        return KJ_EXCEPTION(DISCONNECTED, "machine stopped responding to pings", id, phi,
+                            heartbeat->detector.millisecondsSinceHeartbeat(now));
+      }
+
+      if (!heartbeat->pingInFlight) {
+        // If the ping fails, it stays "in flight" so that no more are sent; the hanging ping will
+        // most likely notice the disconnect first, but otherwise phi will climb.
+        auto& state = *heartbeat;
+        state.pingInFlight = true;
+        state.ping = state.machine.pingRequest().send()
+            .then([this,&state](auto&&) {
+          state.detector.heartbeat(timer.now());
+          state.pingInFlight = false;
+        }).eagerlyEvaluate(nullptr);
+      }
+
+      return heartbeatLoop(kj::mv(heartbeat));
+    });
+  }
+
+  kj::Promise<void> statsLoop(Machine::Client machine) {
+    // Never completes; failures are logged but it's up to the heartbeat to decide whether the
+    // machine is down.
+
+    return machine.getStatsRequest().send().then([this](auto&& response) {
+      metrics.update(id, response.getStats());
+    }, [this](kj::Exception&& exception) {
+      KJ_LOG(WARNING, "getStats() failed", id, exception);
+    }).then([this,KJ_MVCAP(machine)]() mutable {
+      return timer.afterDelay(metrics.getPollInterval())
           .then([this,KJ_MVCAP(machine)]() mutable {
-        return pingLoop(kj::mv(machine));
+        return statsLoop(kj::mv(machine));
       });
     });
   }
@@ -188,9 +302,347 @@ private:
 
 }  // namespace
 
+kj::Promise<void> drainWorker(kj::Timer& timer, Machine::Client machine,
+                              ComputeDriver::MachineId id) {
+  auto ping = machine.pingRequest().send().then([](auto&&) {});
+  return timer.timeoutAfter(10 * kj::SECONDS, kj::mv(ping))
+      .then([&timer,KJ_MVCAP(machine)]() mutable {
+    auto worker = machine.becomeWorkerRequest().send().getWorker();
+    return timer.timeoutAfter(WORKER_DRAIN_TIMEOUT,
+        worker.drainRequest().send().then([](auto&&) {}));
+  }).then([id]() {
+    KJ_LOG(INFO, "drained worker", id);
+  }, [id](kj::Exception&& exception) {
+    KJ_LOG(WARNING, "couldn't drain worker; its grains will be killed", id, exception);
+  });
+}
+
+ClusterMetrics::ClusterMetrics(kj::Timer& timer, MetricsConfig::Reader config)
+    : timer(timer), config(config), tasks(*this) {}
+
+kj::Duration ClusterMetrics::getPollInterval() {
+  return config.getPollIntervalSeconds() * kj::SECONDS;
+}
+
+void ClusterMetrics::update(ComputeDriver::MachineId id, MachineStats::Reader stats) {
+  auto now = timer.now();
+  for (auto metric: stats.getMetrics()) {
+    auto iter = series.find(metric.getName());
+    if (iter == series.end()) {
+      auto name = kj::heapString(metric.getName());
+      kj::StringPtr key = name;
+      iter = series.insert(std::make_pair(key, Series {
+          kj::mv(name), kj::heapString(metric.getHelp()), metric.getKind(), {} })).first;
+    }
+
+    auto& samples = iter->second.samples;
+    double value = metric.getValue();
+    kj::Maybe<double> rate;
+    auto previous = samples.find(id);
+    if (previous != samples.end() && metric.getKind() == MachineStats::Metric::Kind::COUNTER) {
+      double seconds = (now - previous->second.time) / kj::MILLISECONDS / 1000.0;
+      // A counter that went backwards was reset by a restart; skip one rate.
+      if (seconds > 0 && value >= previous->second.value) {
+        rate = (value - previous->second.value) / seconds;
+      }
+    }
+    samples[id] = Sample { value, rate, now };
+  }
+}
+
+void ClusterMetrics::remove(ComputeDriver::MachineId id) {
+  for (auto iter = series.begin(); iter != series.end();) {
+    iter->second.samples.erase(id);
+    if (iter->second.samples.empty()) {
+      iter = series.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+}
+
+kj::Promise<void> ClusterMetrics::serve(kj::ConnectionReceiver& receiver) {
+  return receiver.accept().then([this,&receiver](kj::Own<kj::AsyncIoStream>&& connection) {
+    tasks.add(timer.timeoutAfter(10 * kj::SECONDS, respond(kj::mv(connection))));
+    return serve(receiver);
+  });
+}
+
+kj::String ClusterMetrics::render() {
+  kj::Vector<kj::String> lines;
+
+  for (auto& entry: series) {
+    auto& s = entry.second;
+    bool isCounter = s.kind == MachineStats::Metric::Kind::COUNTER;
+
+    lines.add(kj::str("# HELP ", s.name, ' ', s.help));
+    lines.add(kj::str("# TYPE ", s.name, isCounter ? " counter" : " gauge"));
+
+    // Per machine type, the value we aggregate from each machine: rate for counters, level for
+    // gauges.
+    std::map<ComputeDriver::MachineType,
+             kj::Vector<std::pair<double, ComputeDriver::MachineId>>> byType;
+    for (auto& sample: s.samples) {
+      lines.add(kj::str(s.name, "{machine=\"", sample.first.toString(), "\"} ",
+                        sample.second.value));
+      if (isCounter) {
+        KJ_IF_MAYBE(rate, sample.second.rate) {
+          byType[sample.first.type].add(*rate, sample.first);
+        }
+      } else {
+        byType[sample.first.type].add(sample.second.value, sample.first);
+      }
+    }
+
+    auto aggregate = isCounter ? kj::str(s.name, "_rate") : kj::str(s.name, "_cluster");
+    if (isCounter) {
+      lines.add(kj::str("# HELP ", aggregate, " Rate per second, summed over machines: ",
+                        s.help));
+      lines.add(kj::str("# TYPE ", aggregate, " gauge"));
+    } else {
+      lines.add(kj::str("# HELP ", aggregate, " Distribution across machines: ", s.help));
+      lines.add(kj::str("# TYPE ", aggregate, " summary"));
+    }
+    for (auto& group: byType) {
+      auto& values = group.second;
+      std::sort(values.begin(), values.end(),
+          [](const std::pair<double, ComputeDriver::MachineId>& a,
+             const std::pair<double, ComputeDriver::MachineId>& b) {
+        return a.first < b.first;
+      });
+
+      auto type = machineTypeName(group.first);
+      double sum = 0;
+      for (auto& value: values) sum += value.first;
+
+      if (isCounter) {
+        lines.add(kj::str(aggregate, "{type=\"", type, "\"} ", sum));
+      } else {
+        for (double quantile: {0.5, 0.9, 0.99}) {
+          // Nearest rank.
+          size_t rank = ceil(quantile * values.size());
+          if (rank > 0) --rank;
+          lines.add(kj::str(aggregate, "{type=\"", type, "\",quantile=\"", quantile, "\"} ",
+                            values[rank].first));
+        }
+        lines.add(kj::str(aggregate, "_sum{type=\"", type, "\"} ", sum));
+        lines.add(kj::str(aggregate, "_count{type=\"", type, "\"} ", values.size()));
+      }
+    }
+
+    lines.add(kj::str("# HELP ", aggregate, "_top Machines with the highest values."));
+    lines.add(kj::str("# TYPE ", aggregate, "_top gauge"));
+    for (auto& group: byType) {
+      auto& values = group.second;
+      size_t count = kj::min(size_t(config.getTopCount()), values.size());
+      for (size_t i = 0; i < count; i++) {
+        auto& value = values[values.size() - 1 - i];
+        lines.add(kj::str(aggregate, "_top{type=\"", machineTypeName(group.first),
+                          "\",rank=\"", i + 1, "\",machine=\"", value.second.toString(), "\"} ",
+                          value.first));
+      }
+    }
+  }
+
+  lines.add(kj::str());
+  return kj::strArray(lines, "\n");
+}
+
+kj::Promise<void> ClusterMetrics::respond(kj::Own<kj::AsyncIoStream> connection,
+                                          kj::String received) {
+  // Every request gets the same response, so we just read up to the end of the request headers
+  // before sending it.
+
+  auto buffer = kj::heapArray<char>(1024);
+  auto& connectionRef = *connection;
+  auto promise = connectionRef.tryRead(buffer.begin(), 1, buffer.size());
+  return promise.then([this,KJ_MVCAP(connection),KJ_MVCAP(buffer),KJ_MVCAP(received)](
+      size_t n) mutable -> kj::Promise<void> {
+    auto text = kj::str(received, kj::ArrayPtr<const char>(buffer.begin(), n));
+    if (n > 0 && text.size() < 16384 && strstr(text.cStr(), "\r\n\r\n") == nullptr &&
+        strstr(text.cStr(), "\n\n") == nullptr) {
+      return respond(kj::mv(connection), kj::mv(text));
+    }
+
+    auto body = render();
+    auto response = kj::str(
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: ", body.size(), "\r\n"
+        "Connection: close\r\n"
+        "\r\n", body);
+    auto& connectionRef = *connection;
+    return connectionRef.write(response.begin(), response.size())
+        .attach(kj::mv(response), kj::mv(connection));
+  });
+}
+
+void ClusterMetrics::taskFailed(kj::Exception&& exception) {
+  KJ_LOG(WARNING, "metrics request failed", exception);
+}
+
+void validateAutoscaleConfig(AutoscaleConfig::Reader config) {
+  if (config.getMaxWorkers() == 0) return;  // disabled
+
+  KJ_REQUIRE(config.getMinWorkers() > 0 && config.getMinWorkers() <= config.getMaxWorkers(),
+             "invalid autoscale bounds");
+  KJ_REQUIRE(config.getCooldownSeconds() * kj::SECONDS > WORKER_DRAIN_TIMEOUT,
+             "autoscale cooldown must be longer than the worker drain timeout",
+             config.getCooldownSeconds(), WORKER_DRAIN_TIMEOUT / kj::SECONDS);
+}
+
+class Autoscaler::LoadReceiverImpl final: public BackendLoadReceiver::Server {
+public:
+  LoadReceiverImpl(Autoscaler& autoscaler, uint index, BackendLoadReceiver::Client inner)
+      : autoscaler(autoscaler), index(index), inner(kj::mv(inner)) {}
+
+protected:
+  kj::Promise<void> update(UpdateContext context) override {
+    auto load = context.getParams().getLoad();
+    if (index < autoscaler.count) {
+      autoscaler.utilization[index] = autoscaler.utilizationOf(load);
+    }
+
+    auto req = inner.updateRequest();
+    req.setLoad(load);
+    return context.tailCall(kj::mv(req));
+  }
+
+private:
+  Autoscaler& autoscaler;
+  uint index;
+  BackendLoadReceiver::Client inner;
+};
+
+Autoscaler::Autoscaler(kj::Timer& timer, AutoscaleConfig::Reader config, uint initialCount,
+                       kj::Function<void(uint index)> addWorker,
+                       kj::Function<kj::Promise<void>(uint index)> removeWorker)
+    : timer(timer), config(config), count(initialCount), addWorker(kj::mv(addWorker)),
+      removeWorker(kj::mv(removeWorker)), lastChange(timer.now()), tasks(*this),
+      runTask(run().eagerlyEvaluate([](kj::Exception&& exception) {
+        KJ_LOG(ERROR, "autoscaler failed; worker count is now fixed", exception);
+      })) {}
+
+BackendLoadReceiver::Client Autoscaler::wrapLoadReceiver(
+    uint index, BackendLoadReceiver::Client inner) {
+  return kj::heap<LoadReceiverImpl>(*this, index, kj::mv(inner));
+}
+
+float Autoscaler::utilizationOf(BackendLoad::Reader load) {
+  float grains = float(load.getOutstanding()) / kj::max(config.getGrainsPerWorker(), 1u);
+  return kj::max(grains, kj::max(load.getMemoryUsed(), load.getCpuUsed()));
+}
+
+kj::Promise<void> Autoscaler::run() {
+  return timer.afterDelay(config.getCheckIntervalSeconds() * kj::SECONDS).then([this]() {
+    check();
+    return run();
+  });
+}
+
+void Autoscaler::check() {
+  auto now = timer.now();
+  if (now - lastChange < config.getCooldownSeconds() * kj::SECONDS) return;
+
+  float total = 0;
+  for (auto& entry: utilization) {
+    total += entry.second;
+  }
+  float average = total / count;
+
+  if (average > config.getScaleUpAbove() && count < config.getMaxWorkers()) {
+    if (retiring.count(count) > 0) {
+      KJ_LOG(INFO, "waiting for retiring worker to stop before scaling up", average, count);
+      return;
+    }
+
+    KJ_LOG(INFO, "autoscaling workers", average, count, count + 1);
+    addWorker(count++);
+  } else if (average < config.getScaleDownBelow() && count > config.getMinWorkers() &&
+             total / (count - 1) < config.getScaleUpAbove()) {
+    uint index = --count;
+    KJ_LOG(INFO, "autoscaling workers", average, count + 1, count);
+    utilization.erase(index);
+    retiring.insert(index);
+    tasks.add(removeWorker(index).then([this,index]() {
+      retiring.erase(index);
+    }, [this,index](kj::Exception&& exception) {
+      KJ_LOG(ERROR, "failed to stop retired worker; its index can be reused now", index,
+             exception);
+      retiring.erase(index);
+    }));
+  } else {
+    return;
+  }
+
+  lastChange = now;
+}
+
+void Autoscaler::taskFailed(kj::Exception&& exception) {
+  KJ_LOG(ERROR, exception);
+}
+
+void validateHeartbeatConfig(HeartbeatConfig::Reader config) {
+  KJ_REQUIRE(config.getIntervalMs() > 0, "heartbeat interval must be positive");
+  KJ_REQUIRE(config.getPhiThreshold() > 0, "heartbeat phi threshold must be positive",
+             config.getPhiThreshold());
+}
+
+PhiAccrualDetector::PhiAccrualDetector(HeartbeatConfig::Reader config, kj::TimePoint now)
+    : windowSize(kj::max(config.getWindowSize(), 2u)),
+      minStdDev(config.getMinStdDevMs()),
+      acceptablePause(config.getAcceptablePauseMs()),
+      lastHeartbeat(now) {
+  // Until we have real samples, pretend we've seen heartbeats at the configured interval with a
+  // standard deviation of a quarter of it.
+  double interval = config.getIntervalMs();
+  addInterval(interval * 0.75);
+  addInterval(interval * 1.25);
+}
+
+void PhiAccrualDetector::heartbeat(kj::TimePoint now) {
+  addInterval((now - lastHeartbeat) / kj::MILLISECONDS);
+  lastHeartbeat = now;
+}
+
+double PhiAccrualDetector::phi(kj::TimePoint now) const {
+  double n = intervals.size();
+  double mean = sum / n;
+  double stdDev = kj::max(sqrt(kj::max(sumOfSquares / n - mean * mean, 0.0)), minStdDev);
+  mean += acceptablePause;
+
+  // Logistic approximation of the normal CDF, as in Akka's implementation; it stays accurate
+  // far out in the tail, where we care about it.
+  double elapsed = (now - lastHeartbeat) / kj::MILLISECONDS;
+  double y = (elapsed - mean) / stdDev;
+  double e = exp(-y * (1.5976 + 0.070566 * y * y));
+  if (elapsed > mean) {
+    return -log10(e / (1.0 + e));
+  } else {
+    return -log10(1.0 - 1.0 / (1.0 + e));
+  }
+}
+
+uint64_t PhiAccrualDetector::millisecondsSinceHeartbeat(kj::TimePoint now) const {
+  return (now - lastHeartbeat) / kj::MILLISECONDS;
+}
+
+void PhiAccrualDetector::addInterval(double interval) {
+  if (intervals.size() >= windowSize) {
+    double old = intervals.front();
+    intervals.pop_front();
+    sum -= old;
+    sumOfSquares -= old * old;
+  }
+  intervals.push_back(interval);
+  sum += interval;
+  sumOfSquares += interval * interval;
+}
+
 void runMaster(kj::AsyncIoContext& ioContext, ComputeDriver& driver, MasterConfig::Reader config,
                bool shouldRestart, kj::ArrayPtr<kj::StringPtr> machinesToRestart) {
   KJ_REQUIRE(config.getWorkerCount() > 0, "need at least one worker");
+  validateHeartbeatConfig(config.getHeartbeat());
 
   std::set<ComputeDriver::MachineId> restartSet;
   for (auto& m: machinesToRestart) {
@@ -199,27 +651,71 @@ void runMaster(kj::AsyncIoContext& ioContext, ComputeDriver& driver, MasterConfi
 
   VatNetwork network(ioContext.provider->getNetwork(), ioContext.provider->getTimer(),
                      driver.getMasterBindAddress());
+  if (config.getCompressRpc()) {
+    network.setCompressionFilter([](const SimpleAddress&) { return true; });
+  }
+  driver.setCompressRpc(config.getCompressRpc());
   auto rpcSystem = capnp::makeRpcClient(network);
 
-  kj::Vector<kj::Own<MachineHarness>> harnesses;
   ErrorLogger logger;
   kj::TaskSet tasks(logger);
 
-  uint storageCount = 1;
+  // Serve cluster metrics. Declared before the harnesses, which report to it.
+  ClusterMetrics metrics(ioContext.provider->getTimer(), config.getMetrics());
+  kj::Promise<void> metricsTask = nullptr;
+  if (config.getMetrics().getBindAddress().size() > 0) {
+    auto receiver = ioContext.provider->getNetwork()
+        .parseAddress(config.getMetrics().getBindAddress())
+        .wait(ioContext.waitScope)->listen();
+    auto& receiverRef = *receiver;
+    metricsTask = metrics.serve(receiverRef).attach(kj::mv(receiver))
+        .eagerlyEvaluate([](kj::Exception&& exception) {
+      KJ_LOG(ERROR, "metrics server failed", exception);
+    });
+  }
+
+  kj::Vector<kj::Own<MachineHarness>> harnesses;
+
+  uint storageCount = config.getStorageCount();
   uint workerCount = config.getWorkerCount();
+  auto autoscaleConfig = config.getAutoscale();
+  validateAutoscaleConfig(autoscaleConfig);
+
+  KJ_LOG(INFO, "examining currently-running machines...");
+  auto runningMachines = driver.listMachines().wait(ioContext.waitScope);
+
+  if (autoscaleConfig.getMaxWorkers() > 0) {
+    workerCount = kj::max(autoscaleConfig.getMinWorkers(),
+                          kj::min(workerCount, autoscaleConfig.getMaxWorkers()));
+
+    // Keep any workers that the autoscaler added before the master restarted, rather than
+    // stopping them under their grains.
+    for (auto& machine: runningMachines) {
+      if (machine.type == ComputeDriver::MachineType::WORKER &&
+          machine.index < autoscaleConfig.getMaxWorkers()) {
+        workerCount = kj::max(workerCount, machine.index + 1);
+      }
+    }
+  }
   uint frontendCount = config.getFrontendCount();
   uint mongoCount = 1;
-  uint coordinatorCount = 0;
+  uint coordinatorCount = config.getCoordinatorCount();
+  uint hostedRestorerCount = 0;  // TODO(someday): Coordinators should serve these.
   uint gatewayCount = 0;
 
   // Storage feeders.
   BackendSetFeeder<StorageSibling> storageSiblingFeeder(storageCount);
-  BackendSetFeeder<Restorer<SturdyRef::Hosted>> hostedRestorerForStorageFeeder(coordinatorCount);
+  BackendSetFeeder<Restorer<SturdyRef::Hosted>> hostedRestorerForStorageFeeder(hostedRestorerCount);
   BackendSetFeeder<Restorer<SturdyRef::External>> gatewayRestorerForStorageFeeder(gatewayCount);
 
   // Frontend feeders.
   BackendSetFeeder<Restorer<SturdyRef::Stored>> storageRestorerForFrontendFeeder(storageCount);
-  BackendSetFeeder<Restorer<SturdyRef::Hosted>> hostedRestorerForFrontendFeeder(coordinatorCount);
+  BackendSetFeeder<Restorer<SturdyRef::Hosted>> hostedRestorerForFrontendFeeder(
+      hostedRestorerCount);
+  BackendSetFeeder<Coordinator> coordinatorFeeder(coordinatorCount);
+
+  // Coordinator feeders.
+  BackendSetFeeder<Restorer<SturdyRef::Stored>> storageRestorerForCoordinatorFeeder(storageCount);
 
   // Non-specific feeders.
   BackendSetFeeder<Worker> workerFeeder(workerCount);
@@ -233,27 +729,32 @@ void runMaster(kj::AsyncIoContext& ioContext, ComputeDriver& driver, MasterConfi
   expectedCounts[ComputeDriver::MachineType::WORKER] = workerCount;
   expectedCounts[ComputeDriver::MachineType::FRONTEND] = frontendCount;
   expectedCounts[ComputeDriver::MachineType::MONGO] = mongoCount;
+  expectedCounts[ComputeDriver::MachineType::COORDINATOR] = coordinatorCount;
 
   VatPath::Reader storagePath;
   auto workerPaths = kj::heapArray<VatPath::Reader>(config.getWorkerCount());
   auto frontendPaths = kj::heapArray<VatPath::Reader>(config.getFrontendCount());
   VatPath::Reader mongoPath;
 
-  KJ_LOG(INFO, "examining currently-running machines...");
-
   // Shut down any machines that we don't need anymore and record which others are started.
   std::set<ComputeDriver::MachineId> alreadyRunning;
-  for (auto& machine: driver.listMachines().wait(ioContext.waitScope)) {
+  for (auto& machine: runningMachines) {
     if (machine.index >= expectedCounts[machine.type]) {
       KJ_LOG(INFO, "STOPPING", machine);
-      tasks.add(driver.stop(machine));
+      if (machine.type == ComputeDriver::MachineType::WORKER) {
+        tasks.add(drainIfRunning(ioContext.provider->getTimer(), rpcSystem,
+                                 network.getSelf().getId(), driver, machine)
+            .then([&driver,machine]() { return driver.stop(machine); }));
+      } else {
+        tasks.add(driver.stop(machine));
+      }
     } else {
       alreadyRunning.insert(machine);
     }
   }
 
-  auto start = [&](ComputeDriver::MachineId id,
-                   kj::Function<RegistrationArray(Machine::Client)> setup) {
+  auto newHarness = [&](ComputeDriver::MachineId id,
+                        kj::Function<RegistrationArray(Machine::Client)> setup) {
     bool shouldRestartNode = shouldRestart || restartSet.count(id) > 0;
     if (shouldRestartNode) {
       KJ_LOG(INFO, "RESTARTING", id);
@@ -261,35 +762,101 @@ void runMaster(kj::AsyncIoContext& ioContext, ComputeDriver& driver, MasterConfi
       KJ_LOG(INFO, "STARTING", id);
     }
 
-    harnesses.add(kj::heap<MachineHarness>(
+    return kj::heap<MachineHarness>(
         ioContext.provider->getTimer(), rpcSystem, network.getSelf().getId(),
-        driver, id, alreadyRunning.count(id) > 0, shouldRestartNode,
-        kj::mv(setup)));
+        config.getHeartbeat(), metrics, driver, id, alreadyRunning.count(id) > 0,
+        shouldRestartNode,
+        kj::mv(setup));
+  };
+  auto start = [&](ComputeDriver::MachineId id,
+                   kj::Function<RegistrationArray(Machine::Client)> setup) {
+    harnesses.add(newHarness(id, kj::mv(setup)));
   };
 
-  // Start storage.
-  start({ ComputeDriver::MachineType::STORAGE, 0 }, [&](Machine::Client&& machine) {
-    auto storage = machine.becomeStorageRequest().send();
+  // Start storage. Each node's root set is registered under its index so that root names keep
+  // hashing to the same node across restarts (see BackendSetBase::chooseShard()).
+  for (uint i = 0; i < storageCount; i++) {
+    start({ ComputeDriver::MachineType::STORAGE, i }, [&,i](Machine::Client&& machine) {
+      auto storage = machine.becomeStorageRequest().send();
 
-    return registrationArray(
-        storageSiblingFeeder.addBackend(storage.getSibling()),
-        storageRootFeeder.addBackend(storage.getRootSet()),
-        ({
-          auto req = storage.getStorageRestorer().getForOwnerRequest();
-          req.initDomain().setFrontend();
-          storageRestorerForFrontendFeeder.addBackend(req.send().getAttenuated());
-        }),
-        storageFactoryFeeder.addBackend(storage.getStorageFactory()),
-        storageSiblingFeeder.addConsumer(storage.getSiblingSet()),
-        hostedRestorerForStorageFeeder.addConsumer(storage.getHostedRestorerSet()),
-        gatewayRestorerForStorageFeeder.addConsumer(storage.getGatewayRestorerSet()));
-  });
+      return registrationArray(
+          storageSiblingFeeder.addBackend(storage.getSibling()),
+          storageRootFeeder.addBackend(storage.getRootSet(), i),
+          ({
+            auto req = storage.getStorageRestorer().getForOwnerRequest();
+            req.initDomain().setFrontend();
+            storageRestorerForFrontendFeeder.addBackend(req.send().getAttenuated());
+          }),
+          ({
+            auto req = storage.getStorageRestorer().getForOwnerRequest();
+            req.initDomain().setCoordinator();
+            storageRestorerForCoordinatorFeeder.addBackend(req.send().getAttenuated());
+          }),
+          storageFactoryFeeder.addBackend(storage.getStorageFactory()),
+          storageSiblingFeeder.addConsumer(storage.getSiblingSet()),
+          hostedRestorerForStorageFeeder.addConsumer(storage.getHostedRestorerSet()),
+          gatewayRestorerForStorageFeeder.addConsumer(storage.getGatewayRestorerSet()));
+    });
+  }
+
+  // Start workers. These are kept separately from `harnesses` so that the autoscaler can add and
+  // remove them; removing a harness drops the worker from all backend sets.
+  kj::Vector<kj::Own<MachineHarness>> workerHarnesses;
+  kj::Maybe<kj::Own<Autoscaler>> autoscaler;
+  auto startWorker = [&](uint i) {
+    workerHarnesses.add(newHarness({ ComputeDriver::MachineType::WORKER, i },
+                                   [&,i](Machine::Client&& machine) {
+      auto worker = machine.becomeWorkerRequest().send().getWorker();
+      auto registration = workerFeeder.addBackend(worker);
+
+      auto req = worker.watchLoadRequest();
+      auto receiver = workerFeeder.getLoadReceiver(*registration);
+      KJ_IF_MAYBE(a, autoscaler) {
+        receiver = a->get()->wrapLoadReceiver(i, kj::mv(receiver));
+      }
+      req.setReceiver(kj::mv(receiver));
+      tasks.add(req.send().then([](auto&&) {}));
 
-  // Start workers.
+      return registrationArray(kj::mv(registration));
+    }));
+  };
   for (uint i = 0; i < workerCount; i++) {
-    start({ ComputeDriver::MachineType::WORKER, i }, [&](Machine::Client&& machine) {
+    startWorker(i);
+  }
+  if (autoscaleConfig.getMaxWorkers() > 0) {
+    autoscaler = kj::heap<Autoscaler>(ioContext.provider->getTimer(), autoscaleConfig,
+                                      workerCount, [&](uint index) {
+      KJ_ASSERT(index == workerHarnesses.size());
+      startWorker(index);
+    }, [&](uint index) {
+      KJ_ASSERT(index == workerHarnesses.size() - 1);
+      ComputeDriver::MachineId id = { ComputeDriver::MachineType::WORKER, index };
+      // Dropping the harness removes the worker from the backend sets, so it gets no new grains
+      // while it drains.
+      auto connection = workerHarnesses.back()->getConnection();
+      workerHarnesses.removeLast();
+      alreadyRunning.erase(id);
+      KJ_LOG(INFO, "STOPPING", id);
+      kj::Promise<void> drained = nullptr;
+      KJ_IF_MAYBE(machine, connection) {
+        drained = drainWorker(ioContext.provider->getTimer(), kj::mv(*machine), id);
+      } else {
+        drained = drainIfRunning(ioContext.provider->getTimer(), rpcSystem,
+                                 network.getSelf().getId(), driver, id);
+      }
+      return drained.then([&driver,id]() { return driver.stop(id); });
+    });
+  }
+
+  // Start coordinators.
+  for (uint i = 0; i < coordinatorCount; i++) {
+    start({ ComputeDriver::MachineType::COORDINATOR, i }, [&](Machine::Client&& machine) {
+      auto coordinator = machine.becomeCoordinatorRequest().send();
+
       return registrationArray(
-          workerFeeder.addBackend(machine.becomeWorkerRequest().send().getWorker()));
+          coordinatorFeeder.addBackend(coordinator.getCoordinator()),
+          workerFeeder.addConsumer(coordinator.getWorkerSet()),
+          storageRestorerForCoordinatorFeeder.addConsumer(coordinator.getStorageRestorerSet()));
     });
   }
 
@@ -300,6 +867,7 @@ void runMaster(kj::AsyncIoContext& ioContext, ComputeDriver& driver, MasterConfi
         auto req = machine.becomeFrontendRequest();
         req.setConfig(config.getFrontendConfig());
         req.setReplicaNumber(i);
+        req.setStorageCount(storageCount);
         req.send();
       });
 
@@ -310,7 +878,8 @@ void runMaster(kj::AsyncIoContext& ioContext, ComputeDriver& driver, MasterConfi
           storageFactoryFeeder.addConsumer(frontend.getStorageFactorySet()),
           hostedRestorerForFrontendFeeder.addConsumer(frontend.getHostedRestorerSet()),
           workerFeeder.addConsumer(frontend.getWorkerSet()),
-          mongoFeeder.addConsumer(frontend.getMongoSet()));
+          mongoFeeder.addConsumer(frontend.getMongoSet()),
+          coordinatorFeeder.addConsumer(frontend.getCoordinatorSet()));
     });
   }
 
@@ -364,13 +933,18 @@ kj::String ComputeDriver::MachineId::toString() const {
   return kj::str(typeName, index);
 }
 
+kj::Promise<kj::Maybe<VatPath::Reader>> ComputeDriver::findRunning(
+    MachineId id, VatId::Reader masterVatId) {
+  return kj::Maybe<VatPath::Reader>(nullptr);
+}
+
 // =======================================================================================
 
 VagrantDriver::VagrantDriver(sandstorm::SubprocessSet& subprocessSet,
                              kj::LowLevelAsyncIoProvider& ioProvider)
     : subprocessSet(subprocessSet), ioProvider(ioProvider),
       masterBindAddress(SimpleAddress::getInterfaceAddress(AF_INET, "vboxnet0")),
-      logTask(nullptr), logSinkAddress(masterBindAddress) {
+      logSink(ioProvider.getTimer()), logTask(nullptr), logSinkAddress(masterBindAddress) {
   // Create socket for the log sink acceptor.
   int sock;
   KJ_SYSCALL(sock = socket(masterBindAddress.family(),
@@ -492,6 +1066,7 @@ kj::Promise<VatPath::Reader> VagrantDriver::run(
       "vagrant", "ssh", name, "--", "sudo", "/blackrock/bin/blackrock",
       "slave", "--log", addr, "if4:eth1"}));
   if (requireRestartProcess) args.add("-r");
+  if (compressRpc) args.add("--compress-rpc");
   sandstorm::Subprocess::Options options(args.asPtr());
   options.stdin = stdinReadEnd;
   options.stdout = stdoutWriteEnd;
@@ -21,7 +21,10 @@
 #include "cluster-rpc.h"
 #include <kj/async-io.h>
 #include <blackrock/master.capnp.h>
+#include <blackrock/machine.capnp.h>
 #include <map>
+#include <set>
+#include <deque>
 #include "logs.h"
 
 namespace sandstorm {
@@ -89,11 +92,166 @@ public:
 
   virtual kj::Promise<void> stop(MachineId id) KJ_WARN_UNUSED_RESULT = 0;
   // Shut down the given machine.
+
+  virtual kj::Promise<kj::Maybe<VatPath::Reader>> findRunning(
+      MachineId id, VatId::Reader masterVatId) KJ_WARN_UNUSED_RESULT;
+  // Like run() without `requireRestartProcess`, except that if the Blackrock process isn't already
+  // running on the machine, returns null instead of starting it. The default implementation
+  // can't tell, and always returns null.
+
+  void setCompressRpc(bool compress) { compressRpc = compress; }
+  // If true, run() starts Blackrock processes with `--compress-rpc`.
+
+protected:
+  bool compressRpc = false;
 };
 
 void runMaster(kj::AsyncIoContext& ioContext, ComputeDriver& driver, MasterConfig::Reader config,
                bool shouldRestart, kj::ArrayPtr<kj::StringPtr> machinesToRestart);
 
+void validateHeartbeatConfig(HeartbeatConfig::Reader config);
+// Throws if `config` can't be used to monitor machines, e.g. because its interval is zero, which
+// would have the master ping in a busy loop.
+
+class PhiAccrualDetector {
+  // Phi accrual failure detector (Hayashibara et al.). Instead of a fixed timeout, keeps track of
+  // the distribution of intervals between heartbeats and reports how unlikely the current silence
+  // is, as phi = -log10(probability that a heartbeat would arrive this late). Machines whose
+  // heartbeats have been jittery thus get more slack than ones whose heartbeats are regular.
+
+public:
+  PhiAccrualDetector(HeartbeatConfig::Reader config, kj::TimePoint now);
+  // `config` must have passed validateHeartbeatConfig().
+
+  void heartbeat(kj::TimePoint now);
+  // Record a heartbeat received at `now`.
+
+  double phi(kj::TimePoint now) const;
+  // Suspicion level that the machine has failed, given no heartbeat since the last one.
+
+  uint64_t millisecondsSinceHeartbeat(kj::TimePoint now) const;
+
+private:
+  uint windowSize;
+  double minStdDev;
+  double acceptablePause;
+  kj::TimePoint lastHeartbeat;
+
+  std::deque<double> intervals;
+  double sum = 0;
+  double sumOfSquares = 0;
+  // Most recent heartbeat intervals, in milliseconds, with running sums.
+
+  void addInterval(double interval);
+};
+
+class ClusterMetrics: private kj::TaskSet::ErrorHandler {
+  // Aggregates the results of Machine.getStats() from every machine and serves them over HTTP in
+  // Prometheus text format. Besides each machine's own values, for each machine type we report
+  // the total rate of every counter, the distribution of every gauge, and the top machines by
+  // either.
+
+public:
+  ClusterMetrics(kj::Timer& timer, MetricsConfig::Reader config);
+
+  kj::Duration getPollInterval();
+
+  void update(ComputeDriver::MachineId id, MachineStats::Reader stats);
+  // Record the latest stats reported by machine `id`.
+
+  void remove(ComputeDriver::MachineId id);
+  // Forget the machine, e.g. because it was shut down.
+
+  kj::Promise<void> serve(kj::ConnectionReceiver& receiver);
+
+  kj::String render();
+  // Returns the metrics in Prometheus text format, as served.
+
+private:
+  struct Sample {
+    double value;
+    kj::Maybe<double> rate;
+    // Per second since the previous sample, for counters.
+
+    kj::TimePoint time;
+  };
+
+  struct Series {
+    kj::String name;
+    kj::String help;
+    MachineStats::Metric::Kind kind;
+    std::map<ComputeDriver::MachineId, Sample> samples;
+  };
+
+  kj::Timer& timer;
+  MetricsConfig::Reader config;
+  std::map<kj::StringPtr, Series> series;  // keyed by name (pointing into the value)
+  kj::TaskSet tasks;
+
+  kj::Promise<void> respond(kj::Own<kj::AsyncIoStream> connection,
+                            kj::String received = kj::str());
+
+  void taskFailed(kj::Exception&& exception) override;
+};
+
+kj::Promise<void> drainWorker(kj::Timer& timer, Machine::Client machine,
+                              ComputeDriver::MachineId id);
+// Asks the worker process behind `machine` to shut down its grains cleanly (see Worker.drain()) so
+// that they can be restored elsewhere right away. Never fails; if the worker can't be drained, its
+// grains just die with it. The same worker may be drained by several callers at once.
+
+void validateAutoscaleConfig(AutoscaleConfig::Reader config);
+// Throws if autoscaling is enabled with bounds that can't be met, or with a cooldown too short for
+// a removed worker to finish draining.
+
+class Autoscaler: private kj::TaskSet::ErrorHandler {
+  // Adjusts the number of workers to match their load, as reported through watchLoad(), within the
+  // configured bounds. Workers are numbered from zero; only the highest-numbered one is ever added
+  // or removed.
+
+public:
+  Autoscaler(kj::Timer& timer, AutoscaleConfig::Reader config, uint initialCount,
+             kj::Function<void(uint index)> addWorker,
+             kj::Function<kj::Promise<void>(uint index)> removeWorker);
+  // `removeWorker` returns a promise that resolves once the worker has stopped. Until then its
+  // index is kept reserved: a scale-up that would reuse it waits, so that a new worker isn't
+  // stopped by the old one's shutdown.
+
+  BackendLoadReceiver::Client wrapLoadReceiver(uint index, BackendLoadReceiver::Client inner);
+  // Returns a receiver which records the loads reported by worker `index` before passing them on
+  // to `inner`.
+
+  void check();
+  // Add or remove a worker if the load calls for it. Called every `checkIntervalSeconds`.
+
+  uint getCount() { return count; }
+
+private:
+  class LoadReceiverImpl;
+
+  kj::Timer& timer;
+  AutoscaleConfig::Reader config;
+  uint count;
+  kj::Function<void(uint)> addWorker;
+  kj::Function<kj::Promise<void>(uint)> removeWorker;
+
+  std::map<uint, float> utilization;
+  // Most recent utilization reported by each worker, by index. Workers that haven't reported yet,
+  // e.g. because they're still booting, count as idle.
+
+  std::set<uint> retiring;
+  // Indexes of removed workers that haven't stopped yet.
+
+  kj::TimePoint lastChange;
+  kj::TaskSet tasks;
+  kj::Promise<void> runTask;
+
+  float utilizationOf(BackendLoad::Reader load);
+  kj::Promise<void> run();
+
+  void taskFailed(kj::Exception&& exception) override;
+};
+
 class VagrantDriver: public ComputeDriver {
 public:
   VagrantDriver(sandstorm::SubprocessSet& subprocessSet, kj::LowLevelAsyncIoProvider& ioProvider);
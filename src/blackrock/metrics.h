@@ -0,0 +1,64 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BLACKROCK_METRICS_H_
+#define BLACKROCK_METRICS_H_
+
+#include "common.h"
+#include <blackrock/machine.capnp.h>
+#include <kj/vector.h>
+
+namespace blackrock {
+
+class MetricsBuilder {
+  // Collects metrics for Machine.getStats(). Each role adds its own. Names and help text are not
+  // copied, so they should be string literals.
+
+public:
+  void counter(kj::StringPtr name, kj::StringPtr help, double value) {
+    entries.add(Entry { name, help, MachineStats::Metric::Kind::COUNTER, value });
+  }
+
+  void gauge(kj::StringPtr name, kj::StringPtr help, double value) {
+    entries.add(Entry { name, help, MachineStats::Metric::Kind::GAUGE, value });
+  }
+
+  void finish(MachineStats::Builder builder) {
+    auto list = builder.initMetrics(entries.size());
+    for (auto i: kj::indices(entries)) {
+      auto& entry = entries[i];
+      auto metric = list[i];
+      metric.setName(entry.name);
+      metric.setHelp(entry.help);
+      metric.setKind(entry.kind);
+      metric.setValue(entry.value);
+    }
+  }
+
+private:
+  struct Entry {
+    kj::StringPtr name;
+    kj::StringPtr help;
+    MachineStats::Metric::Kind kind;
+    double value;
+  };
+
+  kj::Vector<Entry> entries;
+};
+
+} // namespace blackrock
+
+#endif // BLACKROCK_METRICS_H_
@@ -0,0 +1,141 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fs-storage.h"
+#include <kj/main.h>
+#include <kj/debug.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sandstorm/util.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+namespace blackrock {
+
+class StorageRebalanceTool {
+  // Moves root objects out of a stopped storage node when the number of storage shards changes
+  // and their names now hash to some other shard (see rebalanceStorage()).
+
+public:
+  StorageRebalanceTool(kj::ProcessContext& context): context(context) {}
+
+  kj::MainFunc getMain() {
+    return kj::MainBuilder(context, "Blackrock",
+          "Moves every root object in the storage directory <dir>, which is shard <index>, that "
+          "belongs on a different shard once there are <count> shards. Each such root, and "
+          "everything it owns, is moved to <outbox>/<shard>, which is laid out like a storage "
+          "directory. <outbox> must be on the same filesystem as <dir>. Afterwards, copy each "
+          "<outbox>/<shard> into that shard's storage directory, preserving sparse files and "
+          "xattrs (e.g. with `rsync -aSX`), then start the cluster with the new storage count.\n"
+          "\n"
+          "The storage node must have been shut down cleanly. If interrupted, just run again.")
+        .addOption({'n', "dry-run"}, KJ_BIND_METHOD(*this, setDryRun),
+                   "List the roots that would move without moving anything.")
+        .expectArg("<dir>", KJ_BIND_METHOD(*this, setDirectory))
+        .expectArg("<index>", KJ_BIND_METHOD(*this, setIndex))
+        .expectArg("<count>", KJ_BIND_METHOD(*this, setCount))
+        .expectArg("<outbox>", KJ_BIND_METHOD(*this, setOutbox))
+        .callAfterParsing(KJ_BIND_METHOD(*this, run))
+        .build();
+  }
+
+private:
+  kj::ProcessContext& context;
+  kj::StringPtr directory;
+  uint index = 0;
+  uint count = 0;
+  kj::StringPtr outbox;
+  bool dryRun = false;
+
+  static kj::Maybe<uint> parseUint(kj::StringPtr arg) {
+    char* end;
+    errno = 0;
+    unsigned long result = strtoul(arg.cStr(), &end, 10);
+    if (arg.size() == 0 || *end != '\0' || errno != 0 || uint(result) != result) {
+      return nullptr;
+    }
+    return uint(result);
+  }
+
+  kj::MainBuilder::Validity setDryRun() {
+    dryRun = true;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setDirectory(kj::StringPtr arg) {
+    directory = arg;
+    return true;
+  }
+
+  kj::MainBuilder::Validity setIndex(kj::StringPtr arg) {
+    KJ_IF_MAYBE(i, parseUint(arg)) {
+      index = *i;
+      return true;
+    } else {
+      return "invalid shard index";
+    }
+  }
+
+  kj::MainBuilder::Validity setCount(kj::StringPtr arg) {
+    KJ_IF_MAYBE(c, parseUint(arg)) {
+      if (*c == 0) return "shard count must be positive";
+      count = *c;
+      return true;
+    } else {
+      return "invalid shard count";
+    }
+  }
+
+  kj::MainBuilder::Validity setOutbox(kj::StringPtr arg) {
+    outbox = arg;
+    return true;
+  }
+
+  kj::MainBuilder::Validity run() {
+    auto dirFd = sandstorm::raiiOpen(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    KJ_IF_MAYBE(journal, sandstorm::raiiOpenAtIfExists(dirFd, "journal", O_RDONLY | O_CLOEXEC)) {
+      struct stat stats;
+      KJ_SYSCALL(fstat(*journal, &stats));
+      if (stats.st_size != 0) {
+        return "storage journal isn't empty; start this node and shut it down cleanly first";
+      }
+    }
+
+    kj::AutoCloseFd outboxFd;
+    kj::Maybe<int> outboxFdIfMoving;
+    if (!dryRun) {
+      outboxFd = sandstorm::raiiOpen(outbox, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      outboxFdIfMoving = outboxFd.get();
+    }
+
+    auto counts = rebalanceStorage(dirFd, index, count, outboxFdIfMoving,
+        [this](kj::StringPtr name, uint64_t shard, size_t objectCount) {
+      if (dryRun) {
+        context.warning(kj::str(name, " -> shard ", shard, " (", objectCount, " objects)"));
+      }
+    });
+
+    context.exitInfo(kj::str(dryRun ? "would move " : "moved ",
+                             counts.roots, " roots (", counts.objects, " objects)"));
+  }
+};
+
+}  // namespace blackrock
+
+KJ_MAIN(blackrock::StorageRebalanceTool)
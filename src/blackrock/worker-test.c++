@@ -0,0 +1,59 @@
+// Sandstorm Blackrock
+// Copyright (c) 2015 Sandstorm Development Group, Inc.
+// All Rights Reserved
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "worker.h"
+#include <kj/test.h>
+
+namespace blackrock {
+namespace {
+
+KJ_TEST("SharedCompletion resolves every waiter") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  // Two drains wait for the same grain.
+  auto completion = kj::heap<SharedCompletion>();
+  uint resolved = 0;
+  auto first = completion->wait().then([&]() { ++resolved; }).eagerlyEvaluate(nullptr);
+  auto second = completion->wait().then([&]() { ++resolved; }).eagerlyEvaluate(nullptr);
+
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  auto attached = completion->attach(kj::mv(paf.promise));
+
+  // Like a RunningGrain, the owner goes away before the state is saved.
+  completion = nullptr;
+  kj::evalLater([]() {}).wait(waitScope);
+  KJ_EXPECT(resolved == 0);
+
+  paf.fulfiller->fulfill();
+  attached.wait(waitScope);
+  first.wait(waitScope);
+  second.wait(waitScope);
+  KJ_EXPECT(resolved == 2);
+}
+
+KJ_TEST("SharedCompletion without waiters passes the completion through") {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  SharedCompletion completion;
+  auto attached = completion.attach(KJ_EXCEPTION(FAILED, "state not saved"));
+  KJ_EXPECT_THROW_MESSAGE("state not saved", attached.wait(waitScope));
+  KJ_EXPECT_THROW_MESSAGE("already completed", completion.wait());
+}
+
+}  // namespace
+}  // namespace blackrock
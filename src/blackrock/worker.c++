@@ -31,8 +31,12 @@
 #include <errno.h>
 #include <sandstorm/backup.h>
 #include "bundle.h"
+#include "metrics.h"
 
 #include <sys/mount.h>
+#include <sys/sysinfo.h>
+#include <stdlib.h>
+#include <kj/vector.h>
 #undef BLOCK_SIZE // grr, mount.h
 
 namespace blackrock {
@@ -333,6 +337,14 @@ void PackageMountSet::returnPackage(kj::Own<PackageMount> package) {
   }
 }
 
+auto PackageMountSet::getPackageIds() -> kj::Array<kj::ArrayPtr<const byte>> {
+  auto builder = kj::heapArrayBuilder<kj::ArrayPtr<const byte>>(mounts.size());
+  for (auto& mount: mounts) {
+    builder.add(mount.first);
+  }
+  return builder.finish();
+}
+
 void PackageMountSet::taskFailed(kj::Exception&& exception) {
   KJ_LOG(ERROR, exception);
 }
@@ -467,6 +479,7 @@ public:
         processWaitTask(worker.subprocessSet.waitForSuccess(subprocess)),
         capnpSocket(kj::mv(capnpSocket)),
         rpcClient(*this->capnpSocket, kj::mv(core)),
+        supervisor(rpcClient.bootstrap().castAs<sandstorm::Supervisor>()),
         persistentRegistration(kj::mv(persistentRegistration)),
         grainId(kj::mv(grainIdParam)) {
     KJ_LOG(INFO, "starting grain", grainId);
@@ -489,9 +502,10 @@ public:
     sizeHint.wordCount += 4;
     auto req = grainStateSetter.setRequest(sizeHint);
     req.setValue(newState);
-    req.send().detach([](kj::Exception&& exception) {
+    auto stateSaved = req.send().then([](auto&&) {}, [](kj::Exception&& exception) {
       KJ_LOG(ERROR, "dirty grain shutdown", exception);
     });
+    worker.grainExited(kj::mv(grainId), stateSavedWaiters.attach(kj::mv(stateSaved)));
     worker.packageMountSet.returnPackage(kj::mv(packageMount));
   }
 
@@ -500,7 +514,20 @@ public:
   }
 
   sandstorm::Supervisor::Client getSupervisor() {
-    return rpcClient.bootstrap().castAs<sandstorm::Supervisor>();
+    return supervisor;
+  }
+
+  kj::StringPtr getGrainId() { return grainId; }
+
+  kj::Promise<void> onStateSaved() {
+    // Resolves once the grain has exited and its GrainState has been set inactive (or setting it
+    // has failed).
+
+    return stateSavedWaiters.wait();
+  }
+
+  void kill() {
+    subprocess.signal(SIGKILL);
   }
 
 private:
@@ -524,12 +551,42 @@ private:
   capnp::TwoPartyClient rpcClient;
   // Cap'n Proto RPC connection to the grain's supervisor.
 
+  sandstorm::Supervisor::Client supervisor;
+
   kj::Own<LocalPersistentRegistry::Registration> persistentRegistration;
   // We hold on to this until the grain shuts down, so that the grain can be restored from storage.
 
   kj::String grainId;
+
+  SharedCompletion stateSavedWaiters;
+  // Callers of onStateSaved(), e.g. repeated drains.
 };
 
+kj::Promise<void> SharedCompletion::wait() {
+  KJ_REQUIRE(!attached, "already completed");
+  if (promise == nullptr) {
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    fulfiller = kj::mv(paf.fulfiller);
+    promise = paf.promise.fork();
+  }
+  return KJ_ASSERT_NONNULL(promise).addBranch();
+}
+
+kj::Promise<void> SharedCompletion::attach(kj::Promise<void> completion) {
+  KJ_REQUIRE(!attached, "attach() called twice");
+  attached = true;
+
+  KJ_IF_MAYBE(f, fulfiller) {
+    auto ownFulfiller = kj::mv(*f);
+    fulfiller = nullptr;
+    return completion.then([KJ_MVCAP(ownFulfiller)]() mutable {
+      ownFulfiller->fulfill();
+    });
+  } else {
+    return kj::mv(completion);
+  }
+}
+
 WorkerImpl::WorkerImpl(kj::AsyncIoContext& ioContext, sandstorm::SubprocessSet& subprocessSet,
                        LocalPersistentRegistry& persistentRegistry)
     : ioProvider(*ioContext.lowLevelProvider), subprocessSet(subprocessSet),
@@ -550,8 +607,14 @@ WorkerImpl::WorkerImpl(kj::AsyncIoContext& ioContext, sandstorm::SubprocessSet&
     // Default = 8192, which is too low.
     kj::FdOutputStream(fd->get()).write("524288\n", strlen("524288\n"));
   }
+
+  tasks.add(refreshLoadLoop());
+}
+WorkerImpl::~WorkerImpl() noexcept(false) {
+  // Grains removed while tearing down `tasks` shouldn't try to report load or exits.
+  loadWatchers.clear();
+  grainWatchers.clear();
 }
-WorkerImpl::~WorkerImpl() noexcept(false) {}
 
 struct WorkerImpl::CommandInfo {
   kj::Array<kj::String> commandArgs;
@@ -576,6 +639,10 @@ struct WorkerImpl::CommandInfo {
 };
 
 kj::Promise<void> WorkerImpl::newGrain(NewGrainContext context) {
+  if (draining) {
+    return KJ_EXCEPTION(DISCONNECTED, "worker is draining");
+  }
+
   auto params = context.getParams();
 
   // Create a promise for the Supervisor, and then make that promise persistent. Although in theory
@@ -615,6 +682,11 @@ kj::Promise<void> WorkerImpl::newGrain(NewGrainContext context) {
 }
 
 kj::Promise<void> WorkerImpl::restoreGrain(RestoreGrainContext context) {
+  if (draining) {
+    // The front-end retries on DISCONNECTED, and won't pick us again since our weight is zero.
+    return KJ_EXCEPTION(DISCONNECTED, "worker is draining");
+  }
+
   auto params = context.getParams();
 
   // Create a promise for the Supervisor, and then make that promise persistent. We need to save
@@ -741,13 +813,261 @@ sandstorm::Supervisor::Client WorkerImpl::bootGrain(
     // Put it in the map so that it doesn't go away.
     auto grainPtr = grain.get();
     runningGrains[grainPtr] = kj::mv(grain);
-    auto remover = kj::defer([this,grainPtr]() { runningGrains.erase(grainPtr); });
+    grainsById[grainPtr->getGrainId()] = grainPtr;
+    ++grainsStarted;
+    auto remover = kj::defer([this,grainPtr]() {
+      auto iter = grainsById.find(grainPtr->getGrainId());
+      if (iter != grainsById.end() && iter->second == grainPtr) {
+        grainsById.erase(iter);
+      }
+      runningGrains.erase(grainPtr);
+      loadChanged();
+    });
     tasks.add(grainPtr->onExit().attach(kj::mv(remover)));
+    loadChanged();
 
     return supervisor;
   });
 }
 
+struct WorkerImpl::LoadWatcher {
+  BackendLoadReceiver::Client receiver;
+  bool sending = false;
+  bool dirty = false;
+
+  explicit LoadWatcher(BackendLoadReceiver::Client receiver): receiver(kj::mv(receiver)) {}
+};
+
+kj::Promise<void> WorkerImpl::watchLoad(WatchLoadContext context) {
+  auto watcher = kj::heap<LoadWatcher>(context.getParams().getReceiver());
+  auto& ref = *watcher;
+  loadWatchers[&ref] = kj::mv(watcher);
+  sendLoad(ref);
+  return kj::READY_NOW;
+}
+
+static float getMemoryUsed() {
+  // Fraction of memory which isn't available for new grains, counting reclaimable page cache as
+  // available.
+
+  uint64_t total = 0;
+  uint64_t available = 0;
+  for (auto& line: sandstorm::splitLines(sandstorm::readAll("/proc/meminfo"))) {
+    if (line.startsWith("MemTotal:")) {
+      total = strtoull(line.cStr() + strlen("MemTotal:"), nullptr, 10);
+    } else if (line.startsWith("MemAvailable:")) {
+      available = strtoull(line.cStr() + strlen("MemAvailable:"), nullptr, 10);
+    }
+  }
+  if (total == 0) return 0;
+  return 1.0f - float(kj::min(available, total)) / total;
+}
+
+static float getCpuUsed() {
+  // One-minute load average per CPU, capped at 1.
+
+  struct sysinfo info;
+  KJ_SYSCALL(sysinfo(&info));
+  float load = float(info.loads[0]) / (1 << SI_LOAD_SHIFT);
+  return kj::min(load / kj::max(get_nprocs(), 1), 1.0f);
+}
+
+void WorkerImpl::getLoad(BackendLoad::Builder load) {
+  // TODO(someday): Factor memory and CPU into the weight rather than just counting grains.
+  load.setOutstanding(runningGrains.size());
+  load.setWeight(draining ? 0.0f : 1.0f / (1 + runningGrains.size()));
+  load.setMemoryUsed(getMemoryUsed());
+  load.setCpuUsed(getCpuUsed());
+
+  // Advertise mounted packages so that front-ends send grains of the same app here. Packages are
+  // mounted before a grain starts, so they're always included in the report triggered by the
+  // start. A package unmounted while idle stays advertised until the next report, which only
+  // costs a cold start.
+  auto packageIds = packageMountSet.getPackageIds();
+  auto warm = load.initWarm(packageIds.size());
+  for (auto i: kj::indices(packageIds)) {
+    warm.set(i, packageIds[i]);
+  }
+}
+
+void WorkerImpl::loadChanged() {
+  for (auto& watcher: loadWatchers) {
+    if (watcher.second->sending) {
+      watcher.second->dirty = true;
+    } else {
+      sendLoad(*watcher.second);
+    }
+  }
+}
+
+void WorkerImpl::getMetrics(MetricsBuilder& metrics) {
+  metrics.gauge("blackrock_worker_grains", "Grains running on this worker.", runningGrains.size());
+  metrics.counter("blackrock_worker_grains_started_total", "Grains started on this worker.",
+                  grainsStarted);
+  metrics.gauge("blackrock_worker_packages_mounted", "Packages mounted on this worker.",
+                packageMountSet.getPackageIds().size());
+  metrics.gauge("blackrock_worker_memory_used_ratio", "Fraction of memory not available.",
+                getMemoryUsed());
+  metrics.gauge("blackrock_worker_cpu_used_ratio", "One-minute load average per CPU.",
+                getCpuUsed());
+}
+
+kj::Promise<void> WorkerImpl::refreshLoadLoop() {
+  return ioProvider.getTimer().afterDelay(30 * kj::SECONDS).then([this]() {
+    loadChanged();
+    return refreshLoadLoop();
+  });
+}
+
+void WorkerImpl::sendLoad(LoadWatcher& watcher) {
+  watcher.sending = true;
+  watcher.dirty = false;
+
+  auto req = watcher.receiver.updateRequest();
+  getLoad(req.initLoad());
+  tasks.add(req.send().then([this,&watcher](auto&&) {
+    watcher.sending = false;
+    if (watcher.dirty) {
+      sendLoad(watcher);
+    }
+  }, [this,&watcher](kj::Exception&& exception) {
+    // The receiver is gone, probably because the master restarted. It'll ask again.
+    loadWatchers.erase(&watcher);
+  }));
+}
+
+kj::Promise<void> WorkerImpl::keepAliveGrains(KeepAliveGrainsContext context) {
+  auto grainIds = context.getParams().getGrainIds();
+  auto running = context.getResults(capnp::MessageSize { 4 + grainIds.size() / 64, 0 })
+      .initRunning(grainIds.size());
+
+  kj::Vector<kj::Promise<void>> promises(grainIds.size());
+  for (auto i: kj::indices(grainIds)) {
+    auto iter = grainsById.find(grainIds[i]);
+    if (iter == grainsById.end()) continue;  // Not running here; leave `running[i]` false.
+
+    // A wedged supervisor shouldn't hold up the rest of the batch; count it as not running.
+    auto req = iter->second->getSupervisor().keepAliveRequest();
+    promises.add(ioProvider.getTimer().timeoutAfter(4 * kj::SECONDS, req.send())
+        .then([running,i](auto&&) mutable {
+      running.set(i, true);
+    }, [](kj::Exception&&) {}));
+  }
+
+  return kj::joinPromises(promises.releaseAsArray());
+}
+
+kj::Promise<void> WorkerImpl::watchGrains(WatchGrainsContext context) {
+  grainWatchers.insert(std::make_pair(grainWatcherCounter++, context.getParams().getWatcher()));
+  return kj::READY_NOW;
+}
+
+kj::Promise<void> WorkerImpl::findGrain(FindGrainContext context) {
+  auto params = context.getParams();
+  auto iter = grainsById.find(params.getGrainId());
+  if (iter == grainsById.end()) {
+    // Not here. If it just exited, its final GrainState update may still be in flight, in which
+    // case the caller's own update will fail with DISCONNECTED and be retried.
+    return kj::READY_NOW;
+  }
+
+  auto& grain = *iter->second;
+  auto supervisor = grain.getSupervisor();
+  auto req = supervisor.keepAliveRequest();
+  req.setCore(params.getCore());
+
+  auto exited = grain.onStateSaved().fork();
+  auto answered = req.send().then([context,KJ_MVCAP(supervisor)](auto&&) mutable
+                                  -> kj::Promise<void> {
+    context.getResults(capnp::MessageSize { 4, 1 }).setGrain(kj::mv(supervisor));
+    return kj::READY_NOW;
+  }, [](kj::Exception&&) -> kj::Promise<void> {
+    // Wait for the grain to finish exiting.
+    return kj::NEVER_DONE;
+  });
+  return answered.exclusiveJoin(exited.addBranch()).attach(kj::mv(exited));
+}
+
+static constexpr kj::Duration GRAIN_SHUTDOWN_TIMEOUT = 30 * kj::SECONDS;
+
+kj::Promise<void> WorkerImpl::drain(DrainContext context) {
+  uint batchSize = kj::max(context.getParams().getBatchSize(), 1u);
+
+  if (!draining) {
+    KJ_LOG(INFO, "draining worker", runningGrains.size());
+    draining = true;
+    loadChanged();
+  }
+
+  // Grains still being booted aren't in `grainsById` yet; they'll die with the worker.
+  auto grainIds = KJ_MAP(entry, grainsById) { return kj::heapString(entry.first); };
+  return drainBatches(kj::mv(grainIds), 0, batchSize);
+}
+
+kj::Promise<void> WorkerImpl::drainBatches(
+    kj::Array<kj::String> grainIds, size_t offset, uint batchSize) {
+  if (offset >= grainIds.size()) return kj::READY_NOW;
+
+  size_t end = kj::min(offset + batchSize, grainIds.size());
+  auto promises = kj::heapArrayBuilder<kj::Promise<void>>(end - offset);
+  for (size_t i = offset; i < end; i++) {
+    promises.add(drainGrain(grainIds[i]));
+  }
+
+  return kj::joinPromises(promises.finish())
+      .then([this,KJ_MVCAP(grainIds),end,batchSize]() mutable {
+    return drainBatches(kj::mv(grainIds), end, batchSize);
+  });
+}
+
+kj::Promise<void> WorkerImpl::drainGrain(kj::StringPtr grainId) {
+  auto iter = grainsById.find(grainId);
+  if (iter == grainsById.end()) {
+    // Already exited.
+    return kj::READY_NOW;
+  }
+
+  auto& grain = *iter->second;
+  auto stateSaved = grain.onStateSaved().fork();
+
+  // The supervisor kills itself in response, so this call never returns successfully.
+  tasks.add(grain.getSupervisor().shutdownRequest().send()
+      .then([](auto&&) {}, [](kj::Exception&&) {}));
+
+  auto promise = stateSaved.addBranch();
+  auto ownGrainId = kj::heapString(grainId);
+  return ioProvider.getTimer().timeoutAfter(GRAIN_SHUTDOWN_TIMEOUT, kj::mv(promise))
+      .catch_([this,KJ_MVCAP(stateSaved),KJ_MVCAP(ownGrainId)](
+          kj::Exception&& exception) mutable {
+    KJ_LOG(WARNING, "grain didn't shut down in time; killing it", ownGrainId, exception);
+    auto iter = grainsById.find(ownGrainId);
+    if (iter != grainsById.end()) {
+      iter->second->kill();
+    }
+    return stateSaved.addBranch();
+  });
+}
+
+void WorkerImpl::grainExited(kj::String grainId, kj::Promise<void> stateSaved) {
+  if (grainWatchers.empty()) {
+    // Also the case while we're being destroyed, when `tasks` is no longer usable.
+    stateSaved.detach([](kj::Exception&&) {});
+    return;
+  }
+
+  tasks.add(stateSaved.then([this,KJ_MVCAP(grainId)]() {
+    for (auto& watcher: grainWatchers) {
+      auto req = watcher.second.exitedRequest();
+      req.setGrainId(grainId);
+      uint64_t id = watcher.first;
+      tasks.add(req.send().then([](auto&&) {}, [this,id](kj::Exception&& exception) {
+        // The watcher is gone. It'll ask again if it still cares.
+        grainWatchers.erase(id);
+      }));
+    }
+  }));
+}
+
 void WorkerImpl::taskFailed(kj::Exception&& exception) {
   KJ_LOG(ERROR, exception);
 }
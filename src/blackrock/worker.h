@@ -21,6 +21,7 @@
 #include <blackrock/worker.capnp.h>
 #include <kj/main.h>
 #include <unordered_map>
+#include <map>
 #include <sandstorm/util.h>
 #include <sandstorm/supervisor.h>
 #include <kj/async-io.h>
@@ -33,6 +34,7 @@ namespace kj {
 namespace blackrock {
 
 class NbdVolumeAdapter;
+class MetricsBuilder;
 
 struct ByteStringHash {
   inline size_t operator()(const kj::ArrayPtr<const byte>& token) const {
@@ -108,6 +110,9 @@ public:
   // Grains "return" packages to the mount set where the package may remain mounted for some time
   // in case it is used again.
 
+  kj::Array<kj::ArrayPtr<const byte>> getPackageIds();
+  // IDs of all currently-mounted packages. Only valid until the next turn of the event loop.
+
 private:
   kj::AsyncIoContext& ioContext;
   std::unordered_map<kj::ArrayPtr<const byte>, PackageMount*,
@@ -122,29 +127,62 @@ private:
   void taskFailed(kj::Exception&& exception) override;
 };
 
+class SharedCompletion {
+  // Lets any number of callers wait for something that happens once, such as a grain's final
+  // GrainState update, which several concurrent drain() calls may be waiting for.
+
+public:
+  kj::Promise<void> wait();
+  // Resolves once the promise given to attach() does. Can't be called after attach().
+
+  kj::Promise<void> attach(kj::Promise<void> completion);
+  // Returns `completion`, extended to resolve all waiters once it resolves. Call at most once. The
+  // waiters don't depend on this object afterwards, so it may be destroyed right away.
+
+private:
+  bool attached = false;
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> fulfiller;
+  kj::Maybe<kj::ForkedPromise<void>> promise;
+  // Created by the first wait().
+};
+
 class WorkerImpl: public Worker::Server, private kj::TaskSet::ErrorHandler {
 public:
   WorkerImpl(kj::AsyncIoContext& ioContext, sandstorm::SubprocessSet& subprocessSet,
              LocalPersistentRegistry& persistentRegistry);
   ~WorkerImpl() noexcept(false);
 
+  void getMetrics(MetricsBuilder& metrics);
+
 protected:
   kj::Promise<void> newGrain(NewGrainContext context) override;
   kj::Promise<void> restoreGrain(RestoreGrainContext context) override;
   kj::Promise<void> unpackPackage(UnpackPackageContext context) override;
   kj::Promise<void> unpackBackup(UnpackBackupContext context) override;
   kj::Promise<void> packBackup(PackBackupContext context) override;
+  kj::Promise<void> watchLoad(WatchLoadContext context) override;
+  kj::Promise<void> keepAliveGrains(KeepAliveGrainsContext context) override;
+  kj::Promise<void> watchGrains(WatchGrainsContext context) override;
+  kj::Promise<void> drain(DrainContext context) override;
+  kj::Promise<void> findGrain(FindGrainContext context) override;
 
 private:
   class RunningGrain;
   class PackageUploadStreamImpl;
   struct CommandInfo;
+  struct LoadWatcher;
 
   kj::LowLevelAsyncIoProvider& ioProvider;
   sandstorm::SubprocessSet& subprocessSet;
   LocalPersistentRegistry& persistentRegistry;
   PackageMountSet packageMountSet;
   std::unordered_map<RunningGrain*, kj::Own<RunningGrain>> runningGrains;
+  std::map<kj::StringPtr, RunningGrain*> grainsById;
+  std::unordered_map<LoadWatcher*, kj::Own<LoadWatcher>> loadWatchers;
+  std::unordered_map<uint64_t, Worker::GrainWatcher::Client> grainWatchers;
+  uint64_t grainWatcherCounter = 0;
+  uint64_t grainsStarted = 0;
+  bool draining = false;
   kj::TaskSet tasks;
 
   sandstorm::Supervisor::Client bootGrain(
@@ -154,6 +192,23 @@ private:
       kj::String grainId, sandstorm::SandstormCore::Client core,
       kj::Own<LocalPersistentRegistry::Registration> persistentRegistration);
 
+  void getLoad(BackendLoad::Builder load);
+  void loadChanged();
+  void sendLoad(LoadWatcher& watcher);
+  // Push the current load to watchers. At most one update is in flight per watcher; changes made
+  // while one is in flight are sent when it returns.
+
+  kj::Promise<void> refreshLoadLoop();
+  // Memory and CPU usage change without any event to report them, so push the load periodically.
+
+  kj::Promise<void> drainBatches(kj::Array<kj::String> grainIds, size_t offset, uint batchSize);
+  kj::Promise<void> drainGrain(kj::StringPtr grainId);
+  // Shut down the given grain cleanly, resolving once its GrainState is inactive.
+
+  void grainExited(kj::String grainId, kj::Promise<void> stateSaved);
+  // Called by ~RunningGrain(). Notifies grain watchers once `stateSaved` -- the final GrainState
+  // update -- completes.
+
   void taskFailed(kj::Exception&& exception) override;
 };
 